@@ -0,0 +1,433 @@
+/*****************************************************************************
+ *
+ *   Benchmark suite of MCML
+ *   =========================================================================
+ *   Runs a fixed set of workloads through the same pipeline as MCML (parser,
+ *   workers, batch scheduler and result writer) and writes photons/sec,
+ *   steps/sec and the wall time of every phase as JSON:
+ *
+ *     sample:          resources/sample.mci
+ *     semi_infinite:   one thick layer with a high albedo (long photon paths)
+ *     glass_thin:      a glass layer on top of thin tissue layers (many
+ *                      boundary hits, Fresnel reflections)
+ *     many_tiny_runs:  1000 runs of 1000 photons (per-run overhead)
+ *     one_huge_run:    one run of 2000000 photons
+ *
+ *   Every workload runs on the CPU backend (scalar engine), and on the GPUs
+ *   with --gpu if MCML was built with CUDA. Steps are only counted by the
+ *   CPU engine ("steps": null on the GPU).
+ *
+ *   Usage: mcml_bench [--json file] [--threads n] [--scale s] [--pack_photons n]
+ *                     [--gpu] [--only name]
+ *     --json          output file (default mcml_bench.json)
+ *     --threads       CPU threads (default: all hardware threads)
+ *     --scale         factor on the photons of every run (default 1)
+ *     --pack_photons  photon budget of a packed batch (default 0, as MCML)
+ *     --gpu           also run every workload on all GPUs
+ *     --only          run only the workload <name>
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef MCML_WITH_CUDA
+#include <cuda_runtime.h>
+#endif
+
+#include "../src/gpumcml.h"
+#include "../src/gpumcml_sched.h"
+
+#define BENCH_SEED 12345ull
+
+// Phases of a workload, timed separately
+enum
+{
+    PHASE_PARSE,    // read_simulation_data
+    PHASE_SETUP,    // workers, generator multipliers and buffer pools
+    PHASE_SIMULATE, // simulation, reduction and registration (pipelined)
+    PHASE_WRITE,    // remaining output rows
+    N_PHASES
+};
+
+static const char *phase_names[N_PHASES] = {"parse", "setup", "simulate", "write"};
+
+typedef struct
+{
+    const char *name;
+    // Write the input file of the workload to <file>, or NULL for a file of
+    // the source tree
+    void (*write)(FILE *file);
+    const char *source_file;
+} BenchWorkload;
+
+typedef struct
+{
+    const char *workload;
+    const char *backend;
+    UINT32 n_workers;
+    int n_runs;
+    UINT64 n_photons;
+    UINT64 n_steps; // 0 if not counted
+    double seconds[N_PHASES];
+} BenchResult;
+
+//////////////////////////////////////////////////////////////////////////////
+//   Input files of the generated workloads
+//////////////////////////////////////////////////////////////////////////////
+static void WriteRunHeader(FILE *file, const char *name, UINT32 n_photons, double dz, double dr, int nz, int nr,
+                           int n_layers)
+{
+    fprintf(file, "%s A # output filename, ASCII/Binary\n", name);
+    fprintf(file, "%u # No. of photons\n", n_photons);
+    fprintf(file, "%g %g # dz, dr\n%d %d 1 # No. of dz, dr & da.\n\n", dz, dr, nz, nr);
+    fprintf(file, "%d # No. of layers\n# n mua mus g d # One line for each layer\n1.0 # n for medium above.\n",
+            n_layers);
+}
+
+static void WriteSemiInfinite(FILE *file)
+{
+    fprintf(file, "1.0 # file version\n1 # number of runs\n\n");
+    WriteRunHeader(file, "semi_infinite", 20000, 0.01, 0.01, 200, 200, 1);
+    fprintf(file, "1.4 0.1 100 0.9 1e6\n1.0 # n for medium below.\n\n");
+}
+
+static void WriteGlassThin(FILE *file)
+{
+    fprintf(file, "1.0 # file version\n1 # number of runs\n\n");
+    WriteRunHeader(file, "glass_thin", 1000000, 0.001, 0.01, 100, 100, 5);
+    fprintf(file, "1.52 0 0 0 0.1\n");
+    fprintf(file, "1.37 5 200 0.9 0.005\n1.45 20 100 0.8 0.005\n1.37 5 200 0.9 0.005\n1.45 20 100 0.8 0.005\n");
+    fprintf(file, "1.0 # n for medium below.\n\n");
+}
+
+static void WriteManyTinyRuns(FILE *file)
+{
+    const int n_runs = 1000;
+    fprintf(file, "1.0 # file version\n%d # number of runs\n\n", n_runs);
+    for (int i = 0; i < n_runs; ++i)
+    {
+        char name[STR_LEN];
+        snprintf(name, sizeof(name), "tiny%d", i);
+        WriteRunHeader(file, name, 1000, 0.002, 2, 500, 1, 3);
+        fprintf(file, "1.367 %.3f 850 0.924 0.066\n1.476 %.3f 500 0.869 0.108\n1.445 %.3f 690 0.919 0.004\n",
+                20 + 0.06 * i, 20 + 0.06 * i, 20 + 0.06 * i);
+        fprintf(file, "1.0 # n for medium below.\n\n");
+    }
+}
+
+static void WriteOneHugeRun(FILE *file)
+{
+    fprintf(file, "1.0 # file version\n1 # number of runs\n\n");
+    WriteRunHeader(file, "one_huge_run", 2000000, 0.002, 2, 500, 1, 3);
+    fprintf(file, "1.367 78.74 850.66 0.924 0.066\n1.476 81.74 499.17 0.869 0.108\n1.445 81.65 687.70 0.919 0.004\n");
+    fprintf(file, "1.0 # n for medium below.\n\n");
+}
+
+static const BenchWorkload workloads[] = {
+    {"sample", NULL, MCML_SOURCE_DIR "/resources/sample.mci"},
+    {"semi_infinite", WriteSemiInfinite, NULL},
+    {"glass_thin", WriteGlassThin, NULL},
+    {"many_tiny_runs", WriteManyTinyRuns, NULL},
+    {"one_huge_run", WriteOneHugeRun, NULL},
+};
+
+static double Seconds(std::chrono::steady_clock::time_point t0)
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Simulate the runs of <filename> with <n_cpu_threads> CPU workers or with
+//   <n_gpus> GPU workers, the way MCML does with default options.
+//   Return 0 if successful.
+//////////////////////////////////////////////////////////////////////////////
+static int RunWorkload(const char *filename, UINT32 n_gpus, UINT32 n_cpu_threads, double scale, UINT64 pack_photons,
+                       BenchResult *result)
+{
+    std::string output = std::string(result->workload) + "_bench.csv";
+    memset(result->seconds, 0, sizeof(result->seconds));
+
+    // parse
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    SimulationStruct *simulations;
+    int n_simulations = read_simulation_data(filename, &simulations, 0);
+    if (n_simulations == 0)
+        return 1;
+    result->seconds[PHASE_PARSE] = Seconds(t0);
+
+    result->n_runs = n_simulations;
+    result->n_photons = 0;
+    for (int i = 0; i < n_simulations; ++i)
+    {
+        double n = simulations[i].number_of_photons * scale;
+        simulations[i].number_of_photons = (n < 1) ? 1 : (UINT32)n;
+        result->n_photons += simulations[i].number_of_photons;
+    }
+
+    // setup
+    t0 = std::chrono::steady_clock::now();
+    UINT32 n_workers = n_gpus + n_cpu_threads;
+    result->n_workers = n_workers;
+    std::vector<HostThreadState *> hstates(n_workers);
+    std::vector<RunEngineFn> engines(n_workers);
+    for (UINT32 w = 0; w < n_workers; ++w)
+    {
+        hstates[w] = (HostThreadState *)calloc(1, sizeof(HostThreadState));
+        hstates[w]->dev_id = w;
+        hstates[w]->n_tblks = 1;
+        hstates[w]->n_threads = 1;
+        engines[w] = RunCPUi;
+    }
+#ifdef MCML_WITH_CUDA
+    if (n_gpus > 0)
+    {
+        if (InitGPUHostThreadStates(hstates.data(), n_gpus) == 0)
+            return 1;
+        for (UINT32 w = 0; w < n_gpus; ++w)
+            engines[w] = RunGPUi;
+    }
+#endif
+
+    const UINT32 *multipliers;
+    UINT32 n_multipliers;
+    if (init_RNG(&multipliers, &n_multipliers))
+        return 1;
+    for (UINT32 w = 0; w < n_workers; ++w)
+    {
+        hstates[w]->host_sim_state.multipliers = multipliers;
+        hstates[w]->host_sim_state.n_multipliers = n_multipliers;
+    }
+
+    PackedBatch *batch = (PackedBatch *)malloc(sizeof(PackedBatch));
+    UINT32 max_rz_size = 0, max_ra_size = 0, max_jac_size = 0;
+    for (int i = 0; i < n_simulations; i += batch->n_runs)
+    {
+        BuildPackedBatch(batch, simulations, n_simulations, i, pack_photons);
+        if (max_rz_size < batch->A_rz_ofst[batch->n_runs])
+            max_rz_size = batch->A_rz_ofst[batch->n_runs];
+        if (max_ra_size < batch->ra_ofst[batch->n_runs])
+            max_ra_size = batch->ra_ofst[batch->n_runs];
+        if (max_jac_size < batch->jac_ofst[batch->n_runs])
+            max_jac_size = batch->jac_ofst[batch->n_runs];
+    }
+    for (UINT32 w = 0; w < n_workers; ++w)
+    {
+        if (InitBufferPool(&hstates[w]->pool, max_rz_size, max_ra_size, max_jac_size))
+        {
+            fprintf(stderr, "Error allocating the output buffers\n");
+            return 1;
+        }
+    }
+    result->seconds[PHASE_SETUP] = Seconds(t0);
+
+    // simulate
+    t0 = std::chrono::steady_clock::now();
+    SimulationResults simResults;
+    if (simResults.startWriter(output.c_str()))
+        return 1;
+    {
+        BatchScheduler scheduler(hstates.data(), engines.data(), n_workers, 0, max_rz_size, max_ra_size,
+                                 max_jac_size, NULL, false, &simResults);
+        for (int i = 0; i < n_simulations; i += batch->n_runs)
+        {
+            BuildPackedBatch(batch, simulations, n_simulations, i, pack_photons);
+            SeedBatch(batch, BENCH_SEED);
+            scheduler.Submit(batch, i);
+        }
+        scheduler.Drain();
+    }
+    result->seconds[PHASE_SIMULATE] = Seconds(t0);
+
+    // write
+    t0 = std::chrono::steady_clock::now();
+    simResults.writeSimulationResults(output.c_str());
+    result->seconds[PHASE_WRITE] = Seconds(t0);
+
+    result->n_steps = 0;
+    for (UINT32 w = 0; w < n_workers; ++w)
+    {
+        result->n_steps += hstates[w]->n_steps;
+#ifdef MCML_WITH_CUDA
+        if (w < n_gpus)
+            FreeGPUBufferPool(hstates[w]);
+#endif
+        FreeBufferPool(&hstates[w]->pool);
+        free(hstates[w]);
+    }
+    free(batch);
+    FreeSimulationStruct(simulations, n_simulations);
+    remove(output.c_str());
+    return 0;
+}
+
+static void WriteJSON(FILE *file, const std::vector<BenchResult> &results, double scale)
+{
+    fprintf(file, "{\n  \"version\": \"%s.%s.%s\",\n  \"git_commit\": \"%s\",\n  \"scale\": %g,\n  \"results\": [",
+            PROJECT_VERSION_MAJOR, PROJECT_VERSION_MINOR, PROJECT_VERSION_PATCH, GIT_COMMIT, scale);
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult *r = &results[i];
+        double wall = 0;
+        for (int p = 0; p < N_PHASES; ++p)
+            wall += r->seconds[p];
+        double sim_seconds = r->seconds[PHASE_SIMULATE];
+
+        fprintf(file, "%s\n    {\"workload\": \"%s\", \"backend\": \"%s\", \"workers\": %u, \"runs\": %d, ",
+                (i > 0) ? "," : "", r->workload, r->backend, r->n_workers, r->n_runs);
+        fprintf(file, "\"photons\": %llu, \"photons_per_sec\": %.1f, ", (unsigned long long)r->n_photons,
+                r->n_photons / sim_seconds);
+        if (r->n_steps > 0)
+        {
+            fprintf(file, "\"steps\": %llu, \"steps_per_sec\": %.1f, ", (unsigned long long)r->n_steps,
+                    r->n_steps / sim_seconds);
+        }
+        else
+        {
+            fprintf(file, "\"steps\": null, \"steps_per_sec\": null, ");
+        }
+        fprintf(file, "\"wall_time\": %.6f, \"phases\": {", wall);
+        for (int p = 0; p < N_PHASES; ++p)
+            fprintf(file, "%s\"%s\": %.6f", (p > 0) ? ", " : "", phase_names[p], r->seconds[p]);
+        fprintf(file, "}}");
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    const char *json_file = "mcml_bench.json";
+    const char *only = NULL;
+    UINT32 n_cpu_threads = std::thread::hardware_concurrency();
+    double scale = 1;
+    UINT64 pack_photons = 0;
+    bool use_gpu = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--json") == 0 && has_value)
+            json_file = argv[++i];
+        else if (strcmp(argv[i], "--threads") == 0 && has_value)
+            n_cpu_threads = (UINT32)strtoul(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--scale") == 0 && has_value)
+            scale = strtod(argv[++i], NULL);
+        else if (strcmp(argv[i], "--pack_photons") == 0 && has_value)
+            pack_photons = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--only") == 0 && has_value)
+            only = argv[++i];
+        else if (strcmp(argv[i], "--gpu") == 0)
+            use_gpu = true;
+        else
+        {
+            fprintf(stderr, "Usage: %s [--json file] [--threads n] [--scale s] [--pack_photons n] [--gpu] "
+                            "[--only name]\n",
+                    argv[0]);
+            return 1;
+        }
+    }
+    if (n_cpu_threads == 0)
+        n_cpu_threads = 1;
+
+    UINT32 n_gpus = 0;
+    if (use_gpu)
+    {
+#ifdef MCML_WITH_CUDA
+        int dev_count = 0;
+        if (cudaGetDeviceCount(&dev_count) != cudaSuccess || dev_count == 0)
+        {
+            fprintf(stderr, "No GPU found\n");
+            return 1;
+        }
+        n_gpus = (UINT32)dev_count;
+#else
+        fprintf(stderr, "This build of MCML has no GPU backend\n");
+        return 1;
+#endif
+    }
+
+    std::vector<BenchResult> results;
+    for (size_t k = 0; k < sizeof(workloads) / sizeof(workloads[0]); ++k)
+    {
+        const BenchWorkload *workload = &workloads[k];
+        if (only != NULL && strcmp(only, workload->name) != 0)
+            continue;
+
+        std::string filename = workload->source_file ? workload->source_file : "mcml_bench.mci";
+        if (workload->write != NULL)
+        {
+            FILE *file = fopen(filename.c_str(), "w");
+            if (file == NULL)
+            {
+                perror("Error creating the input file");
+                return 1;
+            }
+            workload->write(file);
+            fclose(file);
+        }
+
+        for (int backend = 0; backend < (n_gpus > 0 ? 2 : 1); ++backend)
+        {
+            BenchResult result;
+            result.workload = workload->name;
+            result.backend = (backend == 0) ? "cpu" : "gpu";
+            int failed = (backend == 0) ? RunWorkload(filename.c_str(), 0, n_cpu_threads, scale, pack_photons, &result)
+                                        : RunWorkload(filename.c_str(), n_gpus, 0, scale, pack_photons, &result);
+            if (failed)
+            {
+                fprintf(stderr, "Error running the workload %s\n", workload->name);
+                return 1;
+            }
+            results.push_back(result);
+        }
+
+        if (workload->write != NULL)
+            remove(filename.c_str());
+    }
+
+    FILE *file = fopen(json_file, "w");
+    if (file == NULL)
+    {
+        perror("Error creating the output file");
+        return 1;
+    }
+    WriteJSON(file, results, scale);
+    fclose(file);
+
+    // The parser and the workers print a few lines per workload, so the
+    // table comes last.
+    printf("\n%-16s %-4s %7s %12s %14s %14s %10s\n", "workload", "", "workers", "photons", "photons/sec", "steps/sec",
+           "wall [s]");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const BenchResult *r = &results[i];
+        double wall = 0;
+        for (int p = 0; p < N_PHASES; ++p)
+            wall += r->seconds[p];
+        printf("%-16s %-4s %7u %12llu %14.0f %14.0f %10.3f\n", r->workload, r->backend, r->n_workers,
+               (unsigned long long)r->n_photons, r->n_photons / r->seconds[PHASE_SIMULATE],
+               r->n_steps / r->seconds[PHASE_SIMULATE], wall);
+    }
+    printf("\nWrote %s\n", json_file);
+    return 0;
+}
@@ -0,0 +1,150 @@
+/*****************************************************************************
+ *
+ *   Benchmark of the .mci parser
+ *   =========================================================================
+ *   Writes an input file with many runs (as produced by parameter sweeps),
+ *   parses it with one thread and with one thread per hardware thread and
+ *   prints the parse throughput in runs/sec and MB/sec.
+ *
+ *   Usage: mcml_parse_bench [number of runs] [number of layers] [file.mci]
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#include "../src/gpumcml.h"
+
+#define N_REPEATS 3
+
+//////////////////////////////////////////////////////////////////////////////
+//   Write <n_runs> runs of <n_layers> layers with random optical properties
+//   to <filename>. Return the size of the file in bytes.
+//////////////////////////////////////////////////////////////////////////////
+static long WriteInputFile(const char *filename, int n_runs, int n_layers)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        perror("Error creating the input file");
+        exit(1);
+    }
+    srand(12345);
+    fprintf(file, "1.0 # file version\n%d # number of runs\n\n", n_runs);
+    for (int i = 0; i < n_runs; ++i)
+    {
+        fprintf(file, "run%d.mco A # output filename, ASCII/Binary\n", i);
+        fprintf(file, "1000000 # No. of photons\n0.002 2 # dz, dr\n500 1 1 # No. of dz, dr & da.\n\n");
+        fprintf(file, "%d # No. of layers\n# n mua mus g d # One line for each layer\n1.0 # n for medium above.\n",
+                n_layers);
+        for (int l = 0; l < n_layers; ++l)
+        {
+            fprintf(file, "%.3f %.5f %.5f %.3f %.3f\n", 1.33 + 0.2 * rand() / RAND_MAX,
+                    100.0 * rand() / RAND_MAX, 1000.0 * rand() / RAND_MAX, 0.7 + 0.25 * rand() / RAND_MAX,
+                    0.1 * rand() / RAND_MAX);
+        }
+        fprintf(file, "1.0 # n for medium below.\n\n");
+    }
+    long size = ftell(file);
+    fclose(file);
+    return size;
+}
+
+typedef struct
+{
+    UINT32 n_threads;
+    double seconds; // best of N_REPEATS
+    SimulationStruct *simulations;
+    int n_runs;
+} BenchResult;
+
+//////////////////////////////////////////////////////////////////////////////
+//   Parse the file N_REPEATS times with <n_threads> threads and keep the
+//   best time and the runs of the last repetition.
+//////////////////////////////////////////////////////////////////////////////
+static void RunBench(const char *filename, UINT32 n_threads, BenchResult *result)
+{
+    result->n_threads = n_threads;
+    result->simulations = NULL;
+    for (int r = 0; r < N_REPEATS; ++r)
+    {
+        if (result->simulations != NULL)
+            FreeSimulationStruct(result->simulations, result->n_runs);
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        result->n_runs = read_simulation_data(filename, &result->simulations, 0, n_threads);
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        if (result->n_runs == 0)
+            exit(1);
+        if (r == 0 || seconds < result->seconds)
+            result->seconds = seconds;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    int n_runs = (argc > 1) ? atoi(argv[1]) : 100000;
+    int n_layers = (argc > 2) ? atoi(argv[2]) : 3;
+    const char *filename = (argc > 3) ? argv[3] : "mcml_parse_bench.mci";
+
+    long size = WriteInputFile(filename, n_runs, n_layers);
+    UINT32 n_threads = std::thread::hardware_concurrency();
+
+    BenchResult results[2];
+    int n_results = 0;
+    RunBench(filename, 1, &results[n_results++]);
+    if (n_threads > 1)
+        RunBench(filename, n_threads, &results[n_results++]);
+    remove(filename);
+
+    // The parser prints a few lines per call, so the table comes last.
+    printf("\n%s: %d runs, %d layers, %.1f MB\n\n", filename, n_runs, n_layers, size / 1e6);
+    printf("%7s %10s %14s %10s %9s\n", "threads", "time [s]", "runs/sec", "MB/sec", "speedup");
+    for (int i = 0; i < n_results; ++i)
+    {
+        printf("%7u %10.3f %14.0f %10.1f %8.2fx\n", results[i].n_threads, results[i].seconds,
+               results[i].n_runs / results[i].seconds, size / results[i].seconds / 1e6,
+               results[0].seconds / results[i].seconds);
+    }
+
+    // Both parses must give the same runs.
+    int mismatches = 0;
+    for (int r = 1; r < n_results; ++r)
+    {
+        for (int i = 0; i < results[0].n_runs; ++i)
+        {
+            const SimulationStruct *a = &results[0].simulations[i], *b = &results[r].simulations[i];
+            if (strcmp(a->outp_filename, b->outp_filename) != 0 || a->number_of_photons != b->number_of_photons ||
+                a->n_layers != b->n_layers ||
+                memcmp(a->layers, b->layers, (a->n_layers + 2) * sizeof(LayerStruct)) != 0)
+                ++mismatches;
+        }
+    }
+    for (int r = 0; r < n_results; ++r)
+        FreeSimulationStruct(results[r].simulations, results[r].n_runs);
+
+    if (mismatches > 0)
+    {
+        fprintf(stderr, "%d runs differ between the single and multithreaded parse\n", mismatches);
+        return 1;
+    }
+    return 0;
+}
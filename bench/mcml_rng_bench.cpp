@@ -0,0 +1,207 @@
+/*****************************************************************************
+ *
+ *   Benchmark of the random number generators and precision policies
+ *   =========================================================================
+ *   Draws random numbers from every generator of gpumcml_rng.h, seeded per
+ *   photon like in the engines, and prints random numbers/sec with simple
+ *   statistics of the numbers (mean, chi-square of the top 8 bits, lag-1
+ *   correlation). Then runs the first simulation of an .mci file with the
+ *   scalar CPU engine and every generator, and with every precision policy
+ *   of gpumcml_precision.h, and prints photons/sec and Rd/A/T with their
+ *   standard errors (over 10 chunks of photons).
+ *
+ *   Usage: mcml_rng_bench [file.mci] [number of photons]
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../src/gpumcml_cpu.h"
+#include "../src/gpumcml_rng.h"
+
+#define N_STREAMS 4096          // photons the numbers are drawn for
+#define N_DRAWS_PER_STREAM 4096 // numbers drawn per photon
+#define N_CHUNKS 10             // chunks of photons for the standard errors
+
+// keeps the numbers of the throughput pass from being optimized away
+static volatile UINT32 g_sink;
+
+//////////////////////////////////////////////////////////////////////////////
+//   Draw N_DRAWS_PER_STREAM numbers for each of N_STREAMS photons of the
+//   stream <key> and print their rate and statistics
+//////////////////////////////////////////////////////////////////////////////
+template <typename RNG> static void BenchGenerator(const char *name, UINT64 key, const UINT32 *multipliers)
+{
+    UINT64 bins[256];
+    memset(bins, 0, sizeof(bins));
+    double sum = 0, sum_sq = 0, sum_lag = 0;
+    UINT32 sink = 0;
+
+    // Throughput alone, then the statistics in a second pass
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    for (UINT64 p = 0; p < N_STREAMS; ++p)
+    {
+        RNG rng;
+        rng.Seed(key, p, multipliers, MAX_RNG_MULTIPLIERS);
+        for (UINT32 i = 0; i < N_DRAWS_PER_STREAM; ++i)
+            sink ^= rng.Next();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    g_sink = sink;
+
+    for (UINT64 p = 0; p < N_STREAMS; ++p)
+    {
+        RNG rng;
+        rng.Seed(key, p, multipliers, MAX_RNG_MULTIPLIERS);
+        double last = 0.5;
+        for (UINT32 i = 0; i < N_DRAWS_PER_STREAM; ++i)
+        {
+            UINT32 v = rng.Next();
+            double u = v * (1.0 / 4294967296.0);
+            ++bins[v >> 24];
+            sum += u;
+            sum_sq += u * u;
+            sum_lag += (u - 0.5) * (last - 0.5);
+            last = u;
+        }
+    }
+
+    double n = (double)N_STREAMS * N_DRAWS_PER_STREAM;
+    double expected = n / 256;
+    double chi2 = 0;
+    for (int b = 0; b < 256; ++b)
+        chi2 += (bins[b] - expected) * (bins[b] - expected) / expected;
+    double mean = sum / n;
+    double var = sum_sq / n - mean * mean;
+
+    // expected: mean 1/2, variance 1/12, chi2 255 +- 23, correlation 0
+    printf("%-10s %14.0f %10.6f %10.6f %10.1f %10.6f\n", name, n / seconds, mean, var, chi2, sum_lag / (n * var));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Simulate <sim> with the generator <rng> and the precision policy
+//   <precision> in N_CHUNKS chunks of photons
+//////////////////////////////////////////////////////////////////////////////
+static void BenchSimulation(const char *name, int rng, int precision, SimulationStruct *sim, CPUThreadContext *ctx)
+{
+    PackedBatch batch;
+    BuildPackedBatch(&batch, sim, 1, 0, 0);
+    BufferPool pool;
+    memset(&pool, 0, sizeof(pool));
+    SimState state;
+    memset(&state, 0, sizeof(state));
+    if (InitHostSimState(&state, &pool, &batch))
+    {
+        fprintf(stderr, "Error allocating the output arrays\n");
+        exit(1);
+    }
+    ctx->A_rz = state.A_rz;
+    ctx->Rd_ra = state.Rd_ra;
+    ctx->Tt_ra = state.Tt_ra;
+    ctx->next_photon = 0;
+
+    // Rd, A and T of every chunk (batch means)
+    UINT32 n_chunk = sim->number_of_photons / N_CHUNKS;
+    double sum[3] = {0, 0, 0}, sum_sq[3] = {0, 0, 0};
+    UINT64 last[3] = {0, 0, 0};
+    double seconds = 0;
+    for (int c = 0; c < N_CHUNKS; ++c)
+    {
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        SimulatePhotonsCPU(ctx, n_chunk, sim->ignoreAdetection, 0, rng, precision);
+        seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+        UINT64 total[3] = {0, 0, 0};
+        for (UINT32 i = 0; i < sim->det.nr * sim->det.na; ++i)
+        {
+            total[0] += state.Rd_ra[i];
+            total[2] += state.Tt_ra[i];
+        }
+        for (UINT32 i = 0; i < sim->det.nr * sim->det.nz; ++i)
+            total[1] += state.A_rz[i];
+        for (int q = 0; q < 3; ++q)
+        {
+            double value = (double)(total[q] - last[q]) / ((double)WEIGHT_SCALE * n_chunk);
+            sum[q] += value;
+            sum_sq[q] += value * value;
+            last[q] = total[q];
+        }
+    }
+
+    printf("%-10s %14.0f", name, N_CHUNKS * n_chunk / seconds);
+    for (int q = 0; q < 3; ++q)
+    {
+        double mean = sum[q] / N_CHUNKS;
+        double var = (sum_sq[q] - N_CHUNKS * mean * mean) / (N_CHUNKS - 1);
+        printf(" %10.6f +- %9.6f", mean, std::sqrt((var > 0 ? var : 0) / N_CHUNKS));
+    }
+    printf("\n");
+
+    FreeHostSimState(&state);
+    FreeBufferPool(&pool);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename = (argc > 1) ? argv[1] : MCML_SOURCE_DIR "/resources/sample.mci";
+    UINT32 n_photons = (argc > 2) ? (UINT32)strtoul(argv[2], NULL, 10) : 200000u;
+
+    SimulationStruct *simulations;
+    int n_simulations = read_simulation_data(filename, &simulations, 0);
+    if (n_simulations == 0)
+        return 1;
+    SimulationStruct *sim = &simulations[0];
+    sim->number_of_photons = n_photons;
+
+    CPUThreadContext *ctx = (CPUThreadContext *)malloc(sizeof(CPUThreadContext));
+    if (InitCPUThreadContext(ctx, sim))
+        return 1;
+    if (init_RNG(&ctx->multipliers, &ctx->n_multipliers))
+        return 1;
+    ctx->rng_key = GetRunKey(12345ull, sim);
+
+    printf("%u x %u numbers per generator, one host thread\n\n", N_STREAMS, N_DRAWS_PER_STREAM);
+    printf("%-10s %14s %10s %10s %10s %10s\n", "generator", "numbers/sec", "mean", "variance", "chi2(255)",
+           "lag-1 corr");
+    BenchGenerator<MWCRng>("mwc", ctx->rng_key, ctx->multipliers);
+    BenchGenerator<PhiloxRng>("philox", ctx->rng_key, ctx->multipliers);
+    BenchGenerator<XoroshiroRng>("xoroshiro", ctx->rng_key, ctx->multipliers);
+
+    printf("\n%s: %u photons, %u layers, scalar engine, one host thread\n\n", sim->outp_filename, n_photons,
+           sim->n_layers);
+    printf("%-10s %14s %23s %23s %23s\n", "generator", "photons/sec", "Rd", "A", "T");
+    BenchSimulation("mwc", RNG_MWC, PRECISION_SINGLE, sim, ctx);
+    BenchSimulation("philox", RNG_PHILOX, PRECISION_SINGLE, sim, ctx);
+    BenchSimulation("xoroshiro", RNG_XOROSHIRO, PRECISION_SINGLE, sim, ctx);
+
+    // The policies draw the same numbers, so their results only differ by
+    // rounding (and the drift of the positions in single precision).
+    printf("\n%-10s %14s %23s %23s %23s\n", "precision", "photons/sec", "Rd", "A", "T");
+    BenchSimulation("single", RNG_MWC, PRECISION_SINGLE, sim, ctx);
+    BenchSimulation("mixed", RNG_MWC, PRECISION_MIXED, sim, ctx);
+    BenchSimulation("double", RNG_MWC, PRECISION_DOUBLE, sim, ctx);
+
+    free(ctx);
+    FreeSimulationStruct(simulations, n_simulations);
+    return 0;
+}
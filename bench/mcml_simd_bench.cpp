@@ -0,0 +1,155 @@
+/*****************************************************************************
+ *
+ *   Benchmark of the scalar and SIMD CPU photon engines
+ *   =========================================================================
+ *   Runs the first simulation of an .mci file on one host thread with the
+ *   scalar engine and with every SIMD variant this CPU supports, and prints
+ *   photons/sec, the speedup over the scalar engine and Rd/A/T.
+ *
+ *   Usage: mcml_simd_bench [file.mci] [number of photons]
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "../src/gpumcml_cpu.h"
+
+typedef struct
+{
+    const char *name;
+    UINT32 width; // 0 for the scalar engine
+    void (*simulate)(CPUThreadContext *ctxs, const UINT32 *n_photons, UINT32 n_ctx, int ignoreAdetection);
+} BenchEngine;
+
+//////////////////////////////////////////////////////////////////////////////
+//   Run one engine and print one line of results. Every engine simulates the
+//   same photons (the first ones of the stream of the run).
+//   Return the photons/sec achieved.
+//////////////////////////////////////////////////////////////////////////////
+static double RunBench(const BenchEngine *engine, SimulationStruct *sim, CPUThreadContext *ctx, double scalar_rate)
+{
+    PackedBatch batch;
+    BuildPackedBatch(&batch, sim, 1, 0, 0);
+
+    BufferPool pool;
+    memset(&pool, 0, sizeof(pool));
+    SimState state;
+    memset(&state, 0, sizeof(state));
+    if (InitHostSimState(&state, &pool, &batch))
+    {
+        fprintf(stderr, "Error allocating the output arrays\n");
+        exit(1);
+    }
+    ctx->A_rz = state.A_rz;
+    ctx->Rd_ra = state.Rd_ra;
+    ctx->Tt_ra = state.Tt_ra;
+    ctx->next_photon = 0;
+
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    if (engine->width == 0)
+    {
+        SimulatePhotonsCPU(ctx, sim->number_of_photons, sim->ignoreAdetection, 0, RNG_MWC,
+                           PRECISION_SINGLE);
+    }
+    else
+    {
+        engine->simulate(ctx, &sim->number_of_photons, 1, sim->ignoreAdetection);
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    double rate = sim->number_of_photons / seconds;
+
+    UINT64 Rd = 0, A = 0, T = 0;
+    for (UINT32 i = 0; i < sim->det.nr * sim->det.nz; ++i)
+        A += state.A_rz[i];
+    for (UINT32 i = 0; i < sim->det.nr * sim->det.na; ++i)
+    {
+        Rd += state.Rd_ra[i];
+        T += state.Tt_ra[i];
+    }
+    double scale = (double)WEIGHT_SCALE * sim->number_of_photons;
+
+    printf("%-8s %5u %10.3f %14.0f %8.2fx %10.6f %10.6f %10.6f\n", engine->name, engine->width ? engine->width : 1,
+           seconds, rate, (scalar_rate > 0) ? rate / scalar_rate : 1.0, Rd / scale, A / scale, T / scale);
+
+    FreeHostSimState(&state);
+    FreeBufferPool(&pool);
+    return rate;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *filename = (argc > 1) ? argv[1] : MCML_SOURCE_DIR "/resources/sample.mci";
+    UINT32 n_photons = (argc > 2) ? (UINT32)strtoul(argv[2], NULL, 10) : 200000u;
+
+    SimulationStruct *simulations;
+    int n_simulations = read_simulation_data(filename, &simulations, 0);
+    if (n_simulations == 0)
+        return 1;
+    SimulationStruct *sim = &simulations[0];
+    sim->number_of_photons = n_photons;
+
+    CPUThreadContext *ctx = (CPUThreadContext *)malloc(sizeof(CPUThreadContext));
+    if (InitCPUThreadContext(ctx, sim))
+        return 1;
+
+    if (init_RNG(&ctx->multipliers, &ctx->n_multipliers))
+        return 1;
+    ctx->rng_key = GetRunKey(12345ull, sim);
+
+    BenchEngine engines[4];
+    int n_engines = 0;
+    BenchEngine scalar = {"scalar", 0, NULL};
+    engines[n_engines++] = scalar;
+    BenchEngine generic = {"generic", GetSIMDWidth_generic(), SimulatePhotonsSIMD_generic};
+    engines[n_engines++] = generic;
+#ifdef MCML_HAVE_SIMD_AVX2
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        BenchEngine avx2 = {"avx2", GetSIMDWidth_avx2(), SimulatePhotonsSIMD_avx2};
+        engines[n_engines++] = avx2;
+    }
+#endif
+#ifdef MCML_HAVE_SIMD_AVX512
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw"))
+    {
+        BenchEngine avx512 = {"avx512", GetSIMDWidth_avx512(), SimulatePhotonsSIMD_avx512};
+        engines[n_engines++] = avx512;
+    }
+#endif
+
+    printf("%s: %u photons, %u layers, one host thread\n\n", sim->outp_filename, n_photons, sim->n_layers);
+    printf("%-8s %5s %10s %14s %9s %10s %10s %10s\n", "engine", "lanes", "time [s]", "photons/sec", "speedup", "Rd",
+           "A", "T");
+
+    double scalar_rate = 0;
+    for (int i = 0; i < n_engines; ++i)
+    {
+        double rate = RunBench(&engines[i], sim, ctx, scalar_rate);
+        if (i == 0)
+            scalar_rate = rate;
+    }
+
+    free(ctx);
+    FreeSimulationStruct(simulations, n_simulations);
+    return 0;
+}
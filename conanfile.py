@@ -24,7 +24,7 @@ class MCMLRecipe(ConanFile):
     default_options = {"shared": False, "fPIC": True, "cuda_arch": "86"}
 
     # Sources are located in the same place as this recipe, copy them to the recipe
-    exports_sources = "CMakeLists.txt", "src/*", "tqdm/*", "resources/*"
+    exports_sources = "CMakeLists.txt", "cmake_uninstall.cmake", "src/*", "resources/*", "tools/*", "bench/*", "test/*"
 
     def config_options(self):
         if self.settings.os == "Windows":
@@ -23,8 +23,6 @@
 #ifndef GPUMCML_H
 #define GPUMCML_H
 
-#define SINGLE_PRECISION
-
 #define CUDA_SAFE_CALL(call)                                                                                           \
     {                                                                                                                  \
         cudaError_t err = call;                                                                                        \
@@ -55,10 +53,18 @@
 typedef unsigned long long UINT64;
 typedef unsigned int UINT32;
 
+// Functions shared by the host and the device code
+#ifdef __CUDACC__
+#define MCML_HOST_DEVICE __host__ __device__ __forceinline__
+#else
+#define MCML_HOST_DEVICE inline
+#endif
+
 // MCML constants
-#ifdef SINGLE_PRECISION
 
-// NOTE: Single Precision
+// Floating-point type of the layer tables, the grid and the SIMD engine. The
+// scalar photon loops compute in the types of their precision policy (see
+// gpumcml_precision.h).
 typedef float GFLOAT;
 
 // Critical weight for roulette
@@ -86,34 +92,40 @@ typedef float GFLOAT;
 #define FP_ONE 1.0F
 #define FP_TWO 2.0F
 
-#else // SINGLE_PRECISION
-
-// NOTE: Double Precision
-typedef double GFLOAT;
-
-// Critical weight for roulette
-#define WEIGHT 1E-4
-
-// scaling factor for photon weight, which is then converted to integer
-#define WEIGHT_SCALE ((GFLOAT)(1 << 24))
+#define STR_LEN 200
 
-#define PI_const 3.1415926
-#define RPI 0.318309886
+// The max number of layers supported (MAX_LAYERS including 2 ambient layers)
+#define MAX_LAYERS 100
 
-#define COSNINETYDEG 1.0E-6
-#define COSZERO (1.0 - 1.0E-12)
-#define CHANCE 0.1
+// Limits of a packed batch: the number of runs, and the number of layers of
+// all runs together (including 2 ambient layers per run). Both tables live in
+// the constant memory of a GPU (64KB, 64 bytes per run and 48 per layer, see
+// gpumcml_kernel.h).
+#define MAX_PACKED_RUNS 256
+#define MAX_PACKED_LAYERS 960
 
-#define MCML_FP_ZERO 0.0
-#define FP_ONE 1.0
-#define FP_TWO 2.0
+// Max number of multipliers the random number generators are seeded with
+#define MAX_RNG_MULTIPLIERS 4096
 
-#endif // SINGLE_PRECISION
+// Random number generators of the photon engines (see gpumcml_rng.h)
+#define RNG_MWC 0       // multiply-with-carry
+#define RNG_PHILOX 1    // Philox4x32-10
+#define RNG_XOROSHIRO 2 // xoroshiro64**
 
-#define STR_LEN 200
+// Precision policies of the photon loops (see gpumcml_precision.h)
+#define PRECISION_SINGLE 0 // float
+#define PRECISION_MIXED 1  // photon positions in double, everything else in float
+#define PRECISION_DOUBLE 2 // double
 
+#include <atomic>
+#include <condition_variable>
+#include <ctime>
 #include <iostream>
+#include <map>
+#include <mutex>
 #include <sstream>
+#include <string>
+#include <thread>
 
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
@@ -161,6 +173,89 @@ typedef struct
     LayerStruct *layers;
 } SimulationStruct;
 
+// Consecutive runs (in the input file) simulated in one engine dispatch.
+// A batch of one run is the normal, unpacked mode.
+//
+// Photons of the batch are numbered 0 .. photon_end[n_runs - 1] - 1, and
+// photon <id> belongs to run r if photon_end[r - 1] <= id < photon_end[r].
+// The tallies of all runs are concatenated: the slices of run r start at
+// A_rz_ofst[r] and ra_ofst[r] (for both Rd_ra and Tt_ra).
+//
+// In a white batch (see BuildWhiteBatch) all runs share the same photons
+// 0 .. photon_end[0] - 1 instead: they are simulated once without absorption
+// and reweighted for the mua of every run.
+//
+// If <jacobian> is set, the engine also tallies the derivatives of Rd with
+// respect to mua and mus of every layer (perturbation Monte Carlo): the
+// slice of run r starts at jac_ofst[r] and holds dRd/dmua and dRd/dmus of
+// layer 1, then of layer 2, and so on.
+//
+// Photon i of run r (counted over all chunks of the run) draws its random
+// numbers from a generator of the kind <rng> seeded from rng_key[r] and i
+// alone (see gpumcml_rng.h), so the tallies of a run do not depend on the other runs,
+// nor on how its photons are split among workers, GPU threads or SIMD
+// lanes. The photons of a white batch use the stream of its first run.
+typedef struct
+{
+    // first run of the batch, runs are consecutive in the input
+    SimulationStruct *sims;
+    UINT32 n_runs;
+    int white;
+    int jacobian;
+    int rng;       // random number generator (RNG_MWC, ...)
+    int precision; // precision policy of the photon loop (PRECISION_SINGLE, ...)
+
+    UINT32 photon_end[MAX_PACKED_RUNS];
+
+    // keys of the random number streams of the runs (see SeedBatch)
+    UINT64 rng_key[MAX_PACKED_RUNS];
+
+    // offsets of the tally slices, the last entry is the total size
+    UINT32 A_rz_ofst[MAX_PACKED_RUNS + 1];
+    UINT32 ra_ofst[MAX_PACKED_RUNS + 1];
+    UINT32 jac_ofst[MAX_PACKED_RUNS + 1];
+} PackedBatch;
+
+// Quantities of a run with batch-means statistics (see RunStats)
+#define STAT_RD 0 // diffuse reflectance
+#define STAT_A 1  // absorbed fraction
+#define STAT_T 2  // transmittance
+#define STAT_PEN 3 // penetration depth
+#define N_STATS 4
+
+// Events counted per run in the photon loops of a build with MCML_PROFILE
+// (see gpumcml_profile.h and --profile)
+#define PROFILE_LAUNCHES 0           // photons launched
+#define PROFILE_STEPS 1              // iterations of the photon loop
+#define PROFILE_BOUNDARY_HITS 2      // steps that end on a layer boundary
+#define PROFILE_TIR 3                // total internal reflections at a boundary
+#define PROFILE_TRANSMISSIONS 4      // crossings of a boundary (into a layer or out of the tissue)
+#define PROFILE_SCATTERS 5           // absorption and scattering events
+#define PROFILE_ROULETTE_SURVIVALS 6 // photons that survive the roulette
+#define PROFILE_ROULETTE_KILLS 7     // photons killed by the roulette (not the ones that left the tissue)
+#define PROFILE_TALLY_SMEM 8         // A_rz writes to the shared memory cache (GPU)
+#define PROFILE_TALLY_GMEM 9         // A_rz writes to global (or host) memory
+#define PROFILE_OVERFLOW_FLUSHES 10  // flushes of the shared memory cache before an overflow (GPU)
+#define N_PROFILE_EVENTS 11
+
+// Batch-means statistics of one run: every chunk of photons of the run (see
+// BatchScheduler) is one batch, with a total weight W_c of each quantity
+// (in units of the photon weight) from N_c photons. For the penetration
+// depth, W_c is the penetration depth of the chunk (if it is computed).
+typedef struct
+{
+    UINT64 n_photons; // sum of N_c
+    UINT32 n_chunks;
+    double sum_n2;          // sum of N_c^2
+    double sum_w[N_STATS];  // sum of W_c
+    double sum_w2[N_STATS]; // sum of W_c^2
+    double sum_wn[N_STATS]; // sum of W_c * N_c
+
+    // event counts of the photon loops (PROFILE_LAUNCHES, ...), zero
+    // without MCML_PROFILE
+    UINT64 events[N_PROFILE_EVENTS];
+} RunStats;
+
 // Per-GPU simulation states
 // One instance of this struct exists in the host memory, while the other
 // in the global memory.
@@ -170,42 +265,111 @@ typedef struct
     // completed (i.e. either on the fly or not yet started)
     UINT32 *n_photons_left;
 
-    // per-thread seeds for random number generation
-    // arrays of length NUM_THREADS
-    // We put these arrays here as opposed to in GPUThreadStates because
-    // they live across different simulation runs and must be copied back
-    // to the host.
+    // per-thread states of the random number generators (GPU only), arrays
+    // of length NUM_THREADS: a thread seeds its generator whenever it
+    // launches a photon, and saves it here between kernel launches (see
+    // the Save and Restore members of the generators in gpumcml_rng.h)
     UINT64 *x;
     UINT32 *a;
 
+    // multipliers the MWC generators are seeded with (see MWCRng)
+    const UINT32 *multipliers;
+    UINT32 n_multipliers;
+
     // output data
     UINT64 *Rd_ra;
     UINT64 *A_rz; // Pointer to a 2D absorption matrix!
     UINT64 *Tt_ra;
+
+    // derivatives of Rd (see PackedBatch), in units of the photon weight
+    double *Rd_jac;
+
+    // event counts of every run (N_PROFILE_EVENTS per run, MCML_PROFILE
+    // builds only)
+    UINT64 *profile;
 } SimState;
 
+// Output buffers of one worker, allocated once for the largest batch of the
+// input and reused by every batch: each batch only zeroes the region it uses.
+typedef struct
+{
+    // host-side output data (the SimState of a batch points here)
+    UINT64 *A_rz;
+    UINT64 *Rd_ra;
+    UINT64 *Tt_ra;
+    double *Rd_jac;
+    UINT64 *profile; // MAX_PACKED_RUNS * N_PROFILE_EVENTS event counts
+
+    // number of elements allocated for A_rz, for each of Rd_ra and Tt_ra
+    // and for Rd_jac
+    UINT32 rz_size;
+    UINT32 ra_size;
+    UINT32 jac_size;
+
+    // device-side buffers of the GPU backend (tallies and thread states),
+    // allocated by the first batch that runs on the GPU
+    void *device;
+
+    // time spent allocating and freeing the buffers [s]
+    double alloc_time;
+} BufferPool;
+
 // Everything a host thread needs to know in order to run simulation on
-// one GPU (host-side only)
+// one GPU, or on one CPU thread of the CPU backend (host-side only)
 typedef struct
 {
-    // GPU identifier
+    // GPU identifier (thread index for the CPU backend)
     unsigned int dev_id;
 
     // those states that will be updated
     SimState host_sim_state;
 
+    // buffers reused across batches
+    BufferPool pool;
+
     // simulation input parameters
-    SimulationStruct *sim;
+    PackedBatch *batch;
+
+    // the photons of this worker are batch photons
+    // photon_begin .. photon_begin + *host_sim_state.n_photons_left - 1
+    UINT32 photon_begin;
+
+    // batch photon p of run r is photon p - (first photon of r) +
+    // photon_ofst of the stream of the run (photon_ofst is only nonzero for
+    // the photons added to a run by adaptive photon counts)
+    UINT64 photon_ofst;
 
     /* GPU-specific constant parameters */
 
     // number of thread blocks launched
     UINT32 n_tblks;
 
+    // number of threads driven by this state (1 for the CPU backend, the
+    // number of lanes for the SIMD engine)
+    UINT32 n_threads;
+
     // the limit that indicates overflow of an element of A_rz
     // in the shared memory
     UINT32 A_rz_overflow;
 
+    // steps simulated by this worker so far (scalar CPU engine only)
+    UINT64 n_steps;
+
+    // length of the next batch of the engine, adapted to --batch_ms (see
+    // AdaptBatchLength): steps per kernel launch on a GPU, photons taken
+    // from a chunk at a time on a CPU thread. 0 before the first batch.
+    UINT64 batch_length;
+
+    // target duration of a batch [s], 0 for fixed batches (NUM_STEPS
+    // steps per kernel launch, whole chunks on a CPU thread)
+    double batch_seconds;
+
+    // photons of the current chunk done so far, for progress reports: the
+    // GPU engine stores the photons finished after every kernel launch and
+    // the CPU engines count the photons they launch. Only the worker writes
+    // it, so the engines update it without a read-modify-write.
+    std::atomic<UINT64> chunk_progress;
+
 } HostThreadState;
 
 //////////////////////////////////////////////////////////////////////////////
@@ -215,21 +379,195 @@ typedef struct
 // Return 0 if successful or an error code.
 extern int interpret_arg(int argc, char *argv[]);
 
-extern int read_simulation_data(const char *filename, SimulationStruct **simulations, int ignoreAdetection);
+// Parse <filename> with <n_threads> threads (0 for one per hardware thread).
+// Return the number of runs, or 0 if the file cannot be parsed.
+extern int read_simulation_data(const char *filename, SimulationStruct **simulations, int ignoreAdetection,
+                                UINT32 n_threads = 0);
 
+// Allocate <n_simulations> runs with n_layers[i] layers each, in one block
+// that FreeSimulationStruct frees. Return NULL if out of memory.
+extern SimulationStruct *AllocSimulationStruct(int n_simulations, const UINT32 *n_layers);
 extern void FreeSimulationStruct(SimulationStruct *sim, int n_simulations);
 
+// Set layer <ii> of <sim> from n, mua, mus, g and d as in an input file;
+// <dtot> is the depth of its top and is advanced to its bottom. Call
+// SetStartWeight once all layers are set.
+extern void SetLayer(SimulationStruct *sim, int ii, float n, float mua, float mus, float g, float d, float *dtot);
+extern void SetStartWeight(SimulationStruct *sim);
+
+// Convert a text input file (.mci) to a binary one (.mcb), which
+// read_simulation_data reads without any text parsing.
+// Return 0 if successful or 1 if an error occurred.
+extern int convert_input_to_binary(const char *mciFile, const char *mcbFile);
+
+// Read the IDs of the complete rows of an existing output file into <ids>
+// (with the number of rows of each ID), dropping an incomplete last row.
+// Return the number of complete rows, -1 if the file does not exist or has
+// no header, or -2 (leaving the file as it is) if its header is not <header>
+// (without the newline), i.e. it has other columns.
+extern int read_completed_runs(const char *mcoFile, const std::string &header, std::map<std::string, UINT32> *ids);
+
+// Point *multipliers at the MAX_RNG_MULTIPLIERS multipliers of the MWC
+// random number generators (safe primes), which are compiled in, and set
+// *n_multipliers. Return 0 if successful.
+extern int init_RNG(const UINT32 **multipliers, UINT32 *n_multipliers);
+
+// Key of the random number stream of run <sim>: a hash of <seed> and the ID
+// of the run, so that it does not depend on where the run is in the input.
+extern UINT64 GetRunKey(UINT64 seed, const SimulationStruct *sim);
+
+// Set the stream keys of the runs of <batch> (see PackedBatch).
+extern void SeedBatch(PackedBatch *batch, UINT64 seed);
+
+// Seed the MWC generator (*x, *a) of photon <photon> of the stream <key>
+// with one of the <n_multipliers> <multipliers> (MWCRng::Seed, for the
+// SIMD engine).
+extern void SeedPhotonRNG(UINT64 key, UINT64 photon, const UINT32 *multipliers, UINT32 n_multipliers, UINT64 *x,
+                          UINT32 *a);
+
+// Allocate the host buffers of <pool> for <rz_size> elements of A_rz,
+// <ra_size> elements of Rd_ra and Tt_ra and <jac_size> elements of Rd_jac
+// (and the event counts of MAX_PACKED_RUNS runs).
+// Return 0 if successful or 1 if an allocation failed.
+extern int InitBufferPool(BufferPool *pool, UINT32 rz_size, UINT32 ra_size, UINT32 jac_size);
+extern void FreeBufferPool(BufferPool *pool);
+
+// Point the output arrays of <HostMem> at the buffers of <pool>, grown if
+// needed, and zero the region used by <batch>.
+// Return 0 if successful or 1 if an allocation failed.
+extern int InitHostSimState(SimState *HostMem, BufferPool *pool, const PackedBatch *batch);
+
+// Release the per-batch parts of <hstate>; the output arrays belong to the
+// buffer pool of the worker and are kept.
+extern void FreeHostSimState(SimState *hstate);
+
+// Group the runs sims[first ..] that differ only in mua (and the number of
+// photons is the same) into a white batch. Return the number of runs in it.
+extern UINT32 BuildWhiteBatch(PackedBatch *batch, SimulationStruct *sims, UINT32 n_sims, UINT32 first);
+
+// Group the runs sims[0 .. n_sims - 1] into a batch, starting at <first>:
+// consecutive runs are packed as long as the batch has at most
+// <pack_photons> photons (0 disables packing) and fits the limits above.
+// Return the number of runs in the batch.
+extern UINT32 BuildPackedBatch(PackedBatch *batch, SimulationStruct *sims, UINT32 n_sims, UINT32 first,
+                               UINT64 pack_photons);
+
+// Photon engines: each one simulates *host_sim_state.n_photons_left photons
+// of hstate->batch (starting at hstate->photon_begin) and leaves the tallies
+// of the whole batch in hstate->host_sim_state.
+// On failure, host_sim_state.n_photons_left is freed and set to NULL.
+extern void RunCPUi(HostThreadState *hstate);
+extern void RunSIMDi(HostThreadState *hstate);
+extern void RunGPUi(HostThreadState *hstate);
+
+// Length of the next batch of an engine that did <done> units (steps or
+// photons) in <seconds>, so that a batch takes about <target> seconds. The
+// length changes by at most a factor of 2 per batch, against the noise of
+// single measurements, and stays within <min_length> .. <max_length>.
+static inline UINT64 AdaptBatchLength(UINT64 length, UINT64 done, double seconds, double target, UINT64 min_length,
+                                      UINT64 max_length)
+{
+    if (done > 0 && seconds > 0)
+    {
+        double next = done * target / seconds;
+        if (next > 2.0 * length)
+            next = 2.0 * length;
+        if (next < 0.5 * length)
+            next = 0.5 * length;
+        length = (UINT64)next;
+    }
+    if (length < min_length)
+        length = min_length;
+    if (length > max_length)
+        length = max_length;
+    return length;
+}
+
+// Standard error of quantity <q> (STAT_RD, ...) of a run, from the spread of
+// its chunks, and the same relative to the mean. HUGE_VAL if the run has
+// fewer than 2 chunks (or a mean of 0).
+extern double StdError(const RunStats *stats, int q);
+extern double RelativeStdError(const RunStats *stats, int q);
+
+// Penetration depth [cm] of <sim> from its absorption <A_rz> (in total <A>)
+// and transmittance <T>, in units of the tallies
+extern float PenetrationDepth(const UINT64 *A_rz, UINT64 A, UINT64 T, const SimulationStruct *sim);
+
+// Number of photons (and generators) of one SIMD lane group on this CPU
+extern UINT32 GetSIMDWidth();
+
+extern int GetGPUCount();
+extern UINT32 InitGPUHostThreadStates(HostThreadState *hstates[], UINT32 num_GPUs);
+extern void FreeGPUBufferPool(HostThreadState *hstate);
+
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
 
+// Rows are handed to the writer thread in chunks of RESULTS_FLUSH_ROWS rows,
+// or every RESULTS_FLUSH_SECONDS if fewer rows are registered. At most
+// RESULTS_MAX_PENDING_ROWS rows are kept in memory.
+#define RESULTS_FLUSH_ROWS 256
+#define RESULTS_FLUSH_SECONDS 1
+#define RESULTS_MAX_PENDING_ROWS (16 * RESULTS_FLUSH_ROWS)
+
+class ResultCache;
+
 class SimulationResults
 {
   public:
-    std::stringstream resultsStream;
+    SimulationResults();
+    ~SimulationResults();
+
+    // Append the registered rows to <mcoFile> from a background thread as
+    // the runs finish. Every flush writes whole rows and syncs the file,
+    // so a crash loses at most the rows of the last few seconds.
+    // Return 0 if successful or 1 if the file cannot be opened.
+    int startWriter(const char *mcoFile);
 
-    void registerSimulationResults(SimState *HostMem, SimulationStruct *sim);
+    // Add the derivatives of Rd with respect to mua and mus of layers
+    // 1 .. <n_layers> to every row (runs with fewer layers leave the
+    // columns of the missing layers empty). 0 disables them.
+    void setJacobianColumns(UINT32 n_layers);
 
+    // Add the standard errors of Rd, A, T and the penetration depth to every
+    // row (see StdError).
+    void setStdErrorColumns(bool enable);
+
+    // Add the event counts of the photon loops (RunStats::events) to every
+    // row.
+    void setProfileColumns(bool enable);
+
+    // Store the result of every simulated run in <cache> and register its
+    // duplicates (see ResultCache) with the same result.
+    void setCache(ResultCache *cache);
+
+    // <stats> has the number of photons simulated for <sim>.
+    void registerSimulationResults(SimState *HostMem, SimulationStruct *sim, const RunStats *stats);
+
+    // Register the row of run <id> with the result <values> (the columns
+    // after the ID), e.g. from the result cache.
+    void registerRow(const char *id, const std::string &values);
+
+    // Write the remaining rows to <mcoFile> and stop the writer thread.
     void writeSimulationResults(const char *mcoFile);
+
+  private:
+    void writerLoop();
+    void flushRows(const std::string &rows);
+
+    std::string pendingRows; // registered rows not written yet
+    UINT32 n_pendingRows;
+    FILE *outputFile;
+    bool stopping;
+    bool stdErrors;
+    bool profile;
+    UINT32 n_jacobianLayers;
+    ResultCache *cache;
+
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable rowsReady;   // signaled when a chunk of rows is pending
+    std::condition_variable rowsWritten; // signaled when pending rows are taken
 };
 
 /**
@@ -239,9 +577,28 @@ struct CommandLineArguments
 {
     bool ignore_absorption_detection = false;
     std::string input_file;
+    std::string sweep_file; // runs generated from a sweep file instead of read from input_file
     std::string output_file;
     UINT64 seed = (UINT64)time(nullptr);
     UINT32 number_of_gpus = 1;
+    std::string backend = "gpu";
+    UINT32 number_of_threads = 0;              // CPU backends only, 0 means all hardware threads
+    UINT64 pack_photons = 0;                   // photon budget of a packed batch, 0 disables packing
+    UINT64 chunk_photons = 0;                  // photons per work queue chunk, 0 picks one from the number of workers
+    bool resume = false;                       // skip the runs already in the output file
+    bool white_mc = false;                     // simulate runs that differ only in mua once (white Monte Carlo)
+    bool jacobian = false;                     // output dRd/dmua and dRd/dmus of every layer
+    std::string rng = "mwc";                   // random number generator: mwc, philox or xoroshiro
+    std::string precision = "single";          // precision policy: single, mixed or double
+    std::string cache_dir;                     // directory of cached results, empty disables the cache
+    bool std_errors = false;                   // output the standard errors of the results
+    bool profile = false;                      // output the event counts of the photon loops (MCML_PROFILE)
+    std::string trace_file;                    // timing trace in the Chrome trace event format, empty disables it
+    double target_rse[N_STATS] = {0, 0, 0, 0}; // relative standard errors to reach (0: no target)
+    std::string progress = "bar";              // progress reports: bar, json (lines on stderr) or none
+    double batch_ms = -1;                      // target duration of an engine batch [ms], 0 for fixed batches
+    double progress_interval = 1.0;            // seconds between progress reports
+    UINT64 max_photons = 0;                    // photons per run with targets, 0 means 10 times the photons of the run
 };
 
 /**
@@ -0,0 +1,185 @@
+/*****************************************************************************
+ *
+ *   On-disk result cache of MCMLGPU
+ *   =========================================================================
+ *   Runs whose result is stored already (by an earlier job, or a duplicate
+ *   in the same input) are not simulated again.
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "gpumcml_cache.h"
+
+//////////////////////////////////////////////////////////////////////////////
+//   128-bit hash of a byte string: FNV-1a and a 64-bit mixer over the same
+//   bytes, printed as 32 hex digits.
+//////////////////////////////////////////////////////////////////////////////
+static UINT64 Mix64(UINT64 z)
+{
+    z += 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+static std::string Hash128(const std::string &bytes)
+{
+    UINT64 fnv = 0xcbf29ce484222325ull;
+    UINT64 mix = bytes.size();
+    for (size_t i = 0; i < bytes.size(); ++i)
+    {
+        fnv = (fnv ^ (unsigned char)bytes[i]) * 0x100000001b3ull;
+        mix = Mix64(mix ^ ((UINT64)(unsigned char)bytes[i] << (8 * (i % 8))));
+    }
+
+    char hex[33];
+    snprintf(hex, sizeof(hex), "%016llx%016llx", (unsigned long long)fnv, (unsigned long long)mix);
+    return hex;
+}
+
+template <typename T> static void Append(std::string *bytes, T value)
+{
+    bytes->append((const char *)&value, sizeof(value));
+}
+
+static int MakeDirectory(const std::string &path)
+{
+    if (mkdir(path.c_str(), 0777) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "Error creating cache directory %s: %s\n", path.c_str(), strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+int ResultCache::Open(const char *dir, const std::string &context)
+{
+    this->dir = dir;
+    this->context = context;
+    return MakeDirectory(this->dir);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Hash the fields of <sim> that the result depends on. The ambient media
+//   only contribute their refractive index, and the IDs do not count.
+//////////////////////////////////////////////////////////////////////////////
+std::string ResultCache::Key(const SimulationStruct *sim) const
+{
+    std::string bytes = context;
+    Append(&bytes, MCML_CACHE_VERSION);
+    Append(&bytes, sim->number_of_photons);
+    Append(&bytes, sim->ignoreAdetection);
+    Append(&bytes, sim->det.dr);
+    Append(&bytes, sim->det.dz);
+    Append(&bytes, sim->det.na);
+    Append(&bytes, sim->det.nr);
+    Append(&bytes, sim->det.nz);
+    Append(&bytes, sim->n_layers);
+    Append(&bytes, sim->layers[0].n);
+    for (UINT32 i = 1; i <= sim->n_layers; ++i)
+    {
+        const LayerStruct *layer = &sim->layers[i];
+        Append(&bytes, layer->z_min);
+        Append(&bytes, layer->z_max);
+        Append(&bytes, layer->mutr);
+        Append(&bytes, layer->mua);
+        Append(&bytes, layer->g);
+        Append(&bytes, layer->n);
+    }
+    Append(&bytes, sim->layers[sim->n_layers + 1].n);
+    return Hash128(bytes);
+}
+
+std::string ResultCache::EntryPath(const std::string &key) const
+{
+    return dir + "/" + key.substr(0, 2) + "/" + key;
+}
+
+int ResultCache::Find(const SimulationStruct *sim, std::string *values)
+{
+    std::string key = Key(sim);
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = pending.find(key);
+    if (it != pending.end())
+    {
+        it->second.push_back(sim->outp_filename);
+        ++n_duplicates;
+        return CACHE_DUPLICATE;
+    }
+
+    FILE *file = fopen(EntryPath(key).c_str(), "r");
+    if (file != NULL)
+    {
+        char line[STR_LEN * 16];
+        int found = (fgets(line, sizeof(line), file) != NULL && strchr(line, '\n') != NULL);
+        fclose(file);
+        if (found)
+        {
+            *strchr(line, '\n') = '\0';
+            *values = line;
+            ++n_hits;
+            return CACHE_HIT;
+        }
+    }
+
+    pending[key];
+    return CACHE_MISS;
+}
+
+void ResultCache::Store(const SimulationStruct *sim, const std::string &values, std::vector<std::string> *duplicates)
+{
+    std::string key = Key(sim);
+    std::lock_guard<std::mutex> lock(mutex);
+
+    auto it = pending.find(key);
+    if (it != pending.end())
+    {
+        duplicates->swap(it->second);
+        pending.erase(it);
+    }
+
+    // Write the entry to a file of its own and rename it, so that readers
+    // never see a partial entry.
+    std::string path = EntryPath(key);
+    std::string tmp_path = path + ".tmp" + std::to_string((long)getpid());
+    if (MakeDirectory(dir + "/" + key.substr(0, 2)))
+        return;
+    FILE *file = fopen(tmp_path.c_str(), "w");
+    if (file == NULL)
+    {
+        perror("Error writing cache entry");
+        return;
+    }
+    int failed = (fprintf(file, "%s\n", values.c_str()) < 0);
+    failed |= (fclose(file) != 0);
+    if (failed || rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        perror("Error writing cache entry");
+        remove(tmp_path.c_str());
+    }
+}
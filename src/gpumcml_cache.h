@@ -0,0 +1,94 @@
+/*****************************************************************************
+ *
+ *   Header file for the on-disk result cache
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPUMCML_CACHE_H
+#define GPUMCML_CACHE_H
+
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "gpumcml.h"
+
+// Bump when a change of the engines changes the results of a run, so that
+// older cache entries are not used any more.
+#define MCML_CACHE_VERSION 2
+
+// Outcome of ResultCache::Find
+#define CACHE_MISS 0      // simulate the run
+#define CACHE_HIT 1       // the result of the run is in the cache
+#define CACHE_DUPLICATE 2 // a run with the same contents is simulated already
+
+//////////////////////////////////////////////////////////////////////////////
+//   Results of runs (the output row without the ID) stored in a directory
+//   under a hash of everything they depend on: the layers, the detection
+//   grid, the number of photons and the A-detection flag of the run, plus a
+//   context string with the seed, the backend, the output options and the
+//   engine version. Entries are stored as <dir>/<2 hex digits>/<32 hex
+//   digits>, written to a temporary file and renamed, so concurrent jobs can
+//   share a directory.
+//
+//   Runs with the same key in one input are simulated once: the first one
+//   is simulated and the others are registered with its result.
+//////////////////////////////////////////////////////////////////////////////
+class ResultCache
+{
+  public:
+    // Use (and create) the cache directory <dir> for runs simulated in
+    // <context>. Return 0 if successful or 1 if it cannot be created.
+    int Open(const char *dir, const std::string &context);
+
+    // Look up <sim>: set *values to its result on a hit, or remember it as a
+    // duplicate of a run with the same contents that is simulated already.
+    // A miss makes <sim> the run that its later duplicates wait for.
+    int Find(const SimulationStruct *sim, std::string *values);
+
+    // Store the result of the simulated run <sim> and return the IDs of its
+    // duplicates, which take the same result.
+    void Store(const SimulationStruct *sim, const std::string &values, std::vector<std::string> *duplicates);
+
+    UINT64 GetHitCount() const
+    {
+        return n_hits;
+    }
+
+    UINT64 GetDuplicateCount() const
+    {
+        return n_duplicates;
+    }
+
+  private:
+    std::string Key(const SimulationStruct *sim) const;
+    std::string EntryPath(const std::string &key) const;
+
+    std::string dir;
+    std::string context;
+
+    // runs simulated in this job (by key), with the IDs of their duplicates
+    std::map<std::string, std::vector<std::string>> pending;
+    UINT64 n_hits = 0;
+    UINT64 n_duplicates = 0;
+    std::mutex mutex;
+};
+
+#endif // GPUMCML_CACHE_H
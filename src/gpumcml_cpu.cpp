@@ -0,0 +1,1078 @@
+/*****************************************************************************
+ *
+ *   CPU backend of MCMLGPU
+ *   =========================================================================
+ *   Host port of MCMLKernel: every host thread runs the same photon loop
+ *   (ComputeStepSize, HitBoundary, Hop, FastReflectTransmit, Spin, roulette)
+ *   on its own private copy of A_rz, Rd_ra and Tt_ra.
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cfloat>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+#include "gpumcml_cpu.h"
+#include "gpumcml_precision.h"
+#include "gpumcml_rng.h"
+#include "gpumcml_trace.h"
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
+//   Host equivalent of the automatic __float2uint_rz conversion on the GPU:
+//   negative values become 0 and large values saturate.
+//////////////////////////////////////////////////////////////////////////////
+template <typename Real> static inline UINT32 float2uint_rz(Real v)
+{
+    if (!(v > (Real)0))
+        return 0;
+    if (v >= (Real)0xFFFFFFFFu)
+        return 0xFFFFFFFFu;
+    return (UINT32)v;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Generates a random number between 0 and 1 [0,1)
+//   Only the upper 24 bits are used, so that the conversion to float is exact
+//   and can never round up to 1 (same guarantee as __uint2float_rz). All
+//   precision policies draw the same numbers.
+//////////////////////////////////////////////////////////////////////////////
+template <typename Real, typename RNG> static inline Real rand_co(RNG *rng)
+{
+    return (Real)(rng->Next() >> 8) * ((Real)1.0 / (Real)(1 << 24));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Generates a random number between 0 and 1 (0,1]
+//////////////////////////////////////////////////////////////////////////////
+template <typename Real, typename RNG> static inline Real rand_oc(RNG *rng)
+{
+    return (Real)1 - rand_co<Real>(rng);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Parameters and layer table of a thread context in the type <Real>
+//////////////////////////////////////////////////////////////////////////////
+template <typename Real> struct HostTables;
+
+template <> struct HostTables<float>
+{
+    static const HostSimParam<float> *Param(const CPUThreadContext *ctx)
+    {
+        return &ctx->param;
+    }
+    static const HostLayerStruct<float> *Layers(const CPUThreadContext *ctx)
+    {
+        return ctx->layerspecs;
+    }
+};
+
+template <> struct HostTables<double>
+{
+    static const HostSimParam<double> *Param(const CPUThreadContext *ctx)
+    {
+        return &ctx->param_d;
+    }
+    static const HostLayerStruct<double> *Layers(const CPUThreadContext *ctx)
+    {
+        return ctx->layerspecs_d;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//   Fill in the parameters and layer table of <sim> in the type <Real>
+//////////////////////////////////////////////////////////////////////////////
+template <typename Real>
+static void InitHostTables(HostSimParam<Real> *param, HostLayerStruct<Real> *layerspecs, const SimulationStruct *sim)
+{
+    UINT32 n_layers = sim->n_layers + 2;
+
+    param->num_layers = sim->n_layers; // not plus 2 here
+    param->init_photon_w = (Real)sim->start_weight;
+    param->dz = (Real)sim->det.dz;
+    param->dr = (Real)sim->det.dr;
+    param->na = sim->det.na;
+    param->nz = sim->det.nz;
+    param->nr = sim->det.nr;
+
+    for (UINT32 i = 0; i < n_layers; ++i)
+    {
+        HostLayerStruct<Real> *layer = &layerspecs[i];
+        layer->z0 = (Real)sim->layers[i].z_min;
+        layer->z1 = (Real)sim->layers[i].z_max;
+        Real n1 = (Real)sim->layers[i].n;
+        layer->n = n1;
+
+        Real rmuas = (Real)sim->layers[i].mutr;
+        layer->muas = (Real)1 / rmuas;
+        layer->rmuas = rmuas;
+        layer->mua_muas = (Real)sim->layers[i].mua * rmuas;
+
+        layer->g = (Real)sim->layers[i].g;
+
+        if (i == 0 || i == n_layers - 1)
+        {
+            layer->cos_crit0 = (Real)0;
+            layer->cos_crit1 = (Real)0;
+        }
+        else
+        {
+            Real n2 = (Real)sim->layers[i - 1].n;
+            layer->cos_crit0 = (n1 > n2) ? std::sqrt((Real)1 - n2 * n2 / (n1 * n1)) : (Real)0;
+            n2 = (Real)sim->layers[i + 1].n;
+            layer->cos_crit1 = (n1 > n2) ? std::sqrt((Real)1 - n2 * n2 / (n1 * n1)) : (Real)0;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Initialize the thread context with read-only data (see InitDCMem)
+//////////////////////////////////////////////////////////////////////////////
+int InitCPUThreadContext(CPUThreadContext *ctx, SimulationStruct *sim)
+{
+    // Make sure that the number of layers is within the limit.
+    UINT32 n_layers = sim->n_layers + 2;
+    if (n_layers > MAX_LAYERS)
+        return 1;
+
+    InitHostTables(&ctx->param, ctx->layerspecs, sim);
+    InitHostTables(&ctx->param_d, ctx->layerspecs_d, sim);
+    ctx->n_steps = 0;
+    ctx->profile.Clear();
+    ctx->progress = NULL;
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Initialize photon position (x, y, z), direction (ux, uy, uz), weight (w),
+//   and current layer (layer), and seed the generator for the next photon
+//   of the run
+//   Note: Infinitely narrow beam (pointing in the +z direction = downwards)
+//////////////////////////////////////////////////////////////////////////////
+template <typename P, typename RNG>
+static inline void LaunchPhoton(CPUThreadContext *ctx, PhotonStructCPU<P> *photon, RNG *rng)
+{
+    typedef typename P::Real Real;
+
+    rng->Seed(ctx->rng_key, ctx->next_photon++, ctx->multipliers, ctx->n_multipliers);
+    CountLaunch(ctx);
+    photon->x = photon->y = photon->z = 0;
+    photon->ux = photon->uy = (Real)0;
+    photon->uz = (Real)1;
+    photon->w = HostTables<Real>::Param(ctx)->init_photon_w;
+    photon->layer = 1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Compute the step size for a photon packet when it is in tissue
+//   Calculate new step size: -log(rnd)/(mua+mus).
+//////////////////////////////////////////////////////////////////////////////
+template <typename P, typename RNG>
+static inline void ComputeStepSize(const CPUThreadContext *ctx, PhotonStructCPU<P> *photon, RNG *rng)
+{
+    typedef typename P::Real Real;
+
+    photon->s = -std::log(rand_oc<Real>(rng)) * HostTables<Real>::Layers(ctx)[photon->layer].rmuas;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Check if the step size calculated above will cause the photon to hit the
+//   boundary between 2 layers.
+//   Return 1 for a hit, 0 otherwise.
+//   If the projected step hits the boundary, the photon steps to the boundary
+//////////////////////////////////////////////////////////////////////////////
+template <typename P> static inline UINT32 HitBoundary(const CPUThreadContext *ctx, PhotonStructCPU<P> *photon)
+{
+    typedef typename P::Real Real;
+
+    /* Distance to the boundary. */
+    const HostLayerStruct<Real> *layer = &HostTables<Real>::Layers(ctx)[photon->layer];
+    Real z_bound = (photon->uz > (Real)0) ? layer->z1 : layer->z0;
+    Real dl_b = (Real)(z_bound - photon->z) / photon->uz; // dl_b > 0
+
+    UINT32 hit_boundary = (photon->uz != (Real)0) && (photon->s > dl_b);
+    if (hit_boundary)
+    {
+        photon->s = dl_b;
+    }
+
+    return hit_boundary;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Move the photon by step size (s) along direction (ux,uy,uz)
+//////////////////////////////////////////////////////////////////////////////
+template <typename P> static inline void Hop(PhotonStructCPU<P> *photon)
+{
+    photon->x += photon->s * photon->ux;
+    photon->y += photon->s * photon->uy;
+    photon->z += photon->s * photon->uz;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Distance of the photon from the z axis
+//////////////////////////////////////////////////////////////////////////////
+template <typename P> static inline typename P::Real RadialDistance(const PhotonStructCPU<P> *photon)
+{
+    return (typename P::Real)std::sqrt(photon->x * photon->x + photon->y * photon->y);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Index in Rd_ra (if *reflected is set) or Tt_ra of a photon that leaves
+//   the tissue
+//////////////////////////////////////////////////////////////////////////////
+template <typename P>
+static inline UINT32 ExitIndex(const CPUThreadContext *ctx, const PhotonStructCPU<P> *photon, int *reflected)
+{
+    typedef typename P::Real Real;
+    const HostSimParam<Real> *param = HostTables<Real>::Param(ctx);
+
+    Real uz2 = photon->uz;
+    *reflected = (photon->layer == 0);
+    if (*reflected)
+    {
+        // diffuse reflectance
+        uz2 = -uz2;
+    }
+
+    UINT32 ia = float2uint_rz(std::acos(uz2) * (Real)FP_TWO * (Real)RPI * param->na);
+    if (ia >= param->na)
+        ia = param->na - 1;
+    UINT32 ir = float2uint_rz(RadialDistance(photon) / param->dr);
+    if (ir >= param->nr)
+        ir = param->nr - 1;
+
+    return ia * param->nr + ir;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   If a photon hits a boundary, determine whether the photon is transmitted
+//   into the next layer or reflected back by computing the internal
+//   reflectance (same reduced-divergence formulation as the GPU kernel).
+//   Return 1 if the photon is transmitted out of the tissue.
+//////////////////////////////////////////////////////////////////////////////
+template <typename P, typename RNG>
+static inline UINT32 ReflectTransmit(const CPUThreadContext *ctx, PhotonStructCPU<P> *photon, RNG *rng,
+                                     ProfileCounters *profile)
+{
+    typedef typename P::Real Real;
+    const HostLayerStruct<Real> *layerspecs = HostTables<Real>::Layers(ctx);
+
+    /* Collect all info that depend on the sign of "uz". */
+    Real cos_crit;
+    UINT32 new_layer;
+    if (photon->uz > (Real)0)
+    {
+        cos_crit = layerspecs[photon->layer].cos_crit1;
+        new_layer = photon->layer + 1;
+    }
+    else
+    {
+        cos_crit = layerspecs[photon->layer].cos_crit0;
+        new_layer = photon->layer - 1;
+    }
+
+    // cosine of the incident angle (0 to 90 deg)
+    Real ca1 = std::fabs(photon->uz);
+
+    // The default move is to reflect.
+    photon->uz = -photon->uz;
+
+    if (ca1 > cos_crit)
+    {
+        /* Compute the Fresnel reflectance. */
+
+        // incident and transmit refractive index
+        Real ni = layerspecs[photon->layer].n;
+        Real nt = layerspecs[new_layer].n;
+        Real ni_nt = ni / nt; // reused later
+
+        Real sa1 = std::sqrt((Real)1 - ca1 * ca1);
+        if (ca1 > CosZero<Real>())
+            sa1 = (Real)0;
+        Real sa2 = std::fmin(ni_nt * sa1, (Real)1);
+        Real uz1 = std::sqrt((Real)1 - sa2 * sa2); // uz1 = ca2
+
+        Real ca1ca2 = ca1 * uz1;
+        Real sa1sa2 = sa1 * sa2;
+        Real sa1ca2 = sa1 * uz1;
+        Real ca1sa2 = ca1 * sa2;
+
+        // normal incidence: [(1-ni_nt)/(1+ni_nt)]^2
+        // We ensure that ca1ca2 = 1, sa1sa2 = 0, sa1ca2 = 1, ca1sa2 = ni_nt
+        if (ca1 > CosZero<Real>())
+        {
+            sa1ca2 = (Real)1;
+            ca1sa2 = ni_nt;
+        }
+
+        Real cam = ca1ca2 + sa1sa2; /* c- = cc + ss. */
+        Real sap = sa1ca2 + ca1sa2; /* s+ = sc + cs. */
+        Real sam = sa1ca2 - ca1sa2; /* s- = sc - cs. */
+
+        Real rFresnel = sam / (sap * cam);
+        rFresnel *= rFresnel;
+        rFresnel *= (ca1ca2 * ca1ca2 + sa1sa2 * sa1sa2);
+
+        // In this case, we do not care if "uz1" is exactly 0.
+        if (ca1 < (Real)COSNINETYDEG || sa2 == (Real)1)
+            rFresnel = (Real)1;
+
+        Real rand = rand_co<Real>(rng);
+
+        if (rFresnel < rand)
+        {
+            // The move is to transmit.
+            profile->Count(PROFILE_TRANSMISSIONS);
+            photon->layer = new_layer;
+
+            // Let's do these even if the photon is dead.
+            photon->ux *= ni_nt;
+            photon->uy *= ni_nt;
+            photon->uz = -std::copysign(uz1, photon->uz);
+
+            // transmitted out of the tissue?
+            return (photon->layer == 0 || photon->layer > ctx->param.num_layers);
+        }
+    }
+    else
+    {
+        profile->Count(PROFILE_TIR);
+    }
+    return 0;
+}
+
+template <typename P, typename RNG>
+static inline UINT32 FastReflectTransmit(CPUThreadContext *ctx, PhotonStructCPU<P> *photon, RNG *rng,
+                                         ProfileCounters *profile)
+{
+    if (ReflectTransmit(ctx, photon, rng, profile))
+    {
+        int reflected;
+        UINT32 i = ExitIndex(ctx, photon, &reflected);
+        UINT64 *ra_arr = reflected ? ctx->Rd_ra : ctx->Tt_ra;
+        ra_arr[i] += (UINT32)(photon->w * WEIGHT_SCALE);
+
+        // Kill the photon.
+        photon->w = 0;
+        return 1;
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Perturbation Monte Carlo: a photon path with n_l collisions and path
+//   length L_l in layer l has the weight prod_l (mus_l / mut_l)^n_l and the
+//   probability density prod_l mut_l^n_l exp(-mut_l L_l), so its share of
+//   Rd changes with
+//     d/dmua_l = -L_l * w,    d/dmus_l = (n_l / mus_l - L_l) * w.
+//   Add these for a photon that leaves the tissue by diffuse reflection
+//   with the weight <w>.
+//////////////////////////////////////////////////////////////////////////////
+static inline void TallyJacobian(const CPUThreadContext *ctx, const PhotonPathCPU *path, double w)
+{
+    for (UINT32 l = 1; l <= ctx->param.num_layers; ++l)
+    {
+        const LayerStructCPU *layer = &ctx->layerspecs[l];
+
+        // Glass layers have neither absorption nor scattering.
+        if (layer->rmuas == (GFLOAT)FLT_MAX)
+            continue;
+
+        double mus = (double)layer->muas * (1.0 - (double)layer->mua_muas);
+        double *jac = &ctx->Rd_jac[2 * (l - 1)];
+        jac[0] -= w * path->L[l];
+        jac[1] += w * ((mus > 0) ? path->n_coll[l] / mus - path->L[l] : -path->L[l]);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Computing the scattering angle and new direction by
+//	 sampling the polar deflection angle theta and the
+// 	 azimuthal angle psi.
+//////////////////////////////////////////////////////////////////////////////
+template <typename P, typename RNG> static inline void Spin(typename P::Real g, PhotonStructCPU<P> *photon, RNG *rng)
+{
+    typedef typename P::Real Real;
+
+    Real cost, sint; // cosine and sine of the polar deflection angle theta
+    Real cosp, sinp; // cosine and sine of the azimuthal angle psi
+    Real psi;
+    Real temp;
+    Real last_ux, last_uy, last_uz;
+    Real rand;
+
+    // SpinTheta: sample cos(theta) from the Henyey-Greenstein function,
+    // or uniformly if g is 0.
+    rand = rand_oc<Real>(rng);
+
+    cost = (Real)FP_TWO * rand - (Real)1;
+
+    if (g != (Real)0)
+    {
+        temp = ((Real)1 - g * g) / ((Real)1 + g * cost);
+        cost = ((Real)1 + g * g - temp * temp) / ((Real)FP_TWO * g);
+    }
+    sint = std::sqrt((Real)1 - cost * cost);
+
+    /* spin psi 0-2pi. */
+    rand = rand_co<Real>(rng);
+
+    psi = (Real)FP_TWO * (Real)PI_const * rand;
+    sinp = std::sin(psi);
+    cosp = std::cos(psi);
+
+    Real stcp = sint * cosp;
+    Real stsp = sint * sinp;
+
+    last_ux = photon->ux;
+    last_uy = photon->uy;
+    last_uz = photon->uz;
+
+    if (std::fabs(last_uz) > CosZero<Real>())
+    // Normal incident.
+    {
+        photon->ux = stcp;
+        photon->uy = stsp;
+        photon->uz = std::copysign(cost, last_uz * cost);
+    }
+    else
+    // Regular incident.
+    {
+        temp = (Real)1 / std::sqrt((Real)1 - last_uz * last_uz);
+        photon->ux = (stcp * last_ux * last_uz - stsp * last_uy) * temp + last_ux * cost;
+        photon->uy = (stcp * last_uy * last_uz + stsp * last_ux) * temp + last_uy * cost;
+        photon->uz = -stcp / temp + last_uz * cost;
+    }
+
+    // Normalize unit vector to ensure its magnitude is 1 (unity)
+    // only required in 32-bit floating point
+    if (sizeof(Real) == sizeof(float))
+    {
+        temp = (Real)1 / std::sqrt(photon->ux * photon->ux + photon->uy * photon->uy + photon->uz * photon->uz);
+        photon->ux = photon->ux * temp;
+        photon->uy = photon->uy * temp;
+        photon->uz = photon->uz * temp;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Photon loop (host version of MCMLKernel), with the precision policy <P>
+//   and the random number generator <RNG>
+//////////////////////////////////////////////////////////////////////////////
+template <int ignoreAdetection, int jacobian, typename P, typename RNG>
+static void SimulatePhotons(CPUThreadContext *ctx, UINT32 n_photons)
+{
+    typedef typename P::Real Real;
+    const HostSimParam<Real> *param = HostTables<Real>::Param(ctx);
+    const HostLayerStruct<Real> *layerspecs = HostTables<Real>::Layers(ctx);
+
+    PhotonStructCPU<P> photon;
+    PhotonPathCPU path;
+    RNG rng;
+    UINT64 n_steps = 0;
+    ProfileCounters profile;
+    profile.Clear();
+
+    for (UINT32 i = 0; i < n_photons; ++i)
+    {
+        LaunchPhoton(ctx, &photon, &rng);
+        profile.Count(PROFILE_LAUNCHES);
+        if (jacobian)
+        {
+            memset(path.L, 0, (param->num_layers + 2) * sizeof(path.L[0]));
+            memset(path.n_coll, 0, (param->num_layers + 2) * sizeof(path.n_coll[0]));
+        }
+
+        for (;;)
+        {
+            ++n_steps;
+            profile.Count(PROFILE_STEPS);
+
+            //>>>>>>>>> StepSizeInTissue() in MCML
+            ComputeStepSize(ctx, &photon, &rng);
+
+            //>>>>>>>>> HitBoundary() in MCML
+            photon.hit = HitBoundary(ctx, &photon);
+
+            if (jacobian)
+                path.L[photon.layer] += photon.s;
+
+            Hop(&photon);
+
+            if (photon.hit)
+            {
+                profile.Count(PROFILE_BOUNDARY_HITS);
+                Real w = photon.w;
+                if (FastReflectTransmit(ctx, &photon, &rng, &profile) && jacobian && photon.layer == 0)
+                    TallyJacobian(ctx, &path, w);
+            }
+            else
+            {
+                profile.Count(PROFILE_SCATTERS);
+                if (jacobian)
+                    ++path.n_coll[photon.layer];
+
+                //>>>>>>>>> Drop() in MCML
+                Real dwa = photon.w * layerspecs[photon.layer].mua_muas;
+                photon.w -= dwa;
+
+                if (ignoreAdetection == 0)
+                {
+                    UINT32 iz = float2uint_rz((Real)photon.z / param->dz);
+                    UINT32 ir = float2uint_rz(RadialDistance(&photon) / param->dr);
+
+                    // Only record if photon is not at the edge!!
+                    // This will be ignored anyways.
+                    if (iz < param->nz && ir < param->nr)
+                    {
+                        ctx->A_rz[ir * param->nz + iz] += (UINT32)(dwa * WEIGHT_SCALE);
+                        profile.Count(PROFILE_TALLY_GMEM);
+                    }
+                }
+                //>>>>>>>>> end of Drop()
+
+                Spin(layerspecs[photon.layer].g, &photon, &rng);
+            }
+
+            /***********************************************************
+             *  >>>>>>>>> Roulette()
+             *  If the photon weight is small, the photon packet tries
+             *  to survive a roulette.
+             ****/
+            if (photon.w < (Real)WEIGHT)
+            {
+                Real rand = rand_co<Real>(&rng);
+
+                // This photon survives the roulette.
+                if (photon.w != (Real)0 && rand < (Real)CHANCE)
+                {
+                    photon.w *= ((Real)1 / (Real)CHANCE);
+                    profile.Count(PROFILE_ROULETTE_SURVIVALS);
+                }
+                // This photon is terminated.
+                else
+                {
+                    if (photon.w != (Real)0)
+                        profile.Count(PROFILE_ROULETTE_KILLS);
+                    break;
+                }
+            }
+        }
+    }
+    ctx->n_steps += n_steps;
+    ctx->profile.Add(profile);
+}
+
+template <typename P, typename RNG>
+static void SimulatePhotonsWith(CPUThreadContext *ctx, UINT32 n_photons, int ignoreAdetection, int jacobian)
+{
+    if (jacobian)
+    {
+        if (ignoreAdetection == 1)
+            SimulatePhotons<1, 1, P, RNG>(ctx, n_photons);
+        else
+            SimulatePhotons<0, 1, P, RNG>(ctx, n_photons);
+    }
+    else if (ignoreAdetection == 1)
+    {
+        SimulatePhotons<1, 0, P, RNG>(ctx, n_photons);
+    }
+    else
+    {
+        SimulatePhotons<0, 0, P, RNG>(ctx, n_photons);
+    }
+}
+
+template <typename P>
+static void SimulatePhotonsP(CPUThreadContext *ctx, UINT32 n_photons, int ignoreAdetection, int jacobian, int rng)
+{
+    switch (rng)
+    {
+    case RNG_PHILOX:
+        SimulatePhotonsWith<P, PhiloxRng>(ctx, n_photons, ignoreAdetection, jacobian);
+        break;
+    case RNG_XOROSHIRO:
+        SimulatePhotonsWith<P, XoroshiroRng>(ctx, n_photons, ignoreAdetection, jacobian);
+        break;
+    default:
+        SimulatePhotonsWith<P, MWCRng>(ctx, n_photons, ignoreAdetection, jacobian);
+        break;
+    }
+}
+
+void SimulatePhotonsCPU(CPUThreadContext *ctx, UINT32 n_photons, int ignoreAdetection, int jacobian, int rng,
+                        int precision)
+{
+    switch (precision)
+    {
+    case PRECISION_MIXED:
+        SimulatePhotonsP<MixedPrecision>(ctx, n_photons, ignoreAdetection, jacobian, rng);
+        break;
+    case PRECISION_DOUBLE:
+        SimulatePhotonsP<DoublePrecision>(ctx, n_photons, ignoreAdetection, jacobian, rng);
+        break;
+    default:
+        SimulatePhotonsP<SinglePrecision>(ctx, n_photons, ignoreAdetection, jacobian, rng);
+        break;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   White Monte Carlo: the photons scatter as in the runs of ctxs[0] without
+//   absorption, and every run k carries its own weight, attenuated by
+//   exp(-mua_k * s) over every step s (Beer-Lambert). The runs must only
+//   differ in mua (see BuildWhiteBatch). The photons are seeded from the
+//   stream of ctxs[0].
+//////////////////////////////////////////////////////////////////////////////
+template <int ignoreAdetection, typename P, typename RNG>
+static void SimulatePhotonsWhite(CPUThreadContext *ctxs, UINT32 n_ctx, UINT32 n_photons)
+{
+    typedef typename P::Real Real;
+
+    CPUThreadContext *ctx = &ctxs[0];
+    const HostSimParam<Real> *param = HostTables<Real>::Param(ctx);
+    const HostLayerStruct<Real> *layerspecs = HostTables<Real>::Layers(ctx);
+    UINT32 n_layers = param->num_layers + 2;
+
+    // 1/mus of every layer (glass layers do not scatter) and mua of every
+    // run and layer
+    Real rmus[MAX_LAYERS];
+    std::vector<Real> mua((size_t)n_ctx * n_layers);
+    for (UINT32 l = 0; l < n_layers; ++l)
+    {
+        const HostLayerStruct<Real> *layer = &layerspecs[l];
+        int glass = (layer->rmuas == (Real)FLT_MAX);
+        rmus[l] = glass ? layer->rmuas : (Real)1 / (layer->muas - layer->mua_muas * layer->muas);
+        for (UINT32 k = 0; k < n_ctx; ++k)
+        {
+            const HostLayerStruct<Real> *layer_k = &HostTables<Real>::Layers(&ctxs[k])[l];
+            mua[(size_t)k * n_layers + l] = glass ? (Real)0 : layer_k->mua_muas * layer_k->muas;
+        }
+    }
+
+    std::vector<Real> w(n_ctx);
+    PhotonStructCPU<P> photon;
+    RNG rng;
+    UINT64 n_steps = 0;
+    ProfileCounters profile;
+    profile.Clear();
+
+    for (UINT32 i = 0; i < n_photons; ++i)
+    {
+        LaunchPhoton(ctx, &photon, &rng);
+        profile.Count(PROFILE_LAUNCHES);
+        for (UINT32 k = 0; k < n_ctx; ++k)
+            w[k] = HostTables<Real>::Param(&ctxs[k])->init_photon_w;
+
+        for (;;)
+        {
+            ++n_steps;
+            profile.Count(PROFILE_STEPS);
+            photon.s = -std::log(rand_oc<Real>(&rng)) * rmus[photon.layer];
+            photon.hit = HitBoundary(ctx, &photon);
+            Hop(&photon);
+
+            // Absorption along the step, recorded where the step ends
+            UINT32 iz = float2uint_rz((Real)photon.z / param->dz);
+            UINT32 ir = float2uint_rz(RadialDistance(&photon) / param->dr);
+            const Real *mua_l = &mua[photon.layer];
+            Real w_max = 0;
+            if (ignoreAdetection == 0 && iz < param->nz && ir < param->nr)
+                profile.Count(PROFILE_TALLY_GMEM);
+            for (UINT32 k = 0; k < n_ctx; ++k)
+            {
+                Real dwa = -w[k] * std::expm1(-mua_l[(size_t)k * n_layers] * photon.s);
+                w[k] -= dwa;
+                if (ignoreAdetection == 0 && iz < param->nz && ir < param->nr)
+                    ctxs[k].A_rz[ir * param->nz + iz] += (UINT32)(dwa * WEIGHT_SCALE);
+                w_max = std::fmax(w_max, w[k]);
+            }
+
+            if (photon.hit)
+            {
+                profile.Count(PROFILE_BOUNDARY_HITS);
+                if (ReflectTransmit(ctx, &photon, &rng, &profile))
+                {
+                    int reflected;
+                    UINT32 ia_ir = ExitIndex(ctx, &photon, &reflected);
+                    for (UINT32 k = 0; k < n_ctx; ++k)
+                    {
+                        UINT64 *ra_arr = reflected ? ctxs[k].Rd_ra : ctxs[k].Tt_ra;
+                        ra_arr[ia_ir] += (UINT32)(w[k] * WEIGHT_SCALE);
+                    }
+                    break;
+                }
+            }
+            else
+            {
+                profile.Count(PROFILE_SCATTERS);
+                Spin(layerspecs[photon.layer].g, &photon, &rng);
+            }
+
+            // Roulette on the largest weight, so that all runs keep the
+            // same photon.
+            if (w_max < (Real)WEIGHT)
+            {
+                Real rand = rand_co<Real>(&rng);
+                if (w_max == (Real)0 || rand >= (Real)CHANCE)
+                {
+                    if (w_max != (Real)0)
+                        profile.Count(PROFILE_ROULETTE_KILLS);
+                    break;
+                }
+                profile.Count(PROFILE_ROULETTE_SURVIVALS);
+                for (UINT32 k = 0; k < n_ctx; ++k)
+                    w[k] *= ((Real)1 / (Real)CHANCE);
+            }
+        }
+    }
+    ctx->n_steps += n_steps;
+
+    // Every run sees all photons.
+    for (UINT32 k = 0; k < n_ctx; ++k)
+        ctxs[k].profile.Add(profile);
+}
+
+template <typename P, typename RNG>
+static void SimulatePhotonsWhiteWith(CPUThreadContext *ctxs, UINT32 n_ctx, UINT32 n_photons, int ignoreAdetection)
+{
+    if (ignoreAdetection == 1)
+    {
+        SimulatePhotonsWhite<1, P, RNG>(ctxs, n_ctx, n_photons);
+    }
+    else
+    {
+        SimulatePhotonsWhite<0, P, RNG>(ctxs, n_ctx, n_photons);
+    }
+}
+
+template <typename P>
+static void SimulatePhotonsWhiteP(CPUThreadContext *ctxs, UINT32 n_ctx, UINT32 n_photons, int ignoreAdetection,
+                                  int rng)
+{
+    switch (rng)
+    {
+    case RNG_PHILOX:
+        SimulatePhotonsWhiteWith<P, PhiloxRng>(ctxs, n_ctx, n_photons, ignoreAdetection);
+        break;
+    case RNG_XOROSHIRO:
+        SimulatePhotonsWhiteWith<P, XoroshiroRng>(ctxs, n_ctx, n_photons, ignoreAdetection);
+        break;
+    default:
+        SimulatePhotonsWhiteWith<P, MWCRng>(ctxs, n_ctx, n_photons, ignoreAdetection);
+        break;
+    }
+}
+
+void SimulatePhotonsWhiteCPU(CPUThreadContext *ctxs, UINT32 n_ctx, UINT32 n_photons, int ignoreAdetection, int rng,
+                             int precision)
+{
+    switch (precision)
+    {
+    case PRECISION_MIXED:
+        SimulatePhotonsWhiteP<MixedPrecision>(ctxs, n_ctx, n_photons, ignoreAdetection, rng);
+        break;
+    case PRECISION_DOUBLE:
+        SimulatePhotonsWhiteP<DoublePrecision>(ctxs, n_ctx, n_photons, ignoreAdetection, rng);
+        break;
+    default:
+        SimulatePhotonsWhiteP<SinglePrecision>(ctxs, n_ctx, n_photons, ignoreAdetection, rng);
+        break;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Allocate the host-side output buffers of one worker
+//////////////////////////////////////////////////////////////////////////////
+int InitBufferPool(BufferPool *pool, UINT32 rz_size, UINT32 ra_size, UINT32 jac_size)
+{
+    TraceScope scope("InitBufferPool", "alloc");
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+    // Keep at least one element so that an empty grid is not a failure.
+    pool->rz_size = rz_size > 0 ? rz_size : 1;
+    pool->ra_size = ra_size > 0 ? ra_size : 1;
+    pool->jac_size = jac_size > 0 ? jac_size : 1;
+    pool->A_rz = (UINT64 *)malloc(pool->rz_size * sizeof(UINT64));
+    pool->Rd_ra = (UINT64 *)malloc(pool->ra_size * sizeof(UINT64));
+    pool->Tt_ra = (UINT64 *)malloc(pool->ra_size * sizeof(UINT64));
+    pool->Rd_jac = (double *)malloc(pool->jac_size * sizeof(double));
+    pool->profile = (UINT64 *)malloc(MAX_PACKED_RUNS * N_PROFILE_EVENTS * sizeof(UINT64));
+
+    pool->alloc_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+
+    return (pool->A_rz == NULL || pool->Rd_ra == NULL || pool->Tt_ra == NULL || pool->Rd_jac == NULL ||
+            pool->profile == NULL)
+               ? 1
+               : 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Free the host-side output buffers of one worker
+//////////////////////////////////////////////////////////////////////////////
+void FreeBufferPool(BufferPool *pool)
+{
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+    free(pool->A_rz);
+    free(pool->Rd_ra);
+    free(pool->Tt_ra);
+    free(pool->Rd_jac);
+    free(pool->profile);
+    pool->A_rz = pool->Rd_ra = pool->Tt_ra = pool->profile = NULL;
+    pool->Rd_jac = NULL;
+    pool->rz_size = pool->ra_size = pool->jac_size = 0;
+
+    pool->alloc_time += std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Hand out the (zeroed) output data of one batch from the buffer pool
+//////////////////////////////////////////////////////////////////////////////
+int InitHostSimState(SimState *HostMem, BufferPool *pool, const PackedBatch *batch)
+{
+    UINT32 rz_size = batch->A_rz_ofst[batch->n_runs];
+    UINT32 ra_size = batch->ra_ofst[batch->n_runs];
+    UINT32 jac_size = batch->jac_ofst[batch->n_runs];
+
+    // The pool is sized for the largest batch, so this only happens if the
+    // caller did not size it.
+    if (pool->A_rz == NULL || rz_size > pool->rz_size || ra_size > pool->ra_size || jac_size > pool->jac_size)
+    {
+        UINT32 new_rz_size = rz_size > pool->rz_size ? rz_size : pool->rz_size;
+        UINT32 new_ra_size = ra_size > pool->ra_size ? ra_size : pool->ra_size;
+        UINT32 new_jac_size = jac_size > pool->jac_size ? jac_size : pool->jac_size;
+        FreeBufferPool(pool);
+        if (InitBufferPool(pool, new_rz_size, new_ra_size, new_jac_size))
+        {
+            FreeBufferPool(pool);
+            return 1;
+        }
+    }
+
+    memset(pool->A_rz, 0, rz_size * sizeof(UINT64));
+    memset(pool->Rd_ra, 0, ra_size * sizeof(UINT64));
+    memset(pool->Tt_ra, 0, ra_size * sizeof(UINT64));
+    memset(pool->Rd_jac, 0, jac_size * sizeof(double));
+    memset(pool->profile, 0, batch->n_runs * N_PROFILE_EVENTS * sizeof(UINT64));
+
+    HostMem->A_rz = pool->A_rz;
+    HostMem->Rd_ra = pool->Rd_ra;
+    HostMem->Tt_ra = pool->Tt_ra;
+    HostMem->Rd_jac = pool->Rd_jac;
+    HostMem->profile = pool->profile;
+
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Free Host Memory (of one batch)
+//////////////////////////////////////////////////////////////////////////////
+void FreeHostSimState(SimState *hstate)
+{
+    if (hstate->n_photons_left != NULL)
+    {
+        free(hstate->n_photons_left);
+        hstate->n_photons_left = NULL;
+    }
+
+    // DO NOT FREE RANDOM NUMBER SEEDS HERE.
+    // The output arrays belong to the buffer pool (see FreeBufferPool).
+    hstate->A_rz = NULL;
+    hstate->Rd_ra = NULL;
+    hstate->Tt_ra = NULL;
+    hstate->Rd_jac = NULL;
+    hstate->profile = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   SIMD engine variant selected for this CPU
+//////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+    const char *name;
+    UINT32 (*width)();
+    void (*simulate)(CPUThreadContext *ctxs, const UINT32 *n_photons, UINT32 n_ctx, int ignoreAdetection);
+} SIMDVariant;
+
+static SIMDVariant SelectSIMDVariant()
+{
+#if defined(MCML_HAVE_SIMD_AVX512)
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512dq") &&
+        __builtin_cpu_supports("avx512vl") && __builtin_cpu_supports("avx512bw"))
+    {
+        SIMDVariant v = {"avx512", GetSIMDWidth_avx512, SimulatePhotonsSIMD_avx512};
+        return v;
+    }
+#endif
+#if defined(MCML_HAVE_SIMD_AVX2)
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+    {
+        SIMDVariant v = {"avx2", GetSIMDWidth_avx2, SimulatePhotonsSIMD_avx2};
+        return v;
+    }
+#endif
+    SIMDVariant v = {"generic", GetSIMDWidth_generic, SimulatePhotonsSIMD_generic};
+    return v;
+}
+
+static const SIMDVariant &GetSIMDVariant()
+{
+    static const SIMDVariant variant = SelectSIMDVariant();
+    return variant;
+}
+
+UINT32 GetSIMDWidth()
+{
+    return GetSIMDVariant().width();
+}
+
+const char *GetSIMDVariantName()
+{
+    return GetSIMDVariant().name;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Simulate the photons assigned to one host thread with the scalar
+//   (use_simd == 0) or the SIMD engine. The photons may span several runs
+//   of the batch: every run gets its own context, writing to its slices of
+//   the output arrays.
+//////////////////////////////////////////////////////////////////////////////
+static void RunHostEngine(HostThreadState *hstate, int use_simd)
+{
+    SimState *HostMem = &(hstate->host_sim_state);
+    const PackedBatch *batch = hstate->batch;
+    int ignoreAdetection = batch->sims[0].ignoreAdetection;
+
+    if (InitHostSimState(HostMem, &hstate->pool, batch))
+    {
+        fprintf(stderr, "[CPU %u] failure allocating the output arrays\n", hstate->dev_id);
+        FreeHostSimState(HostMem);
+        return;
+    }
+
+    // Runs overlapping the photons of this thread, and their photon counts.
+    // In a white batch, every run sees all photons of the thread.
+    UINT32 photon_begin = hstate->photon_begin;
+    UINT32 photon_end = photon_begin + *HostMem->n_photons_left;
+    UINT32 first_run = 0;
+    UINT32 n_ctx = 0;
+    UINT32 n_photons[MAX_PACKED_RUNS];
+    if (batch->white)
+    {
+        n_ctx = batch->n_runs;
+        for (UINT32 k = 0; k < n_ctx; ++k)
+            n_photons[k] = photon_end - photon_begin;
+    }
+    else
+    {
+        while (first_run < batch->n_runs && batch->photon_end[first_run] <= photon_begin)
+            ++first_run;
+        for (UINT32 r = first_run; r < batch->n_runs && photon_begin < photon_end; ++r)
+        {
+            UINT32 run_end = batch->photon_end[r] < photon_end ? batch->photon_end[r] : photon_end;
+            n_photons[n_ctx++] = run_end - photon_begin;
+            photon_begin = run_end;
+        }
+    }
+
+    CPUThreadContext *ctxs = (CPUThreadContext *)malloc((n_ctx > 0 ? n_ctx : 1) * sizeof(CPUThreadContext));
+    if (ctxs == NULL)
+    {
+        fprintf(stderr, "[CPU %u] failure allocating the thread contexts\n", hstate->dev_id);
+        FreeHostSimState(HostMem);
+        return;
+    }
+    for (UINT32 k = 0; k < n_ctx; ++k)
+    {
+        UINT32 r = first_run + k;
+        CPUThreadContext *ctx = &ctxs[k];
+        if (InitCPUThreadContext(ctx, &batch->sims[r]))
+        {
+            fprintf(stderr, "[CPU %u] failure in InitCPUThreadContext (more than %d layers?)\n", hstate->dev_id,
+                    MAX_LAYERS - 2);
+            free(ctxs);
+            FreeHostSimState(HostMem);
+            return;
+        }
+
+        ctx->A_rz = HostMem->A_rz + batch->A_rz_ofst[r];
+        ctx->Rd_ra = HostMem->Rd_ra + batch->ra_ofst[r];
+        ctx->Tt_ra = HostMem->Tt_ra + batch->ra_ofst[r];
+        ctx->Rd_jac = HostMem->Rd_jac + batch->jac_ofst[r];
+
+        // First photon of this thread in run r, counted from the first
+        // photon of the run (see HostThreadState)
+        UINT32 run_begin = (r == 0 || batch->white) ? 0 : batch->photon_end[r - 1];
+        UINT32 begin = (k == 0) ? hstate->photon_begin : run_begin;
+        ctx->rng_key = batch->rng_key[batch->white ? 0 : r];
+        ctx->next_photon = hstate->photon_ofst + (begin - run_begin);
+        ctx->multipliers = HostMem->multipliers;
+        ctx->n_multipliers = HostMem->n_multipliers;
+        ctx->progress = &hstate->chunk_progress;
+    }
+
+    if (batch->white)
+    {
+        SimulatePhotonsWhiteCPU(ctxs, n_ctx, n_photons[0], ignoreAdetection, batch->rng, batch->precision);
+    }
+    else if (use_simd)
+    {
+        GetSIMDVariant().simulate(ctxs, n_photons, n_ctx, ignoreAdetection);
+    }
+    else
+    {
+        for (UINT32 k = 0; k < n_ctx; ++k)
+            SimulatePhotonsCPU(&ctxs[k], n_photons[k], ignoreAdetection, batch->jacobian, batch->rng,
+                               batch->precision);
+    }
+    *HostMem->n_photons_left = 0;
+    for (UINT32 k = 0; k < n_ctx; ++k)
+    {
+        hstate->n_steps += ctxs[k].n_steps;
+        ctxs[k].profile.Flush(HostMem->profile + (size_t)(first_run + k) * N_PROFILE_EVENTS);
+    }
+
+    free(ctxs);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   CPU counterpart of RunGPUi: simulate the photons assigned to one host
+//   thread. Each thread runs one random number generator at a time.
+//////////////////////////////////////////////////////////////////////////////
+void RunCPUi(HostThreadState *hstate)
+{
+    RunHostEngine(hstate, 0);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Same as RunCPUi, but with the SIMD engine. Each thread runs one
+//   generator per lane (hstate->n_threads == GetSIMDWidth()).
+//////////////////////////////////////////////////////////////////////////////
+void RunSIMDi(HostThreadState *hstate)
+{
+    RunHostEngine(hstate, 1);
+}
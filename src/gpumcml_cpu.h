@@ -0,0 +1,185 @@
+/*****************************************************************************
+ *
+ *   Header file for the CPU photon engine
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPUMCML_CPU_H
+#define GPUMCML_CPU_H
+
+#include "gpumcml.h"
+#include "gpumcml_profile.h"
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+// Host counterpart of SimParamGPU, in the floating-point type <Real>
+template <typename Real> struct HostSimParam
+{
+    Real init_photon_w; // initial photon weight
+
+    Real dz; // z grid separation.[cm]
+    Real dr; // r grid separation.[cm]
+
+    UINT32 na; // array range 0..na-1.
+    UINT32 nz; // array range 0..nz-1.
+    UINT32 nr; // array range 0..nr-1.
+
+    UINT32 num_layers; // number of layers.
+};
+
+// Host counterpart of LayerStructGPU, in the floating-point type <Real>
+template <typename Real> struct HostLayerStruct
+{
+    Real z0, z1; // z coordinates of a layer. [cm]
+    Real n;      // refractive index of a layer.
+
+    Real muas;     // mua + mus
+    Real rmuas;    // 1/(mua+mus)
+    Real mua_muas; // mua/(mua+mus)
+
+    Real g; // anisotropy.
+
+    Real cos_crit0, cos_crit1;
+};
+
+typedef HostSimParam<GFLOAT> SimParamCPU;
+typedef HostLayerStruct<GFLOAT> LayerStructCPU;
+
+// Host counterpart of PhotonStructGPU, in the types of the precision policy
+// <P> (see gpumcml_precision.h)
+template <typename P> struct PhotonStructCPU
+{
+    // cartesian coordinates of the photon [cm]
+    typename P::Pos x;
+    typename P::Pos y;
+    typename P::Pos z;
+
+    // directional cosines of the photon
+    typename P::Real ux;
+    typename P::Real uy;
+    typename P::Real uz;
+
+    typename P::Real w; // photon weight
+
+    typename P::Real s; // step size [cm]
+
+    // index to layer where the photon resides
+    UINT32 layer;
+
+    // flag to indicate if photon hits a boundary
+    UINT32 hit;
+};
+
+// Everything one host thread reads and writes while it simulates photons.
+// Each thread owns one instance, so no synchronization is needed.
+typedef struct
+{
+    SimParamCPU param;
+    LayerStructCPU layerspecs[MAX_LAYERS];
+
+    // the same in double, for the double precision policy
+    HostSimParam<double> param_d;
+    HostLayerStruct<double> layerspecs_d[MAX_LAYERS];
+
+    // where the random number generator of the next photon of the run is
+    // seeded from (see gpumcml_rng.h)
+    UINT64 rng_key;
+    UINT64 next_photon;
+    const UINT32 *multipliers;
+    UINT32 n_multipliers;
+
+    // thread-private output data
+    UINT64 *A_rz;
+    UINT64 *Rd_ra;
+    UINT64 *Tt_ra;
+    double *Rd_jac; // derivatives of Rd (see PackedBatch)
+
+    // steps simulated (iterations of the photon loop, not counted by the
+    // SIMD engine)
+    UINT64 n_steps;
+
+    // event counts of the photons of this run (MCML_PROFILE builds)
+    ProfileCounters profile;
+
+    // counter of launched photons that the progress reporter reads (see
+    // HostThreadState::chunk_progress), or NULL. All runs of a worker share
+    // it.
+    std::atomic<UINT64> *progress;
+} CPUThreadContext;
+
+//////////////////////////////////////////////////////////////////////////////
+//   Count one launched photon in the progress counter of <ctx>
+//////////////////////////////////////////////////////////////////////////////
+inline void CountLaunch(const CPUThreadContext *ctx)
+{
+    if (ctx->progress != NULL)
+        ctx->progress->store(ctx->progress->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+// Path of one photon in every layer, for perturbation Monte Carlo
+typedef struct
+{
+    double L[MAX_LAYERS];      // path length [cm]
+    UINT32 n_coll[MAX_LAYERS]; // number of collisions (scattering events)
+} PhotonPathCPU;
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+// Fill in the parameters and layer specifications of <ctx> from <sim>, the
+// same way InitDCMem fills in the constant memory of a GPU.
+// Return 0 if successful or 1 if the simulation has too many layers.
+extern int InitCPUThreadContext(CPUThreadContext *ctx, SimulationStruct *sim);
+
+// Simulate <n_photons> photons from launch to termination with the random
+// number generator <rng> (RNG_MWC, ...) and the precision policy
+// <precision> (PRECISION_SINGLE, ...). If <jacobian> is set, the
+// derivatives of Rd are added to ctx->Rd_jac as well.
+extern void SimulatePhotonsCPU(CPUThreadContext *ctx, UINT32 n_photons, int ignoreAdetection, int jacobian, int rng,
+                               int precision);
+
+// Simulate <n_photons> photons once for all runs ctxs[k] (k < n_ctx), which
+// differ only in mua: the photons scatter without absorption and the weight
+// of each run is attenuated with its own mua (white Monte Carlo).
+extern void SimulatePhotonsWhiteCPU(CPUThreadContext *ctxs, UINT32 n_ctx, UINT32 n_photons, int ignoreAdetection,
+                                    int rng, int precision);
+
+// Variants of the SIMD engine, one per instruction set (gpumcml_simd.cpp).
+// SimulatePhotonsSIMD_<isa> simulates n_photons[k] photons of each run
+// ctxs[k] (k < n_ctx) on one lane group of GetSIMDWidth_<isa>() lanes, each
+// lane with its own generator. RunSIMDi dispatches to the widest supported
+// variant.
+#define MCML_DECLARE_SIMD_VARIANT(isa)                                                                                 \
+    extern UINT32 GetSIMDWidth_##isa();                                                                                \
+    extern void SimulatePhotonsSIMD_##isa(CPUThreadContext *ctxs, const UINT32 *n_photons, UINT32 n_ctx,              \
+                                          int ignoreAdetection);
+
+MCML_DECLARE_SIMD_VARIANT(generic)
+#ifdef MCML_HAVE_SIMD_AVX2
+MCML_DECLARE_SIMD_VARIANT(avx2)
+#endif
+#ifdef MCML_HAVE_SIMD_AVX512
+MCML_DECLARE_SIMD_VARIANT(avx512)
+#endif
+
+// Name of the SIMD variant selected for this CPU ("generic", "avx2", ...)
+extern const char *GetSIMDVariantName();
+
+#endif // GPUMCML_CPU_H
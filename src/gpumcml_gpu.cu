@@ -0,0 +1,340 @@
+/*****************************************************************************
+*
+*   GPU backend of MCMLGPU
+*   =========================================================================
+*
+****************************************************************************/
+/*
+*   This file is part of GPUMCML.
+*
+*   GPUMCML is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   GPUMCML is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+
+#include <cuda_runtime.h>
+#include "gpumcml.h"
+#include "gpumcml_kernel.h"
+#include "gpumcml_trace.h"
+
+#include "gpumcml_kernel.cu"
+#include "gpumcml_mem.cu"
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
+//   Simulate the photons of one GPU with the random number generator <RNG>
+//   and the precision policy <P>: initialize the thread states and launch
+//   MCMLKernel until all photons are done
+//////////////////////////////////////////////////////////////////////////////
+template <typename RNG, typename P>
+static void RunKernels(HostThreadState *hstate, SimState *HostMem,
+                       SimState DeviceMem, GPUThreadStates tstates) {
+    const PackedBatch *batch = hstate->batch;
+    int ignoreAdetection = batch->sims[0].ignoreAdetection;
+    UINT32 n_photons = *HostMem->n_photons_left;
+    UINT32 n_threads = hstate->n_tblks * NUM_THREADS_PER_BLOCK;
+    cudaError_t cudastat;
+
+    dim3 dimBlock(NUM_THREADS_PER_BLOCK);
+    dim3 dimGrid(hstate->n_tblks);
+
+    // Initialize the remaining thread states.
+    {
+        TraceScope scope("InitThreadState", "kernel");
+        InitThreadState<RNG, P><<<dimGrid, dimBlock>>>(DeviceMem, tstates, *HostMem->n_photons_left);
+        CUDA_SAFE_CALL(cudaDeviceSynchronize()); // Wait for all threads to finish
+    }
+    cudastat = cudaGetLastError(); // Check if there was an error
+    if (cudastat) {
+        fprintf(stderr, "[GPU %u] failure in InitThreadState (%i): %s\n",
+                hstate->dev_id, cudastat, cudaGetErrorString(cudastat));
+        FreeHostSimState(HostMem);
+        FreeGPUBufferPool(hstate);
+        exit(1);
+    }
+
+#if !defined(CACHE_A_RZ_IN_SMEM)
+    // Configure the L1 cache for Fermi.
+    if (ignoreAdetection == 1)
+    {
+      cudaFuncSetCacheConfig(MCMLKernel<1, RNG, P>, cudaFuncCachePreferL1);
+    }
+    else
+    {
+      cudaFuncSetCacheConfig(MCMLKernel<0, RNG, P>, cudaFuncCachePreferL1);
+    }
+#endif
+
+    int k_smem_sz = 0;
+#ifdef USE_32B_ELEM_FOR_ARZ_SMEM
+    // This piece of shared memory is for overflow handling.
+    k_smem_sz = NUM_THREADS_PER_BLOCK * sizeof(UINT32);
+#endif
+
+    // Steps per launch: the number of launches (and their overhead) against
+    // the time between progress updates and the steps wasted by the idle
+    // threads of the last launch. The last length of this GPU is kept for
+    // its next chunk.
+    UINT64 n_steps = hstate->batch_length;
+    if (n_steps == 0 || hstate->batch_seconds <= 0) n_steps = NUM_STEPS;
+
+    for (int i = 1; *HostMem->n_photons_left > 0; ++i) {
+        // Every launch is one event, up to the copy of the photons left.
+        TraceScope scope("MCMLKernel", "kernel");
+        scope.Args("\"launch\": %d, \"photons_left\": %u, \"steps\": %llu", i,
+                   *HostMem->n_photons_left, (unsigned long long) n_steps);
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+
+        // Run the kernel.
+        if (ignoreAdetection == 1) {
+            MCMLKernel<1, RNG, P><<<dimGrid, dimBlock, k_smem_sz>>>(DeviceMem, tstates, (UINT32) n_steps);
+        } else {
+            MCMLKernel<0, RNG, P><<<dimGrid, dimBlock, k_smem_sz>>>(DeviceMem, tstates, (UINT32) n_steps);
+        }
+        // Wait for all threads to finish.
+        CUDA_SAFE_CALL_INFO(cudaDeviceSynchronize(), std::string ("Error processing: ") + batch->sims[0].outp_filename);
+        // Check if there was an error
+        cudastat = cudaGetLastError();
+        if (cudastat) {
+            fprintf(stderr, "[GPU %u] failure in MCMLKernel (%i): %s.\n",
+                    hstate->dev_id, cudastat, cudaGetErrorString(cudastat));
+            FreeHostSimState(HostMem);
+            FreeGPUBufferPool(hstate);
+            exit(1);
+        }
+
+        // Copy the number of photons left from device to host.
+        CUDA_SAFE_CALL(cudaMemcpy(HostMem->n_photons_left,
+                                  DeviceMem.n_photons_left, sizeof(unsigned int),
+                                  cudaMemcpyDeviceToHost));
+        hstate->chunk_progress.store(n_photons - *HostMem->n_photons_left,
+                                     std::memory_order_relaxed);
+
+        // Only launches in which every thread had a photon to simulate tell
+        // the speed of the GPU.
+        if (hstate->batch_seconds > 0 && *HostMem->n_photons_left >= n_threads) {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            n_steps = AdaptBatchLength(n_steps, n_steps, seconds, hstate->batch_seconds, MIN_STEPS, MAX_STEPS);
+            hstate->batch_length = n_steps;
+        }
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   RunKernels with the random number generator of the batch
+//////////////////////////////////////////////////////////////////////////////
+template <typename P>
+static void RunKernelsRNG(HostThreadState *hstate, SimState *HostMem,
+                          SimState DeviceMem, GPUThreadStates tstates) {
+    switch (hstate->batch->rng) {
+    case RNG_PHILOX:
+        RunKernels<PhiloxRng, P>(hstate, HostMem, DeviceMem, tstates);
+        break;
+    case RNG_XOROSHIRO:
+        RunKernels<XoroshiroRng, P>(hstate, HostMem, DeviceMem, tstates);
+        break;
+    default:
+        RunKernels<MWCRng, P>(hstate, HostMem, DeviceMem, tstates);
+        break;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Supports multiple GPUs by allowing multiple host threads to launch kernel
+//   Each thread calls RunGPUi with its own HostThreadState parameters
+//////////////////////////////////////////////////////////////////////////////
+void RunGPUi(HostThreadState *hstate) {
+    SimState *HostMem = &(hstate->host_sim_state);
+    const PackedBatch *batch = hstate->batch;
+    SimState DeviceMem;
+    GPUThreadStates tstates;
+    // total number of threads in the grid
+    UINT32 n_threads = hstate->n_tblks * NUM_THREADS_PER_BLOCK;
+    cudaError_t cudastat;
+
+    CUDA_SAFE_CALL(cudaSetDevice(hstate->dev_id));
+
+    // Compute GPU-specific constant parameters.
+    hstate->A_rz_overflow = 0;
+    // We only need it if we care about A_rz.
+#if defined(CACHE_A_RZ_IN_SMEM) && defined(USE_32B_ELEM_FOR_ARZ_SMEM)
+    // The shared memory cache is only used for batches of one run. The flag
+    // is the same for all runs of the input file.
+    if (! batch->sims[0].ignoreAdetection && batch->n_runs == 1)
+    {
+      hstate->A_rz_overflow = compute_Arz_overflow_count(batch->sims[0].start_weight,
+          batch->sims[0].layers, batch->sims[0].n_layers, NUM_THREADS_PER_BLOCK);
+    }
+#endif
+
+    // Take the output arrays from the buffer pool of this GPU. The device
+    // buffers are allocated by the first batch, for the largest batch of the
+    // input (the size of the host buffers).
+    if (InitHostSimState(HostMem, &hstate->pool, batch)) {
+        fprintf(stderr, "[GPU %u] failure allocating the output arrays\n", hstate->dev_id);
+        FreeHostSimState(HostMem);
+        return;
+    }
+    GPUBufferPool *gpool = (GPUBufferPool *) hstate->pool.device;
+    if (gpool == NULL || hstate->pool.rz_size > gpool->rz_size
+        || hstate->pool.ra_size > gpool->ra_size || n_threads > gpool->n_threads) {
+        FreeGPUBufferPool(hstate);
+
+        TraceScope scope("InitGPUBufferPool", "alloc");
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        gpool = (GPUBufferPool *) calloc(1, sizeof(GPUBufferPool));
+        InitGPUBufferPool(gpool, hstate->pool.rz_size, hstate->pool.ra_size, n_threads, HostMem);
+        hstate->pool.device = gpool;
+        hstate->pool.alloc_time +=
+            std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+    }
+
+    // Init the remaining states.
+    {
+        TraceScope scope("InitSimStates", "setup");
+        InitSimStates(HostMem, &DeviceMem, &tstates, batch, n_threads, gpool);
+        CUDA_SAFE_CALL(cudaDeviceSynchronize()); // Wait for all threads to finish
+    }
+    cudastat = cudaGetLastError(); // Check if there was an error
+    if (cudastat) {
+        fprintf(stderr, "[GPU %u] failure in InitSimStates (%i): %s\n",
+                hstate->dev_id, cudastat, cudaGetErrorString(cudastat));
+        FreeHostSimState(HostMem);
+        FreeGPUBufferPool(hstate);
+        exit(1);
+    }
+
+    int dcmem_failed;
+    {
+        TraceScope scope("InitDCMem", "setup");
+        dcmem_failed = InitDCMem(batch, hstate->photon_begin, *HostMem->n_photons_left,
+                                 hstate->photon_ofst, hstate->A_rz_overflow);
+        CUDA_SAFE_CALL(cudaDeviceSynchronize()); // Wait for all threads to finish
+    }
+    cudastat = cudaGetLastError(); // Check if there was an error
+    if (dcmem_failed) {
+        fprintf(stderr, "[GPU %u] failure in InitDCMem (more than %d layers?)\n",
+                hstate->dev_id, MAX_LAYERS - 2);
+        FreeHostSimState(HostMem);
+        FreeGPUBufferPool(hstate);
+        return;
+    }
+    if (cudastat) {
+        fprintf(stderr, "[GPU %u] failure in InitDCMem (%i): %s\n",
+                hstate->dev_id, cudastat, cudaGetErrorString(cudastat));
+        FreeHostSimState(HostMem);
+        FreeGPUBufferPool(hstate);
+        exit(1);
+    }
+
+    switch (batch->precision) {
+    case PRECISION_MIXED:
+        RunKernelsRNG<MixedPrecision>(hstate, HostMem, DeviceMem, tstates);
+        break;
+    case PRECISION_DOUBLE:
+        RunKernelsRNG<DoublePrecision>(hstate, HostMem, DeviceMem, tstates);
+        break;
+    default:
+        RunKernelsRNG<SinglePrecision>(hstate, HostMem, DeviceMem, tstates);
+        break;
+    }
+
+    // Sum the multiple copies of A_rz in the global memory.
+    {
+        TraceScope scope("sum_A_rz", "kernel");
+        sum_A_rz<<<30, 128>>>(DeviceMem.A_rz);
+        // Wait for all threads to finish.
+        CUDA_SAFE_CALL(cudaDeviceSynchronize());
+    }
+    // Check if there was an error
+    cudastat = cudaGetLastError();
+    if (cudastat) {
+        fprintf(stderr, "[GPU %u] failure in sum_A_rz (%i): %s.\n",
+                hstate->dev_id, cudastat, cudaGetErrorString(cudastat));
+        FreeHostSimState(HostMem);
+        FreeGPUBufferPool(hstate);
+        exit(1);
+    }
+
+    {
+        TraceScope scope("CopyDeviceToHostMem", "copy");
+        CopyDeviceToHostMem(HostMem, &DeviceMem, batch, n_threads);
+        // The device buffers stay in the pool for the next batch, and we
+        // still need the host-side structure.
+        cudaDeviceSynchronize();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Free the device buffers in the buffer pool of one GPU
+//////////////////////////////////////////////////////////////////////////////
+void FreeGPUBufferPool(HostThreadState *hstate) {
+    GPUBufferPool *gpool = (GPUBufferPool *) hstate->pool.device;
+    if (gpool == NULL) return;
+
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    CUDA_SAFE_CALL(cudaSetDevice(hstate->dev_id));
+    FreeDeviceSimStates(&gpool->dstate, &gpool->tstates);
+    free(gpool);
+    hstate->pool.device = NULL;
+    hstate->pool.alloc_time +=
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Return the number of GPUs available on this machine
+//////////////////////////////////////////////////////////////////////////////
+int GetGPUCount() {
+    int dev_count;
+    CUDA_SAFE_CALL(cudaGetDeviceCount(&dev_count));
+    return dev_count;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Fill in the GPU-specific fields of one host thread state per GPU.
+//   Return the total number of threads for all GPUs (i.e. the number of
+//   random number generators needed), or 0 if a GPU is not usable.
+//////////////////////////////////////////////////////////////////////////////
+UINT32 InitGPUHostThreadStates(HostThreadState *hstates[], UINT32 num_GPUs) {
+    cudaDeviceProp props;
+    UINT32 n_threads = 0;    // total number of threads for all GPUs
+    for (UINT32 i = 0; i < num_GPUs; ++i) {
+        // Set the GPU ID.
+        hstates[i]->dev_id = i;
+
+        // Get the GPU properties.
+        CUDA_SAFE_CALL(cudaGetDeviceProperties(&props, hstates[i]->dev_id));
+        printf("[GPU %u] \"%s\" with Compute Capability %d.%d (%d SMs)\n",
+               i, props.name, props.major, props.minor, props.multiProcessorCount);
+
+        // Validate the GPU compute capability.
+        int cc = (props.major * 10 + props.minor) * 10;
+        if (cc < 200) {
+            fprintf(stderr, "\nGPU %u does not meet the Compute Capability "
+                            "this program requires (%d)! Abort.\n\n", i, 200);
+            return 0;
+        }
+
+        // We launch one thread block for each SM on this GPU.
+        hstates[i]->n_tblks = props.multiProcessorCount;
+        hstates[i]->n_threads = hstates[i]->n_tblks * NUM_THREADS_PER_BLOCK;
+
+        n_threads += hstates[i]->n_threads;
+    }
+    return n_threads;
+}
@@ -0,0 +1,293 @@
+/*****************************************************************************
+*
+*   GPU backend of MCMLGPU with the baseline kernel
+*   =========================================================================
+*
+*   The default GPU engine: the kernel, the device memory management and the
+*   random number generator of MCMLGPU 0.0.4 (in src/legacy), driven run by
+*   run through the engine interface of the scheduler. The rewritten engine
+*   (gpumcml_gpu.cu) is built instead with -DMCML_GPU_REWRITE=ON.
+*
+****************************************************************************/
+/*
+*   This file is part of GPUMCML.
+*
+*   GPUMCML is free software: you can redistribute it and/or modify
+*   it under the terms of the GNU General Public License as published by
+*   the Free Software Foundation, either version 3 of the License, or
+*   (at your option) any later version.
+*
+*   GPUMCML is distributed in the hope that it will be useful,
+*   but WITHOUT ANY WARRANTY; without even the implied warranty of
+*   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+*   GNU General Public License for more details.
+*
+*   You should have received a copy of the GNU General Public License
+*   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#include <climits>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <unistd.h>
+
+#include <cuda_runtime.h>
+#include "gpumcml.h"
+
+// The baseline sources are single precision and use the names of the
+// functions of the host code (FreeHostSimState, init_RNG, ...), so they are
+// compiled in a namespace of their own.
+#define SINGLE_PRECISION
+namespace legacy {
+#include "legacy/gpumcml_kernel.cu"
+#include "legacy/gpumcml_mem.cu"
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+//////////////////////////////////////////////////////////////////////////////
+//   Simulate <n_photons> photons of run <r> of the batch with the baseline
+//   kernel and add their tallies to the slices of the run. <first> is the
+//   first photon of the chunk in the stream of the run, <n_done> the photons
+//   this worker simulated before for the chunk.
+//////////////////////////////////////////////////////////////////////////////
+static void RunLegacyGPU(HostThreadState *hstate, UINT32 r, UINT64 first, UINT32 n_photons, UINT64 n_done) {
+    SimState *HostMem = &(hstate->host_sim_state);
+    const PackedBatch *batch = hstate->batch;
+    SimulationStruct *sim = &batch->sims[r];
+    SimState RunMem, DeviceMem;
+    legacy::GPUThreadStates tstates;
+    // total number of threads in the grid
+    UINT32 n_threads = hstate->n_tblks * NUM_THREADS_PER_BLOCK;
+    cudaError_t cudastat;
+
+    memset(&RunMem, 0, sizeof(SimState));
+    RunMem.n_photons_left = (UINT32 *) malloc(sizeof(UINT32));
+    RunMem.x = (UINT64 *) malloc(n_threads * sizeof(UINT64));
+    RunMem.a = (UINT32 *) malloc(n_threads * sizeof(UINT32));
+    if (RunMem.n_photons_left == NULL || RunMem.x == NULL || RunMem.a == NULL) {
+        fprintf(stderr, "[GPU %u] failure allocating the thread states\n", hstate->dev_id);
+        exit(1);
+    }
+    *RunMem.n_photons_left = n_photons;
+
+    // Every thread keeps one MWC generator for all its photons. The baseline
+    // seeded the threads with the same numbers for every run. Here the
+    // streams of a chunk are keyed by its run and its first photon, so the
+    // chunks of a run (on one or several GPUs) never repeat each other.
+    for (UINT32 t = 0; t < n_threads; ++t) {
+        SeedPhotonRNG(batch->rng_key[r] ^ ~first, t, HostMem->multipliers, HostMem->n_multipliers,
+                      &RunMem.x[t], &RunMem.a[t]);
+    }
+
+    // Init the remaining states.
+    legacy::InitSimStates(&RunMem, &DeviceMem, &tstates, sim, n_threads);
+    CUDA_SAFE_CALL(cudaDeviceSynchronize()); // Wait for all threads to finish
+    cudastat = cudaGetLastError(); // Check if there was an error
+    if (cudastat) {
+        fprintf(stderr, "[GPU %u] failure in InitSimStates (%i): %s\n",
+                hstate->dev_id, cudastat, cudaGetErrorString(cudastat));
+        legacy::FreeHostSimState(&RunMem);
+        legacy::FreeDeviceSimStates(&DeviceMem, &tstates);
+        exit(1);
+    }
+
+    int dcmem_failed = legacy::InitDCMem(sim, hstate->A_rz_overflow);
+    CUDA_SAFE_CALL(cudaDeviceSynchronize()); // Wait for all threads to finish
+    cudastat = cudaGetLastError(); // Check if there was an error
+    if (dcmem_failed) {
+        fprintf(stderr, "[GPU %u] failure in InitDCMem (more than %d layers?)\n",
+                hstate->dev_id, MAX_LAYERS - 2);
+        legacy::FreeHostSimState(&RunMem);
+        legacy::FreeDeviceSimStates(&DeviceMem, &tstates);
+        exit(1);
+    }
+    if (cudastat) {
+        fprintf(stderr, "[GPU %u] failure in InitDCMem (%i): %s\n",
+                hstate->dev_id, cudastat, cudaGetErrorString(cudastat));
+        legacy::FreeHostSimState(&RunMem);
+        legacy::FreeDeviceSimStates(&DeviceMem, &tstates);
+        exit(1);
+    }
+
+    dim3 dimBlock(NUM_THREADS_PER_BLOCK);
+    dim3 dimGrid(hstate->n_tblks);
+
+    // Initialize the remaining thread states.
+    legacy::InitThreadState<<<dimGrid, dimBlock>>>(tstates, *RunMem.n_photons_left);
+    CUDA_SAFE_CALL(cudaDeviceSynchronize()); // Wait for all threads to finish
+    cudastat = cudaGetLastError(); // Check if there was an error
+    if (cudastat) {
+        fprintf(stderr, "[GPU %u] failure in InitThreadState (%i): %s\n",
+                hstate->dev_id, cudastat, cudaGetErrorString(cudastat));
+        legacy::FreeHostSimState(&RunMem);
+        legacy::FreeDeviceSimStates(&DeviceMem, &tstates);
+        exit(1);
+    }
+
+#if !defined(CACHE_A_RZ_IN_SMEM)
+    // Configure the L1 cache for Fermi.
+    if (sim->ignoreAdetection == 1)
+    {
+      cudaFuncSetCacheConfig(legacy::MCMLKernel<1>, cudaFuncCachePreferL1);
+    }
+    else
+    {
+      cudaFuncSetCacheConfig(legacy::MCMLKernel<0>, cudaFuncCachePreferL1);
+    }
+#endif
+
+    int k_smem_sz = 0;
+#ifdef USE_32B_ELEM_FOR_ARZ_SMEM
+    // This piece of shared memory is for overflow handling.
+    k_smem_sz = NUM_THREADS_PER_BLOCK * sizeof(UINT32);
+#endif
+
+    while (*RunMem.n_photons_left > 0) {
+        // Run the kernel.
+        if (sim->ignoreAdetection == 1) {
+            legacy::MCMLKernel<1><<<dimGrid, dimBlock, k_smem_sz>>>(DeviceMem, tstates);
+        } else {
+            legacy::MCMLKernel<0><<<dimGrid, dimBlock, k_smem_sz>>>(DeviceMem, tstates);
+        }
+        // Wait for all threads to finish.
+        CUDA_SAFE_CALL_INFO(cudaDeviceSynchronize(), std::string ("Error processing: ") + sim->outp_filename);
+        // Check if there was an error
+        cudastat = cudaGetLastError();
+        if (cudastat) {
+            fprintf(stderr, "[GPU %u] failure in MCMLKernel (%i): %s.\n",
+                    hstate->dev_id, cudastat, cudaGetErrorString(cudastat));
+            legacy::FreeHostSimState(&RunMem);
+            legacy::FreeDeviceSimStates(&DeviceMem, &tstates);
+            exit(1);
+        }
+
+        // Copy the number of photons left from device to host.
+        CUDA_SAFE_CALL(cudaMemcpy(RunMem.n_photons_left,
+                                  DeviceMem.n_photons_left, sizeof(unsigned int),
+                                  cudaMemcpyDeviceToHost));
+        hstate->chunk_progress.store(n_done + n_photons - *RunMem.n_photons_left,
+                                     std::memory_order_relaxed);
+    }
+
+    // Sum the multiple copies of A_rz in the global memory.
+    legacy::sum_A_rz<<<30, 128>>>(DeviceMem.A_rz);
+    // Wait for all threads to finish.
+    CUDA_SAFE_CALL(cudaDeviceSynchronize());
+    // Check if there was an error
+    cudastat = cudaGetLastError();
+    if (cudastat) {
+        fprintf(stderr, "[GPU %u] failure in sum_A_rz (%i): %s.\n",
+                hstate->dev_id, cudastat, cudaGetErrorString(cudastat));
+        legacy::FreeHostSimState(&RunMem);
+        legacy::FreeDeviceSimStates(&DeviceMem, &tstates);
+        exit(1);
+    }
+
+    legacy::CopyDeviceToHostMem(&RunMem, &DeviceMem, sim, n_threads);
+    legacy::FreeDeviceSimStates(&DeviceMem, &tstates);
+
+    // Add the tallies to the slices of the run.
+    UINT32 rz_size = sim->det.nr * sim->det.nz;
+    UINT32 ra_size = sim->det.nr * sim->det.na;
+    for (UINT32 i = 0; i < rz_size; ++i) HostMem->A_rz[batch->A_rz_ofst[r] + i] += RunMem.A_rz[i];
+    for (UINT32 i = 0; i < ra_size; ++i) {
+        HostMem->Rd_ra[batch->ra_ofst[r] + i] += RunMem.Rd_ra[i];
+        HostMem->Tt_ra[batch->ra_ofst[r] + i] += RunMem.Tt_ra[i];
+    }
+
+    free(RunMem.x);
+    free(RunMem.a);
+    legacy::FreeHostSimState(&RunMem);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Supports multiple GPUs by allowing multiple host threads to launch kernel
+//   Each thread calls RunGPUi with its own HostThreadState parameters
+//////////////////////////////////////////////////////////////////////////////
+void RunGPUi(HostThreadState *hstate) {
+    SimState *HostMem = &(hstate->host_sim_state);
+    const PackedBatch *batch = hstate->batch;
+    UINT32 photon_begin = hstate->photon_begin;
+    UINT32 photon_end = photon_begin + *HostMem->n_photons_left;
+
+    CUDA_SAFE_CALL(cudaSetDevice(hstate->dev_id));
+
+    // The A_rz cache of the baseline kernel has 64-bit elements, it does not
+    // overflow.
+    hstate->A_rz_overflow = 0;
+
+    if (InitHostSimState(HostMem, &hstate->pool, batch)) {
+        fprintf(stderr, "[GPU %u] failure allocating the output arrays\n", hstate->dev_id);
+        FreeHostSimState(HostMem);
+        return;
+    }
+
+    // The baseline kernel simulates one run at a time: split the photons of
+    // this worker at the runs of the batch.
+    UINT64 n_done = 0;
+    for (UINT32 r = 0; r < batch->n_runs; ++r) {
+        UINT32 run_begin = (r == 0) ? 0 : batch->photon_end[r - 1];
+        UINT32 begin = (photon_begin > run_begin) ? photon_begin : run_begin;
+        UINT32 end = (photon_end < batch->photon_end[r]) ? photon_end : batch->photon_end[r];
+        if (begin >= end) continue;
+
+        RunLegacyGPU(hstate, r, begin - run_begin + hstate->photon_ofst, end - begin, n_done);
+        n_done += end - begin;
+    }
+    *HostMem->n_photons_left = 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Free the device buffers in the buffer pool of one GPU: the baseline
+//   engine allocates and frees its device buffers run by run, there are none
+//////////////////////////////////////////////////////////////////////////////
+void FreeGPUBufferPool(HostThreadState *) {
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Return the number of GPUs available on this machine
+//////////////////////////////////////////////////////////////////////////////
+int GetGPUCount() {
+    int dev_count;
+    CUDA_SAFE_CALL(cudaGetDeviceCount(&dev_count));
+    return dev_count;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Fill in the GPU-specific fields of one host thread state per GPU.
+//   Return the total number of threads for all GPUs (i.e. the number of
+//   random number generators needed), or 0 if a GPU is not usable.
+//////////////////////////////////////////////////////////////////////////////
+UINT32 InitGPUHostThreadStates(HostThreadState *hstates[], UINT32 num_GPUs) {
+    cudaDeviceProp props;
+    UINT32 n_threads = 0;    // total number of threads for all GPUs
+    for (UINT32 i = 0; i < num_GPUs; ++i) {
+        // Set the GPU ID.
+        hstates[i]->dev_id = i;
+
+        // Get the GPU properties.
+        CUDA_SAFE_CALL(cudaGetDeviceProperties(&props, hstates[i]->dev_id));
+        printf("[GPU %u] \"%s\" with Compute Capability %d.%d (%d SMs)\n",
+               i, props.name, props.major, props.minor, props.multiProcessorCount);
+
+        // Validate the GPU compute capability.
+        int cc = (props.major * 10 + props.minor) * 10;
+        if (cc < 200) {
+            fprintf(stderr, "\nGPU %u does not meet the Compute Capability "
+                            "this program requires (%d)! Abort.\n\n", i, 200);
+            return 0;
+        }
+
+        // We launch one thread block for each SM on this GPU.
+        hstates[i]->n_tblks = props.multiProcessorCount;
+        hstates[i]->n_threads = hstates[i]->n_tblks * NUM_THREADS_PER_BLOCK;
+
+        n_threads += hstates[i]->n_threads;
+    }
+    return n_threads;
+}
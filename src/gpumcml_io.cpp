@@ -24,14 +24,25 @@
 #define NINTS 5
 
 #include <cfloat>
+#include <climits>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <fcntl.h>
+#include <functional>
 #include <iostream>
+#include <sstream>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
 
-#include "../tqdm/tqdm.h"
 #include "CLI11.h"
 #include "gpumcml.h"
+#include "gpumcml_cache.h"
+#include "gpumcml_trace.h"
 
 using namespace std;
 
@@ -62,13 +73,77 @@ int interpret_arg(int argc, char *argv[])
     // add options to CLI
     auto input_file = app.add_option("-i,--input", g_commandLineArguments.input_file,
                                      "Path to the .mci file that contains the tissue configuration.");
-    input_file->required();
+    auto sweep_file = app.add_option("-W,--sweep", g_commandLineArguments.sweep_file,
+                                     "Path to a sweep file: the runs are generated from a base geometry and ranges "
+                                     "or lists of layer parameters instead of read from an .mci file.");
+    input_file->excludes(sweep_file);
     auto output_file = app.add_option("-O,--output", g_commandLineArguments.output_file,
                                       "Path to file where the output will be stored. Make sure that the parent folder "
                                       "already exists. The file name will be created on the parent folder.");
     output_file->required();
-    app.add_option("-S,--seed", g_commandLineArguments.seed, "Seed.");
+    auto seed = app.add_option("-S,--seed", g_commandLineArguments.seed, "Seed.");
     app.add_option("-G,--n_gpus", g_commandLineArguments.number_of_gpus, "Number of GPUs to use.");
+    app.add_option("-B,--backend", g_commandLineArguments.backend,
+                   "Engine that runs the photon loop: 'gpu' (default), 'cpu', 'simd' (CPU engine that advances "
+                   "8 or 16 photons at once with AVX2/AVX-512) or 'mixed' (GPUs and SIMD CPU threads together).")
+        ->check(CLI::IsMember({"gpu", "cpu", "simd", "mixed"}));
+    app.add_option("-T,--n_threads", g_commandLineArguments.number_of_threads,
+                   "Number of host threads used by the CPU backends. Defaults to all hardware threads.");
+    app.add_option("-P,--pack_photons", g_commandLineArguments.pack_photons,
+                   "Pack consecutive runs with up to this many photons in total into one engine dispatch, so that "
+                   "small runs keep all GPU threads (or CPU lanes) busy. Defaults to 0 (one run per dispatch).");
+    app.add_option("-C,--chunk_photons", g_commandLineArguments.chunk_photons,
+                   "Number of photons the workers (GPUs or CPU threads) take from the work queue at a time. "
+                   "Defaults to 0 (a quarter of an even share of each batch).");
+    app.add_flag("--white", g_commandLineArguments.white_mc,
+                 "White Monte Carlo (CPU backend): consecutive runs that differ only in mua are simulated once "
+                 "without absorption and reweighted for the mua of every run (Beer-Lambert).");
+    app.add_flag("--jacobian", g_commandLineArguments.jacobian,
+                 "Add dRd/dmua and dRd/dmus of every layer to the output (perturbation Monte Carlo, CPU backend).");
+    app.add_option("--rng", g_commandLineArguments.rng,
+                   "Random number generator: 'mwc' (multiply-with-carry, default), 'philox' (Philox4x32-10) or "
+                   "'xoroshiro' (xoroshiro64**). The SIMD engine only has 'mwc'.")
+        ->check(CLI::IsMember({"mwc", "philox", "xoroshiro"}));
+    app.add_option("--precision", g_commandLineArguments.precision,
+                   "Floating-point precision of the photon loop (CPU and GPU backends): 'single' (default), 'mixed' "
+                   "(photon positions in double, everything else in single) or 'double'. The SIMD engine only has "
+                   "'single'.")
+        ->check(CLI::IsMember({"single", "mixed", "double"}));
+    app.add_option("--cache", g_commandLineArguments.cache_dir,
+                   "Directory of cached results: runs whose result is in it are not simulated again, and the "
+                   "results of the simulated runs are added to it. Duplicate runs in the input are simulated once. "
+                   "Needs --seed.");
+    app.add_flag("--std_errors", g_commandLineArguments.std_errors,
+                 "Add the standard errors of Rd, A, T and the penetration depth to the output, estimated from the "
+                 "spread of the chunks of photons of every run (batch means).");
+    app.add_flag("--profile", g_commandLineArguments.profile,
+                 "Add the event counts of the photon loops of every run to the output (steps, boundary hits, "
+                 "total internal reflections, ...). Needs a build with -DMCML_PROFILE=ON.");
+    app.add_option("--trace", g_commandLineArguments.trace_file,
+                   "Write a timing trace of the phases of the job (parsing, setup, engine chunks, GPU kernels, "
+                   "reduction, output) to this file, in the Chrome trace event format (chrome://tracing, Perfetto).");
+    app.add_option("--progress", g_commandLineArguments.progress,
+                   "Progress reports: 'bar' (default, an updating line with photons/sec and the time left, if the "
+                   "output is a terminal), 'json' (one JSON object per line on stderr, for job schedulers) or "
+                   "'none'.")
+        ->check(CLI::IsMember({"bar", "json", "none"}));
+    app.add_option("--progress_interval", g_commandLineArguments.progress_interval,
+                   "Seconds between progress reports (default 1).");
+    app.add_option("--batch_ms", g_commandLineArguments.batch_ms,
+                   "Target duration of one engine batch in ms: the photons a CPU thread takes from a chunk at a "
+                   "time (default 100), or a GPU kernel launch (by default the GPUs run NUM_STEPS steps per "
+                   "launch). 0 keeps NUM_STEPS steps per launch and whole chunks.");
+    app.add_option("--rse_rd", g_commandLineArguments.target_rse[STAT_RD],
+                   "Target relative standard error of Rd (e.g. 0.001): runs get more photons until it is reached, "
+                   "up to --max_photons.");
+    app.add_option("--rse_a", g_commandLineArguments.target_rse[STAT_A],
+                   "Target relative standard error of the absorbed fraction (see --rse_rd).");
+    app.add_option("--rse_t", g_commandLineArguments.target_rse[STAT_T],
+                   "Target relative standard error of the transmittance (see --rse_rd).");
+    app.add_option("--max_photons", g_commandLineArguments.max_photons,
+                   "Most photons per run with --rse_*. Defaults to 10 times the number of photons of the run.");
+    app.add_flag("--resume", g_commandLineArguments.resume,
+                 "Keep the rows of an existing output file and only simulate the runs that are not in it.");
     app.add_flag("-A,--ignore_absorption", g_commandLineArguments.ignore_absorption_detection,
                  "Indicates that absorption detection should not be recorded. It can speed up simulations in some "
                  "cases, but will not be able to calculate penetration depth.");
@@ -86,6 +161,18 @@ int interpret_arg(int argc, char *argv[])
     {
         return app.exit(e);
     }
+    if (g_commandLineArguments.input_file.empty() && g_commandLineArguments.sweep_file.empty())
+    {
+        std::cerr << "--input or --sweep is required\n";
+        return 1;
+    }
+    if (!g_commandLineArguments.cache_dir.empty() && seed->count() == 0)
+    {
+        // The results are cached per seed, and the default seed is the time.
+        std::cerr << "--cache needs an explicit --seed: with the default seed (the current time) no later job would "
+                     "find the cached results\n";
+        return 1;
+    }
     return 0;
 }
 
@@ -126,290 +213,930 @@ int isnumeric(char a)
         return 0;
 }
 
-int readfloats(int n_floats, float *temp, FILE *pFile)
+int ischar(char a)
 {
-    int ii = 0;
-    char mystring[200];
+    if ((a >= (char)65 && a <= (char)90) || (a >= (char)97 && a <= (char)122))
+        return 1;
+    else
+        return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Tokenizer of .mci files mapped in memory. A data line starts with a
+//   number, a name line (the output filename of a run) with a letter;
+//   every other line is a comment.
+//////////////////////////////////////////////////////////////////////////////
+
+// Minimum number of runs parsed by each parser thread
+#define MIN_RUNS_PER_PARSE_THREAD 256
+
+#define LINE_EOF 0
+#define LINE_DATA 1
+#define LINE_NAME 2
+#define LINE_OTHER 3
 
-    if (n_floats > NFLOATS)
-        return 0; // cannot read more than NFLOATS floats
+// Lines of [data + pos, data + size)
+typedef struct
+{
+    const char *data;
+    size_t pos; // offset of the next line
+    size_t size;
+} LineCursor;
+
+// Read the next line into <line> (without its newline) and return its kind.
+static int NextLine(LineCursor *cur, const char **line, size_t *len)
+{
+    if (cur->pos >= cur->size)
+        return LINE_EOF;
+    const char *begin = cur->data + cur->pos;
+    const char *nl = (const char *)memchr(begin, '\n', cur->size - cur->pos);
+    const char *end = (nl != NULL) ? nl : cur->data + cur->size;
+    cur->pos = end - cur->data + (nl != NULL);
+    *line = begin;
+    *len = end - begin;
 
-    while (ii <= 0)
+    const char *p = begin;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        ++p;
+    if (p == end)
+        return LINE_OTHER;
+    if (ischar(*p))
+        return LINE_NAME;
+    if (p < end && (*p == '+' || *p == '-'))
+        ++p;
+    if (p < end && *p == '.')
+        ++p;
+    return (p < end && isnumeric(*p)) ? LINE_DATA : LINE_OTHER;
+}
+
+// Skip lines up to and including the next line of kind <kind>. Copy that
+// line into <str> (truncated to STR_LEN - 1 chars) if <str> is not NULL.
+// Return 0 at the end of the file.
+static int SkipTo(LineCursor *cur, int kind, char *str)
+{
+    const char *line;
+    size_t len;
+    int k;
+    while ((k = NextLine(cur, &line, &len)) != kind)
     {
-        if (feof(pFile))
-            return 0; // if we reach EOF here something is wrong with the file!
-        char *result = fgets(mystring, 200, pFile);
-        if (result == NULL)
-        {
-            perror("Error white reading stream from file");
-        }
-        memset(temp, 0, NFLOATS * sizeof(float));
-        ii = sscanf(mystring, "%f %f %f %f %f", &temp[0], &temp[1], &temp[2], &temp[3], &temp[4]);
-        if (ii > n_floats)
+        if (k == LINE_EOF)
             return 0;
     }
-    return 1; // Everyting appears to be ok!
+    if (str != NULL)
+    {
+        if (len > STR_LEN - 1)
+            len = STR_LEN - 1;
+        memcpy(str, line, len);
+        str[len] = '\0';
+    }
+    return 1;
 }
 
-int readints(int n_ints, int *temp, FILE *pFile) // replace with template?
+// Read up to NFLOATS floats from the next data line. Return 0 at the end
+// of the file or if the line has more than <n_floats> numbers.
+static int ReadFloats(LineCursor *cur, int n_floats, float *temp)
 {
+    char str[STR_LEN];
+    if (!SkipTo(cur, LINE_DATA, str))
+        return 0;
+    memset(temp, 0, NFLOATS * sizeof(float));
+    char *p = str, *next;
     int ii = 0;
-    char mystring[STR_LEN];
+    for (; ii < NFLOATS; ++ii, p = next)
+    {
+        temp[ii] = strtof(p, &next);
+        if (next == p)
+            break;
+    }
+    return ii <= n_floats;
+}
 
-    if (n_ints > NINTS)
-        return 0; // cannot read more than NFLOATS floats
+// Same as ReadFloats, for ints
+static int ReadInts(LineCursor *cur, int n_ints, long *temp)
+{
+    char str[STR_LEN];
+    if (!SkipTo(cur, LINE_DATA, str))
+        return 0;
+    memset(temp, 0, NINTS * sizeof(long));
+    char *p = str, *next;
+    int ii = 0;
+    for (; ii < NINTS; ++ii, p = next)
+    {
+        temp[ii] = strtol(p, &next, 10);
+        if (next == p)
+            break;
+    }
+    return ii <= n_ints;
+}
 
-    while (ii <= 0)
+//////////////////////////////////////////////////////////////////////////////
+//   Find the lines of the next run. Only its number of layers is parsed.
+//   Return 0 if the file ends first.
+//////////////////////////////////////////////////////////////////////////////
+static int FindRun(LineCursor *cur, long *begin, long *end, UINT32 *n_layers)
+{
+    const char *line;
+    size_t len;
+    int kind;
+    while ((kind = NextLine(cur, &line, &len)) != LINE_NAME)
     {
-        if (feof(pFile))
-            return 0; // if we reach EOF here something is wrong with the file!
-        char *result = fgets(mystring, STR_LEN, pFile);
-        if (result == NULL)
-        {
-            perror("Error white reading stream from file");
-        }
-        memset(temp, 0, NINTS * sizeof(int));
-        ii = sscanf(mystring, "%d %d %d %d %d", &temp[0], &temp[1], &temp[2], &temp[3], &temp[4]);
-        if (ii > n_ints)
+        if (kind == LINE_EOF)
             return 0;
     }
-    return 1; // Everyting appears to be ok!
+    *begin = line - cur->data;
+
+    // No. of photons, dz and dr, No. of dz, dr and da
+    for (int i = 0; i < 3; ++i)
+    {
+        if (!SkipTo(cur, LINE_DATA, NULL))
+            return 0;
+    }
+    long itemp[NINTS];
+    if (!ReadInts(cur, 1, itemp) || itemp[0] < 1)
+        return 0;
+    *n_layers = (UINT32)itemp[0];
+
+    // refractive index above, one line per layer, refractive index below
+    for (UINT32 i = 0; i < *n_layers + 2; ++i)
+    {
+        if (!SkipTo(cur, LINE_DATA, NULL))
+            return 0;
+    }
+    *end = cur->pos;
+    return 1;
 }
 
-int ischar(char a)
+//////////////////////////////////////////////////////////////////////////////
+//   Binary input files (.mcb): a BinaryInputHeader followed by one column
+//   per field of the runs and one per field of the layers, each 8-byte
+//   aligned, in the order of BinaryColumns.
+//////////////////////////////////////////////////////////////////////////////
+#define MCML_BINARY_MAGIC "MCMLBIN"
+#define MCML_BINARY_VERSION 1
+
+typedef struct
 {
-    if ((a >= (char)65 && a <= (char)90) || (a >= (char)97 && a <= (char)122))
-        return 1;
+    char magic[8];    // MCML_BINARY_MAGIC
+    UINT32 version;   // MCML_BINARY_VERSION
+    UINT32 n_runs;    // number of runs
+    UINT64 n_layers;  // number of layers of all runs
+    UINT64 names_size; // bytes of the output filenames, each NUL-terminated
+} BinaryInputHeader;
+
+typedef struct
+{
+    // one entry per run
+    UINT32 *photons;
+    float *dr, *dz;
+    UINT32 *na, *nr, *nz;
+    UINT32 *n_layers;
+    float *n_above, *n_below; // refractive index of the media above and below
+    UINT64 *layer_ofst;       // first layer of each run, n_runs + 1 entries
+    UINT64 *name_ofst;        // first char of each output filename, n_runs + 1 entries
+
+    // one entry per layer, as in the .mci file
+    float *n, *mua, *mus, *g, *d;
+
+    char *names;
+} BinaryColumns;
+
+// Place the columns of <header> after <base>. Return their size in bytes.
+static UINT64 LayoutColumns(const BinaryInputHeader *header, char *base, BinaryColumns *cols)
+{
+    UINT64 ofst = 0;
+    UINT64 n_runs = header->n_runs;
+    UINT64 n_layers = header->n_layers;
+    auto column = [&](UINT64 size) {
+        char *p = base + ofst;
+        ofst += (size + 7) & ~(UINT64)7;
+        return p;
+    };
+    cols->photons = (UINT32 *)column(n_runs * sizeof(UINT32));
+    cols->dr = (float *)column(n_runs * sizeof(float));
+    cols->dz = (float *)column(n_runs * sizeof(float));
+    cols->na = (UINT32 *)column(n_runs * sizeof(UINT32));
+    cols->nr = (UINT32 *)column(n_runs * sizeof(UINT32));
+    cols->nz = (UINT32 *)column(n_runs * sizeof(UINT32));
+    cols->n_layers = (UINT32 *)column(n_runs * sizeof(UINT32));
+    cols->n_above = (float *)column(n_runs * sizeof(float));
+    cols->n_below = (float *)column(n_runs * sizeof(float));
+    cols->layer_ofst = (UINT64 *)column((n_runs + 1) * sizeof(UINT64));
+    cols->name_ofst = (UINT64 *)column((n_runs + 1) * sizeof(UINT64));
+    cols->n = (float *)column(n_layers * sizeof(float));
+    cols->mua = (float *)column(n_layers * sizeof(float));
+    cols->mus = (float *)column(n_layers * sizeof(float));
+    cols->g = (float *)column(n_layers * sizeof(float));
+    cols->d = (float *)column(n_layers * sizeof(float));
+    cols->names = column(header->names_size);
+    return ofst;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Set layer <ii> of a run from its line in the input file (dtot is the
+//   depth of its top) and the start weight once all layers are set
+//////////////////////////////////////////////////////////////////////////////
+void SetLayer(SimulationStruct *sim, int ii, float n, float mua, float mus, float g, float d, float *dtot)
+{
+    sim->layers[ii].n = n;
+    sim->layers[ii].mua = mua;
+    sim->layers[ii].g = g;
+    sim->layers[ii].z_min = *dtot;
+    *dtot += d;
+    sim->layers[ii].z_max = *dtot;
+    if (mus == 0.0f)
+        sim->layers[ii].mutr = FLT_MAX; // Glas layer
     else
-        return 0;
+        sim->layers[ii].mutr = 1.0f / (mua + mus);
+}
+
+void SetStartWeight(SimulationStruct *sim)
+{
+    double n1 = sim->layers[0].n;
+    double n2 = sim->layers[1].n;
+    double r = (n1 - n2) / (n1 + n2);
+    r = r * r;
+    sim->start_weight = 1.0F - (float)r;
 }
 
 //////////////////////////////////////////////////////////////////////////////
-//   Parse simulation input file
+//   Parse the lines sim->begin .. sim->end - 1 of a run. The layers read
+//   are also stored in <raw> (from layer <layer_ofst> on) if it is not NULL.
+//   Return NULL if successful or what could not be read.
 //////////////////////////////////////////////////////////////////////////////
-int read_simulation_data(const char *filename, SimulationStruct **simulations, int ignoreAdetection)
+static const char *ParseRun(const char *data, SimulationStruct *sim, BinaryColumns *raw, UINT64 layer_ofst)
 {
-    int i = 0;
-    int ii = 0;
-    unsigned long number_of_photons;
-    int n_simulations = 0;
-    int n_layers = 0;
-    FILE *pFile;
+    LineCursor cur = {data, (size_t)sim->begin, (size_t)sim->end};
     char mystring[STR_LEN];
     char str[STR_LEN];
-    char AorB;
+    char AorB = 0;
+    float ftemp[NFLOATS];
+    long itemp[NINTS];
+
+    // Read the output filename and determine ASCII or Binary output
+    if (!SkipTo(&cur, LINE_NAME, mystring) || sscanf(mystring, "%s %c", str, &AorB) < 1)
+        return "output filename";
+    strcpy(sim->outp_filename, str);
+    sim->AorB = AorB;
+
+    // Read the number of photons
+    if (!SkipTo(&cur, LINE_DATA, mystring))
+        return "number of photons";
+    sim->number_of_photons = (UINT32)strtoul(mystring, NULL, 10);
+
+    // Read dr and dz (2x float)
+    if (!ReadFloats(&cur, 2, ftemp))
+        return "dr and dz";
+    sim->det.dz = ftemp[0];
+    sim->det.dr = ftemp[1];
+
+    // Read No. of dz, dr and da  (3x int)
+    if (!ReadInts(&cur, 3, itemp))
+        return "No. of dz, dr and da";
+    sim->det.nz = itemp[0];
+    sim->det.nr = itemp[1];
+    sim->det.na = itemp[2];
+
+    // Read No. of layers (1xint), the layers were allocated for it
+    if (!ReadInts(&cur, 1, itemp) || itemp[0] != (long)sim->n_layers)
+        return "No. of layers";
+    int n_layers = sim->n_layers;
+
+    // Read upper refractive index (1xfloat)
+    if (!ReadFloats(&cur, 1, ftemp))
+        return "upper refractive index";
+    sim->layers[0].n = ftemp[0];
+
     float dtot = 0;
+    for (int ii = 1; ii <= n_layers; ii++)
+    {
+        // Read Layer data (5x float)
+        if (!ReadFloats(&cur, 5, ftemp))
+            return "layer data";
+        SetLayer(sim, ii, ftemp[0], ftemp[1], ftemp[2], ftemp[3], ftemp[4], &dtot);
+        if (raw != NULL)
+        {
+            UINT64 l = layer_ofst + ii - 1;
+            raw->n[l] = ftemp[0];
+            raw->mua[l] = ftemp[1];
+            raw->mus[l] = ftemp[2];
+            raw->g[l] = ftemp[3];
+            raw->d[l] = ftemp[4];
+        }
+    } // end ii<n_layers
 
-    float ftemp[NFLOATS]; // Find a more elegant way to do this...
-    int itemp[NINTS];
+    // Read lower refractive index (1xfloat)
+    if (!ReadFloats(&cur, 1, ftemp))
+        return "lower refractive index";
+    sim->layers[n_layers + 1].n = ftemp[0];
 
-    double n1, n2, r;
+    SetStartWeight(sim);
+    return NULL;
+}
 
-    pFile = fopen(filename, "r");
-    if (pFile == NULL)
+//////////////////////////////////////////////////////////////////////////////
+//   Allocate <n_simulations> runs with n_layers[i] layers each. The layers
+//   of all runs are allocated in the same block as the runs, so that
+//   FreeSimulationStruct frees everything at once.
+//////////////////////////////////////////////////////////////////////////////
+SimulationStruct *AllocSimulationStruct(int n_simulations, const UINT32 *n_layers)
+{
+    UINT64 n_total = 0;
+    for (int i = 0; i < n_simulations; ++i)
+        n_total += n_layers[i] + 2;
+
+    SimulationStruct *sims = (SimulationStruct *)calloc(
+        1, n_simulations * sizeof(SimulationStruct) + n_total * sizeof(LayerStruct));
+    if (sims == NULL)
+        return NULL;
+
+    LayerStruct *layers = (LayerStruct *)(sims + n_simulations);
+    for (int i = 0; i < n_simulations; ++i)
+    {
+        sims[i].n_layers = n_layers[i];
+        sims[i].layers = layers;
+        layers += n_layers[i] + 2;
+    }
+    return sims;
+}
+
+void FreeSimulationStruct(SimulationStruct *sim, int n_simulations)
+{
+    (void)n_simulations;
+    free(sim);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Call fn(t, first, last) for the items first .. last - 1 of <n_items>,
+//   split into one contiguous range for each of <n_threads> threads (0 for
+//   one per hardware thread). Return the number of threads used.
+//////////////////////////////////////////////////////////////////////////////
+static UINT32 ParallelFor(int n_items, UINT32 n_threads, const std::function<void(UINT32, int, int)> &fn)
+{
+    if (n_threads == 0)
+        n_threads = std::thread::hardware_concurrency();
+    UINT32 max_threads = (n_items + MIN_RUNS_PER_PARSE_THREAD - 1) / MIN_RUNS_PER_PARSE_THREAD;
+    if (n_threads > max_threads)
+        n_threads = max_threads;
+    if (n_threads == 0)
+        n_threads = 1;
+
+    auto range = [&](UINT32 t) {
+        int first = (int)((UINT64)n_items * t / n_threads), last = (int)((UINT64)n_items * (t + 1) / n_threads);
+        if (t > 0)
+            TraceThreadName("parse %u", t);
+        TraceScope scope("parse runs", "parse");
+        scope.Args("\"first\": %d, \"last\": %d", first, last);
+        fn(t, first, last);
+    };
+    std::vector<std::thread> threads;
+    for (UINT32 t = 1; t < n_threads; ++t)
+        threads.push_back(std::thread(range, t));
+    range(0);
+    for (auto &thread : threads)
+        thread.join();
+    return n_threads;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Map an input file in memory. Return NULL if it cannot be read or is
+//   empty.
+//////////////////////////////////////////////////////////////////////////////
+static const char *MapInputFile(const char *filename, size_t *size)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
     {
         perror("Error opening file");
-        return 0;
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        fprintf(stderr, "Error reading %s: the file is empty\n", filename);
+        close(fd);
+        return NULL;
+    }
+    *size = (size_t)st.st_size;
+    void *data = mmap(NULL, *size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        perror("Error mapping file");
+        return NULL;
     }
+    return (const char *)data;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Parse a text (.mci) input file: the lines of every run are found in
+//   one pass, then the runs are parsed in parallel. The layers read are
+//   also stored in the columns <raw> (allocated here) if it is not NULL.
+//////////////////////////////////////////////////////////////////////////////
+static int ReadTextInput(const char *filename, const char *data, size_t size, SimulationStruct **simulations,
+                         int ignoreAdetection, UINT32 n_threads, BinaryColumns *raw, char **raw_buffer)
+{
+    LineCursor cur = {data, 0, size};
+    float ftemp[NFLOATS];
+    long itemp[NINTS];
 
     // First read the first data line (file version) and ignore
-    if (!readfloats(1, ftemp, pFile))
+    if (!ReadFloats(&cur, 1, ftemp))
     {
-        perror("Error reading file version");
+        fprintf(stderr, "Error reading file version\n");
         return 0;
     }
 
     // Second, read the number of runs
-    if (!readints(1, itemp, pFile))
+    if (!ReadInts(&cur, 1, itemp) || itemp[0] <= 0)
     {
-        perror("Error reading number of runs");
+        fprintf(stderr, "Error reading number of runs\n");
         return 0;
     }
-    n_simulations = itemp[0];
+    int n_simulations = (int)itemp[0];
+
+    // Find the lines and the number of layers of every run.
+    std::vector<long> begin(n_simulations), end(n_simulations);
+    std::vector<UINT32> n_layers(n_simulations);
+    for (int i = 0; i < n_simulations; i++)
+    {
+        if (!FindRun(&cur, &begin[i], &end[i], &n_layers[i]))
+        {
+            fprintf(stderr, "Error reading run %d of %s: invalid number of layers or the file ends early\n", i,
+                    filename);
+            return 0;
+        }
+    }
 
-    // Allocate memory for the SimulationStruct array
-    *simulations = (SimulationStruct *)malloc(sizeof(SimulationStruct) * n_simulations);
+    *simulations = AllocSimulationStruct(n_simulations, n_layers.data());
     if (*simulations == NULL)
     {
         perror("Failed to malloc simulations.\n");
         return 0;
     }
 
-    tqdm pbar;
-    for (i = 0; i < n_simulations; i++)
+    std::vector<UINT64> layer_ofst;
+    if (raw != NULL)
     {
-        if (i == 0)
-        {
-            printf("Reading Simulations MCI file\n");
-        }
-        // Store the input filename
-        strcpy((*simulations)[i].inp_filename, filename);
-
-        // Store ignoreAdetection data
-        (*simulations)[i].ignoreAdetection = ignoreAdetection;
+        layer_ofst.resize(n_simulations + 1, 0);
+        for (int i = 0; i < n_simulations; i++)
+            layer_ofst[i + 1] = layer_ofst[i] + n_layers[i];
 
-        // Read the output filename and determine ASCII or Binary output
-        ii = 0;
-        while (ii <= 0)
+        BinaryInputHeader header;
+        memset(&header, 0, sizeof(header));
+        header.n_runs = n_simulations;
+        header.n_layers = layer_ofst[n_simulations];
+        *raw_buffer = (char *)malloc(LayoutColumns(&header, NULL, raw));
+        if (*raw_buffer == NULL)
         {
-            (*simulations)[i].begin = ftell(pFile);
-            char *result = fgets(mystring, STR_LEN, pFile);
-            if (result == NULL)
-            {
-                perror("Error white reading stream from file");
-            }
-            ii = sscanf(mystring, "%s %c", str, &AorB);
-            if (feof(pFile) || ii > 2)
-            {
-                perror("Error reading output filename");
-                return 0;
-            }
-            if (ii > 0)
-                ii = ischar(str[0]);
+            perror("Failed to malloc the layer columns.\n");
+            FreeSimulationStruct(*simulations, n_simulations);
+            return 0;
         }
-        strcpy((*simulations)[i].outp_filename, str);
-        (*simulations)[i].AorB = AorB;
+        LayoutColumns(&header, *raw_buffer, raw);
+    }
 
-        // Read the number of photons
-        ii = 0;
-        while (ii <= 0)
+    // Parse the runs, in one contiguous range per thread, and report the
+    // first run that fails.
+    std::mutex failed_mutex;
+    int failed_run = -1;
+    const char *failed_field = NULL;
+    ParallelFor(n_simulations, n_threads, [&](UINT32 t, int first, int last) {
+        (void)t;
+        for (int i = first; i < last; i++)
         {
-            char *result = fgets(mystring, STR_LEN, pFile);
-            if (result == NULL)
+            SimulationStruct *sim = &(*simulations)[i];
+            strcpy(sim->inp_filename, filename);
+            sim->ignoreAdetection = ignoreAdetection;
+            sim->begin = begin[i];
+            sim->end = end[i];
+            const char *field = ParseRun(data, sim, raw, raw ? layer_ofst[i] : 0);
+            if (field != NULL)
             {
-                perror("Error white reading stream from file");
-            }
-            number_of_photons = 0;
-            ii = sscanf(mystring, "%lu", &number_of_photons);
-            if (feof(pFile) || ii > 1)
-            {
-                perror("Error reading number of photons");
-                return 0;
+                std::lock_guard<std::mutex> lock(failed_mutex);
+                if (failed_run < 0 || i < failed_run)
+                {
+                    failed_run = i;
+                    failed_field = field;
+                }
+                return;
             }
         }
-        (*simulations)[i].number_of_photons = number_of_photons;
+    });
 
-        // Read dr and dz (2x float)
-        if (!readfloats(2, ftemp, pFile))
-        {
-            perror("Error reading dr and dz");
-            return 0;
-        }
-        (*simulations)[i].det.dz = ftemp[0];
-        (*simulations)[i].det.dr = ftemp[1];
+    if (failed_run >= 0)
+    {
+        fprintf(stderr, "Error reading %s of run %d of %s\n", failed_field, failed_run, filename);
+        FreeSimulationStruct(*simulations, n_simulations);
+        if (raw != NULL)
+            free(*raw_buffer);
+        return 0;
+    }
+    return n_simulations;
+}
 
-        // Read No. of dz, dr and da  (3x int)
-        if (!readints(3, itemp, pFile))
-        {
-            perror("Error reading No. of dz, dr and da");
-            return 0;
-        }
-        (*simulations)[i].det.nz = itemp[0];
-        (*simulations)[i].det.nr = itemp[1];
-        (*simulations)[i].det.na = itemp[2];
+//////////////////////////////////////////////////////////////////////////////
+//   Read a binary (.mcb) input file. The runs are copied from the columns
+//   into newly allocated SimulationStructs, in parallel, without parsing.
+//////////////////////////////////////////////////////////////////////////////
+static int ReadBinaryInput(const char *filename, const char *data, size_t size, SimulationStruct **simulations,
+                           int ignoreAdetection, UINT32 n_threads)
+{
+    BinaryInputHeader header;
+    BinaryColumns cols;
+    memcpy(&header, data, sizeof(header));
+    if (header.version != MCML_BINARY_VERSION || header.n_runs == 0 || header.n_runs > INT_MAX ||
+        header.n_layers > size || header.names_size > size ||
+        LayoutColumns(&header, (char *)data + sizeof(header), &cols) > size - sizeof(header))
+    {
+        fprintf(stderr, "Error reading %s: invalid or truncated binary input file\n", filename);
+        return 0;
+    }
+    int n_simulations = (int)header.n_runs;
 
-        // Read No. of layers (1xint)
-        if (!readints(1, itemp, pFile))
+    // Check the offsets before any run is read: the offsets start at 0 and
+    // grow, so every name is checked to lie within the names column before
+    // its terminating NUL is read.
+    if (cols.layer_ofst[0] != 0 || cols.name_ofst[0] != 0)
+    {
+        fprintf(stderr, "Error reading %s: invalid column offsets\n", filename);
+        return 0;
+    }
+    for (int i = 0; i < n_simulations; i++)
+    {
+        if (cols.n_layers[i] < 1 ||
+            cols.layer_ofst[i + 1] != cols.layer_ofst[i] + cols.n_layers[i] ||
+            cols.name_ofst[i + 1] <= cols.name_ofst[i] || cols.name_ofst[i + 1] > header.names_size ||
+            cols.name_ofst[i + 1] - cols.name_ofst[i] > STR_LEN || cols.names[cols.name_ofst[i + 1] - 1] != '\0')
         {
-            perror("Error reading No. of layers");
+            fprintf(stderr, "Error reading run %d of %s: invalid layers or output filename\n", i, filename);
             return 0;
         }
-        n_layers = itemp[0];
-        (*simulations)[i].n_layers = itemp[0];
+    }
+    if (cols.layer_ofst[n_simulations] != header.n_layers || cols.name_ofst[n_simulations] != header.names_size)
+    {
+        fprintf(stderr, "Error reading %s: invalid column offsets\n", filename);
+        return 0;
+    }
 
-        // Allocate memory for the layers (including one for the upper and one for the lower)
-        (*simulations)[i].layers = (LayerStruct *)malloc(sizeof(LayerStruct) * (n_layers + 2));
-        if ((*simulations)[i].layers == NULL)
-        {
-            perror("Failed to malloc layers.\n");
-            return 0;
-        }
+    *simulations = AllocSimulationStruct(n_simulations, cols.n_layers);
+    if (*simulations == NULL)
+    {
+        perror("Failed to malloc simulations.\n");
+        return 0;
+    }
 
-        // Read upper refractive index (1xfloat)
-        if (!readfloats(1, ftemp, pFile))
+    ParallelFor(n_simulations, n_threads, [&](UINT32 t, int first, int last) {
+        (void)t;
+        for (int i = first; i < last; i++)
         {
-            perror("Error reading upper refractive index");
-            return 0;
+            SimulationStruct *sim = &(*simulations)[i];
+            strcpy(sim->inp_filename, filename);
+            strcpy(sim->outp_filename, cols.names + cols.name_ofst[i]);
+            sim->AorB = 'A';
+            sim->ignoreAdetection = ignoreAdetection;
+            sim->number_of_photons = cols.photons[i];
+            sim->det.dr = cols.dr[i];
+            sim->det.dz = cols.dz[i];
+            sim->det.na = cols.na[i];
+            sim->det.nr = cols.nr[i];
+            sim->det.nz = cols.nz[i];
+
+            sim->layers[0].n = cols.n_above[i];
+            float dtot = 0;
+            UINT64 l = cols.layer_ofst[i];
+            for (UINT32 ii = 1; ii <= sim->n_layers; ii++, l++)
+                SetLayer(sim, ii, cols.n[l], cols.mua[l], cols.mus[l], cols.g[l], cols.d[l], &dtot);
+            sim->layers[sim->n_layers + 1].n = cols.n_below[i];
+            SetStartWeight(sim);
         }
-        (*simulations)[i].layers[0].n = ftemp[0];
+    });
+    return n_simulations;
+}
 
-        dtot = 0;
-        for (ii = 1; ii <= n_layers; ii++)
+//////////////////////////////////////////////////////////////////////////////
+//   Parse simulation input file: a text (.mci) or binary (.mcb) file,
+//   told apart by its first bytes, is mapped in memory and its runs are
+//   read by <n_threads> threads (0 for one per hardware thread).
+//////////////////////////////////////////////////////////////////////////////
+int read_simulation_data(const char *filename, SimulationStruct **simulations, int ignoreAdetection,
+                         UINT32 n_threads)
+{
+    TraceScope scope("read_simulation_data", "parse");
+    size_t size;
+    const char *data = MapInputFile(filename, &size);
+    if (data == NULL)
+        return 0;
+
+    printf("Reading Simulations MCI file\n");
+    std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+    int n_simulations;
+    bool binary = size >= sizeof(BinaryInputHeader) && memcmp(data, MCML_BINARY_MAGIC, 8) == 0;
+    if (binary)
+        n_simulations = ReadBinaryInput(filename, data, size, simulations, ignoreAdetection, n_threads);
+    else
+        n_simulations = ReadTextInput(filename, data, size, simulations, ignoreAdetection, n_threads, NULL, NULL);
+    munmap((void *)data, size);
+
+    if (n_simulations > 0)
+    {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+        printf("Parsed %d runs (%.1f MB, %s) in %.3f s\n", n_simulations, size / 1e6, binary ? "binary" : "text",
+               seconds);
+    }
+    return n_simulations;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Convert a text input file to a binary one
+//////////////////////////////////////////////////////////////////////////////
+int convert_input_to_binary(const char *mciFile, const char *mcbFile)
+{
+    size_t size;
+    const char *data = MapInputFile(mciFile, &size);
+    if (data == NULL)
+        return 1;
+
+    SimulationStruct *sims;
+    BinaryColumns raw;
+    char *raw_buffer;
+    int n_simulations = ReadTextInput(mciFile, data, size, &sims, 0, 0, &raw, &raw_buffer);
+    munmap((void *)data, size);
+    if (n_simulations == 0)
+        return 1;
+
+    BinaryInputHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, MCML_BINARY_MAGIC, 8);
+    header.version = MCML_BINARY_VERSION;
+    header.n_runs = n_simulations;
+    for (int i = 0; i < n_simulations; i++)
+    {
+        header.n_layers += sims[i].n_layers;
+        header.names_size += strlen(sims[i].outp_filename) + 1;
+    }
+
+    // The layers are already in <raw>, lay out the complete file around them.
+    BinaryColumns cols;
+    UINT64 cols_size = LayoutColumns(&header, NULL, &cols);
+    char *buffer = (char *)calloc(1, cols_size);
+    if (buffer == NULL)
+    {
+        perror("Failed to malloc the columns.\n");
+        free(raw_buffer);
+        FreeSimulationStruct(sims, n_simulations);
+        return 1;
+    }
+    LayoutColumns(&header, buffer, &cols);
+
+    size_t layers_size = header.n_layers * sizeof(float);
+    memcpy(cols.n, raw.n, layers_size);
+    memcpy(cols.mua, raw.mua, layers_size);
+    memcpy(cols.mus, raw.mus, layers_size);
+    memcpy(cols.g, raw.g, layers_size);
+    memcpy(cols.d, raw.d, layers_size);
+    free(raw_buffer);
+
+    cols.layer_ofst[0] = 0;
+    cols.name_ofst[0] = 0;
+    for (int i = 0; i < n_simulations; i++)
+    {
+        SimulationStruct *sim = &sims[i];
+        cols.photons[i] = sim->number_of_photons;
+        cols.dr[i] = sim->det.dr;
+        cols.dz[i] = sim->det.dz;
+        cols.na[i] = sim->det.na;
+        cols.nr[i] = sim->det.nr;
+        cols.nz[i] = sim->det.nz;
+        cols.n_layers[i] = sim->n_layers;
+        cols.n_above[i] = sim->layers[0].n;
+        cols.n_below[i] = sim->layers[sim->n_layers + 1].n;
+        cols.layer_ofst[i + 1] = cols.layer_ofst[i] + sim->n_layers;
+        size_t len = strlen(sim->outp_filename) + 1;
+        memcpy(cols.names + cols.name_ofst[i], sim->outp_filename, len);
+        cols.name_ofst[i + 1] = cols.name_ofst[i] + len;
+    }
+    FreeSimulationStruct(sims, n_simulations);
+
+    FILE *file = fopen(mcbFile, "wb");
+    if (file == NULL)
+    {
+        perror("Error opening output file");
+        free(buffer);
+        return 1;
+    }
+    int failed = fwrite(&header, sizeof(header), 1, file) != 1 || fwrite(buffer, 1, cols_size, file) != cols_size;
+    failed |= fclose(file) != 0;
+    free(buffer);
+    if (failed)
+    {
+        perror("Error writing output file");
+        return 1;
+    }
+    printf("Wrote %d runs (%llu layers) to %s\n", n_simulations, (unsigned long long)header.n_layers, mcbFile);
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Group consecutive runs into one batch (see PackedBatch)
+//////////////////////////////////////////////////////////////////////////////
+UINT32 BuildPackedBatch(PackedBatch *batch, SimulationStruct *sims, UINT32 n_sims, UINT32 first, UINT64 pack_photons)
+{
+    batch->sims = &sims[first];
+    batch->white = 0;
+    batch->jacobian = 0;
+    batch->rng = RNG_MWC;
+    batch->precision = PRECISION_SINGLE;
+    batch->n_runs = 0;
+    batch->A_rz_ofst[0] = 0;
+    batch->ra_ofst[0] = 0;
+    batch->jac_ofst[0] = 0;
+
+    UINT64 n_photons = 0;
+    UINT64 n_layers = 0;
+    UINT64 rz_size = 0;
+    UINT64 ra_size = 0;
+    for (UINT32 i = first; i < n_sims && batch->n_runs < MAX_PACKED_RUNS; ++i)
+    {
+        SimulationStruct *sim = &sims[i];
+        UINT64 next_photons = n_photons + sim->number_of_photons;
+        UINT64 next_layers = n_layers + sim->n_layers + 2;
+        UINT64 next_rz_size = rz_size + (UINT64)sim->det.nr * sim->det.nz;
+        UINT64 next_ra_size = ra_size + (UINT64)sim->det.nr * sim->det.na;
+
+        // The first run always makes a batch on its own.
+        if (batch->n_runs > 0 && (next_photons > pack_photons || next_layers > MAX_PACKED_LAYERS ||
+                                  next_photons > 0xFFFFFFFFull || next_rz_size > 0xFFFFFFFFull ||
+                                  next_ra_size > 0xFFFFFFFFull))
+            break;
+
+        n_photons = next_photons;
+        n_layers = next_layers;
+        rz_size = next_rz_size;
+        ra_size = next_ra_size;
+
+        batch->photon_end[batch->n_runs] = (UINT32)n_photons;
+        batch->A_rz_ofst[batch->n_runs + 1] = (UINT32)rz_size;
+        batch->ra_ofst[batch->n_runs + 1] = (UINT32)ra_size;
+        batch->jac_ofst[batch->n_runs + 1] = batch->jac_ofst[batch->n_runs] + 2 * sim->n_layers;
+        ++batch->n_runs;
+    }
+
+    return batch->n_runs;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Do two runs differ in mua only? The scattering coefficients are
+//   recovered from mutr = 1 / (mua + mus), so they are compared with a
+//   relative tolerance.
+//////////////////////////////////////////////////////////////////////////////
+static int DiffersInMuaOnly(const SimulationStruct *a, const SimulationStruct *b)
+{
+    if (a->number_of_photons != b->number_of_photons || a->n_layers != b->n_layers || a->det.dr != b->det.dr ||
+        a->det.dz != b->det.dz || a->det.na != b->det.na || a->det.nr != b->det.nr || a->det.nz != b->det.nz ||
+        a->layers[0].n != b->layers[0].n || a->layers[a->n_layers + 1].n != b->layers[b->n_layers + 1].n)
+        return 0;
+
+    for (UINT32 i = 1; i <= a->n_layers; ++i)
+    {
+        const LayerStruct *la = &a->layers[i], *lb = &b->layers[i];
+        if (la->n != lb->n || la->g != lb->g || la->z_min != lb->z_min || la->z_max != lb->z_max)
+            return 0;
+        if (la->mutr == FLT_MAX || lb->mutr == FLT_MAX)
         {
-            // Read Layer data (5x float)
-            if (!readfloats(5, ftemp, pFile))
-            {
-                perror("Error reading layer data");
+            // glass layers
+            if (la->mutr != lb->mutr)
                 return 0;
-            }
-            (*simulations)[i].layers[ii].n = ftemp[0];
-            (*simulations)[i].layers[ii].mua = ftemp[1];
-            (*simulations)[i].layers[ii].g = ftemp[3];
-            (*simulations)[i].layers[ii].z_min = dtot;
-            dtot += ftemp[4];
-            (*simulations)[i].layers[ii].z_max = dtot;
-            if (ftemp[2] == 0.0f)
-                (*simulations)[i].layers[ii].mutr = FLT_MAX; // Glas layer
-            else
-                (*simulations)[i].layers[ii].mutr = 1.0f / (ftemp[1] + ftemp[2]);
-        } // end ii<n_layers
-
-        // Read lower refractive index (1xfloat)
-        if (!readfloats(1, ftemp, pFile))
-        {
-            perror("Error reading lower refractive index");
-            return 0;
+            continue;
         }
-        (*simulations)[i].layers[n_layers + 1].n = ftemp[0];
+        double mus_a = 1.0 / la->mutr - la->mua;
+        double mus_b = 1.0 / lb->mutr - lb->mua;
+        if (fabs(mus_a - mus_b) > 1e-5 * fabs(mus_a))
+            return 0;
+    }
+    return 1;
+}
 
-        (*simulations)[i].end = ftell(pFile);
+UINT32 BuildWhiteBatch(PackedBatch *batch, SimulationStruct *sims, UINT32 n_sims, UINT32 first)
+{
+    batch->sims = &sims[first];
+    batch->white = 1;
+    batch->jacobian = 0;
+    batch->rng = RNG_MWC;
+    batch->precision = PRECISION_SINGLE;
+    batch->n_runs = 0;
+    batch->A_rz_ofst[0] = 0;
+    batch->ra_ofst[0] = 0;
+    batch->jac_ofst[0] = 0;
 
-        // calculate start_weight
-        n1 = (*simulations)[i].layers[0].n;
-        n2 = (*simulations)[i].layers[1].n;
-        r = (n1 - n2) / (n1 + n2);
-        r = r * r;
-        (*simulations)[i].start_weight = 1.0F - (float)r;
+    UINT64 rz_size = 0;
+    UINT64 ra_size = 0;
+    for (UINT32 i = first; i < n_sims && batch->n_runs < MAX_PACKED_RUNS; ++i)
+    {
+        SimulationStruct *sim = &sims[i];
+        UINT64 next_rz_size = rz_size + (UINT64)sim->det.nr * sim->det.nz;
+        UINT64 next_ra_size = ra_size + (UINT64)sim->det.nr * sim->det.na;
 
-        pbar.progress(i, n_simulations);
+        // The first run always makes a batch on its own.
+        if (batch->n_runs > 0 && (!DiffersInMuaOnly(&sims[first], sim) || next_rz_size > 0xFFFFFFFFull ||
+                                  next_ra_size > 0xFFFFFFFFull))
+            break;
 
-    } // end for i<n_simulations
-    printf("\n");
-    return n_simulations;
+        rz_size = next_rz_size;
+        ra_size = next_ra_size;
+
+        batch->photon_end[batch->n_runs] = sim->number_of_photons;
+        batch->A_rz_ofst[batch->n_runs + 1] = (UINT32)rz_size;
+        batch->ra_ofst[batch->n_runs + 1] = (UINT32)ra_size;
+        batch->jac_ofst[batch->n_runs + 1] = batch->jac_ofst[batch->n_runs] + 2 * sim->n_layers;
+        ++batch->n_runs;
+    }
+
+    return batch->n_runs;
 }
 
-void FreeSimulationStruct(SimulationStruct *sim, int n_simulations)
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+double StdError(const RunStats *stats, int q)
 {
-    int i;
-    for (i = 0; i < n_simulations; i++)
-        free(sim[i].layers);
-    free(sim);
+    double m = stats->n_chunks;
+    if (m < 2)
+        return HUGE_VAL;
+
+    if (q == STAT_PEN)
+    {
+        // mean of the penetration depths of the chunks
+        double mean = stats->sum_w[q] / m;
+        return std::sqrt(std::fmax(stats->sum_w2[q] - m * mean * mean, 0.0) / ((m - 1) * m));
+    }
+
+    // Var(sum W_c / sum N_c) ~ m / (m - 1) * sum (W_c - mean * N_c)^2 / (sum N_c)^2
+    double n = (double)stats->n_photons;
+    double mean = stats->sum_w[q] / n;
+    double ss = stats->sum_w2[q] - 2 * mean * stats->sum_wn[q] + mean * mean * stats->sum_n2;
+    return std::sqrt(std::fmax(ss, 0.0) * m / (m - 1)) / n;
+}
+
+double RelativeStdError(const RunStats *stats, int q)
+{
+    double mean = (q == STAT_PEN) ? stats->sum_w[q] / stats->n_chunks : stats->sum_w[q] / stats->n_photons;
+    double se = StdError(stats, q);
+    return (se == HUGE_VAL || !(mean > 0)) ? HUGE_VAL : se / mean;
 }
 
 //////////////////////////////////////////////////////////////////////////////
+//   Penetration depth of a run from its absorption (A_rz, summed to A) and
+//   transmittance (T)
 //////////////////////////////////////////////////////////////////////////////
+float PenetrationDepth(const UINT64 *A_rz, UINT64 A, UINT64 T, const SimulationStruct *sim)
+{
+    int nr = sim->det.nr; // Number of grid elements in r-direction
+    int nz = sim->det.nz; // Number of grid elements in z-direction
+    float dz = sim->det.dz;
 
-void SimulationResults::registerSimulationResults(SimState *HostMem, SimulationStruct *sim)
+    UINT64 beamIntensityAtPenetrationDepth;
+    UINT64 weightPenetration = 0;
+
+    // get tissue depth, it can be less than dimensions of grid. Layer number 0 has depth 0, only used for specular
+    // reflections
+    float tissueDept = sim->layers[sim->n_layers].z_max;
+
+    // get penetration depth, ignore Rd because penetration depth should be estimated based on the intensity of the beam
+    // just below the surface of the tissue (no reflection).
+    beamIntensityAtPenetrationDepth = (A + T) * (1. / EULER);
+    for (int iz = 0; iz < nz; ++iz)
+    {
+        // A_rz stores values in column-major order, this means that all absorption values A_rz[0 ... nz] correspond
+        // to the first element of the radial direction. Here the index is recomputed to sum all radial values
+        // for each z value first.
+        for (int ir = 0; ir < nr; ++ir)
+            weightPenetration += A_rz[ir * nz + iz];
+        if (weightPenetration > beamIntensityAtPenetrationDepth)
+            return static_cast<float>(iz) * dz; // gets penetration depth in cm
+    }
+
+    // when the beam has gone through the whole layered tissue but there is a lot of transmission such that the
+    // intensity of the beam does not reduce to I/e within the tissue, the penetration depth has to be the whole
+    // thickness of the tissue model
+    return (weightPenetration > 0) ? tissueDept : 0;
+}
+
+void SimulationResults::registerSimulationResults(SimState *HostMem, SimulationStruct *sim, const RunStats *stats)
 {
     int na = sim->det.na; // Number of grid elements in angular-direction [-]
     int nr = sim->det.nr; // Number of grid elements in r-direction
     int nz = sim->det.nz; // Number of grid elements in z-direction
-    float dz = sim->det.dz;
-    float tissueDept = 0;
 
     int rz_size = nr * nz;
     int ra_size = nr * na;
     int i;
 
-    double scale1 = (double)(WEIGHT_SCALE) * (double)sim->number_of_photons;
+    double scale1 = (double)(WEIGHT_SCALE) * (double)stats->n_photons;
 
     // Calculate and write RAT
     UINT64 Rd = 0; // Diffuse reflectance [-]
     UINT64 A = 0;  // Absorbed fraction [-]
     UINT64 T = 0;  // Transmittance [-]
-    float penetrationDepth = 0;
-    UINT64 beamIntensityAtPenetrationDepth;
-    UINT64 weightPenetration = 0;
 
     for (i = 0; i < rz_size; i++)
     {
@@ -420,52 +1147,223 @@ void SimulationResults::registerSimulationResults(SimState *HostMem, SimulationS
         T += HostMem->Tt_ra[i];
         Rd += HostMem->Rd_ra[i];
     }
+    float penetrationDepth = PenetrationDepth(HostMem->A_rz, A, T, sim);
 
-    // get tissue depth, it can be less than dimensions of grid. Layer number 0 has depth 0, only used for specular
-    // reflections
-    tissueDept = sim->layers[sim->n_layers].z_max;
-
-    // get penetration depth, ignore Rd because penetration depth should be estimated based on the intensity of the beam
-    // just below the surface of the tissue (no reflection).
-    beamIntensityAtPenetrationDepth = (A + T) * (1. / EULER);
-    for (int iz = 0; iz < nz; ++iz)
+    std::ostringstream row;
+    row << 1.0F - sim->start_weight << "," << (double)Rd / scale1 << ",";
+    row << (double)A / scale1 << "," << (double)T / scale1 << "," << (double)penetrationDepth;
+    if (this->stdErrors)
     {
-        for (int ir = 0; ir < nr; ++ir)
+        // Rd, A, T and the penetration depth, as in the columns before
+        for (int q = 0; q < N_STATS; ++q)
         {
-            unsigned index = ir * nz + iz;
-            // A_rz stores values in column-major order, this means that all absorption values A_rz[0 ... nz] correspond
-            // to the first element of the radial direction. Here the index is recomputed to sum all radial values
-            // for each z value first.
-            weightPenetration += HostMem->A_rz[index];
-            if (weightPenetration > beamIntensityAtPenetrationDepth)
-            {
-                penetrationDepth = static_cast<float>(iz) * dz; // gets penetration depth in cm
-                break;
-            }
-            else if ((index == rz_size - 1) && (weightPenetration > 0.))
-            {
-                // when the beam has gone through the whole layered tissue but there is a lot of transmission such that
-                // the intensity of the beam does not reduce to I/e within the tissue, the penetration depth has to be
-                // the whole thickness of the tissue model
-                penetrationDepth = tissueDept;
-                break;
-            }
+            double se = StdError(stats, q);
+            row << ",";
+            if (se != HUGE_VAL)
+                row << se;
+        }
+    }
+    if (this->profile)
+    {
+        for (int e = 0; e < N_PROFILE_EVENTS; ++e)
+            row << "," << stats->events[e];
+    }
+    for (UINT32 l = 0; l < this->n_jacobianLayers; ++l)
+    {
+        if (l < sim->n_layers)
+        {
+            row << "," << HostMem->Rd_jac[2 * l] / stats->n_photons;
+            row << "," << HostMem->Rd_jac[2 * l + 1] / stats->n_photons;
+        }
+        else
+        {
+            row << ",,";
         }
     }
-    this->resultsStream << sim->outp_filename << "," << 1.0F - sim->start_weight << "," << (double)Rd / scale1 << ",";
-    this->resultsStream << (double)A / scale1 << "," << (double)T / scale1 << "," << (double)penetrationDepth << "\n";
+
+    std::vector<std::string> duplicates;
+    if (this->cache != NULL)
+        this->cache->Store(sim, row.str(), &duplicates);
+    registerRow(sim->outp_filename, row.str());
+    for (const std::string &id : duplicates)
+        registerRow(id.c_str(), row.str());
 }
 
-void SimulationResults::writeSimulationResults(const char *mcoFile)
+void SimulationResults::registerRow(const char *id, const std::string &values)
+{
+    // Hold the caller back while the writer thread is behind, so that the
+    // pending rows stay bounded.
+    std::unique_lock<std::mutex> lock(this->mutex);
+    this->rowsWritten.wait(lock, [this] {
+        return this->n_pendingRows < RESULTS_MAX_PENDING_ROWS || this->outputFile == NULL || this->stopping;
+    });
+    this->pendingRows += id;
+    this->pendingRows += ",";
+    this->pendingRows += values;
+    this->pendingRows += "\n";
+    if (++this->n_pendingRows >= RESULTS_FLUSH_ROWS)
+        this->rowsReady.notify_one();
+}
+
+SimulationResults::SimulationResults()
+    : n_pendingRows(0), outputFile(NULL), stopping(false), stdErrors(false), profile(false), n_jacobianLayers(0),
+      cache(NULL)
+{
+}
+
+SimulationResults::~SimulationResults()
 {
-    FILE *pFile_outp;
-    pFile_outp = fopen(mcoFile, "a");
-    if (pFile_outp == NULL)
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->rowsReady.notify_one();
+    if (this->writer.joinable())
+        this->writer.join();
+    if (this->outputFile != NULL)
+        fclose(this->outputFile);
+}
+
+int SimulationResults::startWriter(const char *mcoFile)
+{
+    this->outputFile = fopen(mcoFile, "a");
+    if (this->outputFile == NULL)
     {
         perror("Error opening output file");
+        return 1;
+    }
+    this->writer = std::thread(&SimulationResults::writerLoop, this);
+    return 0;
+}
+
+void SimulationResults::setJacobianColumns(UINT32 n_layers)
+{
+    this->n_jacobianLayers = n_layers;
+}
+
+void SimulationResults::setStdErrorColumns(bool enable)
+{
+    this->stdErrors = enable;
+}
+
+void SimulationResults::setProfileColumns(bool enable)
+{
+    this->profile = enable;
+}
+
+void SimulationResults::setCache(ResultCache *cache)
+{
+    this->cache = cache;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Write whole rows and push them to disk: after a crash, the output file
+//   ends with a complete row (or at worst a partial one, which --resume
+//   drops).
+//////////////////////////////////////////////////////////////////////////////
+void SimulationResults::flushRows(const std::string &rows)
+{
+    if (rows.empty())
+        return;
+    TraceScope scope("write rows", "output");
+    scope.Args("\"bytes\": %zu", rows.size());
+    if (fwrite(rows.data(), 1, rows.size(), this->outputFile) != rows.size())
+        perror("Error writing output file");
+    fflush(this->outputFile);
+    fsync(fileno(this->outputFile));
+}
+
+void SimulationResults::writerLoop()
+{
+    TraceThreadName("writer");
+    std::unique_lock<std::mutex> lock(this->mutex);
+    for (;;)
+    {
+        this->rowsReady.wait_for(lock, std::chrono::seconds(RESULTS_FLUSH_SECONDS),
+                                 [this] { return this->n_pendingRows >= RESULTS_FLUSH_ROWS || this->stopping; });
+
+        std::string rows;
+        rows.swap(this->pendingRows);
+        this->n_pendingRows = 0;
+        bool stop = this->stopping;
+        lock.unlock();
+        this->rowsWritten.notify_all();
+
+        flushRows(rows);
+        if (stop)
+            return;
+        lock.lock();
+    }
+}
+
+void SimulationResults::writeSimulationResults(const char *mcoFile)
+{
+    if (this->outputFile == NULL && startWriter(mcoFile))
+    {
         cout << "unable to open mcoFile";
+        return;
+    }
+
+    // The writer thread writes the remaining rows before it stops.
+    {
+        std::lock_guard<std::mutex> lock(this->mutex);
+        this->stopping = true;
+    }
+    this->rowsReady.notify_one();
+    this->writer.join();
+    fclose(this->outputFile);
+    this->outputFile = NULL;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Read the run IDs (first column) of the complete rows of an output file
+//////////////////////////////////////////////////////////////////////////////
+int read_completed_runs(const char *mcoFile, const std::string &header, std::map<std::string, UINT32> *ids)
+{
+    FILE *pFile = fopen(mcoFile, "r+b");
+    if (pFile == NULL)
+        return -1;
+
+    std::string contents;
+    char buf[65536];
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), pFile)) > 0)
+        contents.append(buf, n);
+
+    // The new rows must have the columns of the rows in the file.
+    size_t line = contents.find('\n');
+    if (line != std::string::npos && contents.compare(0, line, header) != 0)
+    {
+        fclose(pFile);
+        return -2;
+    }
+
+    // Drop a row that was cut off by a crash, so that the next rows start
+    // on a line of their own.
+    size_t end = contents.rfind('\n');
+    end = (end == std::string::npos) ? 0 : end + 1;
+    if (end < contents.size())
+    {
+        fflush(pFile);
+        if (ftruncate(fileno(pFile), (off_t)end) != 0)
+            perror("Error truncating output file");
+        fprintf(stderr, "Dropped an incomplete row at the end of %s\n", mcoFile);
+    }
+    fclose(pFile);
+
+    // The first complete line is the header.
+    if (line == std::string::npos || line >= end)
+        return -1;
+
+    int n_rows = 0;
+    for (size_t begin = line + 1; begin < end; begin = line + 1)
+    {
+        line = contents.find('\n', begin);
+        size_t comma = contents.find(',', begin);
+        if (comma == std::string::npos || comma > line)
+            continue;
+        ++(*ids)[contents.substr(begin, comma - begin)];
+        ++n_rows;
     }
-    std::string results = this->resultsStream.str();
-    fprintf(pFile_outp, "%s", results.c_str());
-    fclose(pFile_outp);
+    return n_rows;
 }
@@ -31,20 +31,27 @@
 #include "gpumcml_kernel.h"
 #include "gpumcml_rng.cu"
 
-// We use different math intrinsics for single- and double-precision.
-#ifdef SINGLE_PRECISION
-#define FAST_DIV(x, y) __fdividef(x,y)
-#define SQRT(x) sqrtf(x)
-#define RSQRT(x) rsqrtf(x)
-#define LOG(x) logf(x)
-#define SINCOS(x, sptr, cptr) __sincosf(x, sptr, cptr)
-#else
-#define FAST_DIV(x,y) __ddiv_rn(x,y)
-#define SQRT(x) sqrt(x)
-#define RSQRT(x) rsqrt(x)
-#define LOG(x) log(x)
-#define SINCOS(x, sptr, cptr) sincos(x, sptr, cptr)
-#endif
+// We use different math intrinsics for single- and double-precision: the
+// overloads below are picked by the type of the photon loop (see
+// gpumcml_precision.h).
+__device__ __forceinline__ float FastDiv(float x, float y) { return __fdividef(x, y); }
+__device__ __forceinline__ double FastDiv(double x, double y) { return __ddiv_rn(x, y); }
+__device__ __forceinline__ float Sqrt(float x) { return sqrtf(x); }
+__device__ __forceinline__ double Sqrt(double x) { return sqrt(x); }
+__device__ __forceinline__ float RSqrt(float x) { return rsqrtf(x); }
+__device__ __forceinline__ double RSqrt(double x) { return rsqrt(x); }
+__device__ __forceinline__ float Log(float x) { return logf(x); }
+__device__ __forceinline__ double Log(double x) { return log(x); }
+__device__ __forceinline__ void SinCos(float x, float *s, float *c) { __sincosf(x, s, c); }
+__device__ __forceinline__ void SinCos(double x, double *s, double *c) { sincos(x, s, c); }
+__device__ __forceinline__ float Abs(float x) { return fabsf(x); }
+__device__ __forceinline__ double Abs(double x) { return fabs(x); }
+__device__ __forceinline__ float CopySign(float x, float y) { return copysignf(x, y); }
+__device__ __forceinline__ double CopySign(double x, double y) { return copysign(x, y); }
+__device__ __forceinline__ float Min(float x, float y) { return fminf(x, y); }
+__device__ __forceinline__ double Min(double x, double y) { return fmin(x, y); }
+__device__ __forceinline__ float ACos(float x) { return acosf(x); }
+__device__ __forceinline__ double ACos(double x) { return acos(x); }
 
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
@@ -82,17 +89,65 @@ UINT32 compute_Arz_overflow_count(GFLOAT init_photon_w,
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
 
+//////////////////////////////////////////////////////////////////////////////
+//   Return the run of the batch that photon <photon_id> belongs to
+//////////////////////////////////////////////////////////////////////////////
+__device__ UINT32 FindRun(UINT32 photon_id) {
+    // Binary search for the first run that ends after the photon.
+    UINT32 lo = 0, hi = d_batchparam.n_runs - 1;
+    while (lo < hi) {
+        UINT32 mid = (lo + hi) >> 1;
+        if (d_simparam[mid].photon_end <= photon_id) lo = mid + 1;
+        else hi = mid;
+    }
+    return lo;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Layer <layer> of the run that <photon> belongs to
+//////////////////////////////////////////////////////////////////////////////
+template <typename P>
+__device__ const LayerStructGPU &GetLayer(const PhotonStructGPU<P> *photon, UINT32 layer) {
+    return d_layerspecs[d_simparam[photon->run].layer_ofst + layer];
+}
+
 //////////////////////////////////////////////////////////////////////////////
 //   Initialize photon position (x, y, z), direction (ux, uy, uz), weight (w),
-//   and current layer (layer)
+//   and current layer (layer) of local photon <local_id> of this GPU, and
+//   seed its generator (rng)
 //   Note: Infinitely narrow beam (pointing in the +z direction = downwards)
 //////////////////////////////////////////////////////////////////////////////
-__device__ void LaunchPhoton(PhotonStructGPU *photon) {
-    photon->x = photon->y = photon->z = MCML_FP_ZERO;
-    photon->ux = photon->uy = MCML_FP_ZERO;
-    photon->uz = FP_ONE;
-    photon->w = d_simparam.init_photon_w;
+template <typename P, typename RNG>
+__device__ void LaunchPhoton(PhotonStructGPU<P> *photon, UINT32 local_id,
+                             const SimState *d_state, RNG *rng) {
+    UINT32 photon_id = d_batchparam.photon_begin + local_id;
+    photon->run = FindRun(photon_id);
+    photon->x = photon->y = photon->z = 0;
+    photon->ux = photon->uy = 0;
+    photon->uz = 1;
+    photon->w = d_simparam[photon->run].init_photon_w;
     photon->layer = 1;
+
+    // The stream of the photon only depends on its index in the run.
+    UINT32 run_begin = (photon->run == 0) ? 0 : d_simparam[photon->run - 1].photon_end;
+    rng->Seed(d_simparam[photon->run].rng_key,
+              d_batchparam.photon_ofst + (photon_id - run_begin),
+              d_state->multipliers, d_state->n_multipliers);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Add the event counts of a thread to the counts of run <run> in the
+//   global memory, and clear them (MCML_PROFILE builds). Threads that never
+//   had a photon have nothing to add.
+//////////////////////////////////////////////////////////////////////////////
+__device__ void FlushProfile(ProfileCounters *profile, SimState *d_state, UINT32 run) {
+#ifdef MCML_PROFILE
+    UINT64 *counts = d_state->profile + run * N_PROFILE_EVENTS;
+    for (int e = 0; e < N_PROFILE_EVENTS; ++e) {
+        if (profile->n[e] > 0) atomicAdd(&counts[e], profile->n[e]);
+    }
+    profile->Clear();
+#endif
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -100,8 +155,10 @@ __device__ void LaunchPhoton(PhotonStructGPU *photon) {
 //   simulation to be broken up into batches
 //   (avoiding display driver time-out errors)
 //////////////////////////////////////////////////////////////////////////////
-__global__ void InitThreadState(GPUThreadStates tstates, UINT32 n_photons) {
-    PhotonStructGPU photon_temp;
+template <typename RNG, typename P>
+__global__ void InitThreadState(SimState d_state, GPUThreadStates tstates, UINT32 n_photons) {
+    PhotonStructGPU<P> photon_temp;
+    RNG rng;
 
     // thread ID that is unique in the grid
     UINT32 tid = blockIdx.x * blockDim.x + threadIdx.x;
@@ -113,7 +170,14 @@ __global__ void InitThreadState(GPUThreadStates tstates, UINT32 n_photons) {
 
     if (is_active) {
         // Initialize the photon and copy into photon_<parameter x>
-        LaunchPhoton(&photon_temp);
+        LaunchPhoton(&photon_temp, tid, &d_state, &rng);
+
+        ProfileCounters profile;
+        profile.Clear();
+        profile.Count(PROFILE_LAUNCHES);
+        FlushProfile(&profile, &d_state, photon_temp.run);
+
+        rng.Save(&d_state.x[tid], &d_state.a[tid]);
 
         tstates.photon_x[tid] = photon_temp.x;
         tstates.photon_y[tid] = photon_temp.y;
@@ -123,6 +187,7 @@ __global__ void InitThreadState(GPUThreadStates tstates, UINT32 n_photons) {
         tstates.photon_uz[tid] = photon_temp.uz;
         tstates.photon_w[tid] = photon_temp.w;
         tstates.photon_layer[tid] = photon_temp.layer;
+        tstates.photon_run[tid] = photon_temp.run;
     }
 }
 
@@ -130,13 +195,13 @@ __global__ void InitThreadState(GPUThreadStates tstates, UINT32 n_photons) {
 //   Save thread states (tstates), by copying the current photon
 //   data from registers into global memory
 //////////////////////////////////////////////////////////////////////////////
+template <typename P, typename RNG>
 __device__ void SaveThreadState(SimState *d_state, GPUThreadStates *tstates,
-                                PhotonStructGPU *photon,
-                                UINT64 rnd_x,
+                                PhotonStructGPU<P> *photon, const RNG *rng,
                                 UINT32 is_active) {
     UINT32 tid = blockIdx.x * blockDim.x + threadIdx.x;
 
-    d_state->x[tid] = rnd_x;
+    rng->Save(&d_state->x[tid], &d_state->a[tid]);
 
     tstates->photon_x[tid] = photon->x;
     tstates->photon_y[tid] = photon->y;
@@ -146,23 +211,22 @@ __device__ void SaveThreadState(SimState *d_state, GPUThreadStates *tstates,
     tstates->photon_uz[tid] = photon->uz;
     tstates->photon_w[tid] = photon->w;
     tstates->photon_layer[tid] = photon->layer;
+    tstates->photon_run[tid] = photon->run;
 
     tstates->is_active[tid] = is_active;
 }
 
 //////////////////////////////////////////////////////////////////////////////
 //   Restore thread states (tstates), by copying the latest photon
-//   data from global memory back into the registers
+//   data from global memory back into the registers. The generator of an
+//   inactive thread is not restored (it was never seeded).
 //////////////////////////////////////////////////////////////////////////////
+template <typename P, typename RNG>
 __device__ void RestoreThreadState(SimState *d_state, GPUThreadStates *tstates,
-                                   PhotonStructGPU *photon,
-                                   UINT64 *rnd_x, UINT32 *rnd_a,
+                                   PhotonStructGPU<P> *photon, RNG *rng,
                                    UINT32 *is_active) {
     UINT32 tid = blockIdx.x * blockDim.x + threadIdx.x;
 
-    *rnd_x = d_state->x[tid];
-    *rnd_a = d_state->a[tid];
-
     photon->x = tstates->photon_x[tid];
     photon->y = tstates->photon_y[tid];
     photon->z = tstates->photon_z[tid];
@@ -171,8 +235,14 @@ __device__ void RestoreThreadState(SimState *d_state, GPUThreadStates *tstates,
     photon->uz = tstates->photon_uz[tid];
     photon->w = tstates->photon_w[tid];
     photon->layer = tstates->photon_layer[tid];
+    photon->run = tstates->photon_run[tid];
 
     *is_active = tstates->is_active[tid];
+
+    if (*is_active) {
+        rng->Restore(d_simparam[photon->run].rng_key,
+                     d_state->x[tid], d_state->a[tid]);
+    }
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -183,11 +253,12 @@ __device__ void RestoreThreadState(SimState *d_state, GPUThreadStates *tstates,
 //////////////////////////////////////////////////////////////////////////////
 // Flush the element at offset <s_addr> of A_rz in shared memory (s_A_rz)
 // to the global memory (g_A_rz). <s_A_rz> is of dimension MAX_IR x MAX_IZ.
+// The cache is only used for batches of one run.
 //////////////////////////////////////////////////////////////////////////////
 __device__ void Flush_Arz(UINT64 *g_A_rz, ARZ_SMEM_TY *s_A_rz, UINT32 saddr) {
     UINT32 ir = saddr / MAX_IZ;
     UINT32 iz = saddr - ir * MAX_IZ;
-    UINT32 g_addr = ir * d_simparam.nz + iz;
+    UINT32 g_addr = ir * d_simparam[0].nz + iz;
 
     atomicAdd(&g_A_rz[g_addr], (UINT64) s_A_rz[saddr]);
 }
@@ -229,10 +300,12 @@ __device__ void AtomicAddULL_Global(UINT64 *address, UINT32 add) {
 //   Compute the step size for a photon packet when it is in tissue
 //   Calculate new step size: -log(rnd)/(mua+mus).
 //////////////////////////////////////////////////////////////////////////////
-__device__ void ComputeStepSize(PhotonStructGPU *photon,
-                                UINT64 *rnd_x, UINT32 *rnd_a) {
-    photon->s = -LOG(rand_MWC_oc(rnd_x, rnd_a))
-                * d_layerspecs[photon->layer].rmuas;
+template <typename P, typename RNG>
+__device__ void ComputeStepSize(PhotonStructGPU<P> *photon, RNG *rng) {
+    typedef typename P::Real Real;
+
+    photon->s = -Log(rand_oc<Real>(rng))
+                * GetLayer(photon, photon->layer).rmuas;
 }
 
 
@@ -242,16 +315,19 @@ __device__ void ComputeStepSize(PhotonStructGPU *photon,
 //   Return 1 for a hit, 0 otherwise.
 //   If the projected step hits the boundary, the photon steps to the boundary
 //////////////////////////////////////////////////////////////////////////////
-__device__ int HitBoundary(PhotonStructGPU *photon) {
+template <typename P>
+__device__ int HitBoundary(PhotonStructGPU<P> *photon) {
+    typedef typename P::Real Real;
+
     /* step size to boundary. */
-    GFLOAT dl_b;
+    Real dl_b;
 
     /* Distance to the boundary. */
-    GFLOAT z_bound = (photon->uz > MCML_FP_ZERO) ?
-                     d_layerspecs[photon->layer].z1 : d_layerspecs[photon->layer].z0;
-    dl_b = FAST_DIV(z_bound - photon->z, photon->uz);     // dl_b > 0
+    Real z_bound = (photon->uz > (Real) 0) ?
+                   GetLayer(photon, photon->layer).z1 : GetLayer(photon, photon->layer).z0;
+    dl_b = FastDiv((Real) (z_bound - photon->z), photon->uz);     // dl_b > 0
 
-    UINT32 hit_boundary = (photon->uz != MCML_FP_ZERO) && (photon->s > dl_b);
+    UINT32 hit_boundary = (photon->uz != (Real) 0) && (photon->s > dl_b);
     if (hit_boundary) {
         // No need to multiply by (mua + mus), as it is later
         // divided by (mua + mus) anyways (in the original version).
@@ -264,7 +340,8 @@ __device__ int HitBoundary(PhotonStructGPU *photon) {
 //////////////////////////////////////////////////////////////////////////////
 //   Move the photon by step size (s) along direction (ux,uy,uz)
 //////////////////////////////////////////////////////////////////////////////
-__device__ void Hop(PhotonStructGPU *photon) {
+template <typename P>
+__device__ void Hop(PhotonStructGPU<P> *photon) {
     photon->x += photon->s * photon->ux;
     photon->y += photon->s * photon->uy;
     photon->z += photon->s * photon->uz;
@@ -275,22 +352,25 @@ __device__ void Hop(PhotonStructGPU *photon) {
 //   If a photon hits a boundary, determine whether the photon is transmitted
 //   into the next layer or reflected back by computing the internal reflectance
 //////////////////////////////////////////////////////////////////////////////
-__device__ void FastReflectTransmit(PhotonStructGPU *photon,
-                                    SimState *d_state_ptr,
-                                    UINT64 *rnd_x, UINT32 *rnd_a) {
+template <typename P, typename RNG>
+__device__ void FastReflectTransmit(PhotonStructGPU<P> *photon,
+                                    SimState *d_state_ptr, RNG *rng,
+                                    ProfileCounters *profile) {
+    typedef typename P::Real Real;
+
     /* Collect all info that depend on the sign of "uz". */
-    GFLOAT cos_crit;
+    Real cos_crit;
     UINT32 new_layer;
-    if (photon->uz > MCML_FP_ZERO) {
-        cos_crit = d_layerspecs[photon->layer].cos_crit1;
+    if (photon->uz > (Real) 0) {
+        cos_crit = GetLayer(photon, photon->layer).cos_crit1;
         new_layer = photon->layer + 1;
     } else {
-        cos_crit = d_layerspecs[photon->layer].cos_crit0;
+        cos_crit = GetLayer(photon, photon->layer).cos_crit0;
         new_layer = photon->layer - 1;
     }
 
     // cosine of the incident angle (0 to 90 deg)
-    GFLOAT ca1 = fabsf(photon->uz);
+    Real ca1 = Abs(photon->uz);
 
     // The default move is to reflect.
     photon->uz = -photon->uz;
@@ -302,70 +382,75 @@ __device__ void FastReflectTransmit(PhotonStructGPU *photon,
         /* Compute the Fresnel reflectance. */
 
         // incident and transmit refractive index
-        GFLOAT ni = d_layerspecs[photon->layer].n;
-        GFLOAT nt = d_layerspecs[new_layer].n;
-        GFLOAT ni_nt = FAST_DIV(ni, nt);   // reused later
+        Real ni = GetLayer(photon, photon->layer).n;
+        Real nt = GetLayer(photon, new_layer).n;
+        Real ni_nt = FastDiv(ni, nt);   // reused later
 
-        GFLOAT sa1 = SQRT(FP_ONE - ca1 * ca1);
-        if (ca1 > COSZERO) sa1 = MCML_FP_ZERO;
-        GFLOAT sa2 = fminf(ni_nt * sa1, FP_ONE);
-        GFLOAT uz1 = SQRT(FP_ONE - sa2 * sa2);    // uz1 = ca2
+        Real sa1 = Sqrt((Real) 1 - ca1 * ca1);
+        if (ca1 > CosZero<Real>()) sa1 = (Real) 0;
+        Real sa2 = Min(ni_nt * sa1, (Real) 1);
+        Real uz1 = Sqrt((Real) 1 - sa2 * sa2);    // uz1 = ca2
 
-        GFLOAT ca1ca2 = ca1 * uz1;
-        GFLOAT sa1sa2 = sa1 * sa2;
-        GFLOAT sa1ca2 = sa1 * uz1;
-        GFLOAT ca1sa2 = ca1 * sa2;
+        Real ca1ca2 = ca1 * uz1;
+        Real sa1sa2 = sa1 * sa2;
+        Real sa1ca2 = sa1 * uz1;
+        Real ca1sa2 = ca1 * sa2;
 
         // normal incidence: [(1-ni_nt)/(1+ni_nt)]^2
         // We ensure that ca1ca2 = 1, sa1sa2 = 0, sa1ca2 = 1, ca1sa2 = ni_nt
-        if (ca1 > COSZERO) {
-            sa1ca2 = FP_ONE;
+        if (ca1 > CosZero<Real>()) {
+            sa1ca2 = (Real) 1;
             ca1sa2 = ni_nt;
         }
 
-        GFLOAT cam = ca1ca2 + sa1sa2; /* c- = cc + ss. */
-        GFLOAT sap = sa1ca2 + ca1sa2; /* s+ = sc + cs. */
-        GFLOAT sam = sa1ca2 - ca1sa2; /* s- = sc - cs. */
+        Real cam = ca1ca2 + sa1sa2; /* c- = cc + ss. */
+        Real sap = sa1ca2 + ca1sa2; /* s+ = sc + cs. */
+        Real sam = sa1ca2 - ca1sa2; /* s- = sc - cs. */
 
-        GFLOAT rFresnel = FAST_DIV(sam, sap * cam);
+        Real rFresnel = FastDiv(sam, sap * cam);
         rFresnel *= rFresnel;
         rFresnel *= (ca1ca2 * ca1ca2 + sa1sa2 * sa1sa2);
 
         // In this case, we do not care if "uz1" is exactly 0.
-        if (ca1 < COSNINETYDEG || sa2 == FP_ONE) rFresnel = FP_ONE;
+        if (ca1 < (Real) COSNINETYDEG || sa2 == (Real) 1) rFresnel = (Real) 1;
 
-        GFLOAT rand = rand_MWC_co(rnd_x, rnd_a);
+        Real rand = rand_co<Real>(rng);
 
         if (rFresnel < rand) {
             // The move is to transmit.
+            profile->Count(PROFILE_TRANSMISSIONS);
             photon->layer = new_layer;
 
             // Let's do these even if the photon is dead.
             photon->ux *= ni_nt;
             photon->uy *= ni_nt;
-            photon->uz = -copysignf(uz1, photon->uz);
+            photon->uz = -CopySign(uz1, photon->uz);
 
-            if (photon->layer == 0 || photon->layer > d_simparam.num_layers) {
+            const SimParamGPU &param = d_simparam[photon->run];
+            if (photon->layer == 0 || photon->layer > param.num_layers) {
                 // transmitted
-                GFLOAT uz2 = photon->uz;
-                UINT64 *ra_arr = d_state_ptr->Tt_ra;
+                Real uz2 = photon->uz;
+                UINT64 *ra_arr = d_state_ptr->Tt_ra + param.ra_ofst;
                 if (photon->layer == 0) {
                     // diffuse reflectance
                     uz2 = -uz2;
-                    ra_arr = d_state_ptr->Rd_ra;
+                    ra_arr = d_state_ptr->Rd_ra + param.ra_ofst;
                 }
 
-                UINT32 ia = acosf(uz2) * FP_TWO * RPI * d_simparam.na;
-                UINT32 ir = FAST_DIV(SQRT(photon->x * photon->x + photon->y * photon->y), d_simparam.dr);
-                if (ir >= d_simparam.nr) ir = d_simparam.nr - 1;
+                UINT32 ia = ACos(uz2) * (Real) FP_TWO * (Real) RPI * param.na;
+                UINT32 ir = FastDiv(Sqrt((Real) (photon->x * photon->x + photon->y * photon->y)),
+                                    (Real) param.dr);
+                if (ir >= param.nr) ir = param.nr - 1;
 
-                AtomicAddULL_Global(&ra_arr[ia * d_simparam.nr + ir],
+                AtomicAddULL_Global(&ra_arr[ia * param.nr + ir],
                                     (UINT32) (photon->w * WEIGHT_SCALE));
 
                 // Kill the photon.
-                photon->w = MCML_FP_ZERO;
+                photon->w = 0;
             }
         }
+    } else {
+        profile->Count(PROFILE_TIR);
     }
 }
 
@@ -374,14 +459,16 @@ __device__ void FastReflectTransmit(PhotonStructGPU *photon,
 //	 sampling the polar deflection angle theta and the
 // 	 azimuthal angle psi.
 //////////////////////////////////////////////////////////////////////////////
-__device__ void Spin(GFLOAT g, PhotonStructGPU *photon,
-                     UINT64 *rnd_x, UINT32 *rnd_a) {
-    GFLOAT cost, sint; // cosine and sine of the polar deflection angle theta
-    GFLOAT cosp, sinp; // cosine and sine of the azimuthal angle psi
-    GFLOAT psi;
-    GFLOAT temp;
-    GFLOAT last_ux, last_uy, last_uz;
-    GFLOAT rand;
+template <typename P, typename RNG>
+__device__ void Spin(typename P::Real g, PhotonStructGPU<P> *photon, RNG *rng) {
+    typedef typename P::Real Real;
+
+    Real cost, sint; // cosine and sine of the polar deflection angle theta
+    Real cosp, sinp; // cosine and sine of the azimuthal angle psi
+    Real psi;
+    Real temp;
+    Real last_ux, last_uy, last_uz;
+    Real rand;
 
     /***********************************************************
     *	>>>>>>> SpinTheta
@@ -396,56 +483,56 @@ __device__ void Spin(GFLOAT g, PhotonStructGPU *photon,
     *	Returns the cosine of the polar deflection angle theta.
     ****/
 
-    rand = rand_MWC_oc(rnd_x, rnd_a);
+    rand = rand_oc<Real>(rng);
 
-    cost = FP_TWO * rand - FP_ONE;
+    cost = (Real) FP_TWO * rand - (Real) 1;
 
-    if (g != MCML_FP_ZERO) {
-        temp = FAST_DIV((FP_ONE - g * g), FP_ONE + g * cost);
-        cost = FAST_DIV(FP_ONE + g * g - temp * temp, FP_TWO * g);
+    if (g != (Real) 0) {
+        temp = FastDiv(((Real) 1 - g * g), (Real) 1 + g * cost);
+        cost = FastDiv((Real) 1 + g * g - temp * temp, (Real) FP_TWO * g);
         //cost = fmaxf(cost, -FP_ONE); //these are just here because of the bad PRNG in MCML
         //cost = fminf(cost, FP_ONE);
     }
-    sint = SQRT(FP_ONE - cost * cost);
+    sint = Sqrt((Real) 1 - cost * cost);
 
     /* spin psi 0-2pi. */
-    rand = rand_MWC_co(rnd_x, rnd_a);
+    rand = rand_co<Real>(rng);
 
-    psi = FP_TWO * PI_const * rand;
-    SINCOS(psi, &sinp, &cosp);
+    psi = (Real) FP_TWO * (Real) PI_const * rand;
+    SinCos(psi, &sinp, &cosp);
 
-    GFLOAT stcp = sint * cosp;
-    GFLOAT stsp = sint * sinp;
+    Real stcp = sint * cosp;
+    Real stsp = sint * sinp;
 
     last_ux = photon->ux;
     last_uy = photon->uy;
     last_uz = photon->uz;
 
-    if (fabsf(last_uz) > COSZERO)
+    if (Abs(last_uz) > CosZero<Real>())
         // Normal incident.
     {
         photon->ux = stcp;
         photon->uy = stsp;
-        photon->uz = copysignf(cost, last_uz * cost);
+        photon->uz = CopySign(cost, last_uz * cost);
     } else
         // Regular incident.
     {
-        temp = RSQRT(FP_ONE - last_uz * last_uz);
+        temp = RSqrt((Real) 1 - last_uz * last_uz);
         photon->ux = (stcp * last_ux * last_uz - stsp * last_uy) * temp
                      + last_ux * cost;
         photon->uy = (stcp * last_uy * last_uz + stsp * last_ux) * temp
                      + last_uy * cost;
-        photon->uz = FAST_DIV(-stcp, temp) + last_uz * cost;
+        photon->uz = FastDiv(-stcp, temp) + last_uz * cost;
     }
 
     // Normalize unit vector to ensure its magnitude is 1 (unity)
     // only required in 32-bit floating point version
-#ifdef SINGLE_PRECISION
-    temp = RSQRT(photon->ux * photon->ux + photon->uy * photon->uy + photon->uz * photon->uz);
-    photon->ux = photon->ux * temp;
-    photon->uy = photon->uy * temp;
-    photon->uz = photon->uz * temp;
-#endif
+    if (sizeof(Real) == sizeof(float)) {
+        temp = RSqrt(photon->ux * photon->ux + photon->uy * photon->uy + photon->uz * photon->uz);
+        photon->ux = photon->ux * temp;
+        photon->uy = photon->uy * temp;
+        photon->uz = photon->uz * temp;
+    }
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -454,23 +541,31 @@ __device__ void Spin(GFLOAT g, PhotonStructGPU *photon,
 extern __shared__ UINT32 MCMLKernel_smem[];
 
 //////////////////////////////////////////////////////////////////////////////
-//   Main Kernel for MCML (Calls the above inline device functions)
+//   Main Kernel for MCML (Calls the above inline device functions), with
+//   the random number generator <RNG> (see gpumcml_rng.h) and the precision
+//   policy <P> (see gpumcml_precision.h). Each thread performs <n_steps>
+//   steps (see RunKernels).
 //////////////////////////////////////////////////////////////////////////////
 
-template<int ignoreAdetection>
-__global__ void MCMLKernel(SimState d_state, GPUThreadStates tstates) {
+template<int ignoreAdetection, typename RNG, typename P>
+__global__ void MCMLKernel(SimState d_state, GPUThreadStates tstates, UINT32 n_steps) {
+    typedef typename P::Real Real;
+
     // photon structure stored in registers
-    PhotonStructGPU photon;
+    PhotonStructGPU<P> photon;
 
-    // random number seeds
-    UINT64 rnd_x;
-    UINT32 rnd_a;
+    // random number generator of the photon
+    RNG rng;
 
     // Flag to indicate if this thread is active
     UINT32 is_active;
 
     // Restore the thread state from global memory.
-    RestoreThreadState(&d_state, &tstates, &photon, &rnd_x, &rnd_a, &is_active);
+    RestoreThreadState(&d_state, &tstates, &photon, &rng, &is_active);
+
+    // event counts of the run of the photon (MCML_PROFILE builds)
+    ProfileCounters profile;
+    profile.Clear();
 
     //////////////////////////////////////////////////////////////////////////
 
@@ -521,15 +616,22 @@ __global__ void MCMLKernel(SimState d_state, GPUThreadStates tstates) {
 
     // Get the copy of A_rz (in the global memory) this thread writes to.
     UINT64 *g_A_rz = d_state.A_rz
-                     + (blockIdx.x % N_A_RZ_COPIES) * (d_simparam.nz * d_simparam.nr);
+                     + (blockIdx.x % N_A_RZ_COPIES) * d_batchparam.A_rz_size;
+
+#ifdef CACHE_A_RZ_IN_SMEM
+    // The cached region belongs to the only run of the batch.
+    const int use_A_rz_shared = (d_batchparam.n_runs == 1);
+#endif
 
     //////////////////////////////////////////////////////////////////////////
 
-    for (int iIndex = 0; iIndex < NUM_STEPS; ++iIndex) {
+    for (UINT32 iIndex = 0; iIndex < n_steps; ++iIndex) {
         // Only process photon if the thread is active.
         if (is_active) {
+            profile.Count(PROFILE_STEPS);
+
             //>>>>>>>>> StepSizeInTissue() in MCML
-            ComputeStepSize(&photon, &rnd_x, &rnd_a);
+            ComputeStepSize(&photon, &rng);
 
             //>>>>>>>>> HitBoundary() in MCML
             photon.hit = HitBoundary(&photon);
@@ -537,36 +639,40 @@ __global__ void MCMLKernel(SimState d_state, GPUThreadStates tstates) {
             Hop(&photon);
 
             if (photon.hit) {
-                FastReflectTransmit(&photon, &d_state, &rnd_x, &rnd_a);
+                profile.Count(PROFILE_BOUNDARY_HITS);
+                FastReflectTransmit(&photon, &d_state, &rng, &profile);
             } else {
+                profile.Count(PROFILE_SCATTERS);
+
                 //>>>>>>>>> Drop() in MCML
-                GFLOAT dwa = photon.w * d_layerspecs[photon.layer].mua_muas;
+                Real dwa = photon.w * GetLayer(&photon, photon.layer).mua_muas;
                 photon.w -= dwa;
 
                 if (ignoreAdetection == 0) {
+                    const SimParamGPU &param = d_simparam[photon.run];
                     // automatic __float2uint_rz
-                    UINT32 iz = FAST_DIV(photon.z, d_simparam.dz);
+                    UINT32 iz = FastDiv((Real) photon.z, (Real) param.dz);
                     // automatic __float2uint_rz
-                    UINT32 ir = FAST_DIV(
-                            SQRT(photon.x * photon.x + photon.y * photon.y),
-                            d_simparam.dr);
+                    UINT32 ir = FastDiv(
+                            Sqrt((Real) (photon.x * photon.x + photon.y * photon.y)),
+                            (Real) param.dr);
 
                     // Only record if photon is not at the edge!!
                     // This will be ignored anyways.
-                    if (iz < d_simparam.nz && ir < d_simparam.nr) {
-                        UINT32 addr = ir * d_simparam.nz + iz;
+                    if (iz < param.nz && ir < param.nr) {
+                        UINT32 addr = param.A_rz_ofst + ir * param.nz + iz;
 
                         if (addr != last_addr) {
 #ifdef CACHE_A_RZ_IN_SMEM
                             // Commit the weight drop to memory.
-                            if (last_ir < MAX_IR && last_iz < MAX_IZ) {
+                            if (use_A_rz_shared && last_ir < MAX_IR && last_iz < MAX_IZ) {
                                 // Write it to the shared memory.
                                 last_addr = last_ir * MAX_IZ + last_iz;
 #ifdef USE_32B_ELEM_FOR_ARZ_SMEM
                                 // Use 32-bit atomicAdd.
                                 UINT32 oldval = atomicAdd(&A_rz_shared[last_addr], last_w);
                                 // Detect overflow.
-                                if (oldval >= d_simparam.A_rz_overflow)
+                                if (oldval >= d_simparam[0].A_rz_overflow)
                                 {
                                   A_rz_overflow[last_addr % blockDim.x] = 1;
                                 }
@@ -574,11 +680,13 @@ __global__ void MCMLKernel(SimState d_state, GPUThreadStates tstates) {
                                 // 64-bit atomic instruction
                                 AtomicAddULL_Shared(&A_rz_shared[last_addr], last_w);
 #endif
+                                profile.Count(PROFILE_TALLY_SMEM);
                             } else
 #endif
                             {
                                 // Write it to the global memory directly.
                                 AtomicAddULL_Global(&g_A_rz[last_addr], last_w);
+                                profile.Count(PROFILE_TALLY_GMEM);
                             }
 
                             last_ir = ir;
@@ -595,7 +703,7 @@ __global__ void MCMLKernel(SimState d_state, GPUThreadStates tstates) {
                 }
                 //>>>>>>>>> end of Drop()
 
-                Spin(d_layerspecs[photon.layer].g, &photon, &rnd_x, &rnd_a);
+                Spin(GetLayer(&photon, photon.layer).g, &photon, &rng);
             }
 
             /***********************************************************
@@ -604,17 +712,32 @@ __global__ void MCMLKernel(SimState d_state, GPUThreadStates tstates) {
             *  to survive a roulette.
             ****/
             if (photon.w < WEIGHT) {
-                GFLOAT rand = rand_MWC_co(&rnd_x, &rnd_a);
+                Real rand = rand_co<Real>(&rng);
 
                 // This photon survives the roulette.
-                if (photon.w != MCML_FP_ZERO && rand < CHANCE)
-                    photon.w *= (FP_ONE / CHANCE);
+                if (photon.w != (Real) 0 && rand < (Real) CHANCE) {
+                    photon.w *= ((Real) 1 / (Real) CHANCE);
+                    profile.Count(PROFILE_ROULETTE_SURVIVALS);
+                } else {
                     // This photon is terminated.
-                else if (atomicSub(d_state.n_photons_left, 1) > gridDim.x * blockDim.x)
-                    LaunchPhoton(&photon); // Launch a new photon.
-                    // No need to process any more photons.
-                else
-                    is_active = 0;
+                    if (photon.w != (Real) 0) profile.Count(PROFILE_ROULETTE_KILLS);
+
+                    UINT32 n_left = atomicSub(d_state.n_photons_left, 1);
+                    if (n_left > gridDim.x * blockDim.x) {
+                        // Launch a new photon: the first <gridDim.x * blockDim.x>
+                        // photons were launched by InitThreadState.
+                        UINT32 last_run = photon.run;
+                        LaunchPhoton(&photon, d_batchparam.n_photons - n_left + gridDim.x * blockDim.x,
+                                     &d_state, &rng);
+
+                        // The counts so far belong to the run of the last photon.
+                        if (photon.run != last_run) FlushProfile(&profile, &d_state, last_run);
+                        profile.Count(PROFILE_LAUNCHES);
+                    } else {
+                        // No need to process any more photons.
+                        is_active = 0;
+                    }
+                }
             }
         }
 
@@ -628,6 +751,8 @@ __global__ void MCMLKernel(SimState d_state, GPUThreadStates tstates) {
 
           if (A_rz_overflow[threadIdx.x])
           {
+            profile.Count(PROFILE_OVERFLOW_FLUSHES);
+
             // Flush all elements I am responsible for to the global memory.
             for (int i = threadIdx.x; i < MAX_IR*MAX_IZ; i += blockDim.x)
             {
@@ -654,13 +779,14 @@ __global__ void MCMLKernel(SimState d_state, GPUThreadStates tstates) {
             // Commit to the global memory directly.
             // TODO: could we commit it to the shared memory, or does it matter?
             AtomicAddULL_Global(&g_A_rz[last_addr], last_w);
+            profile.Count(PROFILE_TALLY_GMEM);
         }
     }
 
     //////////////////////////////////////////////////////////////////////////
 
 #ifdef CACHE_A_RZ_IN_SMEM
-    if (ignoreAdetection == 0) {
+    if (ignoreAdetection == 0 && use_A_rz_shared) {
         // Flush A_rz_shared to the global memory.
         for (int i = threadIdx.x; i < MAX_IR * MAX_IZ; i += blockDim.x) {
             Flush_Arz(g_A_rz, A_rz_shared, i);
@@ -671,7 +797,9 @@ __global__ void MCMLKernel(SimState d_state, GPUThreadStates tstates) {
     //////////////////////////////////////////////////////////////////////////
 
     // Save the thread state to the global memory.
-    SaveThreadState(&d_state, &tstates, &photon, rnd_x, is_active);
+    SaveThreadState(&d_state, &tstates, &photon, &rng, is_active);
+
+    FlushProfile(&profile, &d_state, photon.run);
 }
 
 //////////////////////////////////////////////////////////////////////////////
@@ -680,7 +808,7 @@ __global__ void MCMLKernel(SimState d_state, GPUThreadStates tstates) {
 __global__ void sum_A_rz(UINT64 *g_A_rz) {
     UINT64 sum;
 
-    int n_elems = d_simparam.nz * d_simparam.nr;
+    int n_elems = d_batchparam.A_rz_size;
     int base_ofst, ofst;
 
     for (base_ofst = blockIdx.x * blockDim.x + threadIdx.x;
@@ -24,6 +24,8 @@
 #define _GPUMCML_KERNEL_H_
 
 #include "gpumcml.h"
+#include "gpumcml_precision.h"
+#include "gpumcml_profile.h"
 
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
@@ -116,9 +118,14 @@ typedef UINT64 ARZ_SMEM_TY;
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
 
-/*  Number of simulation steps performed by each thread in one kernel call
+/*  Number of simulation steps performed by each thread in one kernel call.
+    With --batch_ms, it is the number of the first call of a GPU, and the
+    following calls adapt it (between MIN_STEPS and MAX_STEPS) so that a
+    call takes about --batch_ms milliseconds.
  */
-#define NUM_STEPS 50000 // Use 5000 for faster response time
+#define NUM_STEPS 50000
+#define MIN_STEPS 1000
+#define MAX_STEPS 5000000
 
 /*  Multi-GPU support:
     Sets the maximum number of GPUs to 6
@@ -142,6 +149,14 @@ typedef struct __align__(16)
 
     UINT32 num_layers;    // number of layers.
     UINT32 A_rz_overflow; // overflow threshold for A_rz_shared
+
+    // where this run lives in a packed batch (see PackedBatch)
+    UINT32 layer_ofst;    // first entry in d_layerspecs
+    UINT32 A_rz_ofst;     // offset of its slice of A_rz
+    UINT32 ra_ofst;       // offset of its slices of Rd_ra and Tt_ra
+    UINT32 photon_end;    // photons of the batch before the next run
+
+    UINT64 rng_key;       // key of its random number stream
 }
 SimParamGPU;
 
@@ -160,11 +175,26 @@ typedef struct __align__(16)
 }
 LayerStructGPU;
 
-// The max number of layers supported (MAX_LAYERS including 2 ambient layers)
-#define MAX_LAYERS 100
+// Photons of the packed batch simulated by one GPU
+typedef struct __align__(16)
+{
+    UINT32 n_runs;       // number of runs in the batch
+    UINT32 photon_begin; // first photon of this GPU
+    UINT32 n_photons;    // number of photons of this GPU
+    UINT32 A_rz_size;    // size of one copy of A_rz (all runs)
+    UINT64 photon_ofst;  // see HostThreadState
+}
+BatchParamGPU;
 
-__constant__ SimParamGPU d_simparam;
-__constant__ LayerStructGPU d_layerspecs[MAX_LAYERS];
+// One entry per run of the batch; the layers of all runs are concatenated.
+__constant__ BatchParamGPU d_batchparam;
+__constant__ SimParamGPU d_simparam[MAX_PACKED_RUNS];
+__constant__ LayerStructGPU d_layerspecs[MAX_PACKED_LAYERS];
+
+// ptxas rejects more than 64KB of constant data.
+static_assert(sizeof(BatchParamGPU) + MAX_PACKED_RUNS * sizeof(SimParamGPU) +
+              MAX_PACKED_LAYERS * sizeof(LayerStructGPU) <= 65536,
+              "the tables of a packed batch exceed the constant memory");
 
 //////////////////////////////////////////////////////////////////////////////
 //////////////////////////////////////////////////////////////////////////////
@@ -178,46 +208,70 @@ __constant__ LayerStructGPU d_layerspecs[MAX_LAYERS];
 typedef struct
 {
     // cartesian coordinates of the photon [cm]
-    GFLOAT *photon_x;
-    GFLOAT *photon_y;
-    GFLOAT *photon_z;
+    // (in double, so that the photons of every precision policy fit)
+    double *photon_x;
+    double *photon_y;
+    double *photon_z;
 
     // directional cosines of the photon
-    GFLOAT *photon_ux;
-    GFLOAT *photon_uy;
-    GFLOAT *photon_uz;
+    double *photon_ux;
+    double *photon_uy;
+    double *photon_uz;
 
-    GFLOAT *photon_w; // photon weight
+    double *photon_w; // photon weight
 
     // index to layer where the photon resides
     UINT32 *photon_layer;
 
+    // index to the run (of the batch) the photon belongs to
+    UINT32 *photon_run;
+
     UINT32 *is_active; // is this thread active?
 } GPUThreadStates;
 
+// Device buffers of one GPU, allocated once and reused by every batch
+// (BufferPool::device)
 typedef struct
+{
+    // n_photons_left, generator states and multipliers, and N_A_RZ_COPIES
+    // copies of A_rz
+    SimState dstate;
+    GPUThreadStates tstates;
+
+    // number of elements allocated for one copy of A_rz, for each of Rd_ra
+    // and Tt_ra, and for each thread state array
+    UINT32 rz_size;
+    UINT32 ra_size;
+    UINT32 n_threads;
+} GPUBufferPool;
+
+// Photon of the precision policy <P> (see gpumcml_precision.h)
+template <typename P> struct PhotonStructGPU
 {
     // cartesian coordinates of the photon [cm]
-    GFLOAT x;
-    GFLOAT y;
-    GFLOAT z;
+    typename P::Pos x;
+    typename P::Pos y;
+    typename P::Pos z;
 
     // directional cosines of the photon
-    GFLOAT ux;
-    GFLOAT uy;
-    GFLOAT uz;
+    typename P::Real ux;
+    typename P::Real uy;
+    typename P::Real uz;
 
-    GFLOAT w; // photon weight
+    typename P::Real w; // photon weight
 
-    GFLOAT s; // step size [cm]
+    typename P::Real s; // step size [cm]
     // GFLOAT sleft;        // leftover step size [cm]
     // removed as an optimization to reduce code divergence
 
     // index to layer where the photon resides
     UINT32 layer;
 
+    // index to the run (of the batch) the photon belongs to
+    UINT32 run;
+
     // flag to indicate if photon hits a boundary
     UINT32 hit;
-} PhotonStructGPU;
+};
 
 #endif // _GPUMCML_KERNEL_H_
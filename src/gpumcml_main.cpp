@@ -0,0 +1,645 @@
+/*****************************************************************************
+ *
+ *   Main control of MCMLGPU
+ *   =========================================================================
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include "gpumcml.h"
+#include "gpumcml_cache.h"
+#include "gpumcml_progress.h"
+#include "gpumcml_sched.h"
+#include "gpumcml_sweep.h"
+#include "gpumcml_trace.h"
+
+// Runs of a sweep are generated into a ring of slots of MAX_PACKED_RUNS runs,
+// with one slot more than batches in flight: a slot is only refilled once
+// all batches of its runs are registered.
+#define SWEEP_SLOTS (MAX_BATCHES_IN_FLIGHT + 1)
+
+//////////////////////////////////////////////////////////////////////////////
+//   Is <id> in the output file already? Each of its rows skips one run.
+//////////////////////////////////////////////////////////////////////////////
+static bool TakeCompletedRun(std::map<std::string, UINT32> *completed, const char *id)
+{
+    auto it = completed->find(id);
+    if (it == completed->end() || it->second == 0)
+        return false;
+    --it->second;
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Header line of the output file (without the newline): the columns of
+//   the rows written with the current options
+//////////////////////////////////////////////////////////////////////////////
+static std::string OutputHeader(UINT32 n_jacobian_layers)
+{
+    std::string header = "ID,Specular,Diffuse,Absorbed,Transmittance,Penetration";
+    if (g_commandLineArguments.std_errors)
+        header += ",Diffuse_SE,Absorbed_SE,Transmittance_SE,Penetration_SE";
+    if (g_commandLineArguments.profile)
+    {
+        // in the order of the PROFILE_* events
+        header += ",Launches,Steps,Boundary_hits,TIR,Transmissions,Scatters,Roulette_survivals,Roulette_kills,"
+                  "Tally_smem,Tally_gmem,Overflow_flushes";
+    }
+    for (UINT32 l = 1; l <= n_jacobian_layers; ++l)
+        header += ",dRd_dmua_" + std::to_string(l) + ",dRd_dmus_" + std::to_string(l);
+    return header;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Move the runs with keep[k] set to the front of <simulations>, in their
+//   order, followed by the others. Return the number of runs kept.
+//////////////////////////////////////////////////////////////////////////////
+static int MoveToFront(SimulationStruct *simulations, int n_simulations, const std::vector<bool> &keep)
+{
+    std::vector<SimulationStruct> order;
+    order.reserve(n_simulations);
+    for (int k = 0; k < n_simulations; ++k)
+    {
+        if (keep[k])
+            order.push_back(simulations[k]);
+    }
+    int n_kept = (int)order.size();
+    for (int k = 0; k < n_simulations; ++k)
+    {
+        if (!keep[k])
+            order.push_back(simulations[k]);
+    }
+    std::copy(order.begin(), order.end(), simulations);
+    return n_kept;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Random number generator selected with --rng
+//////////////////////////////////////////////////////////////////////////////
+static int GetRNGKind()
+{
+    const std::string &rng = g_commandLineArguments.rng;
+    if (rng == "philox")
+        return RNG_PHILOX;
+    if (rng == "xoroshiro")
+        return RNG_XOROSHIRO;
+    return RNG_MWC;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Precision policy of the photon loop selected with --precision
+//////////////////////////////////////////////////////////////////////////////
+static int GetPrecisionKind()
+{
+    const std::string &precision = g_commandLineArguments.precision;
+    if (precision == "mixed")
+        return PRECISION_MIXED;
+    if (precision == "double")
+        return PRECISION_DOUBLE;
+    return PRECISION_SINGLE;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Progress reports selected with --progress
+//////////////////////////////////////////////////////////////////////////////
+static int GetProgressMode()
+{
+    const std::string &progress = g_commandLineArguments.progress;
+    if (progress == "json")
+        return PROGRESS_JSON;
+    if (progress == "none")
+        return PROGRESS_NONE;
+    return PROGRESS_BAR;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Next batch of runs, starting with run <first>
+//////////////////////////////////////////////////////////////////////////////
+static UINT32 BuildBatch(PackedBatch *batch, SimulationStruct *sims, UINT32 n_sims, UINT32 first)
+{
+    if (g_commandLineArguments.white_mc)
+        BuildWhiteBatch(batch, sims, n_sims, first);
+    else
+        BuildPackedBatch(batch, sims, n_sims, first, g_commandLineArguments.pack_photons);
+    batch->jacobian = g_commandLineArguments.jacobian;
+    batch->rng = GetRNGKind();
+    batch->precision = GetPrecisionKind();
+    SeedBatch(batch, g_commandLineArguments.seed);
+    return batch->n_runs;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Perform MCML simulation for one run out of N runs (in the input file)
+//////////////////////////////////////////////////////////////////////////////
+int main(int argc, char *argv[])
+{
+    int result = interpret_arg(argc, argv);
+    if (result)
+    {
+        printf("Error parsing arguments");
+        return 1;
+    }
+    bool use_trace = !g_commandLineArguments.trace_file.empty();
+    if (use_trace)
+    {
+        TraceEnable();
+        TraceThreadName("main");
+    }
+    const char *filename = g_commandLineArguments.input_file.c_str();
+    UINT64 seed = g_commandLineArguments.seed;
+    bool ignoreAdetection = g_commandLineArguments.ignore_absorption_detection;
+    const char *mcoFileName = g_commandLineArguments.output_file.c_str();
+    const std::string &backend = g_commandLineArguments.backend;
+    bool use_gpu = backend == "gpu" || backend == "mixed";
+    bool use_cpu = backend != "gpu";
+    bool use_simd = backend == "simd" || backend == "mixed";
+    UINT32 n_gpus = 0, n_cpu_threads = 0;
+    FILE *pFile_outp;
+
+    SimulationStruct *simulations;
+    int n_simulations;
+    int n_todo; // simulations left to run (the first n_todo ones)
+    int i;
+
+    // runs of a sweep (if any), generated into <simulations>
+    SweepDesign sweep;
+    bool use_sweep = !g_commandLineArguments.sweep_file.empty();
+
+    if (use_gpu)
+    {
+#ifdef MCML_WITH_CUDA
+        // Determine the number of GPUs available.
+        int dev_count = GetGPUCount();
+        if (dev_count <= 0)
+        {
+            fprintf(stderr, "No GPU available. Use --backend cpu to run on the CPU. Quit.\n");
+            return 1;
+        }
+
+        // Make sure we do not use more than what we have.
+        n_gpus = g_commandLineArguments.number_of_gpus;
+        if (n_gpus > (UINT32)dev_count)
+        {
+            printf("The number of GPUs specified (%u) is more than "
+                   "what is available (%d)!\n",
+                   n_gpus, dev_count);
+            n_gpus = (UINT32)dev_count;
+        }
+#else
+        fprintf(stderr, "This build of MCML has no GPU backend. Use --backend cpu. Quit.\n");
+        return 1;
+#endif
+    }
+
+    if (g_commandLineArguments.white_mc && (use_gpu || use_simd))
+    {
+        fprintf(stderr, "White Monte Carlo (--white) is only available with --backend cpu. Quit.\n");
+        return 1;
+    }
+    if (g_commandLineArguments.jacobian && (use_gpu || use_simd || g_commandLineArguments.white_mc))
+    {
+        fprintf(stderr, "The Jacobian (--jacobian) is only available with --backend cpu, without --white. Quit.\n");
+        return 1;
+    }
+    if (GetRNGKind() != RNG_MWC && use_simd)
+    {
+        fprintf(stderr, "The SIMD engine (--backend simd or mixed) only has the MWC generator (--rng mwc). Quit.\n");
+        return 1;
+    }
+    if (GetPrecisionKind() != PRECISION_SINGLE && use_simd)
+    {
+        fprintf(stderr, "The SIMD engine (--backend simd or mixed) is single precision only (--precision single). "
+                        "Quit.\n");
+        return 1;
+    }
+
+#ifndef MCML_GPU_REWRITE
+    if (use_gpu &&
+        (GetRNGKind() != RNG_MWC || GetPrecisionKind() != PRECISION_SINGLE || g_commandLineArguments.profile))
+    {
+        fprintf(stderr, "The GPU engine of this build (the baseline kernel) only has the MWC generator (--rng mwc) in "
+                        "single precision (--precision single), without --profile. Build it with "
+                        "-DMCML_GPU_REWRITE=ON for the rewritten kernel. Quit.\n");
+        return 1;
+    }
+#endif
+
+#ifndef MCML_PROFILE
+    if (g_commandLineArguments.profile)
+    {
+        fprintf(stderr, "This build of MCML does not count events (--profile). Build it with -DMCML_PROFILE=ON. "
+                        "Quit.\n");
+        return 1;
+    }
+#endif
+
+    if (use_cpu)
+    {
+        // One worker per host thread. In mixed mode, the host threads that
+        // drive the GPUs are not available for the CPU engine.
+        n_cpu_threads = g_commandLineArguments.number_of_threads;
+        if (n_cpu_threads == 0)
+        {
+            n_cpu_threads = std::thread::hardware_concurrency();
+            n_cpu_threads = (n_cpu_threads > n_gpus) ? n_cpu_threads - n_gpus : 0;
+        }
+        if (n_cpu_threads == 0 && n_gpus == 0)
+            n_cpu_threads = 1;
+    }
+    UINT32 n_workers = n_gpus + n_cpu_threads;
+
+    // Targets for the standard errors of the results, if any
+    AdaptiveTargets targets;
+    bool use_targets = false;
+    for (int q = 0; q < N_STATS; ++q)
+    {
+        targets.rse[q] = g_commandLineArguments.target_rse[q];
+        use_targets = use_targets || targets.rse[q] > 0;
+    }
+    targets.max_photons = g_commandLineArguments.max_photons;
+
+    // Output the execution configuration.
+    printf("\n====================================\n");
+    printf("EXECUTION MODE:\n");
+    printf("  ignore A-detection:      %s\n", ignoreAdetection ? "YES" : "NO");
+    printf("  seed:                    %llu\n", seed);
+    if (use_targets)
+    {
+        printf("  target rel. std. error:  Rd %g, A %g, T %g (0: none)\n", targets.rse[STAT_RD], targets.rse[STAT_A],
+               targets.rse[STAT_T]);
+    }
+    if (g_commandLineArguments.jacobian)
+        printf("  Jacobian of Rd:          YES\n");
+    if (g_commandLineArguments.profile)
+        printf("  event counts:            YES\n");
+    if (g_commandLineArguments.white_mc)
+        printf("  white Monte Carlo:       YES\n");
+    else if (g_commandLineArguments.pack_photons > 0)
+        printf("  photons per batch:       %llu\n", g_commandLineArguments.pack_photons);
+    if (n_gpus > 0)
+        printf("  # of GPUs:               %u\n", n_gpus);
+    if (n_cpu_threads > 0 && use_simd)
+        printf("  # of CPU threads:        %u (%u photons each)\n", n_cpu_threads, GetSIMDWidth());
+    else if (n_cpu_threads > 0)
+        printf("  # of CPU threads:        %u\n", n_cpu_threads);
+    printf("====================================\n\n");
+
+    // Read the simulation inputs, or allocate the slots for the runs of the
+    // sweep (all with the same number of layers).
+    std::vector<UINT32> n_layers;
+    if (use_sweep)
+    {
+        if (sweep.Load(g_commandLineArguments.sweep_file.c_str()))
+            return 1;
+        n_simulations = (int)sweep.GetRunCount();
+        n_layers.assign(SWEEP_SLOTS * MAX_PACKED_RUNS, sweep.GetLayerCount());
+        simulations = AllocSimulationStruct(SWEEP_SLOTS * MAX_PACKED_RUNS, n_layers.data());
+        if (simulations == NULL)
+        {
+            fprintf(stderr, "Error allocating the runs of the sweep\n");
+            return 1;
+        }
+        printf("Sweep of %d runs of %u layers\n\n", n_simulations, sweep.GetLayerCount());
+    }
+    else
+    {
+        n_simulations = read_simulation_data(filename, &simulations, ignoreAdetection);
+        if (n_simulations == 0)
+        {
+            printf("Something wrong with read_simulation_data!\n");
+            return 1;
+        }
+        printf("Read %d simulations\n\n", n_simulations);
+    }
+
+    // Jacobian columns for the largest number of layers of any run
+    UINT32 n_jacobian_layers = 0;
+    if (g_commandLineArguments.jacobian && use_sweep)
+        n_jacobian_layers = sweep.GetLayerCount();
+    for (i = 0; g_commandLineArguments.jacobian && !use_sweep && i < n_simulations; ++i)
+    {
+        if (n_jacobian_layers < simulations[i].n_layers)
+            n_jacobian_layers = simulations[i].n_layers;
+    }
+    std::string header = OutputHeader(n_jacobian_layers);
+
+    // Move the runs that are already in the output file to the end of the
+    // list, so that only the first n_todo ones are simulated. Runs with the
+    // same ID are skipped as many times as they appear in the file. The
+    // runs of a sweep are skipped as they are generated.
+    n_todo = n_simulations;
+    int n_completed = -1;
+    std::map<std::string, UINT32> completed;
+    if (g_commandLineArguments.resume)
+    {
+        n_completed = read_completed_runs(mcoFileName, header, &completed);
+        if (n_completed == -2)
+        {
+            fprintf(stderr,
+                    "Cannot resume %s: its columns differ from the ones of this job (check --std_errors, --profile "
+                    "and --jacobian)\n",
+                    mcoFileName);
+            return 1;
+        }
+        if (n_completed >= 0 && use_sweep)
+        {
+            n_todo = (n_completed < n_simulations) ? n_simulations - n_completed : 0;
+            printf("Resuming: %d runs already in %s\n\n", n_completed, mcoFileName);
+        }
+        else if (n_completed >= 0)
+        {
+            // Take the completed runs in input order, so that of several
+            // runs with the same ID the first ones are skipped.
+            std::vector<bool> left(n_simulations);
+            for (int k = 0; k < n_simulations; ++k)
+                left[k] = !TakeCompletedRun(&completed, simulations[k].outp_filename);
+            n_todo = MoveToFront(simulations, n_simulations, left);
+            printf("Resuming: %d runs already in %s, %d left\n\n", n_completed, mcoFileName, n_todo);
+        }
+    }
+
+    // Runs whose result is in the cache, and duplicates of earlier runs, are
+    // not simulated. The runs of a sweep are looked up as they are generated.
+    // The rows of cached runs are written first, and the rows of duplicates
+    // right after the row of the run they duplicate.
+    ResultCache cache;
+    bool use_cache = !g_commandLineArguments.cache_dir.empty();
+    std::vector<std::pair<std::string, std::string>> cached_rows;
+    if (use_cache)
+    {
+        // Everything besides the run itself that its result depends on
+        char context[STR_LEN];
+        snprintf(context, sizeof(context),
+                 "MCML %s.%s.%s backend=%s seed=%llu rng=%s white=%d jacobian=%d se=%d precision=%s "
+                 "profile=%d rse=%g,%g,%g max_photons=%llu",
+                 PROJECT_VERSION_MAJOR, PROJECT_VERSION_MINOR, PROJECT_VERSION_PATCH, backend.c_str(), seed,
+                 g_commandLineArguments.rng.c_str(), (int)g_commandLineArguments.white_mc,
+                 (int)g_commandLineArguments.jacobian, (int)g_commandLineArguments.std_errors,
+                 g_commandLineArguments.precision.c_str(), (int)g_commandLineArguments.profile, targets.rse[STAT_RD],
+                 targets.rse[STAT_A], targets.rse[STAT_T], (unsigned long long)targets.max_photons);
+        if (cache.Open(g_commandLineArguments.cache_dir.c_str(), context))
+            return 1;
+
+        if (!use_sweep)
+        {
+            // Look up the runs in input order, so that the first of several
+            // duplicates is the one that is simulated, then move the misses to
+            // the front.
+            std::vector<bool> miss(n_todo);
+            std::string values;
+            for (int k = 0; k < n_todo; ++k)
+            {
+                int found = cache.Find(&simulations[k], &values);
+                if (found == CACHE_HIT)
+                    cached_rows.push_back(std::make_pair(std::string(simulations[k].outp_filename), values));
+                miss[k] = found == CACHE_MISS;
+            }
+            n_todo = MoveToFront(simulations, n_todo, miss);
+            printf("Result cache: %llu runs cached, %llu duplicates, %d to simulate\n\n",
+                   (unsigned long long)cache.GetHitCount(), (unsigned long long)cache.GetDuplicateCount(), n_todo);
+        }
+    }
+
+    // Allocate one host thread state for each worker: the GPUs first, then
+    // the CPU threads.
+    std::vector<HostThreadState *> hstates(n_workers);
+    std::vector<RunEngineFn> engines(n_workers);
+    for (UINT32 w = 0; w < n_workers; ++w)
+    {
+        hstates[w] = (HostThreadState *)calloc(1, sizeof(HostThreadState));
+        if (w >= n_gpus)
+        {
+            hstates[w]->dev_id = w - n_gpus;
+            hstates[w]->n_tblks = 1;
+            hstates[w]->n_threads = use_simd ? GetSIMDWidth() : 1;
+            engines[w] = use_simd ? RunSIMDi : RunCPUi;
+        }
+    }
+
+#ifdef MCML_WITH_CUDA
+    if (n_gpus > 0)
+    {
+        if (InitGPUHostThreadStates(hstates.data(), n_gpus) == 0)
+            exit(1);
+        for (UINT32 w = 0; w < n_gpus; ++w)
+            engines[w] = RunGPUi;
+    }
+#endif
+
+    // The engines adapt the length of their batches to this duration. The
+    // GPUs only adapt their steps per launch if --batch_ms is given, until
+    // the adaptive launches are validated on GPUs.
+    for (UINT32 w = 0; w < n_workers; ++w)
+    {
+        double batch_ms = g_commandLineArguments.batch_ms;
+        if (batch_ms < 0)
+            batch_ms = (w < n_gpus) ? 0 : 100;
+        hstates[w]->batch_seconds = batch_ms / 1000.0;
+    }
+
+    // The generators of all threads of all workers are seeded from the
+    // same multipliers (if they use them), photon by photon (see gpumcml_rng.h).
+    const UINT32 *multipliers;
+    UINT32 n_multipliers;
+    {
+        TraceScope scope("init_RNG", "setup");
+        if (init_RNG(&multipliers, &n_multipliers))
+            return 1;
+    }
+
+    static const char *rng_names[] = {"MWC", "Philox4x32-10", "xoroshiro64**"};
+    static const char *precision_names[] = {"single", "mixed", "double"};
+    printf("\nUsing the %s random number generator and %s precision ...\n", rng_names[GetRNGKind()],
+           precision_names[GetPrecisionKind()]);
+
+    for (UINT32 w = 0; w < n_workers; ++w)
+    {
+        SimState *hss = &(hstates[w]->host_sim_state);
+        hss->multipliers = multipliers;
+        hss->n_multipliers = n_multipliers;
+    }
+
+    // Size the buffer pool of every worker for the largest batch, so that the
+    // output buffers are allocated once instead of for every run. All runs
+    // of a sweep have the same size, so its first slot has the largest batch.
+    PackedBatch *batch = (PackedBatch *)malloc(sizeof(PackedBatch));
+    UINT32 max_rz_size = 0, max_ra_size = 0, max_jac_size = 0;
+    UINT64 sized_photons = 0; // photons of the batches sized (the runs of a white batch share them)
+    int n_sized = n_todo;
+    if (use_sweep)
+    {
+        n_sized = (n_simulations < MAX_PACKED_RUNS) ? n_simulations : MAX_PACKED_RUNS;
+        for (i = 0; i < n_sized; ++i)
+            sweep.MakeRun(i, &simulations[i], ignoreAdetection);
+    }
+    for (i = 0; i < n_sized; i += batch->n_runs)
+    {
+        BuildBatch(batch, simulations, n_sized, i);
+        if (max_rz_size < batch->A_rz_ofst[batch->n_runs])
+            max_rz_size = batch->A_rz_ofst[batch->n_runs];
+        if (max_ra_size < batch->ra_ofst[batch->n_runs])
+            max_ra_size = batch->ra_ofst[batch->n_runs];
+        if (max_jac_size < batch->jac_ofst[batch->n_runs])
+            max_jac_size = batch->jac_ofst[batch->n_runs];
+        sized_photons += batch->photon_end[batch->n_runs - 1];
+    }
+    // The runs of a sweep are generated as they are needed, so the photons
+    // of the first ones stand for all.
+    UINT64 total_photons = sized_photons;
+    if (use_sweep && n_sized > 0)
+        total_photons = (UINT64)((double)sized_photons * n_todo / n_sized);
+    for (UINT32 w = 0; w < n_workers; ++w)
+    {
+        if (InitBufferPool(&hstates[w]->pool, max_rz_size, max_ra_size, max_jac_size))
+        {
+            fprintf(stderr, "Error allocating the output buffers\n");
+            return 1;
+        }
+    }
+
+    // write file header (unless resuming a file that has one)
+    if (n_completed < 0)
+    {
+        pFile_outp = fopen(mcoFileName, "w");
+        if (pFile_outp == NULL)
+        {
+            fprintf(stderr, "Error opening file: %s\n", mcoFileName);
+            exit(EXIT_FAILURE);
+        }
+        fprintf(pFile_outp, "%s\n", header.c_str());
+        fclose(pFile_outp);
+    }
+
+    // Rows are appended to the output file as the runs finish.
+    SimulationResults simResults;
+    simResults.setJacobianColumns(n_jacobian_layers);
+    simResults.setStdErrorColumns(g_commandLineArguments.std_errors);
+    simResults.setProfileColumns(g_commandLineArguments.profile);
+    if (use_cache)
+        simResults.setCache(&cache);
+    if (simResults.startWriter(mcoFileName))
+        exit(EXIT_FAILURE);
+    for (const auto &row : cached_rows)
+        simResults.registerRow(row.first.c_str(), row.second);
+    {
+        // perform all the simulations, one batch of consecutive runs at a time
+        BatchScheduler scheduler(hstates.data(), engines.data(), n_workers, g_commandLineArguments.chunk_photons,
+                                 max_rz_size, max_ra_size, max_jac_size, use_targets ? &targets : NULL,
+                                 g_commandLineArguments.std_errors, &simResults);
+        ProgressReporter reporter(&scheduler, total_photons, n_todo, GetProgressMode(),
+                                  g_commandLineArguments.progress_interval);
+        if (use_sweep)
+        {
+            // Generate the runs of the sweep one slot at a time.
+            int n_submitted = 0;
+            UINT64 next = 0;
+            for (int slot = 0; next < sweep.GetRunCount(); slot = (slot + 1) % SWEEP_SLOTS)
+            {
+                SimulationStruct *runs = &simulations[slot * MAX_PACKED_RUNS];
+                int n_runs = 0;
+                TraceScope scope("MakeRun", "sweep");
+                while (n_runs < MAX_PACKED_RUNS && next < sweep.GetRunCount())
+                {
+                    SimulationStruct *run = &runs[n_runs];
+                    sweep.MakeRun(next++, run, ignoreAdetection);
+                    if (TakeCompletedRun(&completed, run->outp_filename))
+                        continue;
+                    if (use_cache)
+                    {
+                        std::string values;
+                        int found = cache.Find(run, &values);
+                        if (found == CACHE_HIT)
+                            simResults.registerRow(run->outp_filename, values);
+                        if (found != CACHE_MISS)
+                            continue;
+                    }
+                    ++n_runs;
+                }
+                scope.Args("\"runs\": %d", n_runs);
+                for (i = 0; i < n_runs; i += batch->n_runs)
+                {
+                    BuildBatch(batch, runs, n_runs, i);
+                    scheduler.Submit(batch, n_submitted);
+                    n_submitted += batch->n_runs;
+                }
+            }
+        }
+        else
+        {
+            for (i = 0; i < n_todo; i += batch->n_runs)
+            {
+                BuildBatch(batch, simulations, n_todo, i);
+
+                // Queue the simulations of the batch
+                scheduler.Submit(batch, i);
+            }
+        }
+        TraceScope scope("Drain", "schedule");
+        scheduler.Drain();
+    }
+    free(batch);
+    {
+        TraceScope scope("writeSimulationResults", "output");
+        simResults.writeSimulationResults(mcoFileName);
+    }
+    if (use_cache && use_sweep)
+    {
+        printf("\nResult cache: %llu runs cached, %llu duplicates\n", (unsigned long long)cache.GetHitCount(),
+               (unsigned long long)cache.GetDuplicateCount());
+    }
+
+    // Free the buffer pools and estimate the time they saved: without them,
+    // every run allocated and freed its buffers on every worker. Only the
+    // pool allocation is timed, so the estimate assumes each run allocation
+    // would take as long.
+    double pool_time = 0;
+    for (UINT32 w = 0; w < n_workers; ++w)
+    {
+#ifdef MCML_WITH_CUDA
+        if (w < n_gpus)
+            FreeGPUBufferPool(hstates[w]);
+#endif
+        FreeBufferPool(&hstates[w]->pool);
+        pool_time += hstates[w]->pool.alloc_time;
+    }
+    pool_time /= n_workers;
+    printf("\nBuffer pool: %.2f MB of tallies per worker, allocated once in %.3f ms "
+           "(estimated %.3f ms of allocation saved per run, if a run allocation takes as long)\n",
+           (((double)max_rz_size + 2.0 * max_ra_size) * sizeof(UINT64) + (double)max_jac_size * sizeof(double)) /
+               (1 << 20),
+           pool_time * 1e3,
+           n_todo > 0 ? pool_time * 1e3 * (n_todo - 1) / n_todo : 0.0);
+
+    // Free host thread states.
+    for (UINT32 w = 0; w < n_workers; ++w)
+        free(hstates[w]);
+
+    FreeSimulationStruct(simulations, use_sweep ? SWEEP_SLOTS * MAX_PACKED_RUNS : n_simulations);
+
+    if (use_trace && TraceWrite(g_commandLineArguments.trace_file.c_str()))
+        return 1;
+
+    return 0;
+}
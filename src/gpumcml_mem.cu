@@ -28,28 +28,11 @@
 //////////////////////////////////////////////////////////////////////////////
 
 //////////////////////////////////////////////////////////////////////////////
-//   Initialize Device Constant Memory with read-only data
+//   Fill in the layer specifications of one run (including the two ambient
+//   layers) in <h_layerspecs>
 //////////////////////////////////////////////////////////////////////////////
-int InitDCMem(SimulationStruct *sim, UINT32 A_rz_overflow) {
-    // Make sure that the number of layers is within the limit.
+void InitLayerSpecs(LayerStructGPU *h_layerspecs, const SimulationStruct *sim) {
     UINT32 n_layers = sim->n_layers + 2;
-    if (n_layers > MAX_LAYERS) return 1;
-
-    SimParamGPU h_simparam;
-
-    h_simparam.num_layers = sim->n_layers;  // not plus 2 here
-    h_simparam.init_photon_w = sim->start_weight;
-    h_simparam.dz = (GFLOAT) sim->det.dz;
-    h_simparam.dr = (GFLOAT) sim->det.dr;
-    h_simparam.na = sim->det.na;
-    h_simparam.nz = sim->det.nz;
-    h_simparam.nr = sim->det.nr;
-    h_simparam.A_rz_overflow = A_rz_overflow;
-
-    CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_simparam,
-                                      &h_simparam, sizeof(SimParamGPU)));
-
-    LayerStructGPU h_layerspecs[MAX_LAYERS];
 
     for (UINT32 i = 0; i < n_layers; ++i) {
         h_layerspecs[i].z0 = (GFLOAT) sim->layers[i].z_min;
@@ -77,84 +60,106 @@ int InitDCMem(SimulationStruct *sim, UINT32 A_rz_overflow) {
                                         sqrtf(FP_ONE - n2 * n2 / (n1 * n1)) : MCML_FP_ZERO;
         }
     }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Initialize Device Constant Memory with read-only data of all runs of
+//   <batch>, of which this GPU simulates <n_photons> photons starting at
+//   <photon_begin> (with the stream offset <photon_ofst>)
+//////////////////////////////////////////////////////////////////////////////
+int InitDCMem(const PackedBatch *batch, UINT32 photon_begin, UINT32 n_photons,
+              UINT64 photon_ofst, UINT32 A_rz_overflow) {
+    BatchParamGPU h_batchparam;
+    h_batchparam.n_runs = batch->n_runs;
+    h_batchparam.photon_begin = photon_begin;
+    h_batchparam.n_photons = n_photons;
+    h_batchparam.A_rz_size = batch->A_rz_ofst[batch->n_runs];
+    h_batchparam.photon_ofst = photon_ofst;
+
+    CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_batchparam,
+                                      &h_batchparam, sizeof(BatchParamGPU)));
+
+    SimParamGPU h_simparam[MAX_PACKED_RUNS];
+    LayerStructGPU h_layerspecs[MAX_PACKED_LAYERS];
+    UINT32 layer_ofst = 0;
+
+    for (UINT32 r = 0; r < batch->n_runs; ++r) {
+        const SimulationStruct *sim = &batch->sims[r];
+
+        // Make sure that the number of layers is within the limit.
+        UINT32 n_layers = sim->n_layers + 2;
+        if (n_layers > MAX_LAYERS || layer_ofst + n_layers > MAX_PACKED_LAYERS) return 1;
+
+        h_simparam[r].num_layers = sim->n_layers;  // not plus 2 here
+        h_simparam[r].init_photon_w = sim->start_weight;
+        h_simparam[r].dz = (GFLOAT) sim->det.dz;
+        h_simparam[r].dr = (GFLOAT) sim->det.dr;
+        h_simparam[r].na = sim->det.na;
+        h_simparam[r].nz = sim->det.nz;
+        h_simparam[r].nr = sim->det.nr;
+        h_simparam[r].A_rz_overflow = A_rz_overflow;
+        h_simparam[r].layer_ofst = layer_ofst;
+        h_simparam[r].A_rz_ofst = batch->A_rz_ofst[r];
+        h_simparam[r].ra_ofst = batch->ra_ofst[r];
+        h_simparam[r].photon_end = batch->photon_end[r];
+        h_simparam[r].rng_key = batch->rng_key[r];
+
+        InitLayerSpecs(&h_layerspecs[layer_ofst], sim);
+        layer_ofst += n_layers;
+    }
+
+    CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_simparam,
+                                      h_simparam, batch->n_runs * sizeof(SimParamGPU)));
 
     // Copy layer data to constant device memory
     CUDA_SAFE_CALL(cudaMemcpyToSymbol(d_layerspecs,
-                                      &h_layerspecs, n_layers * sizeof(LayerStructGPU)));
+                                      h_layerspecs, layer_ofst * sizeof(LayerStructGPU)));
 
     return 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////
-//   Initialize Device Memory (global) for read/write data
+//   Allocate Device Memory (global) for read/write data, for batches of up to
+//   <rz_size> elements of A_rz and <ra_size> elements of Rd_ra and Tt_ra,
+//   and copy the multipliers of the generators from <HostMem>
 //////////////////////////////////////////////////////////////////////////////
-int InitSimStates(SimState *HostMem, SimState *DeviceMem,
-                  GPUThreadStates *tstates, SimulationStruct *sim,
-                  int n_threads) {
-    int rz_size = sim->det.nr * sim->det.nz;
-    int ra_size = sim->det.nr * sim->det.na;
+void InitGPUBufferPool(GPUBufferPool *gpool, UINT32 rz_size, UINT32 ra_size,
+                       int n_threads, const SimState *HostMem) {
+    SimState *DeviceMem = &gpool->dstate;
+    GPUThreadStates *tstates = &gpool->tstates;
+    size_t size;
 
-    unsigned int size;
+    gpool->rz_size = rz_size;
+    gpool->ra_size = ra_size;
+    gpool->n_threads = n_threads;
 
     // Allocate n_photons_left (on device only)
-    size = sizeof(UINT32);
-    CUDA_SAFE_CALL(cudaDeviceSynchronize());
-    CUDA_SAFE_CALL(cudaMalloc((void **) &DeviceMem->n_photons_left, size));
-    CUDA_SAFE_CALL(cudaMemcpy(DeviceMem->n_photons_left,
-                              HostMem->n_photons_left, size, cudaMemcpyHostToDevice));
+    CUDA_SAFE_CALL(cudaMalloc((void **) &DeviceMem->n_photons_left, sizeof(UINT32)));
 
     // random number generation (on device only)
-    size = n_threads * sizeof(UINT32);
-    CUDA_SAFE_CALL(cudaMalloc((void **) &DeviceMem->a, size));
-    CUDA_SAFE_CALL(cudaMemcpy(DeviceMem->a, HostMem->a, size,
-                              cudaMemcpyHostToDevice));
-    size = n_threads * sizeof(UINT64);
-    CUDA_SAFE_CALL(cudaMalloc((void **) &DeviceMem->x, size));
-    CUDA_SAFE_CALL(cudaMemcpy(DeviceMem->x, HostMem->x, size,
-                              cudaMemcpyHostToDevice));
-
-
-    // Allocate A_rz on host and device
-    size = rz_size * sizeof(UINT64);
-    HostMem->A_rz = (UINT64 *) malloc(size);
-    if (HostMem->A_rz == NULL) {
-        fprintf(stderr, "Error allocating HostMem->A_rz");
-        exit(1);
-    }
-    // On the device, we allocate multiple copies for less access contention.
-    size *= N_A_RZ_COPIES;
+    CUDA_SAFE_CALL(cudaMalloc((void **) &DeviceMem->a, n_threads * sizeof(UINT32)));
+    CUDA_SAFE_CALL(cudaMalloc((void **) &DeviceMem->x, n_threads * sizeof(UINT64)));
+    UINT32 *multipliers;
+    size = HostMem->n_multipliers * sizeof(UINT32);
+    CUDA_SAFE_CALL(cudaMalloc((void **) &multipliers, size));
+    CUDA_SAFE_CALL(cudaMemcpy(multipliers, HostMem->multipliers, size, cudaMemcpyHostToDevice));
+    DeviceMem->multipliers = multipliers;
+    DeviceMem->n_multipliers = HostMem->n_multipliers;
+
+    // On the device, we allocate multiple copies of A_rz for less access
+    // contention.
+    size = (size_t) rz_size * N_A_RZ_COPIES * sizeof(UINT64);
     CUDA_SAFE_CALL(cudaMalloc((void **) &DeviceMem->A_rz, size));
-    CUDA_SAFE_CALL(cudaMemset(DeviceMem->A_rz, 0, size));
-
-    // Allocate Rd_ra on host and device
-    size = ra_size * sizeof(UINT64);
-    HostMem->Rd_ra = (UINT64 *) malloc(size);
-    if (HostMem->Rd_ra == NULL) {
-        printf("Error allocating HostMem->Rd_ra");
-        exit(1);
-    }
+    size = (size_t) ra_size * sizeof(UINT64);
     CUDA_SAFE_CALL(cudaMalloc((void **) &DeviceMem->Rd_ra, size));
-    CUDA_SAFE_CALL(cudaMemset(DeviceMem->Rd_ra, 0, size));
-
-    // Allocate Tt_ra on host and device
-    size = ra_size * sizeof(UINT64);
-    HostMem->Tt_ra = (UINT64 *) malloc(size);
-    if (HostMem->Tt_ra == NULL) {
-        printf("Error allocating HostMem->Tt_ra");
-        exit(1);
-    }
     CUDA_SAFE_CALL(cudaMalloc((void **) &DeviceMem->Tt_ra, size));
-    CUDA_SAFE_CALL(cudaMemset(DeviceMem->Tt_ra, 0, size));
 
-    /* Allocate and initialize GPU thread states on the device.
-    *
-    * We only initialize rnd_a and rnd_x here. For all other fields, whose
-    * initial value is a known constant, we use a kernel to do the
-    * initialization.
-    */
+    // Event counts of every run (see gpumcml_profile.h)
+    size = (size_t) MAX_PACKED_RUNS * N_PROFILE_EVENTS * sizeof(UINT64);
+    CUDA_SAFE_CALL(cudaMalloc((void **) &DeviceMem->profile, size));
 
-    // photon structure
-    size = n_threads * sizeof(GFLOAT);
+    // GPU thread states: their initial values are set by InitThreadState.
+    size = n_threads * sizeof(double);
     CUDA_SAFE_CALL(cudaMalloc((void **) &tstates->photon_x, size));
     CUDA_SAFE_CALL(cudaMalloc((void **) &tstates->photon_y, size));
     CUDA_SAFE_CALL(cudaMalloc((void **) &tstates->photon_z, size));
@@ -164,9 +169,39 @@ int InitSimStates(SimState *HostMem, SimState *DeviceMem,
     CUDA_SAFE_CALL(cudaMalloc((void **) &tstates->photon_w, size));
     size = n_threads * sizeof(UINT32);
     CUDA_SAFE_CALL(cudaMalloc((void **) &tstates->photon_layer, size));
+    CUDA_SAFE_CALL(cudaMalloc((void **) &tstates->photon_run, size));
 
     // thread active
     CUDA_SAFE_CALL(cudaMalloc((void **) &tstates->is_active, size));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Initialize Device Memory (global) for read/write data of one batch,
+//   using the buffers of <gpool>: only the region the batch uses is zeroed.
+//////////////////////////////////////////////////////////////////////////////
+int InitSimStates(SimState *HostMem, SimState *DeviceMem,
+                  GPUThreadStates *tstates, const PackedBatch *batch,
+                  int n_threads, GPUBufferPool *gpool) {
+    size_t rz_size = batch->A_rz_ofst[batch->n_runs];
+    size_t ra_size = batch->ra_ofst[batch->n_runs];
+
+    *DeviceMem = gpool->dstate;
+    *tstates = gpool->tstates;
+
+    CUDA_SAFE_CALL(cudaDeviceSynchronize());
+
+    // n_photons_left (on device only)
+    CUDA_SAFE_CALL(cudaMemcpy(DeviceMem->n_photons_left,
+                              HostMem->n_photons_left, sizeof(UINT32), cudaMemcpyHostToDevice));
+
+    // The generators are seeded by the threads (see LaunchPhoton).
+
+    // The copies of A_rz are laid out back to back with a stride of rz_size
+    // (see MCMLKernel), so the used region is contiguous.
+    CUDA_SAFE_CALL(cudaMemset(DeviceMem->A_rz, 0, rz_size * N_A_RZ_COPIES * sizeof(UINT64)));
+    CUDA_SAFE_CALL(cudaMemset(DeviceMem->Rd_ra, 0, ra_size * sizeof(UINT64)));
+    CUDA_SAFE_CALL(cudaMemset(DeviceMem->Tt_ra, 0, ra_size * sizeof(UINT64)));
+    CUDA_SAFE_CALL(cudaMemset(DeviceMem->profile, 0, batch->n_runs * N_PROFILE_EVENTS * sizeof(UINT64)));
 
     return 1;
 }
@@ -175,50 +210,22 @@ int InitSimStates(SimState *HostMem, SimState *DeviceMem,
 //   Transfer data from Device to Host memory after simulation
 //////////////////////////////////////////////////////////////////////////////
 int CopyDeviceToHostMem(SimState *HostMem, SimState *DeviceMem,
-                        SimulationStruct *sim, int n_threads) {
-    int rz_size = sim->det.nr * sim->det.nz;
-    int ra_size = sim->det.nr * sim->det.na;
+                        const PackedBatch *batch, int n_threads) {
+    int rz_size = batch->A_rz_ofst[batch->n_runs];
+    int ra_size = batch->ra_ofst[batch->n_runs];
 
     // Copy A_rz, Rd_ra and Tt_ra
     CUDA_SAFE_CALL(cudaMemcpy(HostMem->A_rz, DeviceMem->A_rz, rz_size * sizeof(UINT64), cudaMemcpyDeviceToHost));
     CUDA_SAFE_CALL(cudaMemcpy(HostMem->Rd_ra, DeviceMem->Rd_ra, ra_size * sizeof(UINT64), cudaMemcpyDeviceToHost));
     CUDA_SAFE_CALL(cudaMemcpy(HostMem->Tt_ra, DeviceMem->Tt_ra, ra_size * sizeof(UINT64), cudaMemcpyDeviceToHost));
-
-    //Also copy the state of the RNG's
-    CUDA_SAFE_CALL(
-            cudaMemcpy(HostMem->x, DeviceMem->x, n_threads * sizeof(UINT64),
-                       cudaMemcpyDeviceToHost));
+    CUDA_SAFE_CALL(cudaMemcpy(HostMem->profile, DeviceMem->profile,
+                              batch->n_runs * N_PROFILE_EVENTS * sizeof(UINT64), cudaMemcpyDeviceToHost));
 
     return 0;
 }
 
 //////////////////////////////////////////////////////////////////////////////
-//   Free Host Memory
-//////////////////////////////////////////////////////////////////////////////
-void FreeHostSimState(SimState *hstate) {
-    if (hstate->n_photons_left != NULL) {
-        free(hstate->n_photons_left);
-        hstate->n_photons_left = NULL;
-    }
-
-    // DO NOT FREE RANDOM NUMBER SEEDS HERE.
-
-    if (hstate->A_rz != NULL) {
-        free(hstate->A_rz);
-        hstate->A_rz = NULL;
-    }
-    if (hstate->Rd_ra != NULL) {
-        free(hstate->Rd_ra);
-        hstate->Rd_ra = NULL;
-    }
-    if (hstate->Tt_ra != NULL) {
-        free(hstate->Tt_ra);
-        hstate->Tt_ra = NULL;
-    }
-}
-
-//////////////////////////////////////////////////////////////////////////////
-//   Free GPU Memory
+//   Free GPU Memory (the buffers of a GPUBufferPool)
 //////////////////////////////////////////////////////////////////////////////
 void FreeDeviceSimStates(SimState *dstate, GPUThreadStates *tstates) {
     CUDA_SAFE_CALL_INFO(cudaFree(dstate->n_photons_left), "Error freeing memory");
@@ -228,6 +235,8 @@ void FreeDeviceSimStates(SimState *dstate, GPUThreadStates *tstates) {
     dstate->x = NULL;
     CUDA_SAFE_CALL_INFO(cudaFree(dstate->a), "Error freeing memory");
     dstate->a = NULL;
+    CUDA_SAFE_CALL_INFO(cudaFree((void *) dstate->multipliers), "Error freeing memory");
+    dstate->multipliers = NULL;
 
     CUDA_SAFE_CALL_INFO(cudaFree(dstate->A_rz), "Error freeing memory");
     dstate->A_rz = NULL;
@@ -235,6 +244,8 @@ void FreeDeviceSimStates(SimState *dstate, GPUThreadStates *tstates) {
     dstate->Rd_ra = NULL;
     CUDA_SAFE_CALL_INFO(cudaFree(dstate->Tt_ra), "Error freeing memory");
     dstate->Tt_ra = NULL;
+    CUDA_SAFE_CALL_INFO(cudaFree(dstate->profile), "Error freeing memory");
+    dstate->profile = NULL;
 
     CUDA_SAFE_CALL_INFO(cudaFree(tstates->photon_x), "Error freeing memory");
     tstates->photon_x = NULL;
@@ -252,6 +263,8 @@ void FreeDeviceSimStates(SimState *dstate, GPUThreadStates *tstates) {
     tstates->photon_w = NULL;
     CUDA_SAFE_CALL_INFO(cudaFree(tstates->photon_layer), "Error freeing memory");
     tstates->photon_layer = NULL;
+    CUDA_SAFE_CALL_INFO(cudaFree(tstates->photon_run), "Error freeing memory");
+    tstates->photon_run = NULL;
     CUDA_SAFE_CALL_INFO(cudaFree(tstates->is_active), "Error freeing memory");
     tstates->is_active = NULL;
 
@@ -0,0 +1,73 @@
+/*****************************************************************************
+ *
+ *   Precision policies of the photon engines
+ *   =========================================================================
+ *   The photon loops (MCMLKernel and the scalar CPU engine) take a precision
+ *   policy as a template parameter: the floating-point type of the photon
+ *   positions (Pos) and of everything else (Real). The layer tables keep
+ *   their precision (GFLOAT on the GPU, Real on the CPU).
+ *
+ *   SinglePrecision: everything in float (the default)
+ *   MixedPrecision:  positions in double, so that small steps are not lost
+ *                    against large depths (thick layers, small dz), and
+ *                    everything else in float
+ *   DoublePrecision: everything in double
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPUMCML_PRECISION_H
+#define GPUMCML_PRECISION_H
+
+#include "gpumcml.h"
+
+struct SinglePrecision
+{
+    typedef float Real;
+    typedef float Pos;
+};
+
+struct MixedPrecision
+{
+    typedef float Real;
+    typedef double Pos;
+};
+
+struct DoublePrecision
+{
+    typedef double Real;
+    typedef double Pos;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//   Cosine above which a photon is taken to travel along z (normal
+//   incidence), for the type <Real>
+//////////////////////////////////////////////////////////////////////////////
+template <typename Real> MCML_HOST_DEVICE Real CosZero();
+
+template <> MCML_HOST_DEVICE float CosZero<float>()
+{
+    return COSZERO;
+}
+
+template <> MCML_HOST_DEVICE double CosZero<double>()
+{
+    return 1.0 - 1.0E-12;
+}
+
+#endif // GPUMCML_PRECISION_H
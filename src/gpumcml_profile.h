@@ -0,0 +1,94 @@
+/*****************************************************************************
+ *
+ *   Event counters of the photon loops
+ *   =========================================================================
+ *   A build with MCML_PROFILE (cmake -DMCML_PROFILE=ON) counts the events of
+ *   the photon loops (PROFILE_STEPS, ...) of every run, which --profile adds
+ *   to the output. Each loop counts into its own ProfileCounters, which stay
+ *   in registers (or on the stack), and adds them to the counts of the run
+ *   when it is done with the run.
+ *
+ *   Without MCML_PROFILE, ProfileCounters has no members and all of its
+ *   functions are empty, so that the counters compile away completely.
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPUMCML_PROFILE_H
+#define GPUMCML_PROFILE_H
+
+#include "gpumcml.h"
+
+struct ProfileCounters
+{
+#ifdef MCML_PROFILE
+    UINT64 n[N_PROFILE_EVENTS];
+
+    MCML_HOST_DEVICE void Clear()
+    {
+        for (int e = 0; e < N_PROFILE_EVENTS; ++e)
+            n[e] = 0;
+    }
+
+    MCML_HOST_DEVICE void Count(int event)
+    {
+        ++n[event];
+    }
+
+    MCML_HOST_DEVICE void Count(int event, UINT64 k)
+    {
+        n[event] += k;
+    }
+
+    MCML_HOST_DEVICE void Add(const ProfileCounters &other)
+    {
+        for (int e = 0; e < N_PROFILE_EVENTS; ++e)
+            n[e] += other.n[e];
+    }
+
+    // Add the counts to <counts> (N_PROFILE_EVENTS of them) and clear them
+    MCML_HOST_DEVICE void Flush(UINT64 *counts)
+    {
+        for (int e = 0; e < N_PROFILE_EVENTS; ++e)
+            counts[e] += n[e];
+        Clear();
+    }
+#else
+    MCML_HOST_DEVICE void Clear()
+    {
+    }
+
+    MCML_HOST_DEVICE void Count(int)
+    {
+    }
+
+    MCML_HOST_DEVICE void Count(int, UINT64)
+    {
+    }
+
+    MCML_HOST_DEVICE void Add(const ProfileCounters &)
+    {
+    }
+
+    MCML_HOST_DEVICE void Flush(UINT64 *)
+    {
+    }
+#endif
+};
+
+#endif // GPUMCML_PROFILE_H
@@ -0,0 +1,124 @@
+/*****************************************************************************
+ *
+ *   Progress reports of MCMLGPU
+ *   =========================================================================
+ *   Photons done, photons/sec and the estimated time left, as an updating
+ *   line on the terminal or as JSON lines for job schedulers.
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <unistd.h>
+
+#include "gpumcml_progress.h"
+
+// Time constant of the average of the rate [s]
+#define PROGRESS_RATE_WINDOW 10.0
+
+ProgressReporter::ProgressReporter(const BatchScheduler *scheduler, UINT64 total_photons, UINT64 total_runs,
+                                   int mode, double interval)
+    : scheduler(scheduler), total_photons(total_photons), total_runs(total_runs), mode(mode),
+      interval(interval > 0 ? interval : 1.0), start(std::chrono::steady_clock::now()), last_time(0),
+      last_photons(0), rate(0), stopping(false)
+{
+    // An updating line only makes sense on a terminal.
+    if (this->mode == PROGRESS_BAR && !isatty(fileno(stdout)))
+        this->mode = PROGRESS_NONE;
+    if (this->mode != PROGRESS_NONE)
+        thread = std::thread(&ProgressReporter::ReportLoop, this);
+}
+
+ProgressReporter::~ProgressReporter()
+{
+    if (!thread.joinable())
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    stop.notify_one();
+    thread.join();
+    Report(true);
+}
+
+void ProgressReporter::ReportLoop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop.wait_for(lock, std::chrono::duration<double>(interval), [this] { return stopping; }))
+        Report(false);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Write one report. The rate is an exponential moving average of the
+//   rates between reports.
+//////////////////////////////////////////////////////////////////////////////
+void ProgressReporter::Report(bool final)
+{
+    UINT64 photons, added, runs;
+    scheduler->GetProgress(&photons, &added, &runs);
+    UINT64 total = total_photons + added;
+    if (photons > total)
+        photons = total;
+
+    double now = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    double dt = now - last_time;
+    if (dt > 0 && photons >= last_photons)
+    {
+        double alpha = (last_time == 0) ? 1.0 : 1.0 - exp(-dt / PROGRESS_RATE_WINDOW);
+        rate += alpha * ((photons - last_photons) / dt - rate);
+    }
+    last_time = now;
+    last_photons = photons;
+    if (final)
+        rate = (now > 0) ? photons / now : 0;
+
+    // seconds left, or < 0 if unknown
+    double eta = final ? 0 : (rate > 0) ? (total - photons) / rate : -1;
+    double percent = (total > 0) ? 100.0 * photons / total : 100.0;
+
+    if (mode == PROGRESS_JSON)
+    {
+        char eta_str[32] = "null";
+        if (eta >= 0)
+            snprintf(eta_str, sizeof(eta_str), "%.1f", eta);
+        fprintf(stderr,
+                "{\"elapsed\": %.1f, \"photons_done\": %llu, \"photons_total\": %llu, \"runs_done\": %llu, "
+                "\"runs_total\": %llu, \"photons_per_sec\": %.4g, \"eta\": %s, \"done\": %s}\n",
+                now, (unsigned long long)photons, (unsigned long long)total, (unsigned long long)runs,
+                (unsigned long long)total_runs, rate, eta_str, final ? "true" : "false");
+        fflush(stderr);
+    }
+    else
+    {
+        char eta_str[32] = "--:--:--";
+        if (eta >= 0)
+        {
+            UINT64 s = (UINT64)(eta + 0.5);
+            snprintf(eta_str, sizeof(eta_str), "%02llu:%02llu:%02llu", (unsigned long long)(s / 3600),
+                     (unsigned long long)(s / 60 % 60), (unsigned long long)(s % 60));
+        }
+        printf("\r[%5.1f%%] %.3g / %.3g photons, %llu / %llu runs, %.3g photons/s, ETA %s   ", percent,
+               (double)photons, (double)total, (unsigned long long)runs, (unsigned long long)total_runs, rate,
+               eta_str);
+        if (final)
+            printf("\n");
+        fflush(stdout);
+    }
+}
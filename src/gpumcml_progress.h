@@ -0,0 +1,82 @@
+/*****************************************************************************
+ *
+ *   Header file for the progress reporter
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPUMCML_PROGRESS_H
+#define GPUMCML_PROGRESS_H
+
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+#include "gpumcml_sched.h"
+
+// Output of ProgressReporter (--progress)
+#define PROGRESS_NONE 0
+#define PROGRESS_BAR 1  // one updating line on stdout, if it is a terminal
+#define PROGRESS_JSON 2 // one JSON object per line on stderr
+
+//////////////////////////////////////////////////////////////////////////////
+//   Reports the photons simulated, photons/sec and the estimated time left
+//   from a thread of its own, every <interval> seconds. It only reads the
+//   counters of the scheduler and the workers (see
+//   BatchScheduler::GetProgress), so the engines are never held back, and
+//   it follows the photons within a run: the GPU workers update their count
+//   after every kernel launch and the CPU workers after every photon.
+//
+//   The rate is averaged over the last few seconds, so the estimate follows
+//   changes of speed (e.g. from thin to thick runs).
+//////////////////////////////////////////////////////////////////////////////
+class ProgressReporter
+{
+  public:
+    // Report the progress of <scheduler> towards <total_photons> photons in
+    // <total_runs> runs (the photons added to runs that miss their targets
+    // are added to the total as they are queued).
+    ProgressReporter(const BatchScheduler *scheduler, UINT64 total_photons, UINT64 total_runs, int mode,
+                     double interval);
+
+    // Stop the thread and write the final report.
+    ~ProgressReporter();
+
+  private:
+    void ReportLoop();
+    void Report(bool final);
+
+    const BatchScheduler *scheduler;
+    UINT64 total_photons;
+    UINT64 total_runs;
+    int mode;
+    double interval;
+
+    std::chrono::steady_clock::time_point start;
+    double last_time;    // elapsed time of the last report [s]
+    UINT64 last_photons; // photons done at the last report
+    double rate;         // photons per second, averaged
+
+    bool stopping;
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable stop;
+};
+
+#endif // GPUMCML_PROGRESS_H
@@ -0,0 +1,200 @@
+/*****************************************************************************
+ *
+ *   Random number generators of the photon engines
+ *   =========================================================================
+ *   The photon loops (MCMLKernel and the CPU engine) take the generator as a
+ *   template parameter. Every generator is seeded per photon from the key of
+ *   the run and the index of the photon (see PackedBatch), and its state
+ *   fits the per-thread state arrays of the GPU (a 64-bit and a 32-bit
+ *   word), so that it can be saved between kernel launches.
+ *
+ *   MWCRng:       multiply-with-carry, the default generator of MCML
+ *   PhiloxRng:    Philox4x32-10 (Salmon et al., SC 2011), counter-based:
+ *                 the n-th number of a photon is a function of the key, the
+ *                 photon and n alone, so there is no state besides n
+ *   XoroshiroRng: xoroshiro64** (Blackman and Vigna), a 64-bit state
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPUMCML_RNG_H
+#define GPUMCML_RNG_H
+
+#include "gpumcml.h"
+
+//////////////////////////////////////////////////////////////////////////////
+//   64-bit mixer (splitmix64 finalizer) the generators are seeded with
+//////////////////////////////////////////////////////////////////////////////
+MCML_HOST_DEVICE UINT64 Mix64(UINT64 z)
+{
+    z += 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+MCML_HOST_DEVICE UINT32 Rotl32(UINT32 v, int k)
+{
+    return (v << k) | (v >> (32 - k));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Multiply-with-carry generator with base 2^32: x holds the carry in the
+//   upper and the last number in the lower 32 bits, a is one of the safe
+//   prime multipliers (see init_RNG).
+//////////////////////////////////////////////////////////////////////////////
+struct MWCRng
+{
+    UINT64 x;
+    UINT32 a;
+
+    MCML_HOST_DEVICE void Seed(UINT64 key, UINT64 photon, const UINT32 *multipliers, UINT32 n_multipliers)
+    {
+        UINT64 h = Mix64(key ^ Mix64(photon));
+        a = multipliers[(UINT32)(h >> 32) % n_multipliers];
+
+        // 0 <= c < a - 1 and 0 <= x < 2^32 - 1 (but not both 0)
+        h = Mix64(h);
+        UINT64 c = ((h >> 32) * (a - 1)) >> 32;
+        x = (c << 32) | ((UINT32)h % 0xffffffffu);
+        if (x == 0)
+            x = 1;
+    }
+
+    MCML_HOST_DEVICE UINT32 Next()
+    {
+        x = (x & 0xffffffffull) * a + (x >> 32);
+        return (UINT32)x;
+    }
+
+    MCML_HOST_DEVICE void Save(UINT64 *sx, UINT32 *sa) const
+    {
+        *sx = x;
+        *sa = a;
+    }
+
+    MCML_HOST_DEVICE void Restore(UINT64, UINT64 sx, UINT32 sa)
+    {
+        x = sx;
+        a = sa;
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//   Philox4x32-10 in counter mode: block n of photon p is the encryption of
+//   the counter (n, p_lo, p_hi, 0) with the key of the run, and yields the
+//   numbers 4n .. 4n + 3 of the photon. Skipping ahead is free, the state
+//   is the photon and the number of numbers drawn.
+//////////////////////////////////////////////////////////////////////////////
+struct PhiloxRng
+{
+    UINT64 key;
+    UINT64 photon;
+    UINT32 n_drawn;
+    UINT32 block[4];
+
+    MCML_HOST_DEVICE void Generate()
+    {
+        UINT32 c0 = n_drawn >> 2, c1 = (UINT32)photon, c2 = (UINT32)(photon >> 32), c3 = 0;
+        UINT32 k0 = (UINT32)key, k1 = (UINT32)(key >> 32);
+        for (int round = 0; round < 10; ++round)
+        {
+            UINT64 p0 = (UINT64)0xD2511F53u * c0;
+            UINT64 p1 = (UINT64)0xCD9E8D57u * c2;
+            c0 = (UINT32)(p1 >> 32) ^ c1 ^ k0;
+            c2 = (UINT32)(p0 >> 32) ^ c3 ^ k1;
+            c1 = (UINT32)p1;
+            c3 = (UINT32)p0;
+            k0 += 0x9E3779B9u;
+            k1 += 0xBB67AE85u;
+        }
+        block[0] = c0;
+        block[1] = c1;
+        block[2] = c2;
+        block[3] = c3;
+    }
+
+    MCML_HOST_DEVICE void Seed(UINT64 run_key, UINT64 photon_id, const UINT32 *, UINT32)
+    {
+        key = run_key;
+        photon = photon_id;
+        n_drawn = 0;
+    }
+
+    MCML_HOST_DEVICE UINT32 Next()
+    {
+        if ((n_drawn & 3) == 0)
+            Generate();
+        return block[n_drawn++ & 3];
+    }
+
+    MCML_HOST_DEVICE void Save(UINT64 *sx, UINT32 *sa) const
+    {
+        *sx = photon;
+        *sa = n_drawn;
+    }
+
+    MCML_HOST_DEVICE void Restore(UINT64 run_key, UINT64 sx, UINT32 sa)
+    {
+        key = run_key;
+        photon = sx;
+        n_drawn = sa;
+        if ((n_drawn & 3) != 0)
+            Generate();
+    }
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//   xoroshiro64**: two 32-bit words of state, both held in x
+//////////////////////////////////////////////////////////////////////////////
+struct XoroshiroRng
+{
+    UINT32 s0, s1;
+
+    MCML_HOST_DEVICE void Seed(UINT64 key, UINT64 photon, const UINT32 *, UINT32)
+    {
+        UINT64 h = Mix64(Mix64(key ^ Mix64(photon)));
+        s0 = (UINT32)h;
+        s1 = (UINT32)(h >> 32);
+        if (s0 == 0 && s1 == 0)
+            s0 = 1;
+    }
+
+    MCML_HOST_DEVICE UINT32 Next()
+    {
+        UINT32 result = Rotl32(s0 * 0x9E3779BBu, 5) * 5;
+        s1 ^= s0;
+        s0 = Rotl32(s0, 26) ^ s1 ^ (s1 << 9);
+        s1 = Rotl32(s1, 13);
+        return result;
+    }
+
+    MCML_HOST_DEVICE void Save(UINT64 *sx, UINT32 *sa) const
+    {
+        *sx = ((UINT64)s1 << 32) | s0;
+        *sa = 0;
+    }
+
+    MCML_HOST_DEVICE void Restore(UINT64, UINT64 sx, UINT32)
+    {
+        s0 = (UINT32)sx;
+        s1 = (UINT32)(sx >> 32);
+    }
+};
+
+#endif // GPUMCML_RNG_H
@@ -0,0 +1,545 @@
+/*****************************************************************************
+ *
+ *   Batch scheduler of MCMLGPU
+ *   =========================================================================
+ *   Long-lived workers (one per GPU or per CPU thread) pull chunks of
+ *   photons from a shared queue, instead of one host thread being spawned
+ *   per GPU for every run with an even share of its photons. Reduction and
+ *   registration of the results run in their own pipeline stages.
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <utility>
+
+#include "gpumcml_sched.h"
+#include "gpumcml_trace.h"
+
+//////////////////////////////////////////////////////////////////////////////
+//   First photon of run <r> of a batch
+//////////////////////////////////////////////////////////////////////////////
+static UINT32 RunBegin(const PackedBatch *batch, UINT32 r)
+{
+    return (r == 0 || batch->white) ? 0 : batch->photon_end[r - 1];
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Allocate the result buffers and start the stages
+//////////////////////////////////////////////////////////////////////////////
+BatchScheduler::BatchScheduler(HostThreadState *hstates[], const RunEngineFn engines[], UINT32 n_workers,
+                               UINT64 chunk_photons, UINT32 rz_size, UINT32 ra_size, UINT32 jac_size,
+                               const AdaptiveTargets *targets, bool std_errors, SimulationResults *simResults)
+    : hstates(hstates, hstates + n_workers), engines(engines, engines + n_workers), chunk_photons(chunk_photons),
+      adaptive(targets != NULL), std_errors(std_errors), simResults(simResults),
+      chunks((size_t)n_workers * CHUNKS_PER_WORKER * MAX_BATCHES_IN_FLIGHT), chunk_results(n_workers),
+      spare_buffers(n_workers), photons_done(0), photons_added(0), runs_done(0), oldest(0), n_jobs(0), stopping(false)
+{
+    memset(&this->targets, 0, sizeof(this->targets));
+    if (targets != NULL)
+        this->targets = *targets;
+    memset(jobs, 0, sizeof(jobs));
+    for (UINT32 i = 0; i < MAX_BATCHES_IN_FLIGHT; ++i)
+    {
+        if (InitBufferPool(&jobs[i].pool, rz_size, ra_size, jac_size))
+        {
+            fprintf(stderr, "Error allocating the batch result buffers\n");
+            exit(1);
+        }
+    }
+
+    // One spare set of tallies per worker: a worker hands its tallies to
+    // the reduction stage in exchange for a spare set.
+    for (UINT32 w = 0; w < n_workers; ++w)
+    {
+        BufferPool spare;
+        memset(&spare, 0, sizeof(spare));
+        if (InitBufferPool(&spare, rz_size, ra_size, jac_size))
+        {
+            fprintf(stderr, "Error allocating the chunk result buffers\n");
+            exit(1);
+        }
+        ChunkResult buffer;
+        memset(&buffer, 0, sizeof(buffer));
+        buffer.A_rz = spare.A_rz;
+        buffer.Rd_ra = spare.Rd_ra;
+        buffer.Tt_ra = spare.Tt_ra;
+        buffer.Rd_jac = spare.Rd_jac;
+        buffer.profile = spare.profile;
+        spare_buffers.Push(buffer);
+    }
+
+    workers.reserve(n_workers);
+    for (UINT32 w = 0; w < n_workers; ++w)
+        workers.push_back(std::thread(&BatchScheduler::WorkerLoop, this, w));
+    reducer = std::thread(&BatchScheduler::ReduceLoop, this);
+    registrar = std::thread(&BatchScheduler::RegisterLoop, this);
+}
+
+BatchScheduler::~BatchScheduler()
+{
+    Drain();
+
+    // Stop the stages from the first to the last one.
+    chunks.Close();
+    for (auto &thread : workers)
+    {
+        if (thread.joinable())
+            thread.join();
+    }
+    chunk_results.Close();
+    reducer.join();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    job_done.notify_all();
+    registrar.join();
+
+    // All spare buffers are back once the stages are stopped.
+    spare_buffers.Close();
+    ChunkResult buffer;
+    while (spare_buffers.Pop(&buffer))
+    {
+        free(buffer.A_rz);
+        free(buffer.Rd_ra);
+        free(buffer.Tt_ra);
+        free(buffer.Rd_jac);
+        free(buffer.profile);
+    }
+    for (UINT32 i = 0; i < MAX_BATCHES_IN_FLIGHT; ++i)
+        FreeBufferPool(&jobs[i].pool);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Split a batch into chunks and queue them
+//////////////////////////////////////////////////////////////////////////////
+void BatchScheduler::Submit(const PackedBatch *batch, int first_sim_id)
+{
+    // The time spent here is the time the pipeline holds back the input.
+    TraceScope scope("Submit", "schedule");
+    scope.Args("\"first_run\": %d, \"runs\": %u", first_sim_id, batch->n_runs);
+    std::unique_lock<std::mutex> lock(mutex);
+    slot_freed.wait(lock, [this] { return n_jobs < MAX_BATCHES_IN_FLIGHT; });
+
+    BatchJob *job = &jobs[(oldest + n_jobs) % MAX_BATCHES_IN_FLIGHT];
+    job->batch = *batch;
+    job->first_sim_id = first_sim_id;
+    job->failed = InitHostSimState(&job->result, &job->pool, &job->batch);
+
+    UINT32 n_photons = job->batch.photon_end[job->batch.n_runs - 1];
+    UINT64 chunk = chunk_photons;
+    if (chunk == 0)
+    {
+        // A single worker takes the batch at once: every chunk ends with a
+        // tail in which part of the GPU threads (or SIMD lanes) are idle.
+        UINT64 n_chunks = (workers.size() == 1) ? 1 : (UINT64)workers.size() * CHUNKS_PER_WORKER;
+        chunk = (n_photons + n_chunks - 1) / n_chunks;
+        if (chunk == 0)
+            chunk = 1;
+    }
+    if (adaptive || std_errors)
+    {
+        // enough chunks in every run for its statistics
+        for (UINT32 r = 0; r < job->batch.n_runs; ++r)
+        {
+            UINT64 run_photons = job->batch.photon_end[r] - RunBegin(&job->batch, r);
+            UINT64 run_chunk = (run_photons + STAT_MIN_CHUNKS - 1) / STAT_MIN_CHUNKS;
+            if (chunk > run_chunk && run_chunk > 0)
+                chunk = run_chunk;
+        }
+    }
+    job->chunk = chunk;
+    memset(job->stats, 0, sizeof(job->stats));
+    UINT64 n_chunks = job->failed ? 0 : (n_photons + chunk - 1) / chunk;
+    job->chunks_left = (UINT32)n_chunks;
+    ++n_jobs;
+    lock.unlock();
+
+    // A batch without chunks is done right away.
+    if (n_chunks == 0)
+        job_done.notify_all();
+
+    // This blocks while the workers are busy with earlier chunks.
+    for (UINT64 begin = 0; begin < n_chunks * chunk; begin += chunk)
+    {
+        WorkChunk c;
+        c.job = job;
+        c.photon_begin = (UINT32)begin;
+        c.n_photons = (UINT32)((n_photons - begin < chunk) ? n_photons - begin : chunk);
+        c.photon_ofst = 0;
+        chunks.Push(c);
+    }
+}
+
+void BatchScheduler::Drain()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    slot_freed.wait(lock, [this] { return n_jobs == 0; });
+}
+
+void BatchScheduler::GetProgress(UINT64 *photons_done, UINT64 *photons_added, UINT64 *runs_done) const
+{
+    // A worker clears its chunk progress before it counts the chunk as
+    // done, so a finished chunk is counted at most once.
+    UINT64 done = this->photons_done.load();
+    for (const HostThreadState *hstate : hstates)
+        done += hstate->chunk_progress.load(std::memory_order_relaxed);
+    *photons_done = done;
+    *photons_added = this->photons_added.load();
+    *runs_done = this->runs_done.load();
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Stage 1 (one thread per worker <w>): simulate chunks and hand their
+//   tallies to the reduction stage
+//////////////////////////////////////////////////////////////////////////////
+void BatchScheduler::WorkerLoop(UINT32 w)
+{
+    HostThreadState *hstate = hstates[w];
+    SimState *hss = &(hstate->host_sim_state);
+    WorkChunk chunk;
+
+    // One lane per device: CPU workers have one host thread each.
+    bool cpu = engines[w] == RunCPUi || engines[w] == RunSIMDi;
+    if (cpu)
+        TraceThreadName("CPU %u", hstate->dev_id);
+    else
+        TraceThreadName("GPU %u", hstate->dev_id);
+    bool split = cpu && hstate->batch_seconds > 0 && !adaptive && !std_errors;
+
+    while (chunks.Pop(&chunk))
+    {
+        // Take a batch of the chunk and hand the rest back to the queue,
+        // unless it is only a little longer than a batch.
+        UINT64 length = (hstate->batch_length > 0) ? hstate->batch_length : INITIAL_BATCH_PHOTONS;
+        if (split && chunk.n_photons > length + length / 2)
+        {
+            WorkChunk rest = chunk;
+            rest.photon_begin += (UINT32)length;
+            rest.n_photons -= (UINT32)length;
+            chunk.n_photons = (UINT32)length;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                ++chunk.job->chunks_left;
+            }
+            chunks.PushFront(rest);
+        }
+
+        TraceScope scope("chunk", "simulate");
+        scope.Args("\"first_run\": %d, \"photon_begin\": %u, \"photons\": %u", chunk.job->first_sim_id,
+                   chunk.photon_begin, chunk.n_photons);
+        std::chrono::steady_clock::time_point t0 = std::chrono::steady_clock::now();
+        hstate->batch = &chunk.job->batch;
+        hstate->photon_begin = chunk.photon_begin;
+        hstate->photon_ofst = chunk.photon_ofst;
+        hss->n_photons_left = (UINT32 *)malloc(sizeof(UINT32));
+        *(hss->n_photons_left) = chunk.n_photons;
+
+        engines[w](hstate);
+        hstate->chunk_progress.store(0);
+        photons_done += chunk.n_photons;
+
+        // Chunks much shorter than a batch (the ends of runs) are dominated
+        // by their setup and do not tell the speed of the engine.
+        if (split && 2 * (UINT64)chunk.n_photons >= length)
+        {
+            double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - t0).count();
+            hstate->batch_length = AdaptBatchLength(length, chunk.n_photons, seconds, hstate->batch_seconds,
+                                                    MIN_BATCH_PHOTONS, UINT32_MAX);
+        }
+
+        ChunkResult result;
+        memset(&result, 0, sizeof(result));
+        if (hss->n_photons_left == NULL)
+        {
+            result.failed = 1;
+        }
+        else
+        {
+            // Swap the tallies in the buffer pool with a spare set, so that
+            // the next chunk can start before these are reduced.
+            spare_buffers.Pop(&result);
+            std::swap(result.A_rz, hstate->pool.A_rz);
+            std::swap(result.Rd_ra, hstate->pool.Rd_ra);
+            std::swap(result.Tt_ra, hstate->pool.Tt_ra);
+            std::swap(result.Rd_jac, hstate->pool.Rd_jac);
+            std::swap(result.profile, hstate->pool.profile);
+        }
+        result.job = chunk.job;
+        result.photon_begin = chunk.photon_begin;
+        result.n_photons = chunk.n_photons;
+        FreeHostSimState(hss);
+
+        chunk_results.Push(result);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Add the tallies of run <r> in <chunk> (from <n_photons> photons) to the
+//   result of its batch, and the chunk to the statistics of the run
+//////////////////////////////////////////////////////////////////////////////
+void BatchScheduler::ReduceRun(ChunkResult *chunk, UINT32 r, UINT64 n_photons)
+{
+    BatchJob *job = chunk->job;
+    const PackedBatch *batch = &job->batch;
+    SimState *result = &job->result;
+    UINT64 w[STAT_PEN] = {0, 0, 0};
+
+    for (UINT32 j = batch->A_rz_ofst[r]; j < batch->A_rz_ofst[r + 1]; ++j)
+    {
+        result->A_rz[j] += chunk->A_rz[j];
+        w[STAT_A] += chunk->A_rz[j];
+    }
+    for (UINT32 j = batch->ra_ofst[r]; j < batch->ra_ofst[r + 1]; ++j)
+    {
+        result->Rd_ra[j] += chunk->Rd_ra[j];
+        result->Tt_ra[j] += chunk->Tt_ra[j];
+        w[STAT_RD] += chunk->Rd_ra[j];
+        w[STAT_T] += chunk->Tt_ra[j];
+    }
+    for (UINT32 j = batch->jac_ofst[r]; j < batch->jac_ofst[r + 1]; ++j)
+        result->Rd_jac[j] += chunk->Rd_jac[j];
+
+    RunStats *stats = &job->stats[r];
+    for (int e = 0; e < N_PROFILE_EVENTS; ++e)
+        stats->events[e] += chunk->profile[r * N_PROFILE_EVENTS + e];
+
+    double n = (double)n_photons;
+    stats->n_photons += n_photons;
+    ++stats->n_chunks;
+    stats->sum_n2 += n * n;
+    for (int q = 0; q < STAT_PEN; ++q)
+    {
+        double wq = w[q] / (double)WEIGHT_SCALE;
+        stats->sum_w[q] += wq;
+        stats->sum_w2[q] += wq * wq;
+        stats->sum_wn[q] += wq * n;
+    }
+    if (std_errors)
+    {
+        double depth = PenetrationDepth(chunk->A_rz + batch->A_rz_ofst[r], w[STAT_A], w[STAT_T], &batch->sims[r]);
+        stats->sum_w[STAT_PEN] += depth;
+        stats->sum_w2[STAT_PEN] += depth * depth;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Stage 2: add the tallies of every chunk to the result of its batch
+//////////////////////////////////////////////////////////////////////////////
+void BatchScheduler::ReduceLoop()
+{
+    ChunkResult chunk;
+
+    TraceThreadName("reduce");
+    while (chunk_results.Pop(&chunk))
+    {
+        BatchJob *job = chunk.job;
+        if (!chunk.failed)
+        {
+            TraceScope scope("reduce", "reduce");
+            scope.Args("\"first_run\": %d, \"photons\": %u", job->first_sim_id, chunk.n_photons);
+
+            // Only the runs that overlap the photons of the chunk have
+            // tallies in it.
+            const PackedBatch *batch = &job->batch;
+            UINT32 photon_end = chunk.photon_begin + chunk.n_photons;
+            for (UINT32 r = 0; r < batch->n_runs; ++r)
+            {
+                UINT32 begin = std::max(RunBegin(batch, r), chunk.photon_begin);
+                UINT32 end = std::min(batch->photon_end[r], photon_end);
+                if (begin < end)
+                    ReduceRun(&chunk, r, end - begin);
+            }
+
+            chunk.job = NULL;
+            spare_buffers.Push(chunk);
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (chunk.failed)
+            job->failed = 1;
+        if (--job->chunks_left == 0)
+            job_done.notify_all();
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Number of photons to add to a run with the statistics <stats>, to meet
+//   the targets: the standard errors fall with 1 / sqrt(photons). Every
+//   round adds at least a quarter of the photons so far, and a run with no
+//   weight at all in a quantity with a target goes up to the cap.
+//////////////////////////////////////////////////////////////////////////////
+static UINT64 PhotonsToTarget(const AdaptiveTargets *targets, const RunStats *stats, UINT64 run_photons)
+{
+    UINT64 cap = (targets->max_photons > 0) ? targets->max_photons : 10 * run_photons;
+    if (stats->n_photons >= cap)
+        return 0;
+
+    double ratio = 0; // (standard error / target)^2
+    for (int q = 0; q < N_STATS; ++q)
+    {
+        if (targets->rse[q] > 0)
+        {
+            double rse = RelativeStdError(stats, q);
+            ratio = std::max(ratio, (rse / targets->rse[q]) * (rse / targets->rse[q]));
+        }
+    }
+    if (ratio <= 1)
+        return 0;
+
+    double n = (double)stats->n_photons;
+    double more = std::max(n * ratio - n, 0.25 * n);
+    return (more < (double)(cap - stats->n_photons)) ? (UINT64)more : cap - stats->n_photons;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Warn if a run is registered above the relative standard error target
+//   of a quantity, i.e. if it reached the cap of its photons first
+//////////////////////////////////////////////////////////////////////////////
+static void WarnMissedTargets(const AdaptiveTargets *targets, const RunStats *stats, UINT32 sim_id,
+                              const SimulationStruct *sim)
+{
+    static const char *names[N_STATS] = {"Rd", "A", "T", "the penetration depth"};
+    for (int q = 0; q < N_STATS; ++q)
+    {
+        double rse = RelativeStdError(stats, q);
+        if (targets->rse[q] > 0 && rse > targets->rse[q])
+            fprintf(stderr,
+                    "Simulation %u (%s) misses the target of %s with %llu photons (relative standard error %.3g > "
+                    "%.3g, see --max_photons).\n",
+                    sim_id, sim->outp_filename, names[q], (unsigned long long)stats->n_photons, rse, targets->rse[q]);
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Queue more chunks for the runs of a reduced batch that miss their
+//   targets. The chunks of run r repeat its photon range of the batch, with
+//   the photons of the run after the ones simulated so far. Return false if
+//   all runs are done.
+//////////////////////////////////////////////////////////////////////////////
+bool BatchScheduler::ExtendJob(BatchJob *job)
+{
+    const PackedBatch *batch = &job->batch;
+    UINT64 more[MAX_PACKED_RUNS];
+    UINT64 photon_ofst[MAX_PACKED_RUNS];
+    UINT64 n_chunks = 0;
+    for (UINT32 r = 0; r < batch->n_runs; ++r)
+    {
+        UINT64 run_photons = batch->photon_end[r] - RunBegin(batch, r);
+        more[r] = PhotonsToTarget(&targets, &job->stats[r], run_photons);
+        photon_ofst[r] = job->stats[r].n_photons;
+        if (batch->white && r > 0)
+        {
+            // All runs of a white batch share their photons.
+            more[0] = std::max(more[0], more[r]);
+            more[r] = 0;
+        }
+    }
+    for (UINT32 r = 0; r < batch->n_runs; ++r)
+    {
+        UINT64 chunk = std::min(job->chunk, (UINT64)(batch->photon_end[r] - RunBegin(batch, r)));
+        n_chunks += (more[r] + chunk - 1) / chunk;
+    }
+    if (n_chunks == 0)
+        return false;
+    for (UINT32 r = 0; r < batch->n_runs; ++r)
+        photons_added += more[r];
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job->chunks_left = (UINT32)n_chunks;
+    }
+    for (UINT32 r = 0; r < batch->n_runs; ++r)
+    {
+        UINT64 chunk = std::min(job->chunk, (UINT64)(batch->photon_end[r] - RunBegin(batch, r)));
+        for (UINT64 left = more[r]; left > 0;)
+        {
+            WorkChunk c;
+            c.job = job;
+            c.photon_begin = RunBegin(batch, r);
+            c.n_photons = (UINT32)std::min(left, chunk);
+            c.photon_ofst = photon_ofst[r];
+            chunks.Push(c);
+            left -= c.n_photons;
+            photon_ofst[r] += c.n_photons;
+        }
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Stage 3: register the results of the runs of every batch (without
+//   writing to file), in the order the batches were submitted
+//////////////////////////////////////////////////////////////////////////////
+void BatchScheduler::RegisterLoop()
+{
+    TraceThreadName("register");
+    for (;;)
+    {
+        BatchJob *job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            job_done.wait(lock, [this] { return (n_jobs > 0 && jobs[oldest].chunks_left == 0) || stopping; });
+            if (n_jobs == 0 || jobs[oldest].chunks_left > 0)
+                return;
+            job = &jobs[oldest];
+        }
+
+        // Runs that miss their targets get more photons first.
+        if (adaptive && !job->failed && ExtendJob(job))
+            continue;
+
+        // No other stage touches a reduced batch, so register it without
+        // the lock.
+        const PackedBatch *batch = &job->batch;
+        TraceScope scope("registerSimulationResults", "register");
+        scope.Args("\"first_run\": %d, \"runs\": %u", job->first_sim_id, batch->n_runs);
+        for (UINT32 r = 0; r < batch->n_runs; ++r)
+        {
+            if (job->failed)
+            {
+                fprintf(stderr, "Simulation %u (%s) failed and is not written to the output.\n",
+                        job->first_sim_id + r, batch->sims[r].outp_filename);
+                continue;
+            }
+
+            SimState run_state = job->result;
+            run_state.A_rz = job->result.A_rz + batch->A_rz_ofst[r];
+            run_state.Rd_ra = job->result.Rd_ra + batch->ra_ofst[r];
+            run_state.Tt_ra = job->result.Tt_ra + batch->ra_ofst[r];
+            run_state.Rd_jac = job->result.Rd_jac + batch->jac_ofst[r];
+            simResults->registerSimulationResults(&run_state, &batch->sims[r], &job->stats[r]);
+            if (adaptive)
+                WarnMissedTargets(&targets, &job->stats[r], job->first_sim_id + r, &batch->sims[r]);
+        }
+        runs_done += batch->n_runs;
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            oldest = (oldest + 1) % MAX_BATCHES_IN_FLIGHT;
+            --n_jobs;
+        }
+        slot_freed.notify_all();
+    }
+}
@@ -0,0 +1,268 @@
+/*****************************************************************************
+ *
+ *   Header file for the batch scheduler (persistent workers and work queue)
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPUMCML_SCHED_H
+#define GPUMCML_SCHED_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "gpumcml.h"
+
+// Number of batches that can be in the pipeline at the same time: while
+// batch i is registered, batch i + 1 can be reduced and batch i + 2
+// simulated.
+#define MAX_BATCHES_IN_FLIGHT 3
+
+// Number of chunks each batch is split into per worker (when several
+// workers share it), so that faster workers can take more of them.
+#define CHUNKS_PER_WORKER 4
+
+// With targets for the standard errors (see AdaptiveTargets), or if they are
+// output, every run is split into at least this many chunks, so that the
+// statistics of its (first round of) photons are meaningful.
+#define STAT_MIN_CHUNKS 16
+
+// Photons a CPU worker takes from a chunk at a time (see
+// HostThreadState::batch_length): the first batch, and the fewest.
+#define INITIAL_BATCH_PHOTONS 10000
+#define MIN_BATCH_PHOTONS 1024
+
+// Targets of adaptive photon counts: a run gets more photons until the
+// relative standard error of every quantity q with rse[q] > 0 is at most
+// rse[q], or until it has max_photons photons (0 means 10 times the number
+// of photons of the run).
+typedef struct
+{
+    double rse[N_STATS];
+    UINT64 max_photons;
+} AdaptiveTargets;
+
+// Entry point of a photon engine (RunGPUi, RunCPUi or RunSIMDi)
+typedef void (*RunEngineFn)(HostThreadState *hstate);
+
+//////////////////////////////////////////////////////////////////////////////
+//   FIFO queue of fixed capacity shared between pipeline stages. Push
+//   blocks while the queue is full, so a slow stage holds back the stages
+//   that feed it instead of letting the queue grow.
+//////////////////////////////////////////////////////////////////////////////
+template <typename T> class BoundedQueue
+{
+  public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity > 0 ? capacity : 1), closed(false)
+    {
+    }
+
+    void Push(const T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_full.wait(lock, [this] { return items.size() < capacity; });
+        items.push_back(item);
+        lock.unlock();
+        not_empty.notify_one();
+    }
+
+    // Return false once the queue is closed and empty.
+    bool Pop(T *item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        not_empty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty())
+            return false;
+        *item = items.front();
+        items.pop_front();
+        lock.unlock();
+        not_full.notify_one();
+        return true;
+    }
+
+    // Put <item> at the front, even if the queue is full: a consumer that
+    // hands back part of an item must not wait for the other consumers.
+    void PushFront(const T &item)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        items.push_front(item);
+        lock.unlock();
+        not_empty.notify_one();
+    }
+
+    // Wake up the consumers: Pop fails once the remaining items are taken.
+    void Close()
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        not_empty.notify_all();
+    }
+
+  private:
+    size_t capacity;
+    bool closed;
+    std::deque<T> items;
+    std::mutex mutex;
+    std::condition_variable not_full;
+    std::condition_variable not_empty;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//////////////////////////////////////////////////////////////////////////////
+
+// One batch in the pipeline, with the sum of the tallies of its reduced
+// chunks
+typedef struct
+{
+    PackedBatch batch;
+    int first_sim_id;
+
+    // summed output data of the reduced chunks (from <pool>)
+    SimState result;
+    BufferPool pool;
+
+    // photons per chunk, and the statistics of the chunks of every run
+    UINT64 chunk;
+    RunStats stats[MAX_PACKED_RUNS];
+
+    UINT32 chunks_left; // chunks not reduced yet
+    int failed;         // did any chunk fail?
+} BatchJob;
+
+// Photons photon_begin .. photon_begin + n_photons - 1 of a batch, which
+// draw their random numbers as the photons from photon_ofst on of their runs
+// (see HostThreadState)
+typedef struct
+{
+    BatchJob *job;
+    UINT32 photon_begin;
+    UINT32 n_photons;
+    UINT64 photon_ofst;
+} WorkChunk;
+
+// Tallies of one simulated chunk, on their way to the reduction stage.
+// Spare buffers (job == NULL) go back and forth between the workers and
+// the reduction stage.
+typedef struct
+{
+    BatchJob *job;
+    int failed;
+
+    UINT64 *A_rz;
+    UINT64 *Rd_ra;
+    UINT64 *Tt_ra;
+    double *Rd_jac;
+    UINT64 *profile;
+
+    // photons of the chunk (see WorkChunk)
+    UINT32 photon_begin;
+    UINT32 n_photons;
+} ChunkResult;
+
+//////////////////////////////////////////////////////////////////////////////
+//   Runs the batches of an input file in a pipeline of three stages
+//   connected by bounded queues:
+//    1) simulate: long-lived workers (one per GPU or per CPU thread) pull
+//       chunks of photons from a shared queue, so faster workers take more
+//       chunks and GPU and CPU workers can be mixed;
+//    2) reduce: one thread adds the tallies of every chunk to its batch;
+//    3) register: one thread registers finished batches in <simResults>,
+//       in the order they were submitted.
+//   The engines therefore keep simulating the next batches while earlier
+//   ones are reduced and registered.
+//////////////////////////////////////////////////////////////////////////////
+class BatchScheduler
+{
+  public:
+    // <hstates>[w] is run by <engines>[w]. Each chunk has <chunk_photons>
+    // photons (0 picks a size from the number of workers). All output
+    // buffers, including the ones in the buffer pools of the workers, hold
+    // <rz_size> elements of A_rz, <ra_size> elements of Rd_ra and Tt_ra and
+    // <jac_size> elements of Rd_jac. If <targets> is not NULL, runs get
+    // more photons until they reach the targets. If <std_errors> is set,
+    // the statistics of the runs include the penetration depth. Otherwise,
+    // CPU workers with a target batch duration (batch_seconds) simulate
+    // their chunks in batches of adapted length and queue the rest of a
+    // chunk for the next free worker. The statistics of the chunks depend
+    // on the timing then, so chunks are not split for targets or standard
+    // errors.
+    BatchScheduler(HostThreadState *hstates[], const RunEngineFn engines[], UINT32 n_workers, UINT64 chunk_photons,
+                   UINT32 rz_size, UINT32 ra_size, UINT32 jac_size, const AdaptiveTargets *targets, bool std_errors,
+                   SimulationResults *simResults);
+
+    // Wait for all batches and stop the stages.
+    ~BatchScheduler();
+
+    // Queue the photons of <batch> (whose first run is <first_sim_id>).
+    // Waits first while MAX_BATCHES_IN_FLIGHT batches are in the pipeline.
+    void Submit(const PackedBatch *batch, int first_sim_id);
+
+    // Wait until all submitted batches are registered.
+    void Drain();
+
+    // Photons simulated so far (including the chunks the workers are busy
+    // with), photons added to runs that missed their targets, and runs
+    // registered. Does not block the stages.
+    void GetProgress(UINT64 *photons_done, UINT64 *photons_added, UINT64 *runs_done) const;
+
+  private:
+    void WorkerLoop(UINT32 w);
+    void ReduceLoop();
+    void RegisterLoop();
+    void ReduceRun(ChunkResult *chunk, UINT32 r, UINT64 n_photons);
+    bool ExtendJob(BatchJob *job);
+
+    std::vector<HostThreadState *> hstates;
+    std::vector<RunEngineFn> engines;
+    UINT64 chunk_photons;
+    bool adaptive;
+    bool std_errors;
+    AdaptiveTargets targets;
+    SimulationResults *simResults;
+
+    // stage queues
+    BoundedQueue<WorkChunk> chunks;          // submit -> simulate
+    BoundedQueue<ChunkResult> chunk_results; // simulate -> reduce
+    BoundedQueue<ChunkResult> spare_buffers; // reduce -> simulate
+
+    // progress (see GetProgress)
+    std::atomic<UINT64> photons_done; // photons of the simulated chunks
+    std::atomic<UINT64> photons_added;
+    std::atomic<UINT64> runs_done;
+
+    std::vector<std::thread> workers;
+    std::thread reducer;
+    std::thread registrar;
+
+    // ring of batch slots: jobs[oldest], ... (n_jobs of them) are in the
+    // pipeline
+    BatchJob jobs[MAX_BATCHES_IN_FLIGHT];
+    UINT32 oldest;
+    UINT32 n_jobs;
+    bool stopping;
+
+    std::mutex mutex;                   // guards the batch slots
+    std::condition_variable slot_freed; // signaled when a batch is registered
+    std::condition_variable job_done;   // signaled when a batch is reduced
+};
+
+#endif // GPUMCML_SCHED_H
@@ -0,0 +1,65 @@
+/*****************************************************************************
+ *
+ *   Seed initialization for the random number generators (host side)
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "gpumcml.h"
+#include "gpumcml_rng.h"
+#include "mcml_safeprimes.h"
+
+//////////////////////////////////////////////////////////////////////////////
+//   Multipliers of the random number generators (generated at build time by
+//   tools/mcml_safeprimes.cpp)
+//////////////////////////////////////////////////////////////////////////////
+int init_RNG(const UINT32 **multipliers, UINT32 *n_multipliers)
+{
+    *multipliers = safeprime_multipliers;
+    *n_multipliers = MAX_RNG_MULTIPLIERS;
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Random number streams: every photon gets its own generator, seeded from
+//   a hash of the key of its run and its index in the run. The generators
+//   are therefore independent of the order in which photons are simulated,
+//   and of the thread that simulates them.
+//////////////////////////////////////////////////////////////////////////////
+
+UINT64 GetRunKey(UINT64 seed, const SimulationStruct *sim)
+{
+    // FNV-1a of the ID
+    UINT64 h = 0xcbf29ce484222325ull;
+    for (const char *c = sim->outp_filename; *c != '\0'; ++c)
+        h = (h ^ (unsigned char)*c) * 0x100000001b3ull;
+    return Mix64(Mix64(seed) ^ h);
+}
+
+void SeedBatch(PackedBatch *batch, UINT64 seed)
+{
+    for (UINT32 r = 0; r < batch->n_runs; ++r)
+        batch->rng_key[r] = GetRunKey(seed, &batch->sims[r]);
+}
+
+void SeedPhotonRNG(UINT64 key, UINT64 photon, const UINT32 *multipliers, UINT32 n_multipliers, UINT64 *x, UINT32 *a)
+{
+    MWCRng rng;
+    rng.Seed(key, photon, multipliers, n_multipliers);
+    rng.Save(x, a);
+}
@@ -0,0 +1,608 @@
+/*****************************************************************************
+ *
+ *   SIMD photon engine of MCMLGPU (CPU backend)
+ *   =========================================================================
+ *   Each host thread advances MCML_SIMD_WIDTH photons at once. The photons
+ *   of a lane group are kept as a struct of arrays (the layout of
+ *   GPUThreadStates), every lane has its own MWC random number generator
+ *   (seeded for every photon it launches), and lanes whose photon is
+ *   terminated are refilled from the photon pool of the thread, the way
+ *   is_active and LaunchPhoton work in MCMLKernel.
+ *   In a packed batch, the pool spans several runs: every lane carries the
+ *   run of its photon, so lanes of different runs advance together.
+ *
+ *   This file is compiled once per instruction set (see CMakeLists.txt):
+ *   MCML_SIMD_ISA names the variant and MCML_SIMD_WIDTH is its lane count.
+ *   RunSIMDi in gpumcml_cpu.cpp picks the widest variant the CPU supports.
+ *   Everything here has internal linkage and avoids templates of the
+ *   standard library, so that no code compiled for a wider instruction set
+ *   can be shared with the other variants by the linker.
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "gpumcml_cpu.h"
+
+#if !defined(MCML_SIMD_ISA) || !defined(MCML_SIMD_WIDTH)
+#error "MCML_SIMD_ISA and MCML_SIMD_WIDTH must be defined by the build system"
+#endif
+
+#define SIMD_CONCAT2(a, b) a##_##b
+#define SIMD_CONCAT(a, b) SIMD_CONCAT2(a, b)
+#define SIMD_NAME(fn) SIMD_CONCAT(fn, MCML_SIMD_ISA)
+
+#define W MCML_SIMD_WIDTH
+
+namespace
+{
+
+//////////////////////////////////////////////////////////////////////////////
+//   Vector types (GCC/Clang vector extensions)
+//   Comparisons yield integer vectors with -1 (true) or 0 (false) per lane.
+//////////////////////////////////////////////////////////////////////////////
+typedef float vfloat __attribute__((vector_size(W * sizeof(float))));
+typedef int vint __attribute__((vector_size(W * sizeof(int))));
+typedef unsigned int vuint __attribute__((vector_size(W * sizeof(unsigned int))));
+typedef long long vint64 __attribute__((vector_size(W * sizeof(long long))));
+typedef unsigned long long vuint64 __attribute__((vector_size(W * sizeof(unsigned long long))));
+
+inline vfloat splat(float s)
+{
+    vfloat v = {};
+    return v + s;
+}
+
+inline vfloat select(vint mask, vfloat a, vfloat b)
+{
+    return mask ? a : b;
+}
+
+inline bool any(vint mask)
+{
+    int r = 0;
+    for (int l = 0; l < W; ++l)
+        r |= mask[l];
+    return r != 0;
+}
+
+inline vfloat vabs(vfloat v)
+{
+    return (vfloat)((vuint)v & 0x7fffffffu);
+}
+
+// magnitude of <mag> with the sign of <sgn>
+inline vfloat vcopysign(vfloat mag, vfloat sgn)
+{
+    return (vfloat)(((vuint)mag & 0x7fffffffu) | ((vuint)sgn & 0x80000000u));
+}
+
+inline vfloat vmin(vfloat a, vfloat b)
+{
+    return select(a < b, a, b);
+}
+
+inline vfloat vsqrt(vfloat v)
+{
+    vfloat r;
+    for (int l = 0; l < W; ++l)
+        r[l] = __builtin_sqrtf(v[l]);
+    return r;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Natural logarithm for normal, positive inputs (Cephes logf)
+//////////////////////////////////////////////////////////////////////////////
+inline vfloat vlog(vfloat v)
+{
+    vint bits = (vint)v;
+    vint e = ((bits >> 23) & 0xff) - 126;
+    // mantissa in [0.5, 1)
+    vfloat x = (vfloat)((bits & (int)0x807fffff) | 0x3f000000);
+
+    vint small = x < 0.707106781186547524f;
+    vfloat fe = __builtin_convertvector(e, vfloat) - (vfloat)(small & (vint)splat(FP_ONE));
+    x = select(small, x + x, x) - FP_ONE;
+
+    vfloat z = x * x;
+    vfloat y = splat(7.0376836292E-2f);
+    y = y * x - 1.1514610310E-1f;
+    y = y * x + 1.1676998740E-1f;
+    y = y * x - 1.2420140846E-1f;
+    y = y * x + 1.4249322787E-1f;
+    y = y * x - 1.6668057665E-1f;
+    y = y * x + 2.0000714765E-1f;
+    y = y * x - 2.4999993993E-1f;
+    y = y * x + 3.3333331174E-1f;
+    y = y * x * z;
+
+    y += -2.12194440E-4f * fe;
+    y += -0.5f * z;
+    x = x + y;
+    x += 0.693359375f * fe;
+    return x;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   sin(2*pi*r) and cos(2*pi*r) for r in [0,1)
+//   The reduction to [-pi/4, pi/4] is done on r, so it is exact.
+//////////////////////////////////////////////////////////////////////////////
+inline void vsincos2pi(vfloat r, vfloat *s, vfloat *c)
+{
+    vint q = __builtin_convertvector(r * 4.0f + 0.5f, vint);
+    vfloat t = (r - __builtin_convertvector(q, vfloat) * 0.25f) * (FP_TWO * 3.14159265358979f);
+    vfloat t2 = t * t;
+
+    vfloat sp = ((-1.9515295891E-4f * t2 + 8.3321608736E-3f) * t2 - 1.6666654611E-1f) * t2 * t + t;
+    vfloat cp = ((2.443315711809948E-5f * t2 - 1.388731625493765E-3f) * t2 + 4.166664568298827E-2f) * t2 * t2 -
+                0.5f * t2 + FP_ONE;
+
+    // rotate by q quarter turns
+    q &= 3;
+    vint swap = (q & 1) != 0;
+    vfloat sr = select(swap, cp, sp);
+    vfloat cr = select(swap, sp, cp);
+    vint neg_s = (q & 2) != 0;
+    vint neg_c = (q == 1) | (q == 2);
+    *s = select(neg_s, -sr, sr);
+    *c = select(neg_c, -cr, cr);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Per-lane layer properties, refreshed only when the layer of a lane
+//   changes (launch or transmission), so that the hot path never gathers.
+//////////////////////////////////////////////////////////////////////////////
+struct LaneLayers
+{
+    vfloat z0, z1;
+    vfloat n, n0, n1; // refractive index of this layer, the one above and the one below
+    vfloat rmuas;
+    vfloat mua_muas;
+    vfloat g;
+    vfloat cos_crit0, cos_crit1;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//   Photon states of one lane group
+//   Same struct-of-arrays layout as GPUThreadStates.
+//////////////////////////////////////////////////////////////////////////////
+struct LaneGroup
+{
+    // cartesian coordinates of the photon [cm]
+    vfloat photon_x;
+    vfloat photon_y;
+    vfloat photon_z;
+
+    // directional cosines of the photon
+    vfloat photon_ux;
+    vfloat photon_uy;
+    vfloat photon_uz;
+
+    vfloat photon_w; // photon weight
+
+    // index to layer where the photon resides
+    vuint photon_layer;
+
+    vint is_active; // is this lane active? (-1 or 0)
+
+    // run of the photon (index into the thread contexts) and its grid
+    vuint photon_run;
+    vfloat det_dz, det_dr, det_nz, det_nr;
+
+    // random number generators, one per lane
+    vuint64 rnd_x;
+    vuint64 rnd_a;
+
+    LaneLayers lyr;
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//   Photons that are not launched yet, taken run by run.
+//   Run k has n_photons[k] photons and is described by ctxs[k].
+//////////////////////////////////////////////////////////////////////////////
+struct PhotonPool
+{
+    CPUThreadContext *ctxs;
+    const UINT32 *n_photons;
+    UINT32 n_ctx;
+
+    UINT32 cur;  // current run
+    UINT32 left; // photons left in the current run
+};
+
+//////////////////////////////////////////////////////////////////////////////
+//   Generates a random number between 0 and 1 [0,1) in every lane.
+//   Only the generators of the lanes in <mask> advance.
+//////////////////////////////////////////////////////////////////////////////
+inline vfloat rand_MWC_co(LaneGroup *grp, vint mask)
+{
+    vuint64 xn = (grp->rnd_x & 0xffffffffull) * grp->rnd_a + (grp->rnd_x >> 32);
+    vint64 mask64 = __builtin_convertvector(mask, vint64);
+    grp->rnd_x = mask64 ? xn : grp->rnd_x;
+
+    vuint lo = __builtin_convertvector(xn, vuint);
+    vint hi24 = (vint)(lo >> 8);
+    return __builtin_convertvector(hi24, vfloat) * (FP_ONE / (GFLOAT)(1 << 24));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Generates a random number between 0 and 1 (0,1] in every lane
+//////////////////////////////////////////////////////////////////////////////
+inline vfloat rand_MWC_oc(LaneGroup *grp, vint mask)
+{
+    return FP_ONE - rand_MWC_co(grp, mask);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Load the properties of the current layer of lane <l>
+//////////////////////////////////////////////////////////////////////////////
+inline void RefreshLaneLayer(const CPUThreadContext *ctx, LaneGroup *grp, int l)
+{
+    UINT32 layer = grp->photon_layer[l];
+    const LayerStructCPU *spec = &ctx->layerspecs[layer];
+    grp->lyr.z0[l] = spec->z0;
+    grp->lyr.z1[l] = spec->z1;
+    grp->lyr.n[l] = spec->n;
+    grp->lyr.n0[l] = ctx->layerspecs[layer - 1].n;
+    grp->lyr.n1[l] = ctx->layerspecs[layer + 1].n;
+    grp->lyr.rmuas[l] = spec->rmuas;
+    grp->lyr.mua_muas[l] = spec->mua_muas;
+    grp->lyr.g[l] = spec->g;
+    grp->lyr.cos_crit0[l] = spec->cos_crit0;
+    grp->lyr.cos_crit1[l] = spec->cos_crit1;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Launch a new photon of run <run> in lane <l> (see LaunchPhoton)
+//////////////////////////////////////////////////////////////////////////////
+inline void LaunchPhotonInLane(const PhotonPool *pool, LaneGroup *grp, int l, UINT32 run)
+{
+    CPUThreadContext *ctx = &pool->ctxs[run];
+    UINT64 rnd_x;
+    UINT32 rnd_a;
+    SeedPhotonRNG(ctx->rng_key, ctx->next_photon++, ctx->multipliers, ctx->n_multipliers, &rnd_x, &rnd_a);
+    CountLaunch(ctx);
+    grp->rnd_x[l] = rnd_x;
+    grp->rnd_a[l] = rnd_a;
+
+    grp->photon_run[l] = run;
+    grp->det_dz[l] = ctx->param.dz;
+    grp->det_dr[l] = ctx->param.dr;
+    grp->det_nz[l] = (GFLOAT)ctx->param.nz;
+    grp->det_nr[l] = (GFLOAT)ctx->param.nr;
+
+    grp->photon_x[l] = grp->photon_y[l] = grp->photon_z[l] = MCML_FP_ZERO;
+    grp->photon_ux[l] = grp->photon_uy[l] = MCML_FP_ZERO;
+    grp->photon_uz[l] = FP_ONE;
+    grp->photon_w[l] = ctx->param.init_photon_w;
+    grp->photon_layer[l] = 1;
+    RefreshLaneLayer(ctx, grp, l);
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Count <event> for the photon of every lane in <mask>, in its run
+//////////////////////////////////////////////////////////////////////////////
+inline void CountLanes(PhotonPool *pool, const LaneGroup *grp, vint mask, int event)
+{
+#ifdef MCML_PROFILE
+    for (int l = 0; l < W; ++l)
+    {
+        if (mask[l])
+            pool->ctxs[grp->photon_run[l]].profile.Count(event);
+    }
+#else
+    (void)pool;
+    (void)grp;
+    (void)mask;
+    (void)event;
+#endif
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Refill lane <l> from the photon pool, or retire it if the pool is empty.
+//   A retired lane keeps a freshly launched (but inactive) photon, so that
+//   its state stays valid while it is carried along masked.
+//////////////////////////////////////////////////////////////////////////////
+inline void RefillLane(PhotonPool *pool, LaneGroup *grp, int l)
+{
+    while (pool->left == 0 && pool->cur + 1 < pool->n_ctx)
+    {
+        ++pool->cur;
+        pool->left = pool->n_photons[pool->cur];
+    }
+
+    if (pool->left > 0)
+    {
+        --pool->left;
+        LaunchPhotonInLane(pool, grp, l, pool->cur);
+        grp->is_active[l] = -1;
+        pool->ctxs[pool->cur].profile.Count(PROFILE_LAUNCHES);
+    }
+    else
+    {
+        LaunchPhotonInLane(pool, grp, l, grp->photon_run[l]);
+        grp->is_active[l] = 0;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Photon loop for one lane group
+//////////////////////////////////////////////////////////////////////////////
+template <int ignoreAdetection> void SimulateLaneGroup(PhotonPool *pool, LaneGroup *grp)
+{
+    for (int l = 0; l < W; ++l)
+        RefillLane(pool, grp, l);
+
+    while (any(grp->is_active))
+    {
+        vint act = grp->is_active;
+        CountLanes(pool, grp, act, PROFILE_STEPS);
+
+        //>>>>>>>>> StepSizeInTissue() in MCML
+        vfloat s = -vlog(rand_MWC_oc(grp, act)) * grp->lyr.rmuas;
+
+        //>>>>>>>>> HitBoundary() in MCML
+        vfloat uz = grp->photon_uz;
+        vfloat z_bound = select(uz > MCML_FP_ZERO, grp->lyr.z1, grp->lyr.z0);
+        vfloat dl_b = (z_bound - grp->photon_z) / uz;
+        vint hit = (uz != MCML_FP_ZERO) & (s > dl_b);
+        s = select(hit, dl_b, s);
+
+        // Hop (inactive lanes are relaunched before they are used again)
+        grp->photon_x += s * grp->photon_ux;
+        grp->photon_y += s * grp->photon_uy;
+        grp->photon_z += s * grp->photon_uz;
+
+        vint refl = act & hit;
+        vint drop = act & ~hit;
+        CountLanes(pool, grp, refl, PROFILE_BOUNDARY_HITS);
+        CountLanes(pool, grp, drop, PROFILE_SCATTERS);
+
+        //////////////////////////////////////////////////////////////////////
+        //   FastReflectTransmit() for the lanes in <refl>
+        //////////////////////////////////////////////////////////////////////
+        if (any(refl))
+        {
+            vint down = uz > MCML_FP_ZERO;
+            vfloat cos_crit = select(down, grp->lyr.cos_crit1, grp->lyr.cos_crit0);
+            vfloat nt = select(down, grp->lyr.n1, grp->lyr.n0);
+
+            // cosine of the incident angle (0 to 90 deg)
+            vfloat ca1 = vabs(uz);
+            vfloat ni_nt = grp->lyr.n / nt;
+
+            vint normal = ca1 > COSZERO;
+            vfloat sa1 = select(normal, splat(MCML_FP_ZERO), vsqrt(FP_ONE - ca1 * ca1));
+            vfloat sa2 = vmin(ni_nt * sa1, splat(FP_ONE));
+            vfloat uz1 = vsqrt(FP_ONE - sa2 * sa2); // uz1 = ca2
+
+            vfloat ca1ca2 = ca1 * uz1;
+            vfloat sa1sa2 = sa1 * sa2;
+            vfloat sa1ca2 = select(normal, splat(FP_ONE), sa1 * uz1);
+            vfloat ca1sa2 = select(normal, ni_nt, ca1 * sa2);
+
+            vfloat cam = ca1ca2 + sa1sa2; /* c- = cc + ss. */
+            vfloat sap = sa1ca2 + ca1sa2; /* s+ = sc + cs. */
+            vfloat sam = sa1ca2 - ca1sa2; /* s- = sc - cs. */
+
+            vfloat rFresnel = sam / (sap * cam);
+            rFresnel *= rFresnel;
+            rFresnel *= (ca1ca2 * ca1ca2 + sa1sa2 * sa1sa2);
+            rFresnel = select((ca1 < COSNINETYDEG) | (sa2 == FP_ONE), splat(FP_ONE), rFresnel);
+
+            // Only the lanes above the critical angle draw a random number.
+            vint fresnel = refl & (ca1 > cos_crit);
+            vfloat rand = rand_MWC_co(grp, fresnel);
+            vint transmit = fresnel & (rFresnel < rand);
+            CountLanes(pool, grp, refl & ~fresnel, PROFILE_TIR);
+            CountLanes(pool, grp, transmit, PROFILE_TRANSMISSIONS);
+
+            // The default move is to reflect.
+            grp->photon_uz = select(refl, -uz, uz);
+
+            // The move is to transmit.
+            grp->photon_ux = select(transmit, grp->photon_ux * ni_nt, grp->photon_ux);
+            grp->photon_uy = select(transmit, grp->photon_uy * ni_nt, grp->photon_uy);
+            grp->photon_uz = select(transmit, vcopysign(uz1, uz), grp->photon_uz);
+
+            if (any(transmit))
+            {
+                for (int l = 0; l < W; ++l)
+                {
+                    if (!transmit[l])
+                        continue;
+
+                    CPUThreadContext *ctx = &pool->ctxs[grp->photon_run[l]];
+                    const SimParamCPU *param = &ctx->param;
+                    UINT32 layer = (uz[l] > MCML_FP_ZERO) ? grp->photon_layer[l] + 1 : grp->photon_layer[l] - 1;
+                    grp->photon_layer[l] = layer;
+
+                    if (layer == 0 || layer > param->num_layers)
+                    {
+                        // transmitted
+                        GFLOAT uz2 = grp->photon_uz[l];
+                        UINT64 *ra_arr = ctx->Tt_ra;
+                        if (layer == 0)
+                        {
+                            // diffuse reflectance
+                            uz2 = -uz2;
+                            ra_arr = ctx->Rd_ra;
+                        }
+
+                        GFLOAT fa = acosf(uz2) * FP_TWO * RPI * param->na;
+                        UINT32 ia = (fa > MCML_FP_ZERO) ? (UINT32)fa : 0;
+                        if (ia >= param->na)
+                            ia = param->na - 1;
+                        GFLOAT px = grp->photon_x[l], py = grp->photon_y[l];
+                        GFLOAT fr = __builtin_sqrtf(px * px + py * py) / param->dr;
+                        UINT32 ir = (fr < (GFLOAT)param->nr) ? (UINT32)fr : param->nr - 1;
+
+                        ra_arr[ia * param->nr + ir] += (UINT32)(grp->photon_w[l] * WEIGHT_SCALE);
+
+                        // Kill the photon. Its (ambient) layer is never used
+                        // since the roulette below relaunches it.
+                        grp->photon_w[l] = MCML_FP_ZERO;
+                    }
+                    else
+                    {
+                        RefreshLaneLayer(ctx, grp, l);
+                    }
+                }
+            }
+        }
+
+        //////////////////////////////////////////////////////////////////////
+        //   Drop() and Spin() for the lanes in <drop>
+        //////////////////////////////////////////////////////////////////////
+        if (any(drop))
+        {
+            vfloat dwa = grp->photon_w * grp->lyr.mua_muas;
+            grp->photon_w = select(drop, grp->photon_w - dwa, grp->photon_w);
+
+            if (ignoreAdetection == 0)
+            {
+                vfloat fz = grp->photon_z / grp->det_dz;
+                vfloat fr = vsqrt(grp->photon_x * grp->photon_x + grp->photon_y * grp->photon_y) / grp->det_dr;
+                // Only record if photon is not at the edge!!
+                // (negative values truncate to 0, as in the automatic __float2uint_rz)
+                fz = select(fz > MCML_FP_ZERO, fz, splat(MCML_FP_ZERO));
+                vint in_grid = drop & (fz < grp->det_nz) & (fr < grp->det_nr);
+                vint iz = __builtin_convertvector(fz, vint);
+                vint ir = __builtin_convertvector(fr, vint);
+                for (int l = 0; l < W; ++l)
+                {
+                    if (in_grid[l])
+                    {
+                        CPUThreadContext *ctx = &pool->ctxs[grp->photon_run[l]];
+                        ctx->A_rz[(UINT32)ir[l] * ctx->param.nz + (UINT32)iz[l]] += (UINT32)(dwa[l] * WEIGHT_SCALE);
+                    }
+                }
+                CountLanes(pool, grp, in_grid, PROFILE_TALLY_GMEM);
+            }
+
+            //>>>>>>>>> Spin() in MCML
+            vfloat g = grp->lyr.g;
+            vfloat cost = FP_TWO * rand_MWC_oc(grp, drop) - FP_ONE;
+            vfloat temp = (FP_ONE - g * g) / (FP_ONE + g * cost);
+            cost = select(g != MCML_FP_ZERO, (FP_ONE + g * g - temp * temp) / (FP_TWO * g), cost);
+            vfloat sint = vsqrt(FP_ONE - cost * cost);
+
+            /* spin psi 0-2pi. */
+            vfloat sinp, cosp;
+            vsincos2pi(rand_MWC_co(grp, drop), &sinp, &cosp);
+
+            vfloat stcp = sint * cosp;
+            vfloat stsp = sint * sinp;
+
+            vfloat last_ux = grp->photon_ux;
+            vfloat last_uy = grp->photon_uy;
+            vfloat last_uz = grp->photon_uz;
+
+            // Regular incident.
+            temp = FP_ONE / vsqrt(FP_ONE - last_uz * last_uz);
+            vfloat ux = (stcp * last_ux * last_uz - stsp * last_uy) * temp + last_ux * cost;
+            vfloat uy = (stcp * last_uy * last_uz + stsp * last_ux) * temp + last_uy * cost;
+            vfloat uz_new = -stcp / temp + last_uz * cost;
+
+            // Normal incident.
+            vint normal = vabs(last_uz) > COSZERO;
+            ux = select(normal, stcp, ux);
+            uy = select(normal, stsp, uy);
+            uz_new = select(normal, vcopysign(cost, last_uz * cost), uz_new);
+
+            // Normalize unit vector to ensure its magnitude is 1 (unity)
+            temp = FP_ONE / vsqrt(ux * ux + uy * uy + uz_new * uz_new);
+            grp->photon_ux = select(drop, ux * temp, last_ux);
+            grp->photon_uy = select(drop, uy * temp, last_uy);
+            grp->photon_uz = select(drop, uz_new * temp, last_uz);
+        }
+
+        /***********************************************************
+         *  >>>>>>>>> Roulette()
+         *  If the photon weight is small, the photon packet tries
+         *  to survive a roulette.
+         ****/
+        vint low = act & (grp->photon_w < WEIGHT);
+        if (any(low))
+        {
+            vfloat rand = rand_MWC_co(grp, low);
+            vint survive = low & (grp->photon_w != MCML_FP_ZERO) & (rand < CHANCE);
+            grp->photon_w = select(survive, grp->photon_w * (FP_ONE / CHANCE), grp->photon_w);
+
+            // Terminated photons are replaced by new ones from the pool.
+            vint dead = low & ~survive;
+            CountLanes(pool, grp, survive, PROFILE_ROULETTE_SURVIVALS);
+            CountLanes(pool, grp, dead & (grp->photon_w != MCML_FP_ZERO), PROFILE_ROULETTE_KILLS);
+            for (int l = 0; l < W; ++l)
+            {
+                if (dead[l])
+                    RefillLane(pool, grp, l);
+            }
+        }
+    }
+}
+
+} // namespace
+
+//////////////////////////////////////////////////////////////////////////////
+//   Number of photons advanced at once by this variant
+//////////////////////////////////////////////////////////////////////////////
+UINT32 SIMD_NAME(GetSIMDWidth)()
+{
+    return W;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Simulate n_photons[k] photons of each run ctxs[k] (k < n_ctx) on one
+//   lane group
+//////////////////////////////////////////////////////////////////////////////
+void SIMD_NAME(SimulatePhotonsSIMD)(CPUThreadContext *ctxs, const UINT32 *n_photons, UINT32 n_ctx, int ignoreAdetection)
+{
+    if (n_ctx == 0)
+        return;
+
+    PhotonPool pool;
+    pool.ctxs = ctxs;
+    pool.n_photons = n_photons;
+    pool.n_ctx = n_ctx;
+    pool.cur = 0;
+    pool.left = n_photons[0];
+
+    LaneGroup *grp = (LaneGroup *)aligned_alloc(64, (sizeof(LaneGroup) + 63) / 64 * 64);
+    if (grp == NULL)
+    {
+        fprintf(stderr, "Error allocating the SIMD lane group\n");
+        exit(1);
+    }
+    memset(grp, 0, sizeof(LaneGroup));
+
+    if (ignoreAdetection == 1)
+    {
+        SimulateLaneGroup<1>(&pool, grp);
+    }
+    else
+    {
+        SimulateLaneGroup<0>(&pool, grp);
+    }
+
+    free(grp);
+}
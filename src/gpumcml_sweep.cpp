@@ -0,0 +1,326 @@
+/*****************************************************************************
+ *
+ *   Parameter sweeps of MCMLGPU
+ *   =========================================================================
+ *   Runs are generated from a base geometry and per-layer ranges or lists
+ *   of parameters (grid, Latin hypercube or random designs) when they are
+ *   needed, instead of being written to and parsed from an .mci file.
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <climits>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "gpumcml_sweep.h"
+
+//////////////////////////////////////////////////////////////////////////////
+//   Deterministic random numbers: every sample is a hash of the seed, the
+//   run index and the parameter, so runs can be generated in any order.
+//////////////////////////////////////////////////////////////////////////////
+static UINT64 Mix64(UINT64 z)
+{
+    z += 0x9e3779b97f4a7c15ull;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+    return z ^ (z >> 31);
+}
+
+// Uniform number in [0, 1)
+static double Uniform(UINT64 seed, UINT64 index, UINT32 dim)
+{
+    return (Mix64(Mix64(seed ^ Mix64(index)) + dim) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Element <i> of a random permutation of 0 .. n - 1 chosen by <key>: a
+// Feistel network permutes the smallest even power of 2 >= n, and values
+// outside 0 .. n - 1 are permuted again until they fall inside.
+static UINT64 Permute(UINT64 i, UINT64 n, UINT64 key)
+{
+    UINT32 bits = 2;
+    while ((1ull << bits) < n)
+        bits += 2;
+    UINT32 half = bits / 2;
+    UINT64 mask = (1ull << half) - 1;
+
+    do
+    {
+        UINT64 l = i >> half, r = i & mask;
+        for (UINT64 round = 0; round < 4; ++round)
+        {
+            UINT64 t = l ^ (Mix64(key + (round << 56) + r) & mask);
+            l = r;
+            r = t;
+        }
+        i = (l << half) | r;
+    } while (i >= n);
+    return i;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Parse a field of a layer line: a value, a list v1,v2,... or a range
+//   lo:hi or lo:hi:n. Return 0 if successful.
+//////////////////////////////////////////////////////////////////////////////
+static int ParseParam(const char *token, SweepParam *param)
+{
+    param->values.clear();
+    param->lo = param->hi = 0;
+    param->n_steps = 0;
+
+    const char *p = token;
+    char *end;
+    if (strchr(token, ':') != NULL)
+    {
+        param->lo = strtof(p, &end);
+        if (end == p || *end != ':')
+            return 1;
+        p = end + 1;
+        param->hi = strtof(p, &end);
+        if (end == p || (*end != ':' && *end != '\0'))
+            return 1;
+        if (*end == ':')
+        {
+            p = end + 1;
+            long n_steps = strtol(p, &end, 10);
+            if (end == p || *end != '\0' || n_steps < 1)
+                return 1;
+            param->n_steps = (UINT32)n_steps;
+        }
+        return 0;
+    }
+
+    for (;;)
+    {
+        float value = strtof(p, &end);
+        if (end == p || (*end != ',' && *end != '\0'))
+            return 1;
+        param->values.push_back(value);
+        if (*end == '\0')
+            return 0;
+        p = end + 1;
+    }
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Read a sweep file
+//////////////////////////////////////////////////////////////////////////////
+int SweepDesign::Load(const char *filename)
+{
+    FILE *pFile = fopen(filename, "r");
+    if (pFile == NULL)
+    {
+        perror("Error opening sweep file");
+        return 1;
+    }
+
+    this->filename = filename;
+    name = "sweep";
+    design = -1;
+    n_runs = 0;
+    seed = 0;
+    number_of_photons = 0;
+    memset(&det, 0, sizeof(det));
+    n_above = n_below = 1.0f;
+    params.clear();
+
+    char line[STR_LEN * 4];
+    int line_no = 0;
+    int error = 0;
+    while (!error && fgets(line, sizeof(line), pFile) != NULL)
+    {
+        ++line_no;
+        char *comment = strchr(line, '#');
+        if (comment != NULL)
+            *comment = '\0';
+
+        char key[STR_LEN], args[SWEEP_FIELDS + 1][STR_LEN];
+        int n_args = sscanf(line, "%199s %199s %199s %199s %199s %199s %199s", key, args[0], args[1], args[2],
+                            args[3], args[4], args[5]) - 1;
+        if (n_args < 0)
+            continue;
+
+        if (strcmp(key, "design") == 0 && n_args >= 1)
+        {
+            if (strcmp(args[0], "grid") == 0 && n_args == 1)
+            {
+                design = SWEEP_GRID;
+            }
+            else if ((strcmp(args[0], "lhs") == 0 || strcmp(args[0], "random") == 0) && n_args == 3)
+            {
+                design = (strcmp(args[0], "lhs") == 0) ? SWEEP_LHS : SWEEP_RANDOM;
+                n_runs = strtoull(args[1], NULL, 10);
+                seed = strtoull(args[2], NULL, 10);
+                error = (n_runs == 0);
+            }
+            else
+            {
+                error = 1;
+            }
+        }
+        else if (strcmp(key, "name") == 0 && n_args == 1)
+        {
+            name = args[0];
+        }
+        else if (strcmp(key, "photons") == 0 && n_args == 1)
+        {
+            number_of_photons = (UINT32)strtoul(args[0], NULL, 10);
+        }
+        else if (strcmp(key, "grid") == 0 && n_args == 5)
+        {
+            det.dz = strtof(args[0], NULL);
+            det.dr = strtof(args[1], NULL);
+            det.nz = (UINT32)strtoul(args[2], NULL, 10);
+            det.nr = (UINT32)strtoul(args[3], NULL, 10);
+            det.na = (UINT32)strtoul(args[4], NULL, 10);
+        }
+        else if (strcmp(key, "above") == 0 && n_args == 1)
+        {
+            n_above = strtof(args[0], NULL);
+        }
+        else if (strcmp(key, "below") == 0 && n_args == 1)
+        {
+            n_below = strtof(args[0], NULL);
+        }
+        else if (strcmp(key, "layer") == 0 && n_args == SWEEP_FIELDS)
+        {
+            for (int f = 0; f < SWEEP_FIELDS && !error; ++f)
+            {
+                SweepParam param;
+                error = ParseParam(args[f], &param);
+                params.push_back(param);
+            }
+        }
+        else
+        {
+            error = 1;
+        }
+    }
+    fclose(pFile);
+
+    if (error)
+    {
+        fprintf(stderr, "Error reading line %d of sweep file %s\n", line_no, filename);
+        return 1;
+    }
+    if (design < 0 || number_of_photons == 0 || det.nz == 0 || det.nr == 0 || det.na == 0 || params.empty())
+    {
+        fprintf(stderr, "Sweep file %s needs a design, photons, grid and at least one layer\n", filename);
+        return 1;
+    }
+
+    if (design == SWEEP_GRID)
+    {
+        // Every combination of the values of the parameters is a run.
+        n_values.assign(params.size(), 1);
+        strides.assign(params.size(), 1);
+        n_runs = 1;
+        for (size_t d = params.size(); d-- > 0;)
+        {
+            const SweepParam *param = &params[d];
+            n_values[d] = param->values.empty() ? param->n_steps : param->values.size();
+            if (n_values[d] == 0)
+            {
+                fprintf(stderr, "Ranges of grid sweeps need a number of steps (lo:hi:n) in %s\n", filename);
+                return 1;
+            }
+            strides[d] = n_runs;
+            if (n_runs > (UINT64)INT_MAX / n_values[d])
+            {
+                fprintf(stderr, "Grid sweep %s has too many runs\n", filename);
+                return 1;
+            }
+            n_runs *= n_values[d];
+        }
+    }
+    if (n_runs > (UINT64)INT_MAX)
+    {
+        fprintf(stderr, "Sweep %s has too many runs\n", filename);
+        return 1;
+    }
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Value of parameter <dim> (param) in run <index>
+//////////////////////////////////////////////////////////////////////////////
+float SweepDesign::Sample(const SweepParam *param, UINT64 index, UINT32 dim) const
+{
+    if (param->values.size() == 1)
+        return param->values[0];
+
+    double u;
+    if (design == SWEEP_GRID)
+    {
+        UINT64 step = (index / strides[dim]) % n_values[dim];
+        if (!param->values.empty())
+            return param->values[step];
+        if (param->n_steps == 1)
+            return param->lo;
+        return (float)(param->lo + (double)(param->hi - param->lo) * step / (param->n_steps - 1));
+    }
+    else if (design == SWEEP_LHS)
+    {
+        // One run in each of the n_runs strata of every parameter
+        u = (Permute(index, n_runs, Mix64(seed + dim)) + Uniform(seed, index, dim)) / n_runs;
+    }
+    else
+    {
+        u = Uniform(seed, index, dim);
+    }
+
+    if (!param->values.empty())
+    {
+        size_t i = (size_t)(u * param->values.size());
+        return param->values[(i < param->values.size()) ? i : param->values.size() - 1];
+    }
+    return (float)(param->lo + u * (param->hi - param->lo));
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Generate run <index>
+//////////////////////////////////////////////////////////////////////////////
+void SweepDesign::MakeRun(UINT64 index, SimulationStruct *sim, int ignoreAdetection) const
+{
+    snprintf(sim->outp_filename, STR_LEN, "%s_%llu", name.c_str(), (unsigned long long)index);
+    snprintf(sim->inp_filename, STR_LEN, "%s", filename.c_str());
+    sim->begin = sim->end = 0;
+    sim->AorB = 'A';
+    sim->number_of_photons = number_of_photons;
+    sim->ignoreAdetection = ignoreAdetection;
+    sim->det = det;
+
+    UINT32 n_layers = GetLayerCount();
+    sim->n_layers = n_layers;
+    sim->layers[0].n = n_above;
+    float dtot = 0;
+    for (UINT32 l = 0; l < n_layers; ++l)
+    {
+        float value[SWEEP_FIELDS];
+        for (UINT32 f = 0; f < SWEEP_FIELDS; ++f)
+        {
+            UINT32 dim = l * SWEEP_FIELDS + f;
+            value[f] = Sample(&params[dim], index, dim);
+        }
+        SetLayer(sim, l + 1, value[SWEEP_N], value[SWEEP_MUA], value[SWEEP_MUS], value[SWEEP_G], value[SWEEP_D],
+                 &dtot);
+    }
+    sim->layers[n_layers + 1].n = n_below;
+    SetStartWeight(sim);
+}
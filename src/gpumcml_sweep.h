@@ -0,0 +1,112 @@
+/*****************************************************************************
+ *
+ *   Header file for parameter sweeps (runs generated inside MCML)
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPUMCML_SWEEP_H
+#define GPUMCML_SWEEP_H
+
+#include <string>
+#include <vector>
+
+#include "gpumcml.h"
+
+// Fields of a layer line, in the order of the .mci file
+#define SWEEP_N 0
+#define SWEEP_MUA 1
+#define SWEEP_MUS 2
+#define SWEEP_G 3
+#define SWEEP_D 4
+#define SWEEP_FIELDS 5
+
+// How the runs of a sweep are chosen
+#define SWEEP_GRID 0   // every combination of the values of the parameters
+#define SWEEP_LHS 1    // Latin hypercube sample of the ranges
+#define SWEEP_RANDOM 2 // independent uniform samples of the ranges
+
+// One field of one layer: a fixed value (one value), a list of values or
+// a range lo .. hi (no values). A range takes n_steps evenly spaced values
+// in grid designs.
+typedef struct
+{
+    std::vector<float> values;
+    float lo, hi;
+    UINT32 n_steps;
+} SweepParam;
+
+//////////////////////////////////////////////////////////////////////////////
+//   A sweep file defines a base geometry and ranges or lists for n, mua,
+//   mus, g and d of every layer:
+//
+//     design lhs 10000 42    # grid, lhs <runs> <seed> or random <runs> <seed>
+//     name skin              # prefix of the run IDs (default: sweep)
+//     photons 1000000
+//     grid 0.002 2 500 1 1   # dz dr, No. of dz, dr and da
+//     above 1.0              # n for medium above
+//     layer 1.4 0.1:10 100:200 0.9 0.01      # n mua mus g d, one line per layer
+//     layer 1.4 1,2,5 50:100:5 0.8 0.1
+//     below 1.0              # n for medium below
+//
+//   A field is a value, a list (v1,v2,...) or a range (lo:hi, with a number
+//   of steps lo:hi:n for grid designs). Run i is generated from i alone,
+//   when it is needed, so a sweep never holds more runs in memory than the
+//   batches in flight.
+//////////////////////////////////////////////////////////////////////////////
+class SweepDesign
+{
+  public:
+    // Read a sweep file. Return 0 if successful or 1 if an error occurred.
+    int Load(const char *filename);
+
+    UINT64 GetRunCount() const
+    {
+        return n_runs;
+    }
+
+    UINT32 GetLayerCount() const
+    {
+        return (UINT32)(params.size() / SWEEP_FIELDS);
+    }
+
+    // Fill run <index> (0 .. GetRunCount() - 1) of the sweep. The layers of
+    // <sim> must have room for GetLayerCount() + 2 layers.
+    void MakeRun(UINT64 index, SimulationStruct *sim, int ignoreAdetection) const;
+
+  private:
+    float Sample(const SweepParam *param, UINT64 index, UINT32 dim) const;
+
+    std::string filename;
+    std::string name;
+    int design;
+    UINT64 n_runs;
+    UINT64 seed;
+
+    UINT32 number_of_photons;
+    DetStruct det;
+    float n_above, n_below;
+    std::vector<SweepParam> params; // SWEEP_FIELDS per layer
+
+    // grid designs: number of values of each parameter and the number of
+    // runs between two of its values (the last parameter changes fastest)
+    std::vector<UINT64> n_values;
+    std::vector<UINT64> strides;
+};
+
+#endif // GPUMCML_SWEEP_H
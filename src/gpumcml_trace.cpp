@@ -0,0 +1,157 @@
+/*****************************************************************************
+ *
+ *   Timing trace of MCMLGPU (Chrome trace event format)
+ *   =========================================================================
+ *   The events of all threads go to one list under a mutex: they are
+ *   recorded per phase, chunk or kernel launch, never per photon, so the
+ *   lock is not contended.
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <map>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "gpumcml_trace.h"
+
+// One complete event
+typedef struct
+{
+    const char *name;
+    const char *cat;
+    double ts;
+    double dur;
+    int lane;
+    std::string args;
+} TraceEvent;
+
+std::atomic<bool> g_traceEnabled(false);
+
+static std::chrono::steady_clock::time_point traceStart;
+static std::mutex traceMutex;
+static std::vector<TraceEvent> traceEvents;
+static std::map<int, std::string> laneNames;
+static std::atomic<int> nextLane(0);
+
+//////////////////////////////////////////////////////////////////////////////
+//   Lane of the calling thread, numbered in the order the threads record
+//   their first event
+//////////////////////////////////////////////////////////////////////////////
+static int ThreadLane()
+{
+    static thread_local int lane = -1;
+    if (lane < 0)
+        lane = nextLane++;
+    return lane;
+}
+
+void TraceEnable()
+{
+    traceStart = std::chrono::steady_clock::now();
+    g_traceEnabled.store(true);
+}
+
+double TraceNow()
+{
+    return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - traceStart).count();
+}
+
+void TraceThreadName(const char *fmt, ...)
+{
+    if (!TraceEnabled())
+        return;
+
+    char name[64];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(name, sizeof(name), fmt, ap);
+    va_end(ap);
+
+    int lane = ThreadLane();
+    std::lock_guard<std::mutex> lock(traceMutex);
+    laneNames[lane] = name;
+}
+
+void TraceComplete(const char *name, const char *cat, double ts, double dur, const char *args)
+{
+    TraceEvent event = {name, cat, ts, dur, ThreadLane(), args};
+    std::lock_guard<std::mutex> lock(traceMutex);
+    traceEvents.push_back(event);
+}
+
+void TraceScope::Args(const char *fmt, ...)
+{
+    if (!enabled)
+        return;
+
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(args, sizeof(args), fmt, ap);
+    va_end(ap);
+}
+
+int TraceWrite(const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if (file == NULL)
+    {
+        perror("Error opening trace file");
+        return 1;
+    }
+
+    std::lock_guard<std::mutex> lock(traceMutex);
+    fprintf(file, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+    fprintf(file, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"args\": {\"name\": \"MCML\"}}");
+
+    // Name the lanes, and keep them in the order of their first event.
+    for (int lane = 0; lane < nextLane; ++lane)
+    {
+        auto it = laneNames.find(lane);
+        if (it != laneNames.end())
+        {
+            fprintf(file, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                          "\"args\": {\"name\": \"%s\"}}",
+                    lane, it->second.c_str());
+        }
+        fprintf(file, ",\n{\"name\": \"thread_sort_index\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, "
+                      "\"args\": {\"sort_index\": %d}}",
+                lane, lane);
+    }
+
+    for (const TraceEvent &event : traceEvents)
+    {
+        fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, "
+                      "\"ts\": %.3f, \"dur\": %.3f, \"args\": {%s}}",
+                event.name, event.cat, event.lane, event.ts, event.dur, event.args.c_str());
+    }
+    fprintf(file, "\n]}\n");
+
+    int failed = ferror(file);
+    if (fclose(file) != 0 || failed)
+    {
+        perror("Error writing trace file");
+        return 1;
+    }
+    printf("Wrote %zu trace events to %s\n", traceEvents.size(), filename);
+    return 0;
+}
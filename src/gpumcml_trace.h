@@ -0,0 +1,99 @@
+/*****************************************************************************
+ *
+ *   Header file for the timing trace (Chrome trace event format)
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef GPUMCML_TRACE_H
+#define GPUMCML_TRACE_H
+
+#include <atomic>
+
+//////////////////////////////////////////////////////////////////////////////
+//   Timing trace of the phases of a job (--trace FILE): parsing, setup,
+//   buffer allocation, the engine dispatches and GPU kernels, reduction,
+//   registration and output writing are recorded as complete events
+//   ("ph": "X") and written as a JSON file in the Chrome trace event format,
+//   which chrome://tracing and Perfetto load. Every thread is a lane of its
+//   own, named after what it runs ("main", "GPU 0", "CPU 3", "reduce", ...),
+//   so that the workers of every device show up side by side and the stalls
+//   between their chunks are visible.
+//
+//   Until TraceEnable is called, recording costs one relaxed atomic load per
+//   scope.
+//////////////////////////////////////////////////////////////////////////////
+
+extern std::atomic<bool> g_traceEnabled;
+
+// Start recording. Timestamps are relative to this call.
+void TraceEnable();
+
+inline bool TraceEnabled()
+{
+    return g_traceEnabled.load(std::memory_order_relaxed);
+}
+
+// Microseconds since TraceEnable
+double TraceNow();
+
+// Name the lane of the calling thread (printf-style).
+void TraceThreadName(const char *fmt, ...);
+
+// Record the event <name> of category <cat> that began at <ts> and took
+// <dur> microseconds on the calling thread. <args> is empty or the members
+// of a JSON object (e.g. "\"photons\": 1000"). <name> and <cat> must be
+// string literals.
+void TraceComplete(const char *name, const char *cat, double ts, double dur, const char *args);
+
+// Write the recorded events to <filename>. Return 0 if successful or 1 if
+// the file cannot be written.
+int TraceWrite(const char *filename);
+
+//////////////////////////////////////////////////////////////////////////////
+//   Records the time from its construction to its destruction as an event
+//   of the calling thread
+//////////////////////////////////////////////////////////////////////////////
+class TraceScope
+{
+  public:
+    TraceScope(const char *name, const char *cat) : name(name), cat(cat), enabled(TraceEnabled()), ts(0)
+    {
+        args[0] = '\0';
+        if (enabled)
+            ts = TraceNow();
+    }
+
+    ~TraceScope()
+    {
+        if (enabled)
+            TraceComplete(name, cat, ts, TraceNow() - ts, args);
+    }
+
+    // Set the arguments of the event (printf-style, see TraceComplete).
+    void Args(const char *fmt, ...);
+
+  private:
+    const char *name;
+    const char *cat;
+    bool enabled;
+    double ts;
+    char args[128];
+};
+
+#endif // GPUMCML_TRACE_H
@@ -0,0 +1,640 @@
+/*****************************************************************************
+ *
+ *   Statistical-equivalence test of the photon engines
+ *   =========================================================================
+ *   Simulates the runs of test/validation.mci with one engine (backend,
+ *   random number generator and precision policy as on the command line of
+ *   MCML) in N_CHUNKS independent chunks of photons, and compares Rd, A, T,
+ *   Rd(r) and A(z) with the reference tallies in test/reference and, where
+ *   published, with the values of the literature:
+ *
+ *    - Rd, A and T: z-test of the difference to the reference, with the
+ *      batch-means standard errors of both sides,
+ *    - Rd(r) and A(z): chi-square test over the bins that the tested
+ *      engine resolves, with the variances of the reference scaled to the
+ *      number of photons of the test (a few photons in a bin give no
+ *      usable variance of their own),
+ *    - published values: z-test with the standard error of the simulation
+ *      (and the rounding of the published value).
+ *
+ *   The photons are fixed by the seed, so a passing engine always passes.
+ *   --write_reference simulates the runs with the given number of photons
+ *   and writes the reference tallies instead. --penetration tests instead
+ *   that the penetration depth of the semi-infinite run falls as its mua
+ *   rises. --white simulates every run in a white batch (white Monte Carlo,
+ *   CPU engine only), after a copy of it with twice its mua, and compares
+ *   the reweighted tallies of the run with the same references (but A(z),
+ *   see ValidateRun).
+ *
+ *   Usage: mcml_validate [--backend cpu|simd|gpu] [--rng mwc|philox|xoroshiro]
+ *                        [--precision single|mixed|double] [--photons n]
+ *                        [--write_reference n] [--penetration] [--white]
+ *   Exit status: 0 if all tests pass, 1 if any fails, 77 if the backend is
+ *   not available (no GPU).
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include <cfloat>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#ifdef MCML_WITH_CUDA
+#include <cuda_runtime.h>
+#endif
+
+#include "../src/gpumcml.h"
+
+#define N_CHUNKS 32           // independent chunks of photons per run
+#define TEST_SEED 20240601ull // seed of the tested photons
+#define REFERENCE_SEED 1ull   // seed of the photons of the reference
+#define Z_CRIT 4.0            // two-sided, p = 6.3e-5 per test
+#define Z_CRIT_CHI2 3.719     // one-sided, p = 1e-4 per test
+#define MAX_BIN_RSE 0.2       // bins with a larger expected relative error are not compared
+
+#define EXIT_SKIP 77
+
+// Values of the literature for runs of test/validation.mci
+typedef struct
+{
+    const char *run;
+    const char *source;
+    double Rd, T;     // total diffuse reflectance and total transmittance
+    double rounding; // half of the last published digit
+} PublishedValues;
+
+static const PublishedValues published[] = {
+    // slab of optical thickness 2, albedo 0.9, g = 0.75, matched boundaries
+    {"slab_vandehulst", "van de Hulst (1980)", 0.09739, 0.66096, 0.5e-5},
+};
+
+// Batch-means estimate of a quantity: mean and standard error of the mean
+typedef struct
+{
+    double mean;
+    double se;
+} Estimate;
+
+// Rd, A, T, the penetration depth, Rd(r) and A(z) of one run
+typedef struct
+{
+    UINT64 n_photons;
+    Estimate Rd, A, T;
+    Estimate depth;             // mean of the penetration depths of the chunks (see PenetrationDepth)
+    std::vector<Estimate> Rd_r; // per radial bin, summed over the angles
+    std::vector<Estimate> A_z;  // per depth bin, summed over the radii
+} Tallies;
+
+//////////////////////////////////////////////////////////////////////////////
+//   Sums of the chunk values of one quantity
+//////////////////////////////////////////////////////////////////////////////
+typedef struct
+{
+    double sum, sum_sq;
+} ChunkSums;
+
+static void AddChunk(ChunkSums *sums, double value)
+{
+    sums->sum += value;
+    sums->sum_sq += value * value;
+}
+
+static Estimate GetEstimate(const ChunkSums *sums, int n_chunks)
+{
+    Estimate e;
+    e.mean = sums->sum / n_chunks;
+    double var = (sums->sum_sq - n_chunks * e.mean * e.mean) / (n_chunks - 1);
+    e.se = std::sqrt((var > 0 ? var : 0) / n_chunks);
+    return e;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Simulate the last of the <n_sims> runs <sims> with <n_photons> photons
+//   in N_CHUNKS chunks on the worker <hstate> with <engine>, and estimate
+//   its tallies. Without <white> there is one run. With <white> the runs
+//   (which differ in mua only) make one white batch, and the tallies of the
+//   last run are reweighted from the photons of the first.
+//   Return 0 if successful.
+//////////////////////////////////////////////////////////////////////////////
+static int SimulateRun(SimulationStruct *sims, UINT32 n_sims, int white, UINT64 n_photons, UINT64 seed, int rng,
+                       int precision, HostThreadState *hstate, void (*engine)(HostThreadState *), Tallies *tallies)
+{
+    UINT32 n_chunk = (UINT32)(n_photons / N_CHUNKS);
+    for (UINT32 i = 0; i < n_sims; ++i)
+        sims[i].number_of_photons = n_chunk;
+
+    PackedBatch *batch = (PackedBatch *)malloc(sizeof(PackedBatch));
+    UINT32 n_runs = white ? BuildWhiteBatch(batch, sims, n_sims, 0) : BuildPackedBatch(batch, sims, 1, 0, 0);
+    if (n_runs != n_sims)
+    {
+        fprintf(stderr, "%s: the runs do not make one batch\n", sims[0].outp_filename);
+        free(batch);
+        return 1;
+    }
+    batch->rng = rng;
+    batch->precision = precision;
+    SeedBatch(batch, seed);
+
+    UINT32 r = n_sims - 1;
+    SimulationStruct *sim = &sims[r];
+    UINT32 nr = sim->det.nr, nz = sim->det.nz, na = sim->det.na;
+    ChunkSums Rd = {0, 0}, A = {0, 0}, T = {0, 0}, depth = {0, 0};
+    std::vector<ChunkSums> Rd_r(nr, Rd), A_z(nz, Rd);
+    std::vector<double> Rd_r_chunk(nr), A_z_chunk(nz);
+
+    SimState *hss = &hstate->host_sim_state;
+    for (int c = 0; c < N_CHUNKS; ++c)
+    {
+        // The chunks are consecutive photons of the stream of the run.
+        hstate->batch = batch;
+        hstate->photon_begin = 0;
+        hstate->photon_ofst = (UINT64)c * n_chunk;
+        hss->n_photons_left = (UINT32 *)malloc(sizeof(UINT32));
+        *hss->n_photons_left = n_chunk;
+        engine(hstate);
+        if (hss->n_photons_left == NULL)
+        {
+            free(batch);
+            return 1;
+        }
+
+        // tally slices of the run
+        const UINT64 *A_rz = hstate->pool.A_rz + batch->A_rz_ofst[r];
+        const UINT64 *Rd_ra = hstate->pool.Rd_ra + batch->ra_ofst[r];
+        const UINT64 *Tt_ra = hstate->pool.Tt_ra + batch->ra_ofst[r];
+
+        double scale = 1.0 / ((double)WEIGHT_SCALE * n_chunk);
+        double Rd_c = 0, A_c = 0, T_c = 0;
+        UINT64 A_w = 0, T_w = 0; // in units of the photon weight, as the tallies
+        std::fill(Rd_r_chunk.begin(), Rd_r_chunk.end(), 0.0);
+        std::fill(A_z_chunk.begin(), A_z_chunk.end(), 0.0);
+        for (UINT32 ia = 0; ia < na; ++ia)
+        {
+            for (UINT32 ir = 0; ir < nr; ++ir)
+            {
+                Rd_r_chunk[ir] += Rd_ra[ia * nr + ir] * scale;
+                T_c += Tt_ra[ia * nr + ir] * scale;
+                T_w += Tt_ra[ia * nr + ir];
+            }
+        }
+        for (UINT32 ir = 0; ir < nr; ++ir)
+        {
+            for (UINT32 iz = 0; iz < nz; ++iz)
+            {
+                A_z_chunk[iz] += A_rz[ir * nz + iz] * scale;
+                A_w += A_rz[ir * nz + iz];
+            }
+            Rd_c += Rd_r_chunk[ir];
+            AddChunk(&Rd_r[ir], Rd_r_chunk[ir]);
+        }
+        for (UINT32 iz = 0; iz < nz; ++iz)
+        {
+            A_c += A_z_chunk[iz];
+            AddChunk(&A_z[iz], A_z_chunk[iz]);
+        }
+        AddChunk(&Rd, Rd_c);
+        AddChunk(&A, A_c);
+        AddChunk(&T, T_c);
+        AddChunk(&depth, PenetrationDepth(A_rz, A_w, T_w, sim));
+        FreeHostSimState(hss);
+    }
+    free(batch);
+
+    tallies->n_photons = (UINT64)n_chunk * N_CHUNKS;
+    tallies->Rd = GetEstimate(&Rd, N_CHUNKS);
+    tallies->A = GetEstimate(&A, N_CHUNKS);
+    tallies->T = GetEstimate(&T, N_CHUNKS);
+    tallies->depth = GetEstimate(&depth, N_CHUNKS);
+    tallies->Rd_r.resize(nr);
+    tallies->A_z.resize(nz);
+    for (UINT32 ir = 0; ir < nr; ++ir)
+        tallies->Rd_r[ir] = GetEstimate(&Rd_r[ir], N_CHUNKS);
+    for (UINT32 iz = 0; iz < nz; ++iz)
+        tallies->A_z[iz] = GetEstimate(&A_z[iz], N_CHUNKS);
+    return 0;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Reference tallies: "photons <n>", "Rd <mean> <se>", "A ..." and "T ...",
+//   then
+//   "Rd_r <n>" and "A_z <n>" followed by n lines "<mean> <se>"
+//////////////////////////////////////////////////////////////////////////////
+static std::string ReferenceFile(const char *run)
+{
+    return std::string(MCML_SOURCE_DIR "/test/reference/") + run + ".ref";
+}
+
+static int WriteReference(const char *run, const Tallies *tallies)
+{
+    std::string filename = ReferenceFile(run);
+    FILE *file = fopen(filename.c_str(), "w");
+    if (file == NULL)
+    {
+        perror(filename.c_str());
+        return 1;
+    }
+    fprintf(file, "# %s: %d chunks, seed %llu, scalar CPU engine\n", run, N_CHUNKS, REFERENCE_SEED);
+    fprintf(file, "photons %llu\n", (unsigned long long)tallies->n_photons);
+    fprintf(file, "Rd %.9e %.9e\nA %.9e %.9e\nT %.9e %.9e\n", tallies->Rd.mean, tallies->Rd.se, tallies->A.mean,
+            tallies->A.se, tallies->T.mean, tallies->T.se);
+    fprintf(file, "Rd_r %zu\n", tallies->Rd_r.size());
+    for (size_t i = 0; i < tallies->Rd_r.size(); ++i)
+        fprintf(file, "%.9e %.9e\n", tallies->Rd_r[i].mean, tallies->Rd_r[i].se);
+    fprintf(file, "A_z %zu\n", tallies->A_z.size());
+    for (size_t i = 0; i < tallies->A_z.size(); ++i)
+        fprintf(file, "%.9e %.9e\n", tallies->A_z[i].mean, tallies->A_z[i].se);
+    fclose(file);
+    return 0;
+}
+
+static int ReadArray(FILE *file, const char *name, std::vector<Estimate> *values)
+{
+    char label[16];
+    size_t n;
+    if (fscanf(file, "%15s %zu", label, &n) != 2 || strcmp(label, name) != 0)
+        return 1;
+    values->resize(n);
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (fscanf(file, "%lf %lf", &(*values)[i].mean, &(*values)[i].se) != 2)
+            return 1;
+    }
+    return 0;
+}
+
+static int ReadReference(const char *run, Tallies *tallies)
+{
+    std::string filename = ReferenceFile(run);
+    FILE *file = fopen(filename.c_str(), "r");
+    if (file == NULL)
+    {
+        perror(filename.c_str());
+        return 1;
+    }
+    int c;
+    while ((c = fgetc(file)) == '#')
+    {
+        while ((c = fgetc(file)) != '\n' && c != EOF)
+            ;
+    }
+    ungetc(c, file);
+
+    unsigned long long n_photons;
+    int failed = fscanf(file, " photons %llu Rd %lf %lf A %lf %lf T %lf %lf", &n_photons, &tallies->Rd.mean,
+                        &tallies->Rd.se, &tallies->A.mean, &tallies->A.se, &tallies->T.mean, &tallies->T.se) != 7;
+    tallies->n_photons = n_photons;
+    failed = failed || ReadArray(file, "Rd_r", &tallies->Rd_r) || ReadArray(file, "A_z", &tallies->A_z);
+    fclose(file);
+    if (failed)
+        fprintf(stderr, "Error reading %s\n", filename.c_str());
+    return failed;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Tests. Each prints one line and returns 1 if it fails.
+//////////////////////////////////////////////////////////////////////////////
+static int TestZ(const char *run, const char *what, double x, double se, double ref, double ref_se)
+{
+    double se_diff = std::sqrt(se * se + ref_se * ref_se);
+    double z = (se_diff > 0) ? (x - ref) / se_diff : (x == ref ? 0 : HUGE_VAL);
+    int failed = !(std::fabs(z) <= Z_CRIT);
+    printf("%-16s %-28s %12.6f %12.6f %8.2f  %s\n", run, what, x, ref, z, failed ? "FAIL" : "ok");
+    return failed;
+}
+
+// The variance of a bin of the test is that of the reference times
+// n_ref / n_test. The chi-square statistic over k bins is compared with the
+// chi-square quantile of k degrees of freedom (Wilson-Hilferty), inflated by
+// the variance (n - 1) / (n - 3) of a t statistic with n - 1 degrees of
+// freedom, as the variances are estimated from n chunks.
+static int TestChi2(const char *run, const char *what, const std::vector<Estimate> &x,
+                    const std::vector<Estimate> &ref, double photon_ratio)
+{
+    if (x.size() != ref.size())
+    {
+        printf("%-16s %-28s %s\n", run, what, "FAIL (grid differs from the reference)");
+        return 1;
+    }
+    double chi2 = 0;
+    int k = 0;
+    for (size_t i = 0; i < x.size(); ++i)
+    {
+        double var_ref = ref[i].se * ref[i].se;
+        if (ref[i].mean <= 0 || var_ref * photon_ratio > MAX_BIN_RSE * MAX_BIN_RSE * ref[i].mean * ref[i].mean)
+            continue;
+        double var = var_ref * (1 + photon_ratio);
+        double d = x[i].mean - ref[i].mean;
+        chi2 += d * d / var;
+        ++k;
+    }
+    double h = 2.0 / (9.0 * k);
+    double crit = k * std::pow(1 - h + Z_CRIT_CHI2 * std::sqrt(h), 3) * (N_CHUNKS - 1.0) / (N_CHUNKS - 3.0);
+    int failed = (k == 0) || !(chi2 <= crit);
+
+    char label[64];
+    snprintf(label, sizeof(label), "%s (chi2, %d bins)", what, k);
+    printf("%-16s %-28s %12.2f %12.2f %8s  %s\n", run, label, chi2, crit, "", failed ? "FAIL" : "ok");
+    return failed;
+}
+
+// White Monte Carlo tallies the absorption along a step where the step
+// ends, which shifts A(z) by up to one scattering length: its A(z) is not
+// tested (<test_A_z> is 0).
+static int ValidateRun(const char *run, const Tallies *t, const Tallies *ref, int test_A_z)
+{
+    int n_failed = 0;
+    n_failed += TestZ(run, "Rd", t->Rd.mean, t->Rd.se, ref->Rd.mean, ref->Rd.se);
+    n_failed += TestZ(run, "A", t->A.mean, t->A.se, ref->A.mean, ref->A.se);
+    n_failed += TestZ(run, "T", t->T.mean, t->T.se, ref->T.mean, ref->T.se);
+    double photon_ratio = (double)ref->n_photons / t->n_photons;
+    n_failed += TestChi2(run, "Rd_r", t->Rd_r, ref->Rd_r, photon_ratio);
+    if (test_A_z)
+        n_failed += TestChi2(run, "A_z", t->A_z, ref->A_z, photon_ratio);
+    else
+        printf("%-16s %-28s %s\n", run, "A_z", "skipped (white Monte Carlo)");
+
+    for (size_t i = 0; i < sizeof(published) / sizeof(published[0]); ++i)
+    {
+        const PublishedValues *p = &published[i];
+        if (strcmp(p->run, run) != 0)
+            continue;
+        std::string what = std::string("Rd, ") + p->source;
+        n_failed += TestZ(run, what.c_str(), t->Rd.mean, t->Rd.se, p->Rd, p->rounding);
+        what = std::string("T, ") + p->source;
+        n_failed += TestZ(run, what.c_str(), t->T.mean, t->T.se, p->T, p->rounding);
+    }
+    return n_failed;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Simulate the one-layer run <sim> with its mua scaled by 1, 4 and 16.
+//   The penetration depth must fall significantly from one mua to the next
+//   (it is resolved to dz, so the chunks of a run often agree and its
+//   standard error can be 0). Return the number of failed tests, or -1 if
+//   a simulation failed.
+//////////////////////////////////////////////////////////////////////////////
+static int TestPenetrationDepth(SimulationStruct *sim, UINT64 n_photons, int rng, int precision,
+                                HostThreadState *hstate, void (*engine)(HostThreadState *))
+{
+    static const float mua_scales[] = {1, 4, 16};
+    const char *run = sim->outp_filename;
+    LayerStruct layer = sim->layers[1];
+    float mus = 1.0f / layer.mutr - layer.mua;
+
+    int n_failed = 0;
+    Estimate last = {0, 0};
+    for (size_t k = 0; k < sizeof(mua_scales) / sizeof(mua_scales[0]); ++k)
+    {
+        float dtot = layer.z_min;
+        SetLayer(sim, 1, layer.n, layer.mua * mua_scales[k], mus, layer.g, layer.z_max - layer.z_min, &dtot);
+        Tallies tallies;
+        if (SimulateRun(sim, 1, 0, n_photons, TEST_SEED, rng, precision, hstate, engine, &tallies))
+        {
+            sim->layers[1] = layer;
+            return -1;
+        }
+
+        // The depth is compared with the one at the previous mua (the z
+        // column is the number of standard errors it fell by).
+        const Estimate *d = &tallies.depth;
+        char what[64];
+        snprintf(what, sizeof(what), "depth, mua x %g", mua_scales[k]);
+        if (k == 0)
+        {
+            printf("%-16s %-28s %12.6f %12s %8s  %s\n", run, what, d->mean, "", "", "ok");
+        }
+        else
+        {
+            double se_diff = std::sqrt(last.se * last.se + d->se * d->se);
+            double fall = last.mean - d->mean;
+            double z = (se_diff > 0) ? fall / se_diff : (fall > 0 ? HUGE_VAL : 0);
+            int failed = !(z >= Z_CRIT);
+            printf("%-16s %-28s %12.6f %12.6f %8.2f  %s\n", run, what, d->mean, last.mean, z, failed ? "FAIL" : "ok");
+            n_failed += failed;
+        }
+        last = *d;
+    }
+    sim->layers[1] = layer;
+    return n_failed;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Copy run <src> to <dst> (allocated for as many layers) with the mua of
+//   every layer scaled by <mua_scale>
+//////////////////////////////////////////////////////////////////////////////
+static void CopyRun(SimulationStruct *dst, const SimulationStruct *src, float mua_scale)
+{
+    LayerStruct *layers = dst->layers;
+    *dst = *src;
+    dst->layers = layers;
+    for (UINT32 l = 0; l < src->n_layers + 2; ++l)
+    {
+        layers[l] = src->layers[l];
+        if (l == 0 || l > src->n_layers || layers[l].mutr == FLT_MAX)
+            continue;
+        float mus = 1.0f / layers[l].mutr - layers[l].mua;
+        layers[l].mua *= mua_scale;
+        layers[l].mutr = 1.0f / (layers[l].mua + mus);
+    }
+}
+
+static int ParseChoice(const char *value, const char *const choices[], int n_choices)
+{
+    for (int i = 0; i < n_choices; ++i)
+    {
+        if (strcmp(value, choices[i]) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *const backends[] = {"cpu", "simd", "gpu"};
+    static const char *const rngs[] = {"mwc", "philox", "xoroshiro"};         // RNG_MWC, ...
+    static const char *const precisions[] = {"single", "mixed", "double"}; // PRECISION_SINGLE, ...
+    int backend = 0, rng = RNG_MWC, precision = PRECISION_SINGLE;
+    UINT64 n_photons = 64000, n_reference = 0;
+    bool penetration = false, white = false;
+    for (int i = 1; i < argc; ++i)
+    {
+        bool has_value = i + 1 < argc;
+        if (strcmp(argv[i], "--backend") == 0 && has_value)
+            backend = ParseChoice(argv[++i], backends, 3);
+        else if (strcmp(argv[i], "--rng") == 0 && has_value)
+            rng = ParseChoice(argv[++i], rngs, 3);
+        else if (strcmp(argv[i], "--precision") == 0 && has_value)
+            precision = ParseChoice(argv[++i], precisions, 3);
+        else if (strcmp(argv[i], "--photons") == 0 && has_value)
+            n_photons = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--write_reference") == 0 && has_value)
+            n_reference = strtoull(argv[++i], NULL, 10);
+        else if (strcmp(argv[i], "--penetration") == 0)
+            penetration = true;
+        else if (strcmp(argv[i], "--white") == 0)
+            white = true;
+        else
+            backend = -1;
+    }
+    if (backend < 0 || rng < 0 || precision < 0 || n_photons < N_CHUNKS)
+    {
+        fprintf(stderr, "Usage: %s [--backend cpu|simd|gpu] [--rng mwc|philox|xoroshiro] "
+                        "[--precision single|mixed|double] [--photons n] [--write_reference n] "
+                        "[--penetration] [--white]\n",
+                argv[0]);
+        return 1;
+    }
+    if (backend == 1 && (rng != RNG_MWC || precision != PRECISION_SINGLE))
+    {
+        fprintf(stderr, "The SIMD engine only has the MWC generator and single precision\n");
+        return 1;
+    }
+    if (white && (backend != 0 || rng != RNG_MWC || precision != PRECISION_SINGLE || penetration || n_reference > 0))
+    {
+        fprintf(stderr, "White Monte Carlo only runs on the CPU engine with the MWC generator and single precision, "
+                        "and it has no reference of its own\n");
+        return 1;
+    }
+#ifndef MCML_GPU_REWRITE
+    if (backend == 2 && (rng != RNG_MWC || precision != PRECISION_SINGLE))
+    {
+        fprintf(stderr, "The baseline GPU engine only has the MWC generator and single precision (see "
+                        "MCML_GPU_REWRITE)\n");
+        return 1;
+    }
+#endif
+
+    // One worker, set up like in MCML
+    HostThreadState *hstate = (HostThreadState *)calloc(1, sizeof(HostThreadState));
+    hstate->n_tblks = 1;
+    hstate->n_threads = (backend == 1) ? GetSIMDWidth() : 1;
+    void (*engine)(HostThreadState *) = (backend == 1) ? RunSIMDi : RunCPUi;
+    if (backend == 2)
+    {
+#ifdef MCML_WITH_CUDA
+        int dev_count = 0;
+        if (cudaGetDeviceCount(&dev_count) != cudaSuccess || dev_count == 0)
+        {
+            printf("No GPU found, skipped\n");
+            return EXIT_SKIP;
+        }
+        HostThreadState *hstates[1] = {hstate};
+        if (InitGPUHostThreadStates(hstates, 1) == 0)
+            return 1;
+        engine = RunGPUi;
+#else
+        printf("This build has no GPU backend, skipped\n");
+        return EXIT_SKIP;
+#endif
+    }
+    if (init_RNG(&hstate->host_sim_state.multipliers, &hstate->host_sim_state.n_multipliers))
+        return 1;
+
+    SimulationStruct *simulations;
+    int n_simulations = read_simulation_data(MCML_SOURCE_DIR "/test/validation.mci", &simulations, 0);
+    if (n_simulations == 0)
+        return 1;
+
+    printf("\n%s engine%s, %s generator, %s precision, %llu photons per run\n\n", backends[backend],
+           white ? " (white Monte Carlo)" : "", rngs[rng], precisions[precision],
+           (unsigned long long)(n_reference > 0 ? n_reference : n_photons));
+    if (n_reference == 0)
+        printf("%-16s %-28s %12s %12s %8s\n", "run", "test", "value", "reference", "z");
+
+    int n_failed = 0;
+    for (int i = 0; i < n_simulations; ++i)
+    {
+        SimulationStruct *sim = &simulations[i];
+        const char *run = sim->outp_filename;
+        if (penetration)
+        {
+            if (strcmp(run, "semi_infinite") != 0)
+                continue;
+            int n_run_failed = TestPenetrationDepth(sim, n_photons, rng, precision, hstate, engine);
+            if (n_run_failed < 0)
+            {
+                fprintf(stderr, "Error simulating %s\n", run);
+                return 1;
+            }
+            n_failed += n_run_failed;
+            continue;
+        }
+
+        Tallies tallies, reference;
+        UINT64 seed = (n_reference > 0) ? REFERENCE_SEED : TEST_SEED;
+        int failed;
+        if (white)
+        {
+            // A copy of the run with twice its mua comes first, so the run
+            // is reweighted into a tally slice other than the first.
+            UINT32 n_layers[2] = {sim->n_layers, sim->n_layers};
+            SimulationStruct *pair = AllocSimulationStruct(2, n_layers);
+            if (pair == NULL)
+                return 1;
+            CopyRun(&pair[0], sim, 2.0f);
+            CopyRun(&pair[1], sim, 1.0f);
+            failed = SimulateRun(pair, 2, 1, n_photons, seed, rng, precision, hstate, engine, &tallies);
+            FreeSimulationStruct(pair, 2);
+        }
+        else
+        {
+            failed = SimulateRun(sim, 1, 0, n_reference > 0 ? n_reference : n_photons, seed, rng, precision, hstate,
+                                 engine, &tallies);
+        }
+        if (failed)
+        {
+            fprintf(stderr, "Error simulating %s\n", run);
+            return 1;
+        }
+
+        if (n_reference > 0)
+        {
+            if (WriteReference(run, &tallies))
+                return 1;
+            printf("Wrote %s\n", ReferenceFile(run).c_str());
+        }
+        else
+        {
+            if (ReadReference(run, &reference))
+                return 1;
+            n_failed += ValidateRun(run, &tallies, &reference, !white);
+        }
+    }
+
+#ifdef MCML_WITH_CUDA
+    if (backend == 2)
+        FreeGPUBufferPool(hstate);
+#endif
+    FreeBufferPool(&hstate->pool);
+    free(hstate);
+    FreeSimulationStruct(simulations, n_simulations);
+
+    if (n_failed > 0)
+    {
+        printf("\n%d tests failed\n", n_failed);
+        return 1;
+    }
+    if (n_reference == 0)
+        printf("\nAll tests passed\n");
+    return 0;
+}
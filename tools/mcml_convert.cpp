@@ -0,0 +1,41 @@
+/*****************************************************************************
+ *
+ *   Converter of text input files (.mci) to binary input files (.mcb)
+ *   =========================================================================
+ *   Binary input files hold the runs in columns (photons, detection grid,
+ *   number of layers and n/mua/mus/g/d of every layer) that MCML reads
+ *   without any text parsing.
+ *
+ *   Usage: mcml_convert input.mci output.mcb
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+
+#include "../src/gpumcml.h"
+
+int main(int argc, char *argv[])
+{
+    if (argc != 3)
+    {
+        fprintf(stderr, "Usage: %s input.mci output.mcb\n", argv[0]);
+        return 1;
+    }
+    return convert_input_to_binary(argv[1], argv[2]);
+}
@@ -0,0 +1,120 @@
+/*****************************************************************************
+ *
+ *   Generator of the multipliers of the MWC random number generators
+ *   =========================================================================
+ *   Writes the MAX_RNG_MULTIPLIERS largest multipliers a < 2^32 for which
+ *   a * 2^32 - 1 and a * 2^31 - 1 are both prime (the multiply-with-carry
+ *   generator with base 2^32 then has the period a * 2^31 - 1) as a C
+ *   array, which is compiled into MCML instead of being read from a file.
+ *
+ *   Usage: mcml_safeprimes output.h
+ *
+ ****************************************************************************/
+/*
+ *   This file is part of GPUMCML.
+ *
+ *   GPUMCML is free software: you can redistribute it and/or modify
+ *   it under the terms of the GNU General Public License as published by
+ *   the Free Software Foundation, either version 3 of the License, or
+ *   (at your option) any later version.
+ *
+ *   GPUMCML is distributed in the hope that it will be useful,
+ *   but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *   GNU General Public License for more details.
+ *
+ *   You should have received a copy of the GNU General Public License
+ *   along with GPUMCML.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstdio>
+
+#include "../src/gpumcml.h"
+
+static UINT64 MulMod(UINT64 a, UINT64 b, UINT64 m)
+{
+    return (UINT64)((unsigned __int128)a * b % m);
+}
+
+static UINT64 PowMod(UINT64 b, UINT64 e, UINT64 m)
+{
+    UINT64 r = 1;
+    for (b %= m; e > 0; e >>= 1)
+    {
+        if (e & 1)
+            r = MulMod(r, b, m);
+        b = MulMod(b, b, m);
+    }
+    return r;
+}
+
+//////////////////////////////////////////////////////////////////////////////
+//   Miller-Rabin test with the first 12 primes as bases, which is exact for
+//   all n < 2^64
+//////////////////////////////////////////////////////////////////////////////
+static bool IsPrime(UINT64 n)
+{
+    static const UINT32 primes[] = {2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37};
+    for (UINT32 p : primes)
+    {
+        if (n % p == 0)
+            return n == p;
+    }
+
+    UINT64 d = n - 1;
+    int s = 0;
+    while ((d & 1) == 0)
+    {
+        d >>= 1;
+        ++s;
+    }
+    for (UINT32 p : primes)
+    {
+        UINT64 x = PowMod(p, d, n);
+        if (x == 1 || x == n - 1)
+            continue;
+        int i = 1;
+        for (; i < s; ++i)
+        {
+            x = MulMod(x, x, n);
+            if (x == n - 1)
+                break;
+        }
+        if (i == s)
+            return false;
+    }
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc != 2)
+    {
+        fprintf(stderr, "Usage: %s output.h\n", argv[0]);
+        return 1;
+    }
+    FILE *file = fopen(argv[1], "w");
+    if (file == NULL)
+    {
+        perror("Error opening the output file");
+        return 1;
+    }
+
+    fprintf(file, "// Generated by mcml_safeprimes, do not edit.\n");
+    fprintf(file, "static const UINT32 safeprime_multipliers[%d] = {", MAX_RNG_MULTIPLIERS);
+    UINT32 n = 0;
+    for (UINT64 a = 0xffffffffull; n < MAX_RNG_MULTIPLIERS && a > 1; --a)
+    {
+        if (IsPrime((a << 31) - 1) && IsPrime((a << 32) - 1))
+            fprintf(file, "%s%lluu,", (n++ % 6 == 0) ? "\n    " : " ", (unsigned long long)a);
+    }
+    fprintf(file, "\n};\n");
+
+    if (fclose(file) != 0 || n < MAX_RNG_MULTIPLIERS)
+    {
+        fprintf(stderr, "Error writing %s\n", argv[1]);
+        remove(argv[1]);
+        return 1;
+    }
+    return 0;
+}